@@ -43,6 +43,12 @@ func NewLinuxHostTaoServer(host *LinuxHost, child *LinuxHostChild) LinuxHostTaoS
 	return LinuxHostTaoServer{host, child}
 }
 
+// batchUnsupportedError is the net/rpc error a client gets when it calls
+// Tao.Batch, which this server does not implement. The C++ TaoRPC
+// (TaoRPC::BatchUnsupportedError in src/tao/tao_rpc.cc) matches on this text to
+// fall back to one request per operation, so keep the two in sync.
+const batchUnsupportedError = "rpc: can't find method Tao.Batch"
+
 // Serve listens on sock for new connections and services them.
 func (server LinuxHostTaoServer) Serve(conn io.ReadWriteCloser) error {
 	s := rpc.NewServer()
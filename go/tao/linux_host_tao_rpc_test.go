@@ -87,6 +87,17 @@ func TestLinuxHostTaoServerExtendTaoName(t *testing.T) {
 	}
 }
 
+func TestLinuxHostTaoServerBatchUnsupported(t *testing.T) {
+	host, err := testNewLinuxHostTaoServer(t)
+	if err != nil {
+		t.Fatal(err)
+	}
+	err = host.(*RPC).rpc.Call("Tao.Batch", &RPCRequest{}, &RPCResponse{})
+	if err == nil || err.Error() != batchUnsupportedError {
+		t.Fatalf("Tao.Batch on LinuxHostTaoServer returned %v, expected %q", err, batchUnsupportedError)
+	}
+}
+
 func TestLinuxHostTaoServerGetRandomBytes(t *testing.T) {
 	host, err := testNewLinuxHostTaoServer(t)
 	if err != nil {
@@ -0,0 +1,116 @@
+//
+// Copyright 2015 Google Corporation, All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//     http://www.apache.org/licenses/LICENSE-2.0
+// or in the the file LICENSE-2.0.txt in the top level sourcedirectory
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License
+//
+// File: aes_ctr_benchmark.cc
+// Compares AesCtrCrypt with the one-block-at-a-time routine it replaced.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include <ssl_helpers.h>
+#include <openssl/aes.h>
+#include <openssl/rand.h>
+
+using std::string;
+using std::vector;
+
+DEFINE_int64(bytes_per_size, 256 * 1024 * 1024,
+             "approximate number of bytes to encrypt for each input size");
+DEFINE_int32(key_size, 128, "AES key size in bits");
+
+// The original AesCtrCrypt.  It always processes whole blocks, so in and
+// out must have room for size rounded up to a multiple of 16.
+static void LegacyAesCtrCrypt(string& iv, int key_size_bits, byte* key,
+                              int size, byte* in, byte* out) {
+  AES_KEY ectx;
+  byte block[32];
+  byte ctr[16];
+
+  for (int i = 0; i < 16; i++)
+    ctr[15 - i] = (byte)iv[i];
+  AES_set_encrypt_key(key, key_size_bits, &ectx);
+
+  while (size > 0) {
+    AES_encrypt(ctr, block, &ectx);
+    XorBlocks(16, block, in, out);
+    in += 16;
+    out += 16;
+    size -= 16;
+    for (int i = 0; i < 16 && ++ctr[i] == 0; i++)
+      ;
+  }
+}
+
+static double MegabytesPerSecond(int size, int iterations,
+                                 std::chrono::steady_clock::duration d) {
+  double secs = std::chrono::duration<double>(d).count();
+  return (double)size * iterations / secs / 1e6;
+}
+
+int main(int an, char** av) {
+#ifdef __linux__
+  gflags::ParseCommandLineFlags(&an, &av, true);
+#else
+  google::ParseCommandLineFlags(&an, &av, true);
+#endif
+  byte key[32];
+  byte iv_bytes[16];
+  RAND_bytes(key, sizeof(key));
+  RAND_bytes(iv_bytes, sizeof(iv_bytes));
+  string iv((const char*)iv_bytes, sizeof(iv_bytes));
+
+  printf("%10s %14s %14s %8s\n", "size", "legacy MB/s", "AesCtr MB/s",
+         "speedup");
+  for (int size = 1024; size <= 64 * 1024 * 1024; size *= 4) {
+    vector<byte> in(size + AESBLKSIZE);
+    vector<byte> legacy_out(size + AESBLKSIZE);
+    vector<byte> out(size);
+    RAND_bytes(in.data(), size);
+
+    int iterations = FLAGS_bytes_per_size / size;
+    if (iterations < 4)
+      iterations = 4;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+      LegacyAesCtrCrypt(iv, FLAGS_key_size, key, size, in.data(),
+                        legacy_out.data());
+    double legacy = MegabytesPerSecond(size, iterations,
+                                       std::chrono::steady_clock::now() - start);
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+      if (!AesCtrCrypt(iv, FLAGS_key_size, key, size, in.data(), out.data())) {
+        printf("AesCtrCrypt failed\n");
+        return 1;
+      }
+    }
+    double current = MegabytesPerSecond(size, iterations,
+                                        std::chrono::steady_clock::now() - start);
+
+    if (memcmp(legacy_out.data(), out.data(), size) != 0) {
+      printf("Output differs from the legacy routine at size %d\n", size);
+      return 1;
+    }
+    printf("%10d %14.1f %14.1f %7.1fx\n", size, legacy, current,
+           current / legacy);
+  }
+  return 0;
+}
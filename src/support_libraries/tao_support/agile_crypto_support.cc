@@ -11,13 +11,22 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 
 #include "agile_crypto_support.h"
 #include "ssl_helpers.h"
@@ -28,11 +37,28 @@
 #include <openssl/x509v3.h>
 #include <openssl/rand.h>
 #include <openssl/err.h>
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include <openssl/ecdsa.h>
+#include <openssl/sha.h>
 
 
 string Basic128BitCipherSuite("sign:ecdsap256,crypt:aes128-ctr-hmacsha256,derive:hdkf-sha256");
 string Basic192BitCipherSuite("sign:ecdsap384,crypt:aes256-ctr-hmacsha384,derive:hdkf-sha256");
 string Basic256BitCipherSuite("sign:ecdsap521,crypt:aes256-ctr-hmacsha512,derive:hdkf-sha256");
+string Basic128BitAeadCipherSuite("sign:ecdsap256,crypt:aes128-gcm,derive:hdkf-sha256");
+string Basic256BitAeadCipherSuite("sign:ecdsap521,crypt:aes256-gcm,derive:hdkf-sha256");
+
+static bool IsAeadCrypterType(const string& key_type) {
+  return key_type == string("aes128-gcm") || key_type == string("aes256-gcm");
+}
+
+static bool IsCrypterType(const string& key_type) {
+  return key_type == string("aes128-ctr-hmacsha256") ||
+         key_type == string("aes256-ctr-hmacsha384") ||
+         key_type == string("aes256-ctr-hmacsha512") ||
+         IsAeadCrypterType(key_type);
+}
 
 
 bool CrypterAlgorithmNameFromCipherSuite(string& cipher_suite, string* crypter_name) {
@@ -45,6 +71,12 @@ bool CrypterAlgorithmNameFromCipherSuite(string& cipher_suite, string* crypter_n
   } else if (cipher_suite == Basic256BitCipherSuite) {
     *crypter_name = "aes256-ctr-hmacsha512";
     return true;
+  } else if (cipher_suite == Basic128BitAeadCipherSuite) {
+    *crypter_name = "aes128-gcm";
+    return true;
+  } else if (cipher_suite == Basic256BitAeadCipherSuite) {
+    *crypter_name = "aes256-gcm";
+    return true;
   } else {
   return false;
   }
@@ -52,13 +84,15 @@ bool CrypterAlgorithmNameFromCipherSuite(string& cipher_suite, string* crypter_n
 }
 
 bool SignerAlgorithmNameFromCipherSuite(string& cipher_suite, string* signer_name) {
-  if (cipher_suite == Basic128BitCipherSuite) {
+  if (cipher_suite == Basic128BitCipherSuite ||
+      cipher_suite == Basic128BitAeadCipherSuite) {
     *signer_name = "ecdsap256";
     return true;
   } else if (cipher_suite == Basic192BitCipherSuite) {
     *signer_name = "ecdsap384";
     return true;
-  } else if (cipher_suite == Basic256BitCipherSuite) {
+  } else if (cipher_suite == Basic256BitCipherSuite ||
+             cipher_suite == Basic256BitAeadCipherSuite) {
     *signer_name = "ecdsap521";
     return true;
   } else {
@@ -159,6 +193,10 @@ Verifier* CryptoKeyToVerifier(tao::CryptoKey& ck) {
   *v->ch_ = ck.key_header();
   EVP_PKEY_set1_EC_KEY(pk, ec_key);
   v->vk_ = pk;
+  if (!v->InitKeyState()) {
+    delete v;
+    return nullptr;
+  }
   return v;
 }
 
@@ -206,32 +244,30 @@ Signer* CryptoKeyToSigner(tao::CryptoKey& ck) {
   *s->ch_ = ck.key_header();
   EVP_PKEY_set1_EC_KEY(pk, ec_key);
   s->sk_ = pk;
+  if (!s->InitKeyState()) {
+    delete s;
+    return nullptr;
+  }
   return s;
 }
 
 Verifier* VerifierFromSigner(Signer* s) {
-  Verifier* v = new(Verifier);
-  EC_KEY* ec_pub_key = nullptr;
-  if (s->ch_->key_type() == string("aes128-ctr-hmacsha256")) {
-        ec_pub_key = EC_KEY_new_by_curve_name(NID_secp256k1);
-  } else if (s->ch_->key_type() != string("aes256-ctr-hmacsha384")) {
-        int k = OBJ_txt2nid("secp384r1");
-        ec_pub_key = EC_KEY_new_by_curve_name(k);
-  } else if (s->ch_->key_type() == string("aes256-ctr-hmacsha512")) {
-        int k = OBJ_txt2nid("secp521r1");
-        ec_pub_key = EC_KEY_new_by_curve_name(k);
-  } else {
+  if (s->ec_key_ == nullptr) {
     return nullptr;
   }
+  Verifier* v = new(Verifier);
   tao::CryptoHeader* ch = new(tao::CryptoHeader);
   *ch = *(s->ch_);
   ch->set_key_type(ch->key_type() + "-public");
   ch->set_key_purpose("verifying");
   v->ch_ = ch;
   v->vk_ = EVP_PKEY_new();
-  EC_KEY* priv_key = EVP_PKEY_get1_EC_KEY(s->sk_);
-  // FIX
-  EVP_PKEY_set1_EC_KEY(v->vk_, priv_key);
+  // FIX: this shares the private key; VerifierToCryptoKey depends on it.
+  EVP_PKEY_set1_EC_KEY(v->vk_, s->ec_key_);
+  if (!v->InitKeyState()) {
+    delete v;
+    return nullptr;
+  }
   return v;
 }
 
@@ -269,13 +305,19 @@ Verifier* VerifierFromCertificate(string& der) {
     return nullptr;
   }
   v->ch_ = ch;
+  if (!v->InitKeyState()) {
+    delete v;
+    return nullptr;
+  }
   return v;
 }
 
 Crypter* CryptoKeyToCrypter(tao::CryptoKey& ck) {
-  if (ck.key_header().key_type() != string("aes128-ctr-hmacsha256") &&
-      ck.key_header().key_type() != string("aes256-ctr-hmacsha384") &&
-      ck.key_header().key_type() != string("aes256-ctr-hmacsha512")) {
+  if (!IsCrypterType(ck.key_header().key_type())) {
+    return nullptr;
+  }
+  int num_components = IsAeadCrypterType(ck.key_header().key_type()) ? 1 : 2;
+  if (ck.key_components_size() < num_components) {
     return nullptr;
   }
   Crypter* c = new(Crypter);
@@ -284,7 +326,15 @@ Crypter* CryptoKeyToCrypter(tao::CryptoKey& ck) {
   c->encryptingKeyBytes_ = new(string);
   c->encryptingKeyBytes_->assign(ck.key_components(0));
   c->hmacKeyBytes_ = new(string);
-  c->hmacKeyBytes_->assign(ck.key_components(1));
+  if (num_components > 1)
+    c->hmacKeyBytes_->assign(ck.key_components(1));
+  if (!c->InitKeyState()) {
+    delete c->ch_;
+    delete c->encryptingKeyBytes_;
+    delete c->hmacKeyBytes_;
+    delete c;
+    return nullptr;
+  }
   return c;
 }
 
@@ -299,8 +349,7 @@ tao::CryptoKey* SignerToCryptoKey(Signer* s) {
   *ch = *(s->ch_);
   ck->set_allocated_key_header(ch);
   string component;
-  EC_KEY* ec_key= EVP_PKEY_get1_EC_KEY(s->sk_);
-  if (!SerializeECCKeyComponents(ec_key, &component)) {
+  if (!SerializeECCKeyComponents(s->ec_key_, &component)) {
     return nullptr;
   }
   string* kc = ck->add_key_components();
@@ -318,9 +367,8 @@ tao::CryptoKey* VerifierToCryptoKey(Verifier* v) {
   tao::CryptoHeader* ch = new(tao::CryptoHeader);
   *ch = *(v->ch_);
   ck->set_allocated_key_header(ch);
-  EC_KEY* ec_key = EVP_PKEY_get1_EC_KEY(v->vk_);
   string component;
-  if (!SerializeECCKeyComponents(ec_key, &component)) {
+  if (!SerializeECCKeyComponents(v->ec_key_, &component)) {
     return nullptr;
   }
   string* kc = ck->add_key_components();
@@ -329,18 +377,19 @@ tao::CryptoKey* VerifierToCryptoKey(Verifier* v) {
 }
 
 tao::CryptoKey* CrypterToCryptoKey(Crypter* c) {
+  if (!IsCrypterType(c->ch_->key_type())) {
+    return nullptr;
+  }
   tao::CryptoKey* ck = new(tao::CryptoKey);
   tao::CryptoHeader* ch = new(tao::CryptoHeader);
   *ch = *(c->ch_);
-  if (c->ch_->key_type() != string("aes128-ctr-hmacsha256") &&
-      c->ch_->key_type() != string("aes256-ctr-hmacsha384") &&
-      c->ch_->key_type() != string("aes256-ctr-hmacsha512")) {
-    return nullptr;
-  }
+  ck->set_allocated_key_header(ch);
   string* kc = ck->add_key_components();
   *kc = *c->encryptingKeyBytes_;
-  kc = ck->add_key_components();
-  *kc = *c->hmacKeyBytes_;
+  if (!IsAeadCrypterType(c->ch_->key_type())) {
+    kc = ck->add_key_components();
+    *kc = *c->hmacKeyBytes_;
+  }
   return ck;
 }
 
@@ -476,6 +525,20 @@ bool GenerateCryptoKey(string& type, tao::CryptoKey* ck) {
     kc->assign((const char*)&buf[0], 32);
     kc = ck->add_key_components();
     kc->assign((const char*)&buf[32], 64);
+  } else if (IsAeadCrypterType(type)) {
+    ch->set_key_purpose("crypting");
+    int key_size = type == string("aes128-gcm") ? 16 : 32;
+#ifdef FAKE_RAND_BYTES
+    int rc = RAND_pseudo_bytes(buf, key_size);
+#else
+    int rc = RAND_bytes(buf, key_size);
+#endif
+    if (rc != 1) {
+      printf("GenerateKey: couldn't generate random bytes.\n");
+      return false;
+    }
+    string* kc = ck->add_key_components();
+    kc->assign((const char*)&buf[0], key_size);
   } else {
     return false;
   }
@@ -513,151 +576,531 @@ void PrintCryptoKey(const tao::CryptoKey& ck) {
   }
 }
 
-bool Signer::Sign(string& in, string* out) {
-  if (ch_ == nullptr) {
+EcdsaKeyType EcdsaKeyTypeFromName(const string& key_type) {
+  if (key_type == string("ecdsap256") || key_type == string("ecdsap256-public"))
+    return ECDSA_P256;
+  if (key_type == string("ecdsap384") || key_type == string("ecdsap384-public"))
+    return ECDSA_P384;
+  if (key_type == string("ecdsap521") || key_type == string("ecdsap521-public"))
+    return ECDSA_P521;
+  return ECDSA_UNKNOWN;
+}
+
+// Returns the digest size, or -1 for an unknown type.
+static int EcdsaDigest(EcdsaKeyType type, string& msg, byte* digest) {
+  switch (type) {
+  case ECDSA_P256:
+    SHA256((byte*)msg.data(), msg.size(), digest);
+    return 32;
+  case ECDSA_P384:
+    SHA384((byte*)msg.data(), msg.size(), digest);
+    return 48;
+  case ECDSA_P521:
+    SHA512((byte*)msg.data(), msg.size(), digest);
+    return 64;
+  default:
+    return -1;
+  }
+}
+
+// Earlier builds swapped the p384 and p521 digests.  Returns the digest
+// size they used, or -1 if they used the same digest as EcdsaDigest.
+static int EcdsaLegacyDigest(EcdsaKeyType type, string& msg, byte* digest) {
+  switch (type) {
+  case ECDSA_P384:
+    SHA512((byte*)msg.data(), msg.size(), digest);
+    return 64;
+  case ECDSA_P521:
+    SHA384((byte*)msg.data(), msg.size(), digest);
+    return 48;
+  default:
+    return -1;
+  }
+}
+
+static bool EcdsaVerify(EcdsaKeyType type, EC_KEY* ec_key, string& msg,
+                        string& serialized_sig) {
+  byte digest[EVP_MAX_MD_SIZE];
+  int dig_len = EcdsaDigest(type, msg, digest);
+  if (dig_len < 0 || ec_key == nullptr) {
     return false;
   }
-  if (!ch_->has_key_type()) {
+  ECDSA_SIG sig;
+  if (!EC_SIG_deserialize(serialized_sig, &sig)) {
+    printf("Can't EC_SIG_deserialize\n");
     return false;
   }
-  if (!ch_->has_key_purpose()) {
+  int result = ECDSA_do_verify((const byte*) digest, dig_len,
+                               (const ECDSA_SIG *) &sig, ec_key);
+  if (result != 1) {
+    // Still accept signatures made by earlier builds.
+    dig_len = EcdsaLegacyDigest(type, msg, digest);
+    if (dig_len > 0)
+      result = ECDSA_do_verify((const byte*) digest, dig_len,
+                               (const ECDSA_SIG *) &sig, ec_key);
+  }
+  BN_free(sig.r);
+  BN_free(sig.s);
+  return result == 1;
+}
+
+// OpenSSL attaches its ECDSA state to a key on first use.  Do that now so
+// that the first concurrent Sign or Verify calls do not race to create it.
+static void PrepareSharedEcKey(EC_KEY* ec_key) {
+  ECDSA_get_ex_data(ec_key, 0);
+}
+
+class EcdsaNoncePool {
+public:
+  EcdsaNoncePool(EC_KEY* ec_key, int per_thread);
+  ~EcdsaNoncePool();
+
+  // Fills every shard, then starts the refiller.
+  bool Fill();
+  // On success the caller owns *kinv and *r and must use them only once.
+  bool Take(BIGNUM** kinv, BIGNUM** r);
+
+private:
+  struct Nonce {
+    BIGNUM* kinv;
+    BIGNUM* r;
+  };
+  struct Shard {
+    std::mutex mu;
+    std::vector<Nonce> nonces;
+  };
+  // Everything the refiller thread waits on.  A forked child has no
+  // refiller, but the inherited condition variable still counts it as a
+  // waiter, so the child abandons this rather than destroy it.
+  struct Refiller {
+    std::mutex mu;
+    std::condition_variable cv;
+    bool refill = false;
+    bool stop = false;
+    std::thread thread;
+  };
+
+  EC_KEY* ec_key_;
+  int per_thread_;
+  BN_CTX* bn_ctx_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::unique_ptr<Refiller> refiller_;
+  // The fork generation the pool was made in.  A forked child must never
+  // hand out the parent's nonces.
+  unsigned generation_;
+
+  bool FillShards();
+  Shard* ThreadShard();
+  void Refill();
+  bool Forked();
+};
+
+// Bumped in every forked child.
+static std::atomic<unsigned> ecdsa_fork_generation(0);
+
+static void EcdsaNoncePoolAtFork() {
+  ecdsa_fork_generation++;
+}
+
+EcdsaNoncePool::EcdsaNoncePool(EC_KEY* ec_key, int per_thread)
+    : ec_key_(ec_key), per_thread_(per_thread), bn_ctx_(BN_CTX_new()),
+      refiller_(new Refiller) {
+  static std::once_flag once;
+  std::call_once(once, []() {
+    pthread_atfork(nullptr, nullptr, EcdsaNoncePoolAtFork);
+  });
+  generation_ = ecdsa_fork_generation;
+  int n = std::thread::hardware_concurrency();
+  if (n < 1)
+    n = 1;
+  for (int i = 0; i < n; i++)
+    shards_.emplace_back(new Shard);
+}
+
+EcdsaNoncePool::~EcdsaNoncePool() {
+  if (Forked()) {
+    refiller_.release();
+  } else {
+    {
+      std::lock_guard<std::mutex> l(refiller_->mu);
+      refiller_->stop = true;
+    }
+    refiller_->cv.notify_one();
+    if (refiller_->thread.joinable())
+      refiller_->thread.join();
+  }
+  // No other thread is left, so the shard locks are not needed; in a
+  // forked child they may even be held.
+  for (auto& shard : shards_) {
+    for (Nonce& n : shard->nonces) {
+      BN_clear_free(n.kinv);
+      BN_clear_free(n.r);
+    }
+  }
+  BN_CTX_free(bn_ctx_);
+}
+
+bool EcdsaNoncePool::Fill() {
+  if (!FillShards())
     return false;
+  refiller_->thread = std::thread(&EcdsaNoncePool::Refill, this);
+  return true;
+}
+
+// The first fill runs on the caller's thread; later ones on the refiller.
+bool EcdsaNoncePool::FillShards() {
+  if (bn_ctx_ == nullptr)
+    return false;
+  for (auto& shard : shards_) {
+    for (;;) {
+      {
+        std::lock_guard<std::mutex> l(shard->mu);
+        if ((int)shard->nonces.size() >= per_thread_)
+          break;
+      }
+      Nonce n = {nullptr, nullptr};
+      if (ECDSA_sign_setup(ec_key_, bn_ctx_, &n.kinv, &n.r) != 1)
+        return false;
+      std::lock_guard<std::mutex> l(shard->mu);
+      shard->nonces.push_back(n);
+    }
   }
-  if (ch_->key_purpose() != string("signing")) {
+  return true;
+}
+
+void EcdsaNoncePool::Refill() {
+  std::unique_lock<std::mutex> l(refiller_->mu);
+  for (;;) {
+    refiller_->cv.wait(l, [this]() {
+      return refiller_->refill || refiller_->stop;
+    });
+    if (refiller_->stop)
+      return;
+    refiller_->refill = false;
+    l.unlock();
+    FillShards();
+    l.lock();
+  }
+}
+
+EcdsaNoncePool::Shard* EcdsaNoncePool::ThreadShard() {
+  static std::atomic<unsigned> next_thread(0);
+  static thread_local unsigned thread_index = next_thread++;
+  return shards_[thread_index % shards_.size()].get();
+}
+
+bool EcdsaNoncePool::Forked() {
+  return generation_ != ecdsa_fork_generation;
+}
+
+bool EcdsaNoncePool::Take(BIGNUM** kinv, BIGNUM** r) {
+  // Parent and child would otherwise sign with the same k, which
+  // reveals the key.
+  if (Forked())
     return false;
+  Shard* shard = ThreadShard();
+  bool found = false;
+  bool low;
+  {
+    std::lock_guard<std::mutex> l(shard->mu);
+    if (!shard->nonces.empty()) {
+      *kinv = shard->nonces.back().kinv;
+      *r = shard->nonces.back().r;
+      shard->nonces.pop_back();
+      found = true;
+    }
+    low = (int)shard->nonces.size() <= per_thread_ / 2;
   }
+  if (low) {
+    {
+      std::lock_guard<std::mutex> l(refiller_->mu);
+      refiller_->refill = true;
+    }
+    refiller_->cv.notify_one();
+  }
+  return found;
+}
 
-  byte digest[128];
-  int dig_len;
-  if (ch_->key_type() == string("ecdsap256")) {
-    dig_len = 32;
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, (byte*)in.data(), in.size());
-    SHA256_Final(digest, &sha256);
-  } else if (ch_->key_type() != string("ecdsap384")) {
-    dig_len = 48;
-    SHA512_CTX sha384;
-    SHA384_Init(&sha384);
-    SHA384_Update(&sha384, (byte*)in.data(), in.size());
-    SHA384_Final(digest, &sha384);
-  } else if (ch_->key_type() != string("ecdsap521")) {
-    dig_len = 64;
-    SHA512_CTX sha512;
-    SHA512_Init(&sha512);
-    SHA512_Update(&sha512, (byte*)in.data(), in.size());
-    SHA512_Final(digest, &sha512);
-  } else {
+Signer::Signer()
+    : ch_(nullptr), sk_(nullptr), ec_key_(nullptr), type_(ECDSA_UNKNOWN),
+      nonce_pool_(nullptr) {
+}
+
+Signer::~Signer() {
+  delete nonce_pool_;
+  if (ec_key_ != nullptr)
+    EC_KEY_free(ec_key_);
+}
+
+bool Signer::InitKeyState() {
+  if (ch_ == nullptr || sk_ == nullptr) {
     return false;
   }
-  EC_KEY* ec_key = EVP_PKEY_get1_EC_KEY(sk_);
-  ECDSA_SIG* sig = ECDSA_do_sign((const byte*) digest, dig_len, ec_key);
-  if (!EC_SIG_serialize(sig, out)) {
+  type_ = EcdsaKeyTypeFromName(ch_->key_type());
+  if (type_ == ECDSA_UNKNOWN) {
     return false;
   }
+  if (ec_key_ == nullptr)
+    ec_key_ = EVP_PKEY_get1_EC_KEY(sk_);
+  if (ec_key_ == nullptr) {
+    return false;
+  }
+  PrepareSharedEcKey(ec_key_);
   return true;
 }
 
-bool Signer::Verify(string& msg, string& serialized_sig) {
-  if (ch_ == nullptr) {
+bool Signer::EnableNoncePool(int per_thread) {
+  if (ec_key_ == nullptr || nonce_pool_ != nullptr || per_thread < 1) {
     return false;
   }
-  if (!ch_->has_key_type()) {
+  // The refiller and the signing threads both draw on RAND.
+  InitOpenSslThreading();
+  EcdsaNoncePool* pool = new EcdsaNoncePool(ec_key_, per_thread);
+  if (!pool->Fill()) {
+    delete pool;
     return false;
   }
-  if (!ch_->has_key_purpose()) {
+  nonce_pool_ = pool;
+  return true;
+}
+
+bool Signer::Sign(string& in, string* out) {
+  if (ch_ == nullptr || ec_key_ == nullptr) {
     return false;
   }
   if (ch_->key_purpose() != string("signing")) {
     return false;
   }
 
-  byte digest[128];
-  int dig_len;
-  if (ch_->key_type() == string("ecdsap256")) {
-    dig_len = 32;
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, (byte*)msg.data(), msg.size());
-    SHA256_Final(digest, &sha256);
-  } else if (ch_->key_type() != string("ecdsap384")) {
-    dig_len = 48;
-    SHA512_CTX sha384;
-    SHA384_Init(&sha384);
-    SHA384_Update(&sha384, (byte*)msg.data(), msg.size());
-    SHA384_Final(digest, &sha384);
-  } else if (ch_->key_type() != string("ecdsap521")) {
-    dig_len = 64;
-    SHA512_CTX sha512;
-    SHA512_Init(&sha512);
-    SHA512_Update(&sha512, (byte*)msg.data(), msg.size());
-    SHA512_Final(digest, &sha512);
-  } else {
+  byte digest[EVP_MAX_MD_SIZE];
+  int dig_len = EcdsaDigest(type_, in, digest);
+  if (dig_len < 0) {
+    return false;
+  }
+  ECDSA_SIG* sig = nullptr;
+  BIGNUM* kinv = nullptr;
+  BIGNUM* r = nullptr;
+  if (nonce_pool_ != nullptr && nonce_pool_->Take(&kinv, &r)) {
+    sig = ECDSA_do_sign_ex((const byte*) digest, dig_len, kinv, r, ec_key_);
+    BN_clear_free(kinv);
+    BN_clear_free(r);
+  }
+  // No pooled nonce, or it gave s == 0 and a new one is needed.
+  if (sig == nullptr)
+    sig = ECDSA_do_sign((const byte*) digest, dig_len, ec_key_);
+  if (sig == nullptr) {
     return false;
   }
+  bool ok = EC_SIG_serialize(sig, out);
+  ECDSA_SIG_free(sig);
+  return ok;
+}
 
-  ECDSA_SIG sig;
-  if (!EC_SIG_deserialize(serialized_sig, &sig)) {
+bool Signer::Verify(string& msg, string& serialized_sig) {
+  if (ch_ == nullptr || ch_->key_purpose() != string("signing")) {
     return false;
   }
-  EC_KEY* ec_key = EVP_PKEY_get1_EC_KEY(sk_);
-  int result = ECDSA_do_verify((const byte*) digest, dig_len, (const ECDSA_SIG *) &sig, ec_key);
-  return result == 1;
+  return EcdsaVerify(type_, ec_key_, msg, serialized_sig);
 }
 
-bool Verifier::Verify(string& msg, string& serialized_sig) {
-  if (ch_ == nullptr) {
+Verifier::Verifier()
+    : ch_(nullptr), vk_(nullptr), ec_key_(nullptr), type_(ECDSA_UNKNOWN) {
+}
+
+Verifier::~Verifier() {
+  if (ec_key_ != nullptr)
+    EC_KEY_free(ec_key_);
+}
+
+bool Verifier::InitKeyState() {
+  if (ch_ == nullptr || vk_ == nullptr) {
     return false;
   }
-  if (!ch_->has_key_type()) {
+  type_ = EcdsaKeyTypeFromName(ch_->key_type());
+  if (type_ == ECDSA_UNKNOWN) {
     return false;
   }
-  if (!ch_->has_key_purpose()) {
+  if (ec_key_ == nullptr)
+    ec_key_ = EVP_PKEY_get1_EC_KEY(vk_);
+  if (ec_key_ == nullptr) {
+    printf("EVP_PKEY_get1_EC_KEY failed\n");
+    return false;
+  }
+  PrepareSharedEcKey(ec_key_);
+  return true;
+}
+
+bool Verifier::Verify(string& msg, string& serialized_sig) {
+  if (ch_ == nullptr || ch_->key_purpose() != string("verifying")) {
+    return false;
+  }
+  return EcdsaVerify(type_, ec_key_, msg, serialized_sig);
+}
+
+// Runs work(0), ..., work(count - 1) on up to num_threads threads, and
+// returns true if every call did.  Threads claim one index at a time, so a
+// slow call does not hold up the rest of a static share.  No more calls are
+// started once one fails.
+static bool ForEachChunk(int64_t count, int num_threads,
+                         const std::function<bool(int64_t)>& work) {
+  if (num_threads <= 0)
+    num_threads = std::thread::hardware_concurrency();
+  if (num_threads > count)
+    num_threads = count;
+  if (num_threads < 1)
+    num_threads = 1;
+
+  std::atomic<int64_t> next(0);
+  std::atomic<bool> ok(true);
+  auto run = [&work, &next, &ok, count]() {
+    for (;;) {
+      int64_t i = next.fetch_add(1);
+      if (i >= count || !ok)
+        return;
+      if (!work(i))
+        ok = false;
+    }
+  };
+  InitOpenSslThreading();
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; i++)
+    threads.emplace_back(run);
+  run();
+  for (std::thread& t : threads)
+    t.join();
+  return ok;
+}
+
+bool VerifyBatch(std::vector<VerifyBatchItem>& items,
+                 std::vector<bool>* results, int num_threads) {
+  int n = items.size();
+  std::vector<char> ok(n, 0);
+  ForEachChunk((n + VERIFY_BATCH_CHUNK - 1) / VERIFY_BATCH_CHUNK, num_threads,
+               [&items, &ok, n](int64_t chunk) {
+    int start = chunk * VERIFY_BATCH_CHUNK;
+    int end = std::min(n, start + VERIFY_BATCH_CHUNK);
+    for (int i = start; i < end; i++) {
+      VerifyBatchItem& item = items[i];
+      ok[i] = item.verifier_ != nullptr && item.msg_ != nullptr &&
+              item.sig_ != nullptr &&
+              item.verifier_->Verify(*item.msg_, *item.sig_);
+    }
+    // A bad signature is a result, not a reason to stop.
+    return true;
+  });
+
+  bool all = true;
+  results->assign(n, false);
+  for (int i = 0; i < n; i++) {
+    (*results)[i] = ok[i] != 0;
+    all = all && ok[i];
+  }
+  return all;
+}
+
+Crypter::Crypter()
+    : ch_(nullptr), encryptingKeyBytes_(nullptr), hmacKeyBytes_(nullptr),
+      aes_ctx_(nullptr), hmac_ctx_(nullptr), aead_(false), mac_size_(0) {
+}
+
+Crypter::~Crypter() {
+  if (aes_ctx_ != nullptr)
+    EVP_CIPHER_CTX_free(aes_ctx_);
+  if (hmac_ctx_ != nullptr) {
+    HMAC_CTX_cleanup(hmac_ctx_);
+    delete hmac_ctx_;
+  }
+}
+
+bool Crypter::InitKeyState() {
+  const EVP_CIPHER* cipher;
+  const EVP_MD* md = nullptr;
+
+  // The Crypter may be shared by threads, which OpenSSL 1.0.x must lock for.
+  InitOpenSslThreading();
+  if (ch_ == nullptr || encryptingKeyBytes_ == nullptr ||
+      hmacKeyBytes_ == nullptr) {
     return false;
   }
-  if (ch_->key_purpose() != string("verifying")) {
-    return false;
-  }
-
-  byte digest[128];
-  int dig_len;
-  if (ch_->key_type() == string("ecdsap256-public")) {
-    dig_len = 32;
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, (byte*)msg.data(), msg.size());
-    SHA256_Final(digest, &sha256);
-  } else if (ch_->key_type() != string("ecdsap384-public")) {
-    dig_len = 48;
-    SHA512_CTX sha384;
-    SHA384_Init(&sha384);
-    SHA384_Update(&sha384, (byte*)msg.data(), msg.size());
-    SHA384_Final(digest, &sha384);
-  } else if (ch_->key_type() != string("ecdsap521-public")) {
-    dig_len = 64;
-    SHA512_CTX sha512;
-    SHA512_Init(&sha512);
-    SHA512_Update(&sha512, (byte*)msg.data(), msg.size());
-    SHA512_Final(digest, &sha512);
+  aead_ = false;
+  if (ch_->key_type() == string("aes128-gcm")) {
+    cipher = EVP_aes_128_gcm();
+    aead_ = true;
+  } else if (ch_->key_type() == string("aes256-gcm")) {
+    cipher = EVP_aes_256_gcm();
+    aead_ = true;
+  } else if (ch_->key_type() == string("aes128-ctr-hmacsha256")) {
+    cipher = EVP_aes_128_ecb();
+    md = EVP_sha256();
+  } else if (ch_->key_type() == string("aes256-ctr-hmacsha384")) {
+    cipher = EVP_aes_256_ecb();
+    md = EVP_sha384();
+  } else if (ch_->key_type() == string("aes256-ctr-hmacsha512")) {
+    cipher = EVP_aes_256_ecb();
+    md = EVP_sha512();
   } else {
     return false;
   }
+  if ((int)encryptingKeyBytes_->size() != EVP_CIPHER_key_length(cipher)) {
+    printf("Crypter::InitKeyState: bad key size\n");
+    return false;
+  }
 
-  ECDSA_SIG sig;
-  if (!EC_SIG_deserialize(serialized_sig, &sig)) {
-    printf("Can't EC_SIG_deserialize\n");
+  if (aes_ctx_ == nullptr)
+    aes_ctx_ = EVP_CIPHER_CTX_new();
+  if (aes_ctx_ == nullptr ||
+      EVP_EncryptInit_ex(aes_ctx_, cipher, nullptr,
+                         (byte*)encryptingKeyBytes_->data(), nullptr) != 1) {
+    printf("Crypter::InitKeyState: can't expand aes key\n");
     return false;
   }
-  EC_KEY* ec_key = EVP_PKEY_get1_EC_KEY(vk_);
-  if (ec_key == nullptr) {
-    printf("EVP_PKEY_get1_EC_KEY failed\n");
+  EVP_CIPHER_CTX_set_padding(aes_ctx_, 0);
+  if (aead_) {
+    return true;
+  }
+
+  if (hmac_ctx_ == nullptr) {
+    hmac_ctx_ = new HMAC_CTX;
+    HMAC_CTX_init(hmac_ctx_);
+  }
+  if (HMAC_Init_ex(hmac_ctx_, (byte*)hmacKeyBytes_->data(),
+                   hmacKeyBytes_->size(), md, nullptr) != 1) {
+    printf("Crypter::InitKeyState: can't key hmac\n");
     return false;
   }
-  int result = ECDSA_do_verify((const byte*) digest, dig_len, (const ECDSA_SIG *) &sig, ec_key);
-  return result == 1;
+  mac_size_ = EVP_MD_size(md);
+  return true;
 }
 
-bool Crypter::Encrypt(string& in, string* iv, string* mac_out, string* out) {
+int Crypter::IvSize() {
+  return aead_ ? AEAD_IV_SIZE : AESBLKSIZE;
+}
+
+int Crypter::MacSize() {
+  return aead_ ? AEAD_TAG_SIZE : mac_size_;
+}
+
+// Without associated data the mac is HMAC(iv | data).  With it, the
+// 8-byte big-endian ad size and the ad come first.
+bool Crypter::Mac(int ad_size, byte* ad, byte* iv, int size, byte* data,
+                  byte* mac) {
+  HMAC_CTX ctx;
+  unsigned int len = 0;
+  byte ad_len[8];
+  for (int i = 0; i < 8; i++)
+    ad_len[i] = (byte)((uint64_t)ad_size >> (56 - 8 * i));
+  HMAC_CTX_init(&ctx);
+  bool ok = HMAC_CTX_copy(&ctx, hmac_ctx_) == 1 &&
+            (ad_size == 0 || (HMAC_Update(&ctx, ad_len, sizeof(ad_len)) == 1 &&
+                              HMAC_Update(&ctx, ad, ad_size) == 1)) &&
+            HMAC_Update(&ctx, iv, AESBLKSIZE) == 1 &&
+            HMAC_Update(&ctx, data, size) == 1 &&
+            HMAC_Final(&ctx, mac, &len) == 1;
+  HMAC_CTX_cleanup(&ctx);
+  return ok && (int)len == mac_size_;
+}
+
+bool Crypter::Ready() {
   if (ch_ == nullptr) {
     return false;
   }
@@ -670,180 +1113,287 @@ bool Crypter::Encrypt(string& in, string* iv, string* mac_out, string* out) {
   if (ch_->key_purpose() != string("crypting")) {
     return false;
   }
+  if (aes_ctx_ == nullptr || (!aead_ && hmac_ctx_ == nullptr)) {
+    printf("Crypter: key state not initialized\n");
+    return false;
+  }
+  return true;
+}
 
-  byte iv_vec[16];
-#ifdef FAKE_RAND_BYTES
-  int rc = RAND_pseudo_bytes(iv_vec, 16);
-#else
-  int rc = RAND_bytes(iv_vec, 16);
-#endif
-    if (rc != 1) {
-      printf("Encrypt: couldn't generate iv\n");
-      return false;
-    }
-  iv->assign((const char*)iv_vec, 16);
-
-  if (ch_->key_type() == string("aes128-ctr-hmacsha256")) {
-    byte* t_buf = (byte*) malloc(in.size());
-    byte mac[32];
-    unsigned int mac_size = 32;
-
-    if (!AesCtrCrypt(*iv, 128, (byte*)encryptingKeyBytes_->data(), in.size(), (byte*) in.data(), t_buf)) {
-      return false;
-    }
+// AES-GCM in one pass.  The iv is a 12-byte nonce and the mac is the tag.
+bool Crypter::EncryptAead(int size, byte* in, byte* out, byte* iv,
+                          byte* mac, int ad_size, byte* ad) {
+  int len = 0;
+  int ad_len = 0;
+  int final_len = 0;
+  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+  bool ok = ctx != nullptr && EVP_CIPHER_CTX_copy(ctx, aes_ctx_) == 1 &&
+            EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, iv) == 1 &&
+            (ad_size == 0 ||
+             EVP_EncryptUpdate(ctx, nullptr, &ad_len, ad, ad_size) == 1) &&
+            EVP_EncryptUpdate(ctx, out, &len, in, size) == 1 &&
+            EVP_EncryptFinal_ex(ctx, out + len, &final_len) == 1 &&
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, AEAD_TAG_SIZE,
+                                mac) == 1;
+  if (ctx != nullptr)
+    EVP_CIPHER_CTX_free(ctx);
+  if (!ok || len + final_len != size) {
+    printf("Crypter::Encrypt: aead encryption failed\n");
+    return false;
+  }
+  return true;
+}
 
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
-    HMAC_Init_ex(&ctx, (byte*)hmacKeyBytes_->data(), hmacKeyBytes_->size(), EVP_sha256(), NULL);
-    HMAC_Update(&ctx, (byte*)iv->data(), iv->size());
-    HMAC_Update(&ctx, t_buf, in.size());
-    HMAC_Final(&ctx, (byte*)mac, &mac_size);
-    HMAC_CTX_cleanup(&ctx);
+bool Crypter::DecryptAead(int size, byte* in, byte* out, byte* iv,
+                          byte* mac, int ad_size, byte* ad) {
+  int len = 0;
+  int ad_len = 0;
+  int final_len = 0;
+  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+  bool ok = ctx != nullptr && EVP_CIPHER_CTX_copy(ctx, aes_ctx_) == 1 &&
+            EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, iv) == 1 &&
+            (ad_size == 0 ||
+             EVP_DecryptUpdate(ctx, nullptr, &ad_len, ad, ad_size) == 1) &&
+            EVP_DecryptUpdate(ctx, out, &len, in, size) == 1 &&
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, AEAD_TAG_SIZE,
+                                mac) == 1 &&
+            EVP_DecryptFinal_ex(ctx, out + len, &final_len) == 1;
+  if (ctx != nullptr)
+    EVP_CIPHER_CTX_free(ctx);
+  if (!ok) {
+    // Don't hand back unauthenticated plaintext.
+    OPENSSL_cleanse(out, size);
+    printf("mac mismatch\n");
+    return false;
+  }
+  return true;
+}
 
-    out->assign((const char*)t_buf, in.size());
-    mac_out->assign((const char*)mac, mac_size);
+bool Crypter::Encrypt(int size, byte* in, byte* out, byte* iv, byte* mac) {
+  return Encrypt(size, in, out, iv, mac, 0, nullptr);
+}
 
-    free(t_buf);
-  } else if (ch_->key_type() == string("aes256-ctr-hmacsha384")) {
-    byte* t_buf = (byte*) malloc(in.size());
-    byte mac[48];
-    unsigned int mac_size = 48;
+bool Crypter::Encrypt(int size, byte* in, byte* out, byte* iv, byte* mac,
+                      int ad_size, byte* ad) {
+  if (!Ready() || size < 0 || ad_size < 0) {
+    return false;
+  }
+#ifdef FAKE_RAND_BYTES
+  int rc = RAND_pseudo_bytes(iv, IvSize());
+#else
+  int rc = RAND_bytes(iv, IvSize());
+#endif
+  if (rc != 1) {
+    printf("Encrypt: couldn't generate iv\n");
+    return false;
+  }
+  if (aead_) {
+    return EncryptAead(size, in, out, iv, mac, ad_size, ad);
+  }
 
-    if (!AesCtrCrypt(*iv, 256, (byte*)encryptingKeyBytes_->data(), in.size(), (byte*) in.data(), t_buf)) {
-      return false;
-    }
+  AesCtr ctr;
+  if (!ctr.Init(aes_ctx_, AESBLKSIZE, iv) || !ctr.Crypt(size, in, out)) {
+    printf("AesCtrCrypt encrypt failed\n");
+    return false;
+  }
+  return Mac(ad_size, ad, iv, size, out, mac);
+}
 
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
-    HMAC_Init_ex(&ctx, hmacKeyBytes_->data(), hmacKeyBytes_->size(), EVP_sha384(), NULL);
-    HMAC_Update(&ctx, (byte*)iv->data(), iv->size());
-    HMAC_Update(&ctx, t_buf, in.size());
-    HMAC_Final(&ctx, (byte*)mac, &mac_size);
-    HMAC_CTX_cleanup(&ctx);
-
-    out->assign((const char*)t_buf, in.size());
-    mac_out->assign((const char*)mac, mac_size);
-    free(t_buf);
-  } else if (ch_->key_type() == string("aes256-ctr-hmacsha512")) {
-    byte* t_buf = (byte*) malloc(in.size());
-    byte mac[64];
-    unsigned int mac_size = 64;
+bool Crypter::Decrypt(int size, byte* in, byte* out, byte* iv, byte* mac) {
+  return Decrypt(size, in, out, iv, mac, 0, nullptr);
+}
 
-    if (!AesCtrCrypt(*iv, 256, (byte*)encryptingKeyBytes_->data(), in.size(), (byte*) in.data(), t_buf)) {
-      return false;
-    }
+bool Crypter::Decrypt(int size, byte* in, byte* out, byte* iv, byte* mac,
+                      int ad_size, byte* ad) {
+  if (!Ready() || size < 0 || ad_size < 0) {
+    return false;
+  }
+  if (aead_) {
+    return DecryptAead(size, in, out, iv, mac, ad_size, ad);
+  }
 
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
-    HMAC_Init_ex(&ctx, hmacKeyBytes_->data(), hmacKeyBytes_->size(), EVP_sha512(), NULL);
-    HMAC_Update(&ctx, (byte*)iv->data(), iv->size());
-    HMAC_Update(&ctx, t_buf, in.size());
-    HMAC_Final(&ctx, (byte*)mac, &mac_size);
-    HMAC_CTX_cleanup(&ctx);
-
-    out->assign((const char*)t_buf, in.size());
-    mac_out->assign((const char*)mac, mac_size);
-    free(t_buf);
-  } else {
+  byte expected[EVP_MAX_MD_SIZE];
+  if (!Mac(ad_size, ad, iv, size, in, expected)) {
+    return false;
+  }
+  if (CRYPTO_memcmp(expected, mac, mac_size_) != 0) {
+    printf("mac mismatch\n");
+    return false;
+  }
+  AesCtr ctr;
+  if (!ctr.Init(aes_ctx_, AESBLKSIZE, iv) || !ctr.Crypt(size, in, out)) {
+    printf("AesCtrCrypt decrypt failed\n");
     return false;
   }
   return true;
 }
 
-bool Crypter::Decrypt(string& in, string& iv, string& mac_in, string* out) {
-  if (ch_ == nullptr) {
+bool Crypter::Encrypt(string& in, string* iv, string* mac_out, string* out) {
+  if (!Ready()) {
     return false;
   }
-  if (!ch_->has_key_type()) {
+  byte iv_vec[AESBLKSIZE];
+  byte mac[EVP_MAX_MD_SIZE];
+  out->resize(in.size());
+  if (!Encrypt(in.size(), (byte*)in.data(), (byte*)&(*out)[0], iv_vec, mac)) {
     return false;
   }
-  if (!ch_->has_key_purpose()) {
+  iv->assign((const char*)iv_vec, IvSize());
+  mac_out->assign((const char*)mac, MacSize());
+  return true;
+}
+
+bool Crypter::Decrypt(string& in, string& iv, string& mac_in, string* out) {
+  if (!Ready()) {
     return false;
   }
-  if (ch_->key_purpose() != string("crypting")) {
+  if ((int)iv.size() != IvSize() || (int)mac_in.size() != MacSize()) {
+    printf("Crypter::Decrypt: bad iv or mac size\n");
+    return false;
+  }
+  out->resize(in.size());
+  if (!Decrypt(in.size(), (byte*)in.data(), (byte*)&(*out)[0],
+               (byte*)iv.data(), (byte*)mac_in.data())) {
+    out->clear();
     return false;
   }
+  return true;
+}
 
-  if (ch_->key_type() == string("aes128-ctr-hmacsha256")) {
-    byte* t_buf = (byte*) malloc(in.size());
-    byte mac[32];
-    unsigned int mac_size = 32;
+Deriver::Deriver()
+    : ch_(nullptr), secret_bytes_(nullptr), md_(nullptr), prk_ctx_(nullptr) {
+}
 
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
-    HMAC_Init_ex(&ctx, hmacKeyBytes_->data(), hmacKeyBytes_->size(), EVP_sha256(), NULL);
-    HMAC_Update(&ctx, (byte*)iv.data(), iv.size());
-    HMAC_Update(&ctx, (byte*) in.data(), in.size());
-    HMAC_Final(&ctx, (byte*)mac, &mac_size);
-    HMAC_CTX_cleanup(&ctx);
+Deriver::~Deriver() {
+  if (prk_ctx_ != nullptr) {
+    HMAC_CTX_cleanup(prk_ctx_);
+    delete prk_ctx_;
+  }
+}
 
-    if (!AesCtrCrypt(iv, 128, (byte*)encryptingKeyBytes_->data(), in.size(), (byte*) in.data(), t_buf)) {
-      printf("AesCtrCrypt decrypt failed\n");
-      return false;
-    }
+bool Deriver::InitKeyState() {
+  std::lock_guard<std::mutex> l(mu_);
+  return ResetKeyState();
+}
 
-    if (!EqualBytes(mac, mac_size, (byte*)mac_in.data(), mac_in.size())) {
-      printf("mac 128 mismatch\n");
-      return false;
-    }
-    out->assign((const char*)t_buf, in.size());
-    free(t_buf);
-  } else if (ch_->key_type() == string("aes256-ctr-hmacsha384")) {
-    byte* t_buf = (byte*) malloc(in.size());
-    byte mac[48];
-    unsigned int mac_size = 48;
-
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
-    HMAC_Init_ex(&ctx, hmacKeyBytes_->data(), hmacKeyBytes_->size(), EVP_sha384(), NULL);
-    HMAC_Update(&ctx, (byte*)iv.data(), iv.size());
-    HMAC_Update(&ctx, (byte*) in.data(), in.size());
-    HMAC_Final(&ctx, (byte*)mac, &mac_size);
-    HMAC_CTX_cleanup(&ctx);
-
-    if (!EqualBytes(mac, mac_size, (byte*)mac_in.data(), mac_in.size())) {
-      printf("mac 256-384 mismatch\n");
-      return false;
-    }
-    if (!AesCtrCrypt(iv, 256, (byte*)encryptingKeyBytes_->data(), in.size(), (byte*) in.data(), t_buf)) {
-      printf("AesCtrCrypt decrypt failed\n");
+// Called with mu_ held.
+bool Deriver::ResetKeyState() {
+  md_ = nullptr;
+  salt_.clear();
+  if (prk_ctx_ != nullptr) {
+    HMAC_CTX_cleanup(prk_ctx_);
+    delete prk_ctx_;
+    prk_ctx_ = nullptr;
+  }
+  if (ch_ == nullptr || secret_bytes_ == nullptr) {
+    return false;
+  }
+  if (ch_->key_type() == string("hdkf-sha256")) {
+    md_ = EVP_sha256();
+  } else if (ch_->key_type() == string("hdkf-sha384")) {
+    md_ = EVP_sha384();
+  } else if (ch_->key_type() == string("hdkf-sha512")) {
+    md_ = EVP_sha512();
+  } else {
+    printf("Deriver::InitKeyState: unsupported type\n");
+    return false;
+  }
+  return true;
+}
+
+// Copies into ctx an HMAC keyed with PRK = HMAC(salt, secret), extracting
+// only if salt is not the cached one.
+bool Deriver::PrkContext(string& salt, HMAC_CTX* ctx) {
+  std::lock_guard<std::mutex> l(mu_);
+  if (md_ == nullptr && !ResetKeyState()) {
+    return false;
+  }
+  if (prk_ctx_ == nullptr || salt != salt_) {
+    // An empty salt is a hash length of zeros.
+    byte zeros[EVP_MAX_MD_SIZE];
+    memset(zeros, 0, sizeof(zeros));
+    const byte* key = salt.empty() ? zeros : (const byte*)salt.data();
+    int key_size = salt.empty() ? EVP_MD_size(md_) : salt.size();
+    byte prk[EVP_MAX_MD_SIZE];
+    unsigned int prk_size = 0;
+    if (HMAC(md_, key, key_size, (const byte*)secret_bytes_->data(),
+             secret_bytes_->size(), prk, &prk_size) == nullptr) {
       return false;
     }
-    out->assign((const char*)t_buf, in.size());
-    free(t_buf);
-  } else if (ch_->key_type() == string("aes256-ctr-hmacsha512")) {
-    byte* t_buf = (byte*) malloc(in.size());
-    byte mac[128];
-    unsigned int mac_size = 64;
-    memset(mac, 0, 64);
-
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
-    HMAC_Init_ex(&ctx, hmacKeyBytes_->data(), hmacKeyBytes_->size(), EVP_sha512(), NULL);
-    HMAC_Update(&ctx, (byte*)iv.data(), iv.size());
-    HMAC_Update(&ctx, (byte*) in.data(), in.size());
-    HMAC_Final(&ctx, mac, &mac_size);
-    HMAC_CTX_cleanup(&ctx);
-
-    if (!EqualBytes(mac, mac_size, (byte*)mac_in.data(), mac_in.size())) {
-      printf("mac 256-512 mismatch\n");
-      return false;
+    if (prk_ctx_ == nullptr) {
+      prk_ctx_ = new HMAC_CTX;
+      HMAC_CTX_init(prk_ctx_);
     }
-    if (!AesCtrCrypt(iv, 256, (byte*)encryptingKeyBytes_->data(), in.size(), (byte*) in.data(), t_buf)) {
-      printf("AesCtrCrypt decrypt failed\n");
+    bool ok = HMAC_Init_ex(prk_ctx_, prk, prk_size, md_, nullptr) == 1;
+    OPENSSL_cleanse(prk, sizeof(prk));
+    if (!ok) {
+      HMAC_CTX_cleanup(prk_ctx_);
+      delete prk_ctx_;
+      prk_ctx_ = nullptr;
       return false;
     }
-    out->assign((const char*)t_buf, in.size());
-    free(t_buf);
-  } else {
+    salt_ = salt;
+  }
+  return HMAC_CTX_copy(ctx, prk_ctx_) == 1;
+}
+
+// T(i) = HMAC(PRK, T(i - 1) | context | i), and out is T(1) | T(2) | ...
+bool Deriver::Expand(HMAC_CTX* prk_ctx, string& context, int size,
+                     byte* out) {
+  int hash_size = EVP_MD_size(md_);
+  if (size < 0 || size > 255 * hash_size) {
+    printf("Deriver: bad output size\n");
     return false;
   }
-  return true;
+  byte t[EVP_MAX_MD_SIZE];
+  unsigned int t_size = 0;
+  HMAC_CTX ctx;
+  HMAC_CTX_init(&ctx);
+  bool ok = true;
+  for (int i = 1; ok && size > 0; i++) {
+    byte counter = (byte)i;
+    ok = HMAC_CTX_copy(&ctx, prk_ctx) == 1 &&
+         HMAC_Update(&ctx, t, t_size) == 1 &&
+         HMAC_Update(&ctx, (const byte*)context.data(), context.size()) == 1 &&
+         HMAC_Update(&ctx, &counter, 1) == 1 &&
+         HMAC_Final(&ctx, t, &t_size) == 1;
+    int n = std::min(size, (int)t_size);
+    if (ok)
+      memcpy(out, t, n);
+    out += n;
+    size -= n;
+  }
+  HMAC_CTX_cleanup(&ctx);
+  OPENSSL_cleanse(t, sizeof(t));
+  return ok;
 }
 
 bool Deriver::Derive(string& salt, string& context, string& in,  string* out) {
-  *out = in;
-  return true;
+  HMAC_CTX prk_ctx;
+  HMAC_CTX_init(&prk_ctx);
+  out->resize(in.size());
+  bool ok = PrkContext(salt, &prk_ctx) &&
+            Expand(&prk_ctx, context, in.size(), (byte*)&(*out)[0]);
+  HMAC_CTX_cleanup(&prk_ctx);
+  if (!ok)
+    out->clear();
+  return ok;
+}
+
+bool Deriver::DeriveMany(string& salt, std::vector<string>& contexts, int size,
+                         std::vector<string>* out) {
+  HMAC_CTX prk_ctx;
+  HMAC_CTX_init(&prk_ctx);
+  bool ok = PrkContext(salt, &prk_ctx);
+  out->resize(contexts.size());
+  for (size_t i = 0; ok && i < contexts.size(); i++) {
+    (*out)[i].resize(size);
+    ok = Expand(&prk_ctx, contexts[i], size, (byte*)&(*out)[i][0]);
+  }
+  HMAC_CTX_cleanup(&prk_ctx);
+  if (!ok)
+    out->clear();
+  return ok;
 }
 
 string* CryptoSuiteName_to_CrypterName(string& cipher_suite) {
@@ -853,17 +1403,23 @@ string* CryptoSuiteName_to_CrypterName(string& cipher_suite) {
     return new string("aes256-ctr-hmacsha384");
   } else if (cipher_suite == Basic256BitCipherSuite) {
     return new string("aes256-ctr-hmacsha512");
+  } else if (cipher_suite == Basic128BitAeadCipherSuite) {
+    return new string("aes128-gcm");
+  } else if (cipher_suite == Basic256BitAeadCipherSuite) {
+    return new string("aes256-gcm");
   } else {
     return nullptr;
   }
 }
 
 string* CryptoSuiteName_to_SignerName(string& cipher_suite) {
-  if (cipher_suite == Basic128BitCipherSuite) {
+  if (cipher_suite == Basic128BitCipherSuite ||
+      cipher_suite == Basic128BitAeadCipherSuite) {
     return new string("ecdsap256");
   } else if (cipher_suite == Basic192BitCipherSuite) {
     return new string("ecdsap384");
-  } else if (cipher_suite == Basic256BitCipherSuite) {
+  } else if (cipher_suite == Basic256BitCipherSuite ||
+             cipher_suite == Basic256BitAeadCipherSuite) {
     return new string("ecdsap521");
   } else {
     return nullptr;
@@ -871,11 +1427,13 @@ string* CryptoSuiteName_to_SignerName(string& cipher_suite) {
 }
 
 string* CryptoSuiteName_to_VerifierName(string& cipher_suite) {
-  if (cipher_suite == Basic128BitCipherSuite) {
+  if (cipher_suite == Basic128BitCipherSuite ||
+      cipher_suite == Basic128BitAeadCipherSuite) {
     return new string("ecdsap256-public");
   } else if (cipher_suite == Basic192BitCipherSuite) {
     return new string("ecdsap384-public");
-  } else if (cipher_suite == Basic256BitCipherSuite) {
+  } else if (cipher_suite == Basic256BitCipherSuite ||
+             cipher_suite == Basic256BitAeadCipherSuite) {
     return new string("ecdsap521-public");
   } else {
     return nullptr;
@@ -915,23 +1473,37 @@ bool UnmarshalSavedProgramData(tao_support::SavedProgramData* pd, string in) {
 }
 
 bool Protect(Crypter& c, string& in, string* out) {
-  string iv;
-  string mac_out;
-  string encrypted_out;
+  tao::EncryptedData ed;
+  string* iv = ed.mutable_iv();
+  string* mac_out = ed.mutable_mac();
+  string* encrypted_out = ed.mutable_ciphertext();
 
-  if (!c.Encrypt(in, &iv, &mac_out, &encrypted_out))
+  if (!c.Encrypt(in, iv, mac_out, encrypted_out))
     return false;
 
-  tao::EncryptedData ed;
-  tao::CryptoHeader* ch = new(tao::CryptoHeader);
-
-  *ch = *c.ch_;
-  ed.set_allocated_header(ch);
-  ed.set_iv(iv);
-  ed.set_ciphertext(encrypted_out);
-  ed.set_mac(mac_out);
-  ed.SerializeToString(out);
+  ed.mutable_header()->CopyFrom(*c.ch_);
+  return ed.SerializeToString(out);
+}
 
+bool Unprotect(Crypter& c, string& in, int out_size, byte* out,
+               int* plain_size) {
+  tao::EncryptedData ed;
+  if (!ed.ParseFromString(in)) {
+    return false;
+  }
+  int size = ed.ciphertext().size();
+  if (size > out_size) {
+    printf("Unprotect: output buffer too small\n");
+    return false;
+  }
+  if ((int)ed.iv().size() != c.IvSize() || (int)ed.mac().size() != c.MacSize()) {
+    printf("Unprotect: bad iv or mac size\n");
+    return false;
+  }
+  if (!c.Decrypt(size, (byte*)ed.ciphertext().data(), out,
+                 (byte*)ed.iv().data(), (byte*)ed.mac().data()))
+    return false;
+  *plain_size = size;
   return true;
 }
 
@@ -940,12 +1512,500 @@ bool Unprotect(Crypter& c, string& in, string* out) {
   if (!ed.ParseFromString(in)) {
     return false;
   }
-  string encrypted_in = ed.ciphertext();
-  string iv = ed.iv();
-  string mac_in = ed.mac();
+  if (!c.Decrypt(*ed.mutable_ciphertext(), *ed.mutable_iv(),
+                 *ed.mutable_mac(), out))
+    return false;
+  return true;
+}
+
+static int CompactAlgorithm(Crypter& c) {
+  const string& type = c.ch_->key_type();
+  if (type == "aes128-ctr-hmacsha256") {
+    return 1;
+  } else if (type == "aes256-ctr-hmacsha384") {
+    return 2;
+  } else if (type == "aes256-ctr-hmacsha512") {
+    return 3;
+  } else if (type == "aes128-gcm") {
+    return 4;
+  } else if (type == "aes256-gcm") {
+    return 5;
+  }
+  return 0;
+}
+
+int CompactProtectOffset(Crypter& c) {
+  return COMPACT_PROTECT_HEADER_SIZE + c.IvSize();
+}
+
+int CompactProtectOverhead(Crypter& c) {
+  return CompactProtectOffset(c) + c.MacSize();
+}
+
+bool ProtectCompact(Crypter& c, int in_size, byte* in, int out_size,
+                    byte* out, int* out_used) {
+  if (c.ch_ == nullptr || CompactAlgorithm(c) == 0) {
+    return false;
+  }
+  int offset = CompactProtectOffset(c);
+  int total = in_size + CompactProtectOverhead(c);
+  if (in_size < 0 || total > out_size) {
+    printf("ProtectCompact: output buffer too small\n");
+    return false;
+  }
+  byte* ct = out + offset;
+  // Overlap is only allowed when the plaintext is already in place.
+  if (in != ct && in < out + total && out < in + in_size) {
+    printf("ProtectCompact: overlapping buffers\n");
+    return false;
+  }
+  out[0] = COMPACT_PROTECT_VERSION;
+  out[1] = (byte)CompactAlgorithm(c);
+  out[2] = (byte)c.IvSize();
+  out[3] = (byte)c.MacSize();
+  if (!c.Encrypt(in_size, in, ct, out + COMPACT_PROTECT_HEADER_SIZE,
+                 ct + in_size))
+    return false;
+  *out_used = total;
+  return true;
+}
 
-  if (!c.Decrypt(encrypted_in, iv, mac_in, out))
+bool ProtectCompact(Crypter& c, string& in, string* out) {
+  int used = 0;
+  out->resize(in.size() + CompactProtectOverhead(c));
+  if (!ProtectCompact(c, in.size(), (byte*)in.data(), out->size(),
+                      (byte*)&(*out)[0], &used)) {
+    out->clear();
     return false;
+  }
+  return true;
+}
+
+// Checks the compact header and returns the ciphertext size.
+static int CompactCiphertextSize(Crypter& c, int size, byte* in) {
+  if (c.ch_ == nullptr || size < CompactProtectOverhead(c) ||
+      in[0] != COMPACT_PROTECT_VERSION || in[1] != CompactAlgorithm(c) ||
+      in[2] != c.IvSize() || in[3] != c.MacSize()) {
+    printf("UnprotectCompact: bad header\n");
+    return -1;
+  }
+  return size - CompactProtectOverhead(c);
+}
+
+bool UnprotectCompactInPlace(Crypter& c, int size, byte* buf, byte** plain,
+                             int* plain_size) {
+  int ct_size = CompactCiphertextSize(c, size, buf);
+  if (ct_size < 0) {
+    return false;
+  }
+  byte* ct = buf + CompactProtectOffset(c);
+  if (!c.Decrypt(ct_size, ct, ct, buf + COMPACT_PROTECT_HEADER_SIZE,
+                 ct + ct_size))
+    return false;
+  *plain = ct;
+  *plain_size = ct_size;
+  return true;
+}
+
+bool UnprotectCompact(Crypter& c, int in_size, byte* in, int out_size,
+                      byte* out, int* plain_size) {
+  int ct_size = CompactCiphertextSize(c, in_size, in);
+  if (ct_size < 0) {
+    return false;
+  }
+  if (ct_size > out_size) {
+    printf("UnprotectCompact: output buffer too small\n");
+    return false;
+  }
+  byte* ct = in + CompactProtectOffset(c);
+  if (!c.Decrypt(ct_size, ct, out, in + COMPACT_PROTECT_HEADER_SIZE,
+                 ct + ct_size))
+    return false;
+  *plain_size = ct_size;
+  return true;
+}
+
+bool UnprotectCompact(Crypter& c, string& in, string* out) {
+  int plain_size = 0;
+  out->resize(in.size());
+  if (!UnprotectCompact(c, in.size(), (byte*)in.data(), out->size(),
+                        (byte*)&(*out)[0], &plain_size)) {
+    out->clear();
+    return false;
+  }
+  out->resize(plain_size);
+  return true;
+}
+
+static void PutBigEndian(int size, uint64_t x, byte* out) {
+  for (int i = size - 1; i >= 0; i--) {
+    out[i] = (byte)x;
+    x >>= 8;
+  }
+}
+
+static uint64_t GetBigEndian(int size, const byte* in) {
+  uint64_t x = 0;
+  for (int i = 0; i < size; i++)
+    x = (x << 8) | in[i];
+  return x;
+}
+
+static int64_t ChunkCount(int chunk_size, int64_t plain_size) {
+  if (plain_size == 0)
+    return 1;
+  return (plain_size + chunk_size - 1) / chunk_size;
+}
+
+int64_t ChunkedProtectSize(Crypter& c, int chunk_size, int64_t plain_size) {
+  if (chunk_size <= 0 || plain_size < 0)
+    return -1;
+  return CHUNKED_PROTECT_HEADER_SIZE +
+         ChunkCount(chunk_size, plain_size) * (c.IvSize() + c.MacSize()) +
+         plain_size;
+}
+
+static bool ChunkedHeader(Crypter& c, int chunk_size, int64_t plain_size,
+                          byte* header) {
+  if (c.ch_ == nullptr || CompactAlgorithm(c) == 0 || chunk_size <= 0 ||
+      chunk_size > CHUNKED_PROTECT_MAX_CHUNK || plain_size < 0) {
+    printf("ProtectChunked: bad crypter or sizes\n");
+    return false;
+  }
+  header[0] = CHUNKED_PROTECT_VERSION;
+  header[1] = (byte)CompactAlgorithm(c);
+  header[2] = (byte)c.IvSize();
+  header[3] = (byte)c.MacSize();
+  PutBigEndian(4, chunk_size, header + 4);
+  PutBigEndian(8, plain_size, header + 8);
+#ifdef FAKE_RAND_BYTES
+  int rc = RAND_pseudo_bytes(header + 16, CHUNKED_PROTECT_FILE_ID_SIZE);
+#else
+  int rc = RAND_bytes(header + 16, CHUNKED_PROTECT_FILE_ID_SIZE);
+#endif
+  return rc == 1;
+}
+
+// The associated data for chunk index is the header followed by the index.
+static void ChunkAd(const byte* header, int64_t index, byte* ad) {
+  memcpy(ad, header, CHUNKED_PROTECT_HEADER_SIZE);
+  PutBigEndian(8, index, ad + CHUNKED_PROTECT_HEADER_SIZE);
+}
+
+// Writes iv | ciphertext | mac for one chunk to out.
+static bool ProtectChunk(Crypter& c, const byte* header, int64_t index,
+                         int size, const byte* in, byte* out) {
+  byte ad[CHUNKED_PROTECT_HEADER_SIZE + 8];
+  ChunkAd(header, index, ad);
+  byte* ct = out + c.IvSize();
+  return c.Encrypt(size, (byte*)in, ct, out, ct + size, sizeof(ad), ad);
+}
+
+static bool ProtectChunks(Crypter& c, int chunk_size, int64_t in_size,
+                          const byte* in, int64_t out_size, byte* out,
+                          int num_threads) {
+  if (!ChunkedHeader(c, chunk_size, in_size, out))
+    return false;
+  if (out_size < ChunkedProtectSize(c, chunk_size, in_size)) {
+    printf("ProtectChunked: output buffer too small\n");
+    return false;
+  }
+  // Every chunk but the last is full, so chunk i's place is fixed.
+  int64_t stride = c.IvSize() + chunk_size + c.MacSize();
+  return ForEachChunk(ChunkCount(chunk_size, in_size), num_threads,
+                      [&](int64_t i) {
+    int64_t start = i * chunk_size;
+    int size = (int)std::min<int64_t>(chunk_size, in_size - start);
+    return ProtectChunk(c, out, i, size, in + start,
+                        out + CHUNKED_PROTECT_HEADER_SIZE + i * stride);
+  });
+}
+
+bool ProtectChunked(Crypter& c, int chunk_size, int64_t in_size,
+                    const byte* in, int64_t out_size, byte* out) {
+  return ProtectChunks(c, chunk_size, in_size, in, out_size, out, 1);
+}
+
+bool ProtectChunked(Crypter& c, int chunk_size, string& in, string* out) {
+  int64_t size = ChunkedProtectSize(c, chunk_size, in.size());
+  if (size < 0)
+    return false;
+  out->resize(size);
+  if (!ProtectChunked(c, chunk_size, in.size(), (const byte*)in.data(), size,
+                      (byte*)&(*out)[0])) {
+    out->clear();
+    return false;
+  }
+  return true;
+}
+
+static bool WriteAll(int fd, const byte* buf, int64_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, buf, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Maps file_name read-only.  An empty file is not mapped; *map is then
+// nullptr.
+static bool MapFile(string& file_name, void** map, int64_t* size) {
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat file_info;
+  if (fstat(fd, &file_info) < 0) {
+    close(fd);
+    return false;
+  }
+  *size = file_info.st_size;
+  *map = nullptr;
+  if (*size > 0) {
+    *map = mmap(nullptr, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (*map == MAP_FAILED) {
+      *map = nullptr;
+      close(fd);
+      return false;
+    }
+    madvise(*map, *size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  return true;
+}
+
+// The file functions write to a temporary file next to out_file and
+// rename it into place.  The input is mapped, so truncating it (out_file
+// may name the same file) would fault; and a failure leaves no partial
+// output behind.
+static int CreateOutputFile(string& out_file, string* temp_file) {
+  *temp_file = out_file + ".XXXXXX";
+  int fd = mkstemp(&(*temp_file)[0]);
+  if (fd < 0)
+    printf("Can't create a temporary file for %s\n", out_file.c_str());
+  return fd;
+}
+
+static bool FinishOutputFile(int fd, string& temp_file, string& out_file,
+                             bool ok) {
+  if (close(fd) != 0)
+    ok = false;
+  if (ok && rename(temp_file.c_str(), out_file.c_str()) != 0)
+    ok = false;
+  if (!ok)
+    unlink(temp_file.c_str());
+  return ok;
+}
+
+bool ProtectChunkedFile(Crypter& c, int chunk_size, string& in_file,
+                        string& out_file) {
+  void* map = nullptr;
+  int64_t in_size = 0;
+  if (!MapFile(in_file, &map, &in_size)) {
+    printf("ProtectChunkedFile: can't map %s\n", in_file.c_str());
+    return false;
+  }
+  const byte* in = (const byte*)map;
+  byte header[CHUNKED_PROTECT_HEADER_SIZE];
+  bool ok = ChunkedHeader(c, chunk_size, in_size, header);
+  int fd = -1;
+  string temp_file;
+  if (ok) {
+    fd = CreateOutputFile(out_file, &temp_file);
+    ok = fd >= 0 && WriteAll(fd, header, sizeof(header));
+  }
+  std::vector<byte> buf;
+  if (ok)
+    buf.resize(c.IvSize() + chunk_size + c.MacSize());
+  int64_t count = ChunkCount(chunk_size, in_size);
+  for (int64_t i = 0; ok && i < count; i++) {
+    int64_t start = i * chunk_size;
+    int size = (int)std::min<int64_t>(chunk_size, in_size - start);
+    ok = ProtectChunk(c, header, i, size, in + start, buf.data()) &&
+         WriteAll(fd, buf.data(), c.IvSize() + size + c.MacSize());
+  }
+  if (fd >= 0)
+    ok = FinishOutputFile(fd, temp_file, out_file, ok);
+  if (map != nullptr)
+    munmap(map, in_size);
+  if (!ok)
+    printf("ProtectChunkedFile: can't protect %s\n", in_file.c_str());
+  return ok;
+}
+
+bool UnprotectChunkedFile(Crypter& c, string& in_file, string& out_file) {
+  ChunkedUnprotector chunks;
+  if (!chunks.OpenFile(&c, in_file))
+    return false;
+  string temp_file;
+  int fd = CreateOutputFile(out_file, &temp_file);
+  if (fd < 0)
+    return false;
+  std::vector<byte> buf(chunks.ChunkSize());
+  bool ok = true;
+  for (int64_t i = 0; ok && i < chunks.NumChunks(); i++) {
+    ok = chunks.DecryptChunk(i, buf.data()) &&
+         WriteAll(fd, buf.data(), chunks.ChunkPlaintextSize(i));
+  }
+  ok = FinishOutputFile(fd, temp_file, out_file, ok);
+  if (!ok)
+    printf("UnprotectChunkedFile: can't unprotect %s\n", in_file.c_str());
+  return ok;
+}
+
+ChunkedUnprotector::ChunkedUnprotector()
+    : crypter_(nullptr), data_(nullptr), size_(0), map_(nullptr),
+      map_size_(0), chunk_size_(0), plain_size_(0), num_chunks_(0) {
+}
+
+ChunkedUnprotector::~ChunkedUnprotector() {
+  Close();
+}
+
+void ChunkedUnprotector::Close() {
+  if (map_ != nullptr)
+    munmap(map_, map_size_);
+  map_ = nullptr;
+  map_size_ = 0;
+  crypter_ = nullptr;
+  data_ = nullptr;
+  size_ = 0;
+  chunk_size_ = 0;
+  plain_size_ = 0;
+  num_chunks_ = 0;
+}
+
+bool ChunkedUnprotector::Init(Crypter* c, int64_t size, const byte* data) {
+  if (c == nullptr || c->ch_ == nullptr || data == nullptr ||
+      size < CHUNKED_PROTECT_HEADER_SIZE || data[0] != CHUNKED_PROTECT_VERSION ||
+      data[1] != CompactAlgorithm(*c) || data[2] != c->IvSize() ||
+      data[3] != c->MacSize()) {
+    printf("ChunkedUnprotector: bad header\n");
+    return false;
+  }
+  uint64_t chunk_size = GetBigEndian(4, data + 4);
+  uint64_t plain_size = GetBigEndian(8, data + 8);
+  if (chunk_size == 0 || chunk_size > CHUNKED_PROTECT_MAX_CHUNK ||
+      plain_size > (uint64_t)size ||
+      ChunkedProtectSize(*c, chunk_size, plain_size) != size) {
+    printf("ChunkedUnprotector: bad sizes\n");
+    return false;
+  }
+  crypter_ = c;
+  data_ = data;
+  size_ = size;
+  chunk_size_ = chunk_size;
+  plain_size_ = plain_size;
+  num_chunks_ = ChunkCount(chunk_size_, plain_size_);
+  return true;
+}
+
+bool ChunkedUnprotector::OpenFile(Crypter* c, string& file_name) {
+  Close();
+  if (!MapFile(file_name, &map_, &map_size_)) {
+    printf("ChunkedUnprotector: can't map %s\n", file_name.c_str());
+    return false;
+  }
+  if (map_ != nullptr)
+    madvise(map_, map_size_, MADV_NORMAL);
+  if (!Init(c, map_size_, (const byte*)map_)) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+int ChunkedUnprotector::ChunkPlaintextSize(int64_t index) {
+  if (index < 0 || index >= num_chunks_)
+    return -1;
+  return (int)std::min<int64_t>(chunk_size_, plain_size_ - index * chunk_size_);
+}
+
+bool ChunkedUnprotector::DecryptChunk(int64_t index, byte* out) {
+  int size = ChunkPlaintextSize(index);
+  if (size < 0) {
+    printf("ChunkedUnprotector: no chunk %lld\n", (long long)index);
+    return false;
+  }
+  int overhead = crypter_->IvSize() + crypter_->MacSize();
+  const byte* chunk = data_ + CHUNKED_PROTECT_HEADER_SIZE +
+                      index * (chunk_size_ + overhead);
+  byte* ct = (byte*)chunk + crypter_->IvSize();
+  byte ad[CHUNKED_PROTECT_HEADER_SIZE + 8];
+  ChunkAd(data_, index, ad);
+  return crypter_->Decrypt(size, ct, out, (byte*)chunk, ct + size,
+                           sizeof(ad), ad);
+}
+
+bool ChunkedUnprotector::DecryptChunk(int64_t index, string* out) {
+  int size = ChunkPlaintextSize(index);
+  if (size < 0)
+    return false;
+  out->resize(size);
+  if (!DecryptChunk(index, (byte*)&(*out)[0])) {
+    out->clear();
+    return false;
+  }
+  return true;
+}
+
+bool ParallelProtect(Crypter& c, int64_t in_size, const byte* in,
+                     int64_t out_size, byte* out, int num_threads,
+                     int segment_size) {
+  return ProtectChunks(c, segment_size, in_size, in, out_size, out,
+                       num_threads);
+}
+
+bool ParallelProtect(Crypter& c, string& in, string* out, int num_threads) {
+  int64_t size = ChunkedProtectSize(c, PARALLEL_PROTECT_SEGMENT, in.size());
+  if (size < 0)
+    return false;
+  out->resize(size);
+  if (!ParallelProtect(c, in.size(), (const byte*)in.data(), size,
+                       (byte*)&(*out)[0], num_threads)) {
+    out->clear();
+    return false;
+  }
+  return true;
+}
+
+bool ParallelUnprotect(Crypter& c, int64_t in_size, const byte* in,
+                       int64_t out_size, byte* out, int64_t* plain_size,
+                       int num_threads) {
+  ChunkedUnprotector chunks;
+  if (!chunks.Init(&c, in_size, in))
+    return false;
+  if (out_size < chunks.PlaintextSize()) {
+    printf("ParallelUnprotect: output buffer too small\n");
+    return false;
+  }
+  int64_t chunk_size = chunks.ChunkSize();
+  if (!ForEachChunk(chunks.NumChunks(), num_threads, [&](int64_t i) {
+        return chunks.DecryptChunk(i, out + i * chunk_size);
+      })) {
+    // Don't hand back plaintext from a partly verified input.
+    OPENSSL_cleanse(out, chunks.PlaintextSize());
+    return false;
+  }
+  *plain_size = chunks.PlaintextSize();
+  return true;
+}
+
+bool ParallelUnprotect(Crypter& c, string& in, string* out, int num_threads) {
+  ChunkedUnprotector chunks;
+  if (!chunks.Init(&c, in.size(), (const byte*)in.data()))
+    return false;
+  int64_t plain_size = 0;
+  out->resize(chunks.PlaintextSize());
+  if (!ParallelUnprotect(c, in.size(), (const byte*)in.data(), out->size(),
+                         (byte*)&(*out)[0], &plain_size, num_threads)) {
+    out->clear();
+    return false;
+  }
   return true;
 }
 
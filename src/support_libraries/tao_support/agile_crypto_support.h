@@ -20,12 +20,17 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <string>
 #include <list>
+#include <mutex>
+#include <vector>
 
 #include "taosupport.pb.h"
 #include "keys.pb.h"
 
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/rsa.h>
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
@@ -39,12 +44,52 @@ using std::string;
 extern string Basic128BitCipherSuite;
 extern string Basic192BitCipherSuite;
 extern string Basic256BitCipherSuite;
+// Suites whose crypter is AES-GCM, which encrypts and authenticates in a
+// single pass.
+extern string Basic128BitAeadCipherSuite;
+extern string Basic256BitAeadCipherSuite;
 
+#define AEAD_IV_SIZE 12
+#define AEAD_TAG_SIZE 16
+
+// Curve and digest of an ecdsa Signer or Verifier, looked up once when it
+// is built.  p256 signs SHA-256, p384 SHA-384 and p521 SHA-512 digests.
+// Earlier builds signed SHA-512 for p384 and SHA-384 for p521; Verify
+// still accepts those signatures, so that existing attestations and older
+// peers keep working.
+enum EcdsaKeyType {
+  ECDSA_UNKNOWN = 0,
+  ECDSA_P256,
+  ECDSA_P384,
+  ECDSA_P521,
+};
+EcdsaKeyType EcdsaKeyTypeFromName(const string& key_type);
+
+// Precomputed (k^-1, r) pairs for one signing key.  See Signer::EnableNoncePool.
+class EcdsaNoncePool;
+
+// sk_, ec_key_ and type_ do not change after InitKeyState, so a Signer
+// may be shared by several threads.
 class Signer {
 public:
   tao::CryptoHeader* ch_;
   EVP_PKEY* sk_;
+  EC_KEY* ec_key_;
+  EcdsaKeyType type_;
+  EcdsaNoncePool* nonce_pool_;
 
+  Signer();
+  ~Signer();
+  Signer(const Signer&) = delete;
+  Signer& operator=(const Signer&) = delete;
+
+  bool InitKeyState();
+  // Keep up to per_thread nonces ready for each signing thread, refilled
+  // by a background thread, so that Sign only does the final step.  Sign
+  // falls back to a full signature when a thread's nonces run out.
+  // A child made by fork() never uses the parent's nonces; its Sign always
+  // does the full signature.
+  bool EnableNoncePool(int per_thread);
   bool Sign(string& in, string* out);
   bool Verify(string& msg, string& sig);
 };
@@ -53,26 +98,116 @@ class Verifier {
 public:
   tao::CryptoHeader* ch_;
   EVP_PKEY* vk_;
+  EC_KEY* ec_key_;
+  EcdsaKeyType type_;
+
+  Verifier();
+  ~Verifier();
+  Verifier(const Verifier&) = delete;
+  Verifier& operator=(const Verifier&) = delete;
 
+  bool InitKeyState();
   bool Verify(string& msg, string& serialized_sig);
 };
 
+// One signature to check with VerifyBatch.
+class VerifyBatchItem {
+public:
+  Verifier* verifier_;
+  string* msg_;
+  string* sig_;
+};
+
+#define VERIFY_BATCH_CHUNK 16
+// Checks items on up to num_threads threads, or one per core if
+// num_threads is 0.  (*results)[i] is the result for items[i].  Returns
+// true if every signature verified.
+bool VerifyBatch(std::vector<VerifyBatchItem>& items,
+                 std::vector<bool>* results, int num_threads);
+
+// Encrypt and Decrypt only copy the key state built by InitKeyState, so a
+// Crypter may be shared by several threads once it is initialized.
+// InitKeyState installs the OpenSSL locking that this needs.
+// For the aes*-gcm types the iv is a 12-byte nonce, the mac is the GCM tag,
+// and hmacKeyBytes_ is empty.
 class Crypter {
 public:
   tao::CryptoHeader* ch_;
   string* encryptingKeyBytes_;
   string* hmacKeyBytes_;
+  EVP_CIPHER_CTX* aes_ctx_;   // AES-ECB, or AES-GCM, with the expanded key.
+  HMAC_CTX* hmac_ctx_;        // Keyed HMAC, before any data.  Not for GCM.
+  bool aead_;
+  int mac_size_;
 
+  Crypter();
+  ~Crypter();
+  Crypter(const Crypter&) = delete;
+  Crypter& operator=(const Crypter&) = delete;
+
+  // Builds aes_ctx_ and hmac_ctx_ from the key bytes.  Called by
+  // CryptoKeyToCrypter; call it again if the key bytes change.
+  bool InitKeyState();
   bool Encrypt(string& in, string* iv, string* mac, string* out);
   bool Decrypt(string& in, string& iv, string& mac, string* out);
+
+  // Buffer versions.  iv must have room for IvSize() bytes and mac for
+  // MacSize() bytes; Encrypt fills both in.  in may equal out.  Decrypt
+  // checks the mac before writing any plaintext.
+  int IvSize();
+  int MacSize();
+  bool Encrypt(int size, byte* in, byte* out, byte* iv, byte* mac);
+  bool Decrypt(int size, byte* in, byte* out, byte* iv, byte* mac);
+  // As above, and the mac also covers ad_size bytes of associated data
+  // at ad, which is not encrypted or stored.
+  bool Encrypt(int size, byte* in, byte* out, byte* iv, byte* mac,
+               int ad_size, byte* ad);
+  bool Decrypt(int size, byte* in, byte* out, byte* iv, byte* mac,
+               int ad_size, byte* ad);
+
+private:
+  bool Ready();
+  bool EncryptAead(int size, byte* in, byte* out, byte* iv, byte* mac,
+                   int ad_size, byte* ad);
+  bool DecryptAead(int size, byte* in, byte* out, byte* iv, byte* mac,
+                   int ad_size, byte* ad);
+  bool Mac(int ad_size, byte* ad, byte* iv, int size, byte* data, byte* mac);
 };
 
+// HKDF (RFC 5869) over secret_bytes_, with the hash named by ch_'s key
+// type: hdkf-sha256, hdkf-sha384 or hdkf-sha512.  The extract step for the
+// most recent salt is cached, so deriving many keys with one salt costs
+// one expand each.  Derive and DeriveMany may be called from several
+// threads at once.
 class Deriver {
 public:
   tao::CryptoHeader* ch_;
   string* secret_bytes_;
 
+  Deriver();
+  ~Deriver();
+  Deriver(const Deriver&) = delete;
+  Deriver& operator=(const Deriver&) = delete;
+
+  // Picks the hash and drops the cached extract.  Derive calls it the
+  // first time; call it again if ch_ or the secret bytes change.
+  bool InitKeyState();
+  // out gets in.size() bytes of key material, as Go's Deriver.Derive
+  // fills its material buffer.
   bool Derive(string& salt, string& context, string& in,  string* out);
+  // (*out)[i] gets size bytes for contexts[i].
+  bool DeriveMany(string& salt, std::vector<string>& contexts, int size,
+                  std::vector<string>* out);
+
+private:
+  std::mutex mu_;
+  const EVP_MD* md_;
+  string salt_;
+  HMAC_CTX* prk_ctx_;   // HMAC keyed with the PRK for salt_, before any data.
+
+  bool ResetKeyState();
+  bool PrkContext(string& salt, HMAC_CTX* ctx);
+  bool Expand(HMAC_CTX* prk_ctx, string& context, int size, byte* out);
 };
 
 bool CrypterAlgorithmNameFromCipherSuite(string& cipher_suite, string* crypter_name);
@@ -92,6 +227,114 @@ bool DeserializeECCKeyComponents(string component, EC_KEY* ec_key);
 
 bool Protect(Crypter& crypter, string& in, string* out);
 bool Unprotect(Crypter& crypter, string& in, string* out);
+// Decrypts the EncryptedData in "in" into a caller-provided buffer.
+bool Unprotect(Crypter& crypter, string& in, int out_size, byte* out,
+               int* plain_size);
+
+// Compact protected format, an alternative to the EncryptedData proto:
+//   version (1 byte) | algorithm (1 byte) | iv size (1 byte) |
+//   mac size (1 byte) | iv | ciphertext | mac
+// The key header is not included.  The ciphertext starts at
+// CompactProtectOffset(crypter) and the total size is the plaintext size
+// plus CompactProtectOverhead(crypter).
+#define COMPACT_PROTECT_VERSION 1
+#define COMPACT_PROTECT_HEADER_SIZE 4
+int CompactProtectOffset(Crypter& crypter);
+int CompactProtectOverhead(Crypter& crypter);
+// Protects into out, which has out_size bytes of room.  For in-place use,
+// place the plaintext at out + CompactProtectOffset(crypter).
+bool ProtectCompact(Crypter& crypter, int in_size, byte* in, int out_size,
+                    byte* out, int* out_used);
+bool ProtectCompact(Crypter& crypter, string& in, string* out);
+// Decrypts within buf; *plain then points at the plaintext inside buf.
+bool UnprotectCompactInPlace(Crypter& crypter, int size, byte* buf,
+                             byte** plain, int* plain_size);
+// Decrypts into out, which has out_size bytes of room.
+bool UnprotectCompact(Crypter& crypter, int in_size, byte* in, int out_size,
+                      byte* out, int* plain_size);
+bool UnprotectCompact(Crypter& crypter, string& in, string* out);
+
+// Chunked protected format, for large files.  The plaintext is split into
+// chunk size pieces (the last may be shorter, and empty data is one empty
+// chunk), each protected separately:
+//   header: version (1 byte) | algorithm (1 byte) | iv size (1 byte) |
+//           mac size (1 byte) | chunk size (4 bytes) |
+//           plaintext size (8 bytes) | file id (16 random bytes)
+//   chunk:  iv | ciphertext | mac
+// Integers are big-endian.  Each chunk's mac also covers the header and
+// the chunk's index, so chunks can't be reordered, dropped, or moved to
+// another file, and any one chunk can be decrypted on its own.
+#define CHUNKED_PROTECT_VERSION 1
+#define CHUNKED_PROTECT_HEADER_SIZE 32
+#define CHUNKED_PROTECT_FILE_ID_SIZE 16
+#define CHUNKED_PROTECT_DEFAULT_CHUNK (64 * 1024)
+#define CHUNKED_PROTECT_MAX_CHUNK (64 * 1024 * 1024)
+int64_t ChunkedProtectSize(Crypter& crypter, int chunk_size,
+                           int64_t plain_size);
+// Protects into out, which must have ChunkedProtectSize bytes of room.
+bool ProtectChunked(Crypter& crypter, int chunk_size, int64_t in_size,
+                    const byte* in, int64_t out_size, byte* out);
+bool ProtectChunked(Crypter& crypter, int chunk_size, string& in,
+                    string* out);
+// Maps in_file and writes out_file a chunk at a time.  out_file is
+// replaced only on success, and may be in_file.
+bool ProtectChunkedFile(Crypter& crypter, int chunk_size, string& in_file,
+                        string& out_file);
+bool UnprotectChunkedFile(Crypter& crypter, string& in_file,
+                          string& out_file);
+
+// Protect and unprotect in the chunked format with the chunks spread over
+// up to num_threads threads, or one per core if num_threads is 0.  The
+// output is the same format ProtectChunked produces, so either side may be
+// serial.  Inputs of a few segments or less gain nothing from threads.
+#define PARALLEL_PROTECT_SEGMENT (1024 * 1024)
+bool ParallelProtect(Crypter& crypter, int64_t in_size, const byte* in,
+                     int64_t out_size, byte* out, int num_threads,
+                     int segment_size = PARALLEL_PROTECT_SEGMENT);
+bool ParallelProtect(Crypter& crypter, string& in, string* out,
+                     int num_threads);
+// out must have room for the plaintext size in the header.
+bool ParallelUnprotect(Crypter& crypter, int64_t in_size, const byte* in,
+                       int64_t out_size, byte* out, int64_t* plain_size,
+                       int num_threads);
+bool ParallelUnprotect(Crypter& crypter, string& in, string* out,
+                       int num_threads);
+
+// Random access to chunked protected data, in memory or in a mapped
+// file.  Once Init or OpenFile succeeds, DecryptChunk may be called from
+// several threads at once.
+class ChunkedUnprotector {
+private:
+  Crypter* crypter_;
+  const byte* data_;
+  int64_t size_;
+  void* map_;
+  int64_t map_size_;
+  int chunk_size_;
+  int64_t plain_size_;
+  int64_t num_chunks_;
+
+public:
+  ChunkedUnprotector();
+  ~ChunkedUnprotector();
+  ChunkedUnprotector(const ChunkedUnprotector&) = delete;
+  ChunkedUnprotector& operator=(const ChunkedUnprotector&) = delete;
+
+  // Checks the header and size of the size bytes at data, which must
+  // stay valid while this is in use.
+  bool Init(Crypter* crypter, int64_t size, const byte* data);
+  // Maps file_name read-only and calls Init.
+  bool OpenFile(Crypter* crypter, string& file_name);
+  void Close();
+
+  int ChunkSize() {return chunk_size_;};
+  int64_t PlaintextSize() {return plain_size_;};
+  int64_t NumChunks() {return num_chunks_;};
+  int ChunkPlaintextSize(int64_t index);
+  // out must have room for ChunkPlaintextSize(index) bytes.
+  bool DecryptChunk(int64_t index, byte* out);
+  bool DecryptChunk(int64_t index, string* out);
+};
 bool KeyPrincipalBytes(Verifier* v, string* out);
 bool UniversalKeyName(Verifier* v, string* out);
 
@@ -0,0 +1,201 @@
+// Copyright 2015 Google Corporation, All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//     http://www.apache.org/licenses/LICENSE-2.0
+// or in the the file LICENSE-2.0.txt in the top level sourcedirectory
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License
+//
+// File: channel_pool.h
+
+#ifndef __CHANNEL_POOL_H__
+#define __CHANNEL_POOL_H__
+
+#include <stdio.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+
+#define CHANNEL_POOL_MAX_PER_PEER 8
+#define CHANNEL_POOL_IDLE_SECONDS 60
+
+// Keeps client channels open for reuse, so that request-heavy clients do
+// not pay for a connection and handshake per request.  Channels are kept
+// by a key naming both the peer and the client identity that opened them.
+// At most max_per_peer channels for a key are open at once; beyond that
+// Acquire waits for a Release.  Idle channels are closed after
+// idle_seconds, or on Acquire if they are no longer usable.
+//
+// Channel must have bool IsAlive(), which does not block, and deleting a
+// Channel must close it.  Acquire and Release may be called from any
+// thread.  Every channel must be released before the pool is destroyed.
+template <class Channel>
+class ChannelPool {
+private:
+  class IdleChannel {
+  public:
+    Channel* channel_;
+    std::chrono::steady_clock::time_point since_;
+  };
+  class Peer {
+  public:
+    int open_;
+    std::list<IdleChannel> idle_;   // Oldest first.
+    Peer() : open_(0) {}
+  };
+
+  int max_per_peer_;
+  int idle_seconds_;
+  std::mutex mu_;
+  std::condition_variable released_;
+  std::map<std::string, Peer> peers_;
+  std::map<Channel*, std::string> in_use_;
+  int opened_;
+  int reused_;
+
+  // Called with mu_ held.  Peers with no open channels are forgotten, so
+  // that peers_ does not grow with every peer ever seen.
+  void ForgetIfUnused(const std::string& key) {
+    auto it = peers_.find(key);
+    if (it != peers_.end() && it->second.open_ == 0)
+      peers_.erase(it);
+  }
+
+  // Called with mu_ held.
+  void CloseExpired() {
+    std::chrono::steady_clock::time_point oldest =
+        std::chrono::steady_clock::now() - std::chrono::seconds(idle_seconds_);
+    for (auto it = peers_.begin(); it != peers_.end();) {
+      Peer& peer = it->second;
+      while (!peer.idle_.empty() && peer.idle_.front().since_ < oldest) {
+        delete peer.idle_.front().channel_;
+        peer.idle_.pop_front();
+        peer.open_--;
+      }
+      if (peer.open_ == 0)
+        it = peers_.erase(it);
+      else
+        ++it;
+    }
+  }
+
+public:
+  ChannelPool(int max_per_peer = CHANNEL_POOL_MAX_PER_PEER,
+              int idle_seconds = CHANNEL_POOL_IDLE_SECONDS)
+      : max_per_peer_(max_per_peer), idle_seconds_(idle_seconds),
+        opened_(0), reused_(0) {
+    if (max_per_peer_ < 1)
+      max_per_peer_ = 1;
+  }
+
+  ~ChannelPool() {
+    CloseIdle();
+    if (!in_use_.empty()) {
+      printf("~ChannelPool: %d channels not released.\n", (int)in_use_.size());
+    }
+  }
+
+  ChannelPool(const ChannelPool&) = delete;
+  ChannelPool& operator=(const ChannelPool&) = delete;
+
+  // Returns an idle channel for key, or one made by open, which is called
+  // without the pool locked.  Returns nullptr if open does.
+  Channel* Acquire(const std::string& key,
+                   const std::function<Channel*()>& open) {
+    std::unique_lock<std::mutex> l(mu_);
+    for (;;) {
+      CloseExpired();
+      Peer& peer = peers_[key];
+      // The most recently used channel is the most likely to still be open.
+      while (!peer.idle_.empty()) {
+        Channel* channel = peer.idle_.back().channel_;
+        peer.idle_.pop_back();
+        if (channel->IsAlive()) {
+          in_use_[channel] = key;
+          reused_++;
+          return channel;
+        }
+        delete channel;
+        peer.open_--;
+      }
+      if (peer.open_ < max_per_peer_) {
+        peer.open_++;
+        break;
+      }
+      released_.wait(l);
+    }
+
+    l.unlock();
+    Channel* channel = open();
+    l.lock();
+    if (channel == nullptr) {
+      peers_[key].open_--;
+      ForgetIfUnused(key);
+      released_.notify_all();
+      return nullptr;
+    }
+    in_use_[channel] = key;
+    opened_++;
+    return channel;
+  }
+
+  // Returns channel to the pool.  Pass reusable = false if an exchange on
+  // it failed or was left unfinished; it is then closed.
+  void Release(Channel* channel, bool reusable = true) {
+    std::lock_guard<std::mutex> l(mu_);
+    auto it = in_use_.find(channel);
+    if (it == in_use_.end()) {
+      printf("ChannelPool::Release: Channel is not from this pool.\n");
+      return;
+    }
+    std::string key = it->second;
+    Peer& peer = peers_[key];
+    in_use_.erase(it);
+    if (reusable && channel->IsAlive()) {
+      IdleChannel idle;
+      idle.channel_ = channel;
+      idle.since_ = std::chrono::steady_clock::now();
+      peer.idle_.push_back(idle);
+    } else {
+      delete channel;
+      peer.open_--;
+      ForgetIfUnused(key);
+    }
+    // Waiters for every key share released_.
+    released_.notify_all();
+  }
+
+  void CloseIdle() {
+    std::lock_guard<std::mutex> l(mu_);
+    for (auto it = peers_.begin(); it != peers_.end();) {
+      Peer& peer = it->second;
+      for (IdleChannel& idle : peer.idle_) {
+        delete idle.channel_;
+        peer.open_--;
+      }
+      peer.idle_.clear();
+      if (peer.open_ == 0)
+        it = peers_.erase(it);
+      else
+        ++it;
+    }
+    released_.notify_all();
+  }
+
+  void GetStats(int* opened, int* reused) {
+    std::lock_guard<std::mutex> l(mu_);
+    *opened = opened_;
+    *reused = reused_;
+  }
+};
+#endif
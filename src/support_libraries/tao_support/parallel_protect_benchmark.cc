@@ -0,0 +1,120 @@
+//
+// Copyright 2015 Google Corporation, All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//     http://www.apache.org/licenses/LICENSE-2.0
+// or in the the file LICENSE-2.0.txt in the top level sourcedirectory
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License
+//
+// File: parallel_protect_benchmark.cc
+// Measures ParallelProtect and ParallelUnprotect throughput as the number
+// of threads grows, against the single-pass Protect.
+
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include <agile_crypto_support.h>
+#include <openssl/rand.h>
+
+using std::string;
+using std::vector;
+
+DEFINE_string(key_type, "aes256-ctr-hmacsha384", "crypting key type");
+DEFINE_int32(megabytes, 64, "size of the payload");
+DEFINE_int32(rounds, 4, "payloads to protect for each thread count");
+DEFINE_int32(max_threads, 0, "largest thread count, 0 for one per core");
+DEFINE_int32(segment_size, PARALLEL_PROTECT_SEGMENT, "bytes per segment");
+
+static double MegabytesPerSecond(int64_t size, int rounds,
+                                 std::chrono::steady_clock::duration d) {
+  double secs = std::chrono::duration<double>(d).count();
+  return (double)size * rounds / secs / 1e6;
+}
+
+int main(int an, char** av) {
+#ifdef __linux__
+  gflags::ParseCommandLineFlags(&an, &av, true);
+#else
+  google::ParseCommandLineFlags(&an, &av, true);
+#endif
+  tao::CryptoKey ck;
+  if (!GenerateCryptoKey(FLAGS_key_type, &ck)) {
+    printf("Can't generate a %s key\n", FLAGS_key_type.c_str());
+    return 1;
+  }
+  Crypter* c = CryptoKeyToCrypter(ck);
+  if (c == nullptr) {
+    printf("Can't make a crypter\n");
+    return 1;
+  }
+
+  int64_t size = (int64_t)FLAGS_megabytes * 1024 * 1024;
+  string in(size, 0);
+  RAND_pseudo_bytes((byte*)&in[0], size);
+  vector<byte> out(ChunkedProtectSize(*c, FLAGS_segment_size, size));
+  vector<byte> plain(size);
+
+  string encrypted;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < FLAGS_rounds; r++) {
+    if (!Protect(*c, in, &encrypted)) {
+      printf("Protect failed\n");
+      return 1;
+    }
+  }
+  double serial = MegabytesPerSecond(size, FLAGS_rounds,
+                                     std::chrono::steady_clock::now() - start);
+  printf("Protect, one pass: %.1f MB/s\n", serial);
+
+  int max_threads = FLAGS_max_threads;
+  if (max_threads <= 0)
+    max_threads = std::thread::hardware_concurrency();
+  // 1, 2, 4, ... and max_threads itself.
+  vector<int> thread_counts;
+  for (int t = 1; t < max_threads; t *= 2)
+    thread_counts.push_back(t);
+  thread_counts.push_back(max_threads);
+
+  printf("%8s %14s %14s %8s\n", "threads", "protect MB/s", "unprotect MB/s",
+         "speedup");
+  for (int threads : thread_counts) {
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < FLAGS_rounds; r++) {
+      if (!ParallelProtect(*c, size, (const byte*)in.data(), out.size(),
+                           out.data(), threads, FLAGS_segment_size)) {
+        printf("ParallelProtect failed\n");
+        return 1;
+      }
+    }
+    double protect = MegabytesPerSecond(
+        size, FLAGS_rounds, std::chrono::steady_clock::now() - start);
+
+    int64_t plain_size = 0;
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < FLAGS_rounds; r++) {
+      if (!ParallelUnprotect(*c, out.size(), out.data(), plain.size(),
+                             plain.data(), &plain_size, threads)) {
+        printf("ParallelUnprotect failed\n");
+        return 1;
+      }
+    }
+    double unprotect = MegabytesPerSecond(
+        size, FLAGS_rounds, std::chrono::steady_clock::now() - start);
+    printf("%8d %14.1f %14.1f %7.2fx\n", threads, protect, unprotect,
+           protect / serial);
+  }
+  delete c;
+  return 0;
+}
@@ -6,12 +6,18 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 
 #include <ssl_helpers.h>
+#include "tao/codec.h"
 
 #include <openssl/rsa.h>
 #include <openssl/x509.h>
@@ -22,7 +28,14 @@
 #include <openssl/aes.h>
 #include <openssl/hmac.h>
 #include <openssl/rand.h>
-
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <new>
 #include <string>
 #include <thread>
 
@@ -316,46 +329,150 @@ void XorBlocks(int size, byte* in1, byte* in2, byte* out) {
     out[i] = in1[i] ^ in2[i];
 }
 
-void bumpCtr(uint64_t* ctr) {
-  uint64_t x = ctr[0] + 1;
-  if (x < ctr[0])
-    ctr[1]++;
-  ctr[0] = x;
+static inline uint64_t LoadWord(const byte* p) {
+  uint64_t w;
+  memcpy(&w, p, sizeof(w));
+  return w;
 }
 
-void toLittleEndian(byte* in, uint64_t* ctr) {
-  byte* out = (byte*) ctr;
-  for (int i = 0; i < 16; i++)
-    out[15 - i] = in[i];
+static inline void StoreWord(byte* p, uint64_t w) {
+  memcpy(p, &w, sizeof(w));
 }
 
-void toBigEndian(uint64_t* ctr, byte* out) {
-  byte* in = (byte*) ctr;
-  for (int i = 0; i < 16; i++)
-    out[15 - i] = in[i];
+AesCtr::AesCtr() : ctx_(nullptr), keystream_size_(0), keystream_used_(0) {
+  ctr_[0] = 0;
+  ctr_[1] = 0;
 }
 
-bool AesCtrCrypt(string& iv, int key_size_bits, byte* key, int size,
-                    byte* in, byte* out) {
-  AES_KEY ectx;
-  byte block[32];
-  uint64_t ctr[2];
+AesCtr::~AesCtr() {
+  if (ctx_ != nullptr)
+    EVP_CIPHER_CTX_free(ctx_);
+  OPENSSL_cleanse(keystream_, sizeof(keystream_));
+}
 
-  toLittleEndian((byte*)iv.data(), ctr);
-  AES_set_encrypt_key(key, key_size_bits, &ectx);
+bool AesCtr::Init(int key_size_bits, byte* key, int iv_size, byte* iv) {
+  const EVP_CIPHER* cipher;
+  if (key_size_bits == 128) {
+    cipher = EVP_aes_128_ecb();
+  } else if (key_size_bits == 192) {
+    cipher = EVP_aes_192_ecb();
+  } else if (key_size_bits == 256) {
+    cipher = EVP_aes_256_ecb();
+  } else {
+    printf("AesCtr::Init: unsupported key size %d\n", key_size_bits);
+    return false;
+  }
+  if (ctx_ == nullptr)
+    ctx_ = EVP_CIPHER_CTX_new();
+  if (ctx_ == nullptr ||
+      EVP_EncryptInit_ex(ctx_, cipher, nullptr, key, nullptr) != 1) {
+    printf("AesCtr::Init: can't initialize cipher\n");
+    return false;
+  }
+  EVP_CIPHER_CTX_set_padding(ctx_, 0);
+  return SetIv(iv_size, iv);
+}
 
-  while (size > 0) {
-    toBigEndian(ctr, block);
-    AES_encrypt((byte*)ctr, block, &ectx);
-    XorBlocks(16, block, in, out);
-    in += 16;
-    out += 16;
-    size -= 16;
-    bumpCtr(ctr);
+bool AesCtr::Init(const EVP_CIPHER_CTX* keyed_ecb, int iv_size, byte* iv) {
+  if (ctx_ == nullptr)
+    ctx_ = EVP_CIPHER_CTX_new();
+  if (ctx_ == nullptr || EVP_CIPHER_CTX_copy(ctx_, keyed_ecb) != 1) {
+    printf("AesCtr::Init: can't copy cipher\n");
+    return false;
   }
+  return SetIv(iv_size, iv);
+}
+
+bool AesCtr::SetIv(int iv_size, byte* iv) {
+  if (iv_size != AESBLKSIZE) {
+    printf("AesCtr::Init: bad iv size %d\n", iv_size);
+    return false;
+  }
+  ctr_[0] = 0;
+  ctr_[1] = 0;
+  for (int i = 0; i < 8; i++) {
+    ctr_[1] = (ctr_[1] << 8) | iv[i];
+    ctr_[0] = (ctr_[0] << 8) | iv[8 + i];
+  }
+  keystream_size_ = 0;
+  keystream_used_ = 0;
   return true;
 }
 
+void AesCtr::MakeCounterBlocks(int num_blocks, byte* out) {
+  for (int i = 0; i < num_blocks; i++) {
+    for (int j = 0; j < 8; j++) {
+      out[j] = (byte)(ctr_[0] >> (8 * j));
+      out[8 + j] = (byte)(ctr_[1] >> (8 * j));
+    }
+    out += AESBLKSIZE;
+    if (++ctr_[0] == 0)
+      ctr_[1]++;
+  }
+}
+
+bool AesCtr::NextKeystream(int num_blocks) {
+  byte counters[AESCTR_BATCH_BLOCKS * AESBLKSIZE];
+  int len = 0;
+
+  MakeCounterBlocks(num_blocks, counters);
+  if (EVP_EncryptUpdate(ctx_, keystream_, &len, counters,
+                        num_blocks * AESBLKSIZE) != 1 ||
+      len != num_blocks * AESBLKSIZE) {
+    printf("AesCtr: encryption failed\n");
+    return false;
+  }
+  keystream_size_ = len;
+  keystream_used_ = 0;
+  return true;
+}
+
+bool AesCtr::Crypt(int size, byte* in, byte* out) {
+  if (ctx_ == nullptr || size < 0)
+    return false;
+
+  // Use up keystream left over from the previous call.
+  while (size > 0 && keystream_used_ < keystream_size_) {
+    *(out++) = *(in++) ^ keystream_[keystream_used_++];
+    size--;
+  }
+
+  // Whole batches, a word at a time.
+  const int batch = AESCTR_BATCH_BLOCKS * AESBLKSIZE;
+  while (size >= batch) {
+    if (!NextKeystream(AESCTR_BATCH_BLOCKS))
+      return false;
+    for (int i = 0; i < batch; i += 8)
+      StoreWord(out + i, LoadWord(in + i) ^ LoadWord(keystream_ + i));
+    keystream_used_ = batch;
+    in += batch;
+    out += batch;
+    size -= batch;
+  }
+
+  // The tail needs only as many blocks as it covers.
+  if (size > 0) {
+    if (!NextKeystream((size + AESBLKSIZE - 1) / AESBLKSIZE))
+      return false;
+    int i = 0;
+    for (; i + 8 <= size; i += 8)
+      StoreWord(out + i, LoadWord(in + i) ^ LoadWord(keystream_ + i));
+    for (; i < size; i++)
+      out[i] = in[i] ^ keystream_[i];
+    keystream_used_ = size;
+  }
+  return true;
+}
+
+bool AesCtrCrypt(string& iv, int key_size_bits, byte* key, int size,
+                    byte* in, byte* out) {
+  AesCtr ctr;
+
+  if (!ctr.Init(key_size_bits, key, iv.size(), (byte*)iv.data()))
+    return false;
+  return ctr.Crypt(size, in, out);
+}
+
 #define AESBLKSIZE 16
 
 bool AesCFBEncrypt(byte* key, int in_size, byte* in, int iv_size, byte* iv,
@@ -425,17 +542,215 @@ bool AesCFBDecrypt(byte* key, int in_size, byte* in, int iv_size, byte* iv,
 }
 
 bool VerifyX509CertificateChain(X509* cacert, X509* cert) {
-  X509_STORE_CTX *store_ctx = X509_STORE_CTX_new();
-  X509_STORE *store = X509_STORE_new();
-  X509_STORE_add_cert(store, cacert);
-  // int X509_STORE_CTX_init(X509_STORE_CTX *ctx, X509_STORE *store, X509 *x509, STACK_OF(X509) *chain);
-  X509_STORE_CTX_init(store_ctx, store, cacert, nullptr);
+  X509VerifyContext verifier(0);
+  return verifier.Init(cacert) && verifier.Verify(cert, nullptr);
+}
+
+// Hashes the DER of the cert and chain store_ctx is to verify, and finds
+// the earliest notAfter among them.  The certs trusted by the store doing
+// the verifying, and the verify purpose, trust, depth and flags, go in the
+// key too, since a chain can pass with one and not another.
+static bool X509ChainKey(X509_STORE_CTX* store_ctx, string* key,
+                         time_t* not_after) {
+  X509* cert = store_ctx->cert;
+  STACK_OF(X509)* chain = store_ctx->untrusted;
+  X509_VERIFY_PARAM* param = store_ctx->param;
+  X509_STORE* store = store_ctx->ctx;
+  SHA256_CTX sha256;
+  byte md[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+  time_t now = time(nullptr);
+  int n = chain == nullptr ? 0 : sk_X509_num(chain);
+
+  SHA256_Init(&sha256);
+  *not_after = 0;
+  for (int i = -1; i < n; i++) {
+    X509* c = i < 0 ? cert : sk_X509_value(chain, i);
+    int days, secs;
+    if (c == nullptr || X509_digest(c, EVP_sha256(), md, &md_len) != 1 ||
+        ASN1_TIME_diff(&days, &secs, nullptr, X509_get_notAfter(c)) != 1) {
+      return false;
+    }
+    SHA256_Update(&sha256, md, md_len);
+    time_t t = now + (time_t)days * 86400 + secs;
+    if (i < 0 || t < *not_after)
+      *not_after = t;
+  }
+  if (store == nullptr)
+    return false;
+  bool ok = true;
+  CRYPTO_w_lock(CRYPTO_LOCK_X509_STORE);
+  for (int i = 0; ok && i < sk_X509_OBJECT_num(store->objs); i++) {
+    X509_OBJECT* obj = sk_X509_OBJECT_value(store->objs, i);
+    if (obj->type != X509_LU_X509)
+      continue;
+    ok = X509_digest(obj->data.x509, EVP_sha256(), md, &md_len) == 1;
+    if (ok)
+      SHA256_Update(&sha256, md, md_len);
+  }
+  CRYPTO_w_unlock(CRYPTO_LOCK_X509_STORE);
+  if (!ok)
+    return false;
+  SHA256_Final(md, &sha256);
+  key->assign((const char*)md, SHA256_DIGEST_LENGTH);
+  key->append(":" + std::to_string(param->purpose) + ":" +
+              std::to_string(param->trust) + ":" +
+              std::to_string(param->depth) + ":" +
+              std::to_string(param->flags));
+  return true;
+}
+
+X509VerifyContext::X509VerifyContext(int max_entries)
+    : store_(nullptr), max_entries_(max_entries), hits_(0), misses_(0) {
+}
+
+X509VerifyContext::~X509VerifyContext() {
+  if (store_ != nullptr)
+    X509_STORE_free(store_);
+}
+
+bool X509VerifyContext::Init(X509* policy_cert) {
+  std::lock_guard<std::mutex> l(mu_);
+  if (store_ != nullptr || policy_cert == nullptr) {
+    return false;
+  }
+  OpenSSL_add_all_algorithms();
+  store_ = X509_STORE_new();
+  if (store_ == nullptr) {
+    printf("X509_STORE_new failed.\n");
+    return false;
+  }
+  if (X509_STORE_add_cert(store_, policy_cert) != 1) {
+    printf("X509_STORE_add_cert failed.\n");
+    return false;
+  }
+  return true;
+}
+
+// mu_ must be held.
+bool X509VerifyContext::CacheLookup(const string& key) {
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    misses_++;
+    return false;
+  }
+  if (time(nullptr) >= it->second->not_after_) {
+    lru_.erase(it->second);
+    index_.erase(it);
+    misses_++;
+    return false;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second);
+  hits_++;
+  return true;
+}
+
+// mu_ must be held.
+void X509VerifyContext::CacheInsert(const string& key, time_t not_after) {
+  if (max_entries_ <= 0 || index_.find(key) != index_.end()) {
+    return;
+  }
+  while ((int)lru_.size() >= max_entries_) {
+    index_.erase(lru_.back().key_);
+    lru_.pop_back();
+  }
+  lru_.push_front(CachedChain{key, not_after});
+  index_[key] = lru_.begin();
+}
+
+bool X509VerifyContext::Verify(X509* cert, STACK_OF(X509)* chain) {
+  if (store_ == nullptr) {
+    return false;
+  }
+  X509_STORE_CTX* store_ctx = X509_STORE_CTX_new();
+  if (store_ctx == nullptr) {
+    return false;
+  }
+  string key;
+  time_t not_after;
+  if (X509_STORE_CTX_init(store_ctx, store_, cert, chain) != 1 ||
+      !X509ChainKey(store_ctx, &key, &not_after)) {
+    X509_STORE_CTX_free(store_ctx);
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> l(mu_);
+    if (CacheLookup(key)) {
+      X509_STORE_CTX_free(store_ctx);
+      return true;
+    }
+  }
+
+  bool ok = X509_verify_cert(store_ctx) == 1;
+  if (!ok)
+    printf("Error: %s\n",
+           X509_verify_cert_error_string(X509_STORE_CTX_get_error(store_ctx)));
+  X509_STORE_CTX_free(store_ctx);
+  if (ok) {
+    std::lock_guard<std::mutex> l(mu_);
+    CacheInsert(key, not_after);
+  }
+  return ok;
+}
+
+bool X509VerifyContext::Verify(string& der_cert, std::list<string>* der_chain) {
+  const byte* p = (const byte*)der_cert.data();
+  X509* cert = d2i_X509(nullptr, &p, der_cert.size());
+  if (cert == nullptr) {
+    return false;
+  }
+  STACK_OF(X509)* chain = sk_X509_new_null();
+  bool ok = chain != nullptr;
+  if (ok && der_chain != nullptr) {
+    for (std::list<string>::iterator it = der_chain->begin();
+         ok && it != der_chain->end(); ++it) {
+      p = (const byte*)it->data();
+      X509* c = d2i_X509(nullptr, &p, it->size());
+      ok = c != nullptr && sk_X509_push(chain, c) != 0;
+    }
+  }
+  ok = ok && Verify(cert, chain);
+  if (chain != nullptr)
+    sk_X509_pop_free(chain, X509_free);
+  X509_free(cert);
+  return ok;
+}
+
+void X509VerifyContext::ClearCache() {
+  std::lock_guard<std::mutex> l(mu_);
+  lru_.clear();
+  index_.clear();
+}
+
+void X509VerifyContext::GetCacheStats(int* hits, int* misses) {
+  std::lock_guard<std::mutex> l(mu_);
+  *hits = hits_;
+  *misses = misses_;
+}
+
+int X509VerifyContext::SslVerifyCallback(X509_STORE_CTX* store_ctx,
+                                         void* arg) {
+  X509VerifyContext* verifier = (X509VerifyContext*)arg;
+  string key;
+  time_t not_after;
+  bool have_key = X509ChainKey(store_ctx, &key, &not_after);
+  if (have_key) {
+    std::lock_guard<std::mutex> l(verifier->mu_);
+    if (verifier->CacheLookup(key))
+      return 1;
+  }
   int ret = X509_verify_cert(store_ctx);
-  if (ret <= 0)
-    printf("Error: %s\n", X509_verify_cert_error_string(store_ctx->error));
+  if (ret == 1 && have_key) {
+    std::lock_guard<std::mutex> l(verifier->mu_);
+    verifier->CacheInsert(key, not_after);
+  }
   return ret;
 }
 
+void X509VerifyContext::AttachToSslCtx(SSL_CTX* ssl_ctx) {
+  SSL_CTX_set_cert_verify_callback(ssl_ctx, SslVerifyCallback, this);
+}
+
 SslChannel::SslChannel() {
   fd_ = -1;
   ssl_ctx_ = nullptr;
@@ -443,33 +758,17 @@ SslChannel::SslChannel() {
   peer_cert_ = nullptr;
   store_ = nullptr;
   private_key_ = nullptr;
+  cert_verifier_ = nullptr;
+  wake_fd_ = -1;
+  stop_ = false;
+}
+
+void SslChannel::SetCertVerifier(X509VerifyContext* verifier) {
+  cert_verifier_ = verifier;
 }
 
 SslChannel::~SslChannel() {
-  if (fd_ > 0) {
-    close(fd_);
-  }
-  fd_ = -1;
-  // clear private_key_;
-#if 0
-  // Doesn't need to be freed, context free takes care of it.
-  if (ssl_ != nullptr) {
-    SSL_free(ssl_);
-  }
-  ssl_ = nullptr;
-#endif
-  if (peer_cert_ != nullptr) {
-    X509_free(peer_cert_);
-  }
-  peer_cert_ = nullptr;
-  if (ssl_ctx_ != nullptr) {
-    SSL_CTX_free(ssl_ctx_);
-  }
-  ssl_ctx_ = nullptr;
-  if (store_ != nullptr) {
-    X509_STORE_free(store_);
-  }
-  store_ = nullptr;
+  Close();
 }
 
 int SslChannel::CreateServerSocket(string& address, string& port) {
@@ -483,12 +782,14 @@ int SslChannel::CreateServerSocket(string& address, string& port) {
   dest_addr.sin_addr.s_addr = INADDR_ANY;
   inet_aton(address.c_str(), &dest_addr.sin_addr);
 
+  int reuse = 1;
+  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
   if (bind(sockfd, (struct sockaddr*)&dest_addr, sizeof(dest_addr)) < 0) {
     printf("Unable to bind\n");
     return -1;
   }
 
-  if (listen(sockfd, 1) < 0) {
+  if (listen(sockfd, SOMAXCONN) < 0) {
     printf("Unable to listen\n");
     return -1;
   }
@@ -515,6 +816,14 @@ int SslChannel::CreateClientSocket(string& addr, string& port) {
   return sockfd;
 }
 
+// SSL_CTX_add_extra_chain_cert takes over the caller's reference; take
+// a new one so that freeing the context leaves the caller's cert alone.
+static void AddExtraChainCert(SSL_CTX* ssl_ctx, X509* cert) {
+  CRYPTO_add(&cert->references, 1, CRYPTO_LOCK_X509);
+  if (SSL_CTX_add_extra_chain_cert(ssl_ctx, cert) != 1)
+    X509_free(cert);
+}
+
 bool SslChannel::InitServerSslChannel(string& network, string& address,
                 string& port, X509* policyCert, X509* programCert,
                 string& keyType, EVP_PKEY* privateKey, int verify) {
@@ -560,6 +869,15 @@ bool SslChannel::InitServerSslChannel(string& network, string& address,
     return false;
   }
 
+  // Let clients resume sessions, by id or ticket, so that a repeat
+  // connection skips the ECDHE exchange and the client cert checks.  A
+  // session id context is needed to resume with client verification.
+  SSL_CTX_set_session_cache_mode(ssl_ctx_, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_set_timeout(ssl_ctx_, SSL_SESSION_TIMEOUT_SECONDS);
+  SSL_CTX_sess_set_cache_size(ssl_ctx_, SSL_SESSION_CACHE_SIZE);
+  SSL_CTX_set_session_id_context(ssl_ctx_, (const byte*)"SslChannel",
+                                 strlen("SslChannel"));
+
   // Setup verification stuff.
   switch(verify) {
     case SSL_NO_SERVER_VERIFY_NO_CLIENT_AUTH:
@@ -569,8 +887,8 @@ bool SslChannel::InitServerSslChannel(string& network, string& address,
       SSL_CTX_set_verify_depth(ssl_ctx_, 3);
       break;
     case SSL_SERVER_VERIFY_CLIENT_VERIFY:
-      SSL_CTX_add_extra_chain_cert(ssl_ctx_, programCert);
-      SSL_CTX_add_extra_chain_cert(ssl_ctx_, policyCert);
+      AddExtraChainCert(ssl_ctx_, programCert);
+      AddExtraChainCert(ssl_ctx_, policyCert);
       store_ = X509_STORE_new();
       if (store_ == nullptr) {
         printf("X509_STORE_new failed.\n");
@@ -578,6 +896,8 @@ bool SslChannel::InitServerSslChannel(string& network, string& address,
       }
       X509_STORE_add_cert(store_, policyCert);
       SSL_CTX_set_cert_store(ssl_ctx_, store_);
+      if (cert_verifier_ != nullptr)
+        cert_verifier_->AttachToSslCtx(ssl_ctx_);
       SSL_CTX_set_verify(ssl_ctx_,
           SSL_VERIFY_PEER|SSL_VERIFY_FAIL_IF_NO_PEER_CERT, nullptr);
       SSL_CTX_set_verify_depth(ssl_ctx_, 3);
@@ -589,83 +909,116 @@ bool SslChannel::InitServerSslChannel(string& network, string& address,
   return true;
 }
 
-bool SslChannel::InitClientSslChannel(string& network, string& address,
-                string& port, X509* policyCert, X509* programCert,
-                string& keyType, EVP_PKEY* privateKey, int verify) {
-   SSL_library_init();
-   OpenSSL_add_all_algorithms();
-   ERR_load_crypto_strings();
-
-  // I'm a client.
-  server_role_ = false;
-
-  // Create socket and contexts.
-  fd_ = CreateClientSocket(address, port);
-  if(fd_ <= 0) {
-    printf("CreateClientSocket failed.\n");
-    return false;
-  }
-
-  ssl_ctx_ = SSL_CTX_new(TLSv1_2_client_method());
-  if (ssl_ctx_ == nullptr) {
-    printf("SSL_CTX_new failed(client).\n");
-    return false;
-  }
-  SSL_CTX_clear_extra_chain_certs(ssl_ctx_);
+// Sets up a client SSL_CTX as InitClientSslChannel always has.  The
+// store of trusted certs, if any, belongs to ssl_ctx.
+static bool ConfigureClientSslCtx(SSL_CTX* ssl_ctx, X509* policyCert,
+                                  X509* programCert, EVP_PKEY* privateKey,
+                                  int verify, X509VerifyContext* verifier) {
+  SSL_CTX_clear_extra_chain_certs(ssl_ctx);
   if (privateKey == nullptr) {
     printf("Private key is null\n");
     return false;
   }
-  private_key_ = privateKey;
 
   // Setup verification stuff.
   switch(verify) {
     case SSL_NO_SERVER_VERIFY_NO_CLIENT_AUTH:
-      SSL_CTX_set_verify(ssl_ctx_, SSL_VERIFY_NONE, nullptr);
-      SSL_CTX_set_verify_depth(ssl_ctx_, 3);
+      SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, nullptr);
+      SSL_CTX_set_verify_depth(ssl_ctx, 3);
       break;
     case SSL_NO_SERVER_VERIFY_NO_CLIENT_VERIFY:
     case SSL_SERVER_VERIFY_NO_CLIENT_VERIFY:
-    case SSL_SERVER_VERIFY_CLIENT_VERIFY:
-      if (privateKey == nullptr) {
-        printf("Private key is null\n");
-        return false;
-      }
-      if (EVP_PKEY_id(private_key_) == EVP_PKEY_EC) {
-        if (!SSL_CTX_set_tmp_ecdh(ssl_ctx_,
-                EVP_PKEY_get1_EC_KEY(private_key_))) {
+    case SSL_SERVER_VERIFY_CLIENT_VERIFY: {
+      if (EVP_PKEY_id(privateKey) == EVP_PKEY_EC) {
+        if (!SSL_CTX_set_tmp_ecdh(ssl_ctx,
+                EVP_PKEY_get1_EC_KEY(privateKey))) {
           printf("SSL_CTX_set_tmp_ecdh failed.\n");
           return false;
         }
-        SSL_CTX_set_options(ssl_ctx_, SSL_OP_SINGLE_ECDH_USE);
+        SSL_CTX_set_options(ssl_ctx, SSL_OP_SINGLE_ECDH_USE);
       }
-      if(SSL_CTX_use_PrivateKey(ssl_ctx_, private_key_) <= 0) {
+      if(SSL_CTX_use_PrivateKey(ssl_ctx, privateKey) <= 0) {
         printf("SSL_CTX_use_PrivateKey failed.\n");
         ERR_print_errors_fp(stderr);
         return false;
       }
-      SSL_CTX_use_certificate(ssl_ctx_, programCert);
-      SSL_CTX_add_extra_chain_cert(ssl_ctx_, programCert);
-      SSL_CTX_add_extra_chain_cert(ssl_ctx_, policyCert);
-      store_ = X509_STORE_new();
-      if (store_ == nullptr) {
+      SSL_CTX_use_certificate(ssl_ctx, programCert);
+      AddExtraChainCert(ssl_ctx, programCert);
+      AddExtraChainCert(ssl_ctx, policyCert);
+      X509_STORE* store = X509_STORE_new();
+      if (store == nullptr) {
         printf("X509_STORE_new failed.\n");
         return false;
       }
-      X509_STORE_add_cert(store_, policyCert);
-      SSL_CTX_set_cert_store(ssl_ctx_, store_);
-      SSL_CTX_set_verify(ssl_ctx_,
+      X509_STORE_add_cert(store, policyCert);
+      SSL_CTX_set_cert_store(ssl_ctx, store);
+      if (verifier != nullptr)
+        verifier->AttachToSslCtx(ssl_ctx);
+      SSL_CTX_set_verify(ssl_ctx,
         SSL_VERIFY_PEER|SSL_VERIFY_FAIL_IF_NO_PEER_CERT, nullptr);
-      SSL_CTX_set_verify_depth(ssl_ctx_, 3);
+      SSL_CTX_set_verify_depth(ssl_ctx, 3);
       if (verify == SSL_NO_SERVER_VERIFY_NO_CLIENT_VERIFY)
-        SSL_CTX_set_verify(ssl_ctx_, SSL_VERIFY_NONE, nullptr); 
+        SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, nullptr); 
       break;
+    }
     default:
       printf("Unknown verification mode.\n");
       return false;
   }
+  return true;
+}
+
+bool SslChannel::InitClientSslChannel(string& network, string& address,
+                string& port, X509* policyCert, X509* programCert,
+                string& keyType, EVP_PKEY* privateKey, int verify) {
+   SSL_library_init();
+   OpenSSL_add_all_algorithms();
+   ERR_load_crypto_strings();
+
+  // I'm a client.
+  server_role_ = false;
+
+  // Create socket and contexts.
+  fd_ = CreateClientSocket(address, port);
+  if(fd_ <= 0) {
+    printf("CreateClientSocket failed.\n");
+    return false;
+  }
 
-  ssl_ = SSL_new(ssl_ctx_);
+  ssl_ctx_ = SSL_CTX_new(TLSv1_2_client_method());
+  if (ssl_ctx_ == nullptr) {
+    printf("SSL_CTX_new failed(client).\n");
+    return false;
+  }
+  private_key_ = privateKey;
+  if (!ConfigureClientSslCtx(ssl_ctx_, policyCert, programCert, privateKey,
+                             verify, cert_verifier_)) {
+    return false;
+  }
+  return ConnectSsl(ssl_ctx_, nullptr, address + ":" + port);
+}
+
+bool SslChannel::InitClientSslChannel(SslClientContext* context,
+                                      string& address, string& port) {
+  server_role_ = false;
+  if (context == nullptr || context->GetSslCtx() == nullptr) {
+    printf("Client context isn't initialized.\n");
+    return false;
+  }
+  fd_ = CreateClientSocket(address, port);
+  if(fd_ <= 0) {
+    printf("CreateClientSocket failed.\n");
+    return false;
+  }
+  private_key_ = context->GetPrivateKey();
+  return ConnectSsl(context->GetSslCtx(), context, address + ":" + port);
+}
+
+// Handshakes on fd_, resuming the session context holds for server, if
+// any, and saving the new one.
+bool SslChannel::ConnectSsl(SSL_CTX* ssl_ctx, SslClientContext* context,
+                            const string& server) {
+  ssl_ = SSL_new(ssl_ctx);
   if (ssl_ == nullptr) {
     printf("SSL_new failed(client).\n");
     return false;
@@ -673,17 +1026,106 @@ bool SslChannel::InitClientSslChannel(string& network, string& address,
 
   SSL_set_fd(ssl_, fd_);
   SSL_set_connect_state(ssl_);
+  SSL_SESSION* session = nullptr;
+  if (context != nullptr)
+    session = context->GetSession(server);
+  if (session != nullptr) {
+    SSL_set_session(ssl_, session);
+    SSL_SESSION_free(session);
+  }
 
   // Connect.
   if (SSL_connect(ssl_) != 1) {
     printf("SSL_connect failed.\n");
     ERR_print_errors_fp(stderr);
+    if (context != nullptr)
+      context->ForgetSession(server);
     return false;
   }
+  if (context != nullptr)
+    context->SaveSession(server, ssl_);
   peer_cert_ = SSL_get_peer_certificate(ssl_);
   return true;
 }
 
+bool SslChannel::SessionReused() {
+  return ssl_ != nullptr && SSL_session_reused(ssl_) == 1;
+}
+
+SslClientContext::SslClientContext()
+    : ssl_ctx_(nullptr), private_key_(nullptr) {
+}
+
+SslClientContext::~SslClientContext() {
+  for (auto& s : sessions_)
+    SSL_SESSION_free(s.second);
+  if (ssl_ctx_ != nullptr)
+    SSL_CTX_free(ssl_ctx_);
+}
+
+bool SslClientContext::Init(X509* policyCert, X509* programCert,
+                            EVP_PKEY* privateKey, int verify,
+                            X509VerifyContext* verifier) {
+  SSL_library_init();
+  OpenSSL_add_all_algorithms();
+  ERR_load_crypto_strings();
+  InitOpenSslThreading();
+
+  if (ssl_ctx_ != nullptr) {
+    return false;
+  }
+  ssl_ctx_ = SSL_CTX_new(TLSv1_2_client_method());
+  if (ssl_ctx_ == nullptr) {
+    printf("SSL_CTX_new failed(client).\n");
+    return false;
+  }
+  // Sessions are kept here, per server, rather than in OpenSSL's
+  // client cache, which has no lookup by server.
+  SSL_CTX_set_session_cache_mode(ssl_ctx_, SSL_SESS_CACHE_OFF);
+  private_key_ = privateKey;
+  return ConfigureClientSslCtx(ssl_ctx_, policyCert, programCert, privateKey,
+                               verify, verifier);
+}
+
+SSL_CTX* SslClientContext::GetSslCtx() {
+  return ssl_ctx_;
+}
+
+EVP_PKEY* SslClientContext::GetPrivateKey() {
+  return private_key_;
+}
+
+SSL_SESSION* SslClientContext::GetSession(const string& server) {
+  std::lock_guard<std::mutex> l(mu_);
+  auto it = sessions_.find(server);
+  if (it == sessions_.end()) {
+    return nullptr;
+  }
+  CRYPTO_add(&it->second->references, 1, CRYPTO_LOCK_SSL_SESSION);
+  return it->second;
+}
+
+void SslClientContext::SaveSession(const string& server, SSL* ssl) {
+  SSL_SESSION* session = SSL_get1_session(ssl);
+  if (session == nullptr) {
+    return;
+  }
+  std::lock_guard<std::mutex> l(mu_);
+  SSL_SESSION*& slot = sessions_[server];
+  if (slot != nullptr)
+    SSL_SESSION_free(slot);
+  slot = session;
+}
+
+void SslClientContext::ForgetSession(const string& server) {
+  std::lock_guard<std::mutex> l(mu_);
+  auto it = sessions_.find(server);
+  if (it != sessions_.end()) {
+    SSL_SESSION_free(it->second);
+    sessions_.erase(it);
+  }
+}
+
 bool SslChannel::ServerLoop(void(*server_loop)(SslChannel*,  SSL*, int)) {
   bool fContinue = true;
   printf("ServerLoop\n");
@@ -718,169 +1160,534 @@ bool SslChannel::ServerLoop(void(*server_loop)(SslChannel*,  SSL*, int)) {
   return true;
 }
 
-void SslChannel::Close() {
-  if (fd_ > 0) {
-    close(fd_);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static std::mutex* openssl_locks = nullptr;
+
+static void OpenSslLockingCallback(int mode, int n, const char* file,
+                                   int line) {
+  if (mode & CRYPTO_LOCK)
+    openssl_locks[n].lock();
+  else
+    openssl_locks[n].unlock();
+}
+
+static void OpenSslThreadIdCallback(CRYPTO_THREADID* id) {
+  CRYPTO_THREADID_set_numeric(id, (unsigned long)pthread_self());
+}
+
+// A forked child has only the calling thread, but inherits any of these
+// locks that another thread held, e.g. a nonce refiller inside RAND.
+static void OpenSslLocksAtFork() {
+  for (int i = 0; i < CRYPTO_num_locks(); i++)
+    new (&openssl_locks[i]) std::mutex();
+}
+#endif
+
+void InitOpenSslThreading() {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  static std::once_flag once;
+  std::call_once(once, []() {
+    if (CRYPTO_get_locking_callback() != nullptr)
+      return;
+    openssl_locks = new std::mutex[CRYPTO_num_locks()];
+    CRYPTO_THREADID_set_callback(OpenSslThreadIdCallback);
+    CRYPTO_set_locking_callback(OpenSslLockingCallback);
+    pthread_atfork(nullptr, nullptr, OpenSslLocksAtFork);
+  });
+#endif
+}
+
+// A connection whose handshake ConcurrentServerLoop is still driving.
+class PendingSslAccept {
+public:
+  SSL* ssl_;
+  int fd_;
+  time_t deadline_;
+};
+
+// Established connections waiting for, or held by, a worker.
+class SslWorkQueue {
+public:
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<std::pair<SSL*, int>> ready_;
+  bool closed_ = false;
+};
+
+static bool SetBlocking(int fd, bool blocking) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) {
+    return false;
   }
-  fd_ = -1;
+  flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+  return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+static void DropPendingAccept(int epoll_fd, PendingSslAccept& p) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p.fd_, nullptr);
+  SSL_free(p.ssl_);
+  close(p.fd_);
+}
+
+bool SslChannel::ConcurrentServerLoop(void(*Handle)(SslChannel*,  SSL*, int),
+                                      int num_workers, int max_pending) {
+  if (ssl_ctx_ == nullptr || fd_ < 0 || private_key_ == nullptr ||
+      num_workers < 1 || max_pending < 0) {
+    printf("ConcurrentServerLoop: channel not initialized.\n");
+    return false;
+  }
+  InitOpenSslThreading();
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd < 0 || wake_fd_ < 0 || !SetBlocking(fd_, false)) {
+    printf("ConcurrentServerLoop: can't set up epoll.\n");
+    if (epoll_fd >= 0)
+      close(epoll_fd);
+    return false;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = wake_fd_;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd_, &ev);
+  ev.data.fd = fd_;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd_, &ev);
+  bool listening = true;
+
+  // Connections accepted but not yet finished by a worker.  Workers
+  // decrement it and poke wake_fd_ so that accepting can resume.
+  std::atomic<int> in_progress(0);
+  int limit = num_workers + max_pending;
+  SslWorkQueue queue;
+  std::vector<thread> workers;
+  for (int i = 0; i < num_workers; i++) {
+    workers.emplace_back([this, Handle, &queue, &in_progress]() {
+      for (;;) {
+        std::pair<SSL*, int> conn;
+        {
+          std::unique_lock<std::mutex> l(queue.mu_);
+          queue.cv_.wait(l, [&queue]() {
+            return queue.closed_ || !queue.ready_.empty();
+          });
+          if (queue.ready_.empty())
+            return;
+          conn = queue.ready_.front();
+          queue.ready_.pop_front();
+        }
+        Handle(this, conn.first, conn.second);
+        in_progress--;
+        uint64_t one = 1;
+        if (write(wake_fd_, &one, sizeof(one)) < 0) {
+          // The loop will still notice on its next timeout.
+        }
+      }
+    });
+  }
+
+  std::map<int, PendingSslAccept> handshakes;
+  auto drive = [&](PendingSslAccept& p) -> bool {
+    ERR_clear_error();
+    int ret = SSL_accept(p.ssl_);
+    if (ret == 1) {
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p.fd_, nullptr);
+      SetBlocking(p.fd_, true);
+      std::lock_guard<std::mutex> l(queue.mu_);
+      queue.ready_.push_back(std::make_pair(p.ssl_, p.fd_));
+      queue.cv_.notify_one();
+      return true;
+    }
+    int err = SSL_get_error(p.ssl_, ret);
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+      printf("Unable to ssl_accept\n");
+      ERR_print_errors_fp(stderr);
+      DropPendingAccept(epoll_fd, p);
+      in_progress--;
+      return true;
+    }
+    struct epoll_event pev;
+    memset(&pev, 0, sizeof(pev));
+    pev.events = err == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT;
+    pev.data.fd = p.fd_;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, p.fd_, &pev);
+    return false;
+  };
+
+  printf("ConcurrentServerLoop\n");
+  struct epoll_event events[64];
+  while (!stop_) {
+    int n = epoll_wait(epoll_fd, events, 64, 1000);
+    if (n < 0 && errno != EINTR) {
+      printf("epoll_wait failed\n");
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == wake_fd_) {
+        uint64_t count;
+        while (read(wake_fd_, &count, sizeof(count)) > 0)
+          ;
+      } else if (fd == fd_) {
+        while (in_progress < limit) {
+          int client = accept4(fd_, nullptr, nullptr,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (client < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+              printf("Unable to accept\n");
+            break;
+          }
+          SSL* ssl = SSL_new(ssl_ctx_);
+          if (ssl == nullptr) {
+            close(client);
+            continue;
+          }
+          SSL_set_fd(ssl, client);
+          SSL_set_accept_state(ssl);
+          struct epoll_event cev;
+          memset(&cev, 0, sizeof(cev));
+          cev.events = EPOLLIN;
+          cev.data.fd = client;
+          epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &cev);
+          in_progress++;
+          PendingSslAccept& p = handshakes[client];
+          p.ssl_ = ssl;
+          p.fd_ = client;
+          p.deadline_ = time(nullptr) + SSL_HANDSHAKE_TIMEOUT_SECONDS;
+          if (drive(p))
+            handshakes.erase(client);
+        }
+      } else {
+        auto it = handshakes.find(fd);
+        if (it != handshakes.end() && drive(it->second))
+          handshakes.erase(it);
+      }
+    }
+
+    // Drop handshakes that have stalled, so they can't hold slots.
+    time_t now = time(nullptr);
+    for (auto it = handshakes.begin(); it != handshakes.end();) {
+      if (now < it->second.deadline_) {
+        ++it;
+        continue;
+      }
+      DropPendingAccept(epoll_fd, it->second);
+      in_progress--;
+      it = handshakes.erase(it);
+    }
+
+    // Stop listening while at the limit; the kernel queues new clients.
+    bool want_listen = in_progress < limit;
+    if (want_listen != listening) {
+      ev.events = want_listen ? EPOLLIN : 0;
+      ev.data.fd = fd_;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd_, &ev);
+      listening = want_listen;
+    }
+  }
+
+  for (auto& h : handshakes)
+    DropPendingAccept(epoll_fd, h.second);
+  {
+    std::lock_guard<std::mutex> l(queue.mu_);
+    queue.closed_ = true;
+    for (auto& conn : queue.ready_) {
+      SSL_free(conn.first);
+      close(conn.second);
+    }
+    queue.ready_.clear();
+  }
+  queue.cv_.notify_all();
+  for (thread& t : workers)
+    t.join();
+  close(epoll_fd);
+  int wake_fd = wake_fd_;
+  wake_fd_ = -1;
+  close(wake_fd);
+  SetBlocking(fd_, true);
+  stop_ = false;
+  return true;
+}
+
+void SslChannel::StopServerLoop() {
+  stop_ = true;
+  int wake_fd = wake_fd_;
+  if (wake_fd >= 0) {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+      // The loop will still notice on its next timeout.
+    }
+  }
+}
+
+void SslChannel::Close() {
   if (ssl_ != nullptr) {
+    // Say goodbye, unless the peer already has: writing to a closed
+    // connection would raise SIGPIPE.
+    if (IsAlive())
+      SSL_shutdown(ssl_);
     SSL_free(ssl_);
   }
   ssl_ = nullptr;
+  if (fd_ > 0) {
+    close(fd_);
+  }
+  fd_ = -1;
   if (peer_cert_ != nullptr) {
     X509_free(peer_cert_);
   }
   peer_cert_ = nullptr;
+  // store_ is ssl_ctx_'s cert store, and is freed with it.
   if (ssl_ctx_ != nullptr) {
     SSL_CTX_free(ssl_ctx_);
-  }
-  ssl_ctx_ = nullptr;
-  if (store_ != nullptr) {
+  } else if (store_ != nullptr) {
     X509_STORE_free(store_);
   }
+  ssl_ctx_ = nullptr;
   store_ = nullptr;
 }
 
+int SslChannel::GetPort() {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  if (fd_ < 0 || getsockname(fd_, (struct sockaddr*)&addr, &len) < 0 ||
+      addr.sin_family != AF_INET) {
+    return -1;
+  }
+  return ntohs(addr.sin_port);
+}
+
 X509* SslChannel::GetPeerCert() {
   return peer_cert_;
 }
 
-int SslMessageRead(SSL* ssl, int size, byte* buf) {
-  byte new_buf[8192];
-  int tmp_size = SslRead(ssl, size, new_buf);
-  if (tmp_size <= 0)
-    return tmp_size;
-  int real_size = __builtin_bswap32(*((int*)new_buf));
-  if (tmp_size == sizeof(int)) {
-    return SslRead(ssl, real_size, buf);
+bool SslChannel::IsAlive() {
+  if (ssl_ == nullptr || fd_ < 0)
+    return false;
+  if (SSL_pending(ssl_) > 0)
+    return false;
+  struct pollfd p;
+  p.fd = fd_;
+  p.events = POLLIN;
+  p.revents = 0;
+  return poll(&p, 1, 0) == 0;
+}
+
+static int SslMessageStatus(SSL* ssl, int ret) {
+  switch (SSL_get_error(ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+      return SSL_MESSAGE_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+      return SSL_MESSAGE_WANT_WRITE;
+    default:
+      return SSL_MESSAGE_ERROR;
   }
-  memcpy(buf, &new_buf[4], real_size);
-  return real_size;
 }
 
-int SslMessageWrite(SSL* ssl, int size, byte* buf) {
-  // write 32 bit size and buffer
-  int big_endian_size = __builtin_bswap32(size);
-  byte new_buf[8192];
-  memcpy(new_buf, (byte*)&big_endian_size, sizeof(int));
-  memcpy(&new_buf[sizeof(int)], buf, size);
-  return SslWrite(ssl, size + sizeof(int), new_buf) - sizeof(int);
+SslMessageReader::SslMessageReader() {
+  Reset();
 }
 
-int SslRead(SSL* ssl, int size, byte* buf) {
-  return SSL_read(ssl, buf, size);
+void SslMessageReader::Reset() {
+  header_got_ = 0;
+  body_size_ = -1;
+  body_got_ = 0;
+  discard_ = false;
 }
 
-int SslWrite(SSL* ssl, int size, byte* buf) {
-  return SSL_write(ssl, buf, size);
+int SslMessageReader::ReadHeader(SSL* ssl) {
+  while (header_got_ < SSL_MESSAGE_HEADER_SIZE) {
+    int n = SSL_read(ssl, header_ + header_got_,
+                     SSL_MESSAGE_HEADER_SIZE - header_got_);
+    if (n <= 0)
+      return SslMessageStatus(ssl, n);
+    header_got_ += n;
+  }
+  if (body_size_ < 0) {
+    uint32_t size = ((uint32_t)header_[0] << 24) | ((uint32_t)header_[1] << 16) |
+                    ((uint32_t)header_[2] << 8) | (uint32_t)header_[3];
+    if (size > SSL_MESSAGE_MAX_SIZE) {
+      printf("SslMessageReader: message too large (%u).\n", size);
+      return SSL_MESSAGE_ERROR;
+    }
+    body_size_ = size;
+  }
+  return SSL_MESSAGE_DONE;
 }
 
-// TODO: consider using std::to_string
-int NumHexInBytes(int size, byte* in) { return 2 * size; }
+int SslMessageReader::ReadBody(SSL* ssl, byte* body) {
+  while (body_got_ < body_size_) {
+    int n = SSL_read(ssl, body + body_got_, body_size_ - body_got_);
+    if (n <= 0)
+      return SslMessageStatus(ssl, n);
+    body_got_ += n;
+  }
+  Reset();
+  return SSL_MESSAGE_DONE;
+}
 
-int NumBytesInHex(char* in) {
-  if (in == nullptr)
-    return -1;
-  int len = strlen(in);
-  return ((len + 1) / 2);
+int SslMessageReader::DiscardBody(SSL* ssl) {
+  byte scratch[4096];
+  while (body_got_ < body_size_) {
+    int n = SSL_read(ssl, scratch,
+                     std::min(body_size_ - body_got_, (int)sizeof(scratch)));
+    if (n <= 0)
+      return SslMessageStatus(ssl, n);
+    body_got_ += n;
+  }
+  Reset();
+  return SSL_MESSAGE_TOO_LARGE;
 }
 
-char ValueToHex(byte x) {
-  if (x >= 0 && x <= 9) {
-    return x + '0';
-  } else if (x >= 10 && x <= 15) {
-    return x - 10 + 'a';
-  } else {
-    return ' ';
+int SslMessageReader::Read(SSL* ssl, string* message) {
+  int ret = ReadHeader(ssl);
+  if (ret != SSL_MESSAGE_DONE)
+    return ret;
+  if (body_got_ == 0)
+    message->clear();
+  while (body_got_ < body_size_) {
+    int chunk = std::min(body_size_ - body_got_, SSL_MESSAGE_READ_CHUNK);
+    message->resize(body_got_ + chunk);
+    int n = SSL_read(ssl, &(*message)[body_got_], chunk);
+    message->resize(body_got_ + (n > 0 ? n : 0));
+    if (n <= 0)
+      return SslMessageStatus(ssl, n);
+    body_got_ += n;
   }
+  Reset();
+  return SSL_MESSAGE_DONE;
 }
 
-byte HexToValue(char x) {
-  if (x >= '0' && x <= '9') {
-    return x - '0';
-  } else if (x >= 'a' && x <= 'f') {
-    return x + 10 - 'a';
-  } else {
-    return 0;
+int SslMessageReader::Read(SSL* ssl, int size, byte* buf, int* message_size) {
+  int ret = ReadHeader(ssl);
+  if (ret != SSL_MESSAGE_DONE)
+    return ret;
+  if (!discard_ && body_size_ > size) {
+    printf("SslMessageReader: %d byte message, %d byte buffer.\n",
+           body_size_, size);
+    discard_ = true;
   }
+  *message_size = body_size_;
+  if (discard_)
+    return DiscardBody(ssl);
+  return ReadBody(ssl, buf);
 }
 
-string* ByteToHexLeftToRight(int size, byte* in) {
-  if (in == nullptr)
-    return nullptr;
-  int n = NumHexInBytes(size, in);
-  string* out = new string(n, 0);
-  char* str = (char*)out->c_str();
-  byte a, b;
-
-  while (size > 0) {
-    a = (*in) >> 4;
-    b = (*in) & 0xf;
-    in++;
-    *(str++) = ValueToHex(a);
-    *(str++) = ValueToHex(b);
-    size--;
+SslMessageWriter::SslMessageWriter()
+    : first_size_(0), rest_(nullptr), rest_size_(0), first_sent_(true) {
+}
+
+bool SslMessageWriter::Start(int size, const byte* message) {
+  if (size < 0 || size > SSL_MESSAGE_MAX_SIZE) {
+    return false;
   }
-  return out;
+  first_[0] = (byte)(size >> 24);
+  first_[1] = (byte)(size >> 16);
+  first_[2] = (byte)(size >> 8);
+  first_[3] = (byte)size;
+  int first_body = SSL_MESSAGE_FIRST_RECORD - SSL_MESSAGE_HEADER_SIZE;
+  if (first_body > size)
+    first_body = size;
+  if (first_body > 0)
+    memcpy(first_ + SSL_MESSAGE_HEADER_SIZE, message, first_body);
+  first_size_ = SSL_MESSAGE_HEADER_SIZE + first_body;
+  rest_ = message + first_body;
+  rest_size_ = size - first_body;
+  first_sent_ = false;
+  return true;
 }
 
-int HexToByteLeftToRight(char* in, int size, byte* out) {
-  if (in == nullptr)
-    return -1;
-  int n = NumBytesInHex(in);
-  int m = strlen(in);
-  byte a, b;
+// SSL_write must be retried with the same arguments after WANT_*, so
+// each piece is one call that either completes or is repeated.
+int SslMessageWriter::Write(SSL* ssl) {
+  if (!first_sent_) {
+    int n = SSL_write(ssl, first_, first_size_);
+    if (n <= 0)
+      return SslMessageStatus(ssl, n);
+    first_sent_ = true;
+  }
+  if (rest_size_ > 0) {
+    int n = SSL_write(ssl, rest_, rest_size_);
+    if (n <= 0)
+      return SslMessageStatus(ssl, n);
+    rest_size_ = 0;
+  }
+  return SSL_MESSAGE_DONE;
+}
+
+int SslMessageRead(SSL* ssl, int size, byte* buf) {
+  SslMessageReader reader;
+  int message_size = 0;
+  int ret;
+  while ((ret = reader.Read(ssl, size, buf, &message_size)) ==
+             SSL_MESSAGE_WANT_READ || ret == SSL_MESSAGE_WANT_WRITE)
+    ;
+  return ret == SSL_MESSAGE_DONE ? message_size : -1;
+}
 
-  if (n > size) {
+int SslMessageWrite(SSL* ssl, int size, byte* buf) {
+  std::unique_ptr<SslMessageWriter> writer(new SslMessageWriter());
+  if (!writer->Start(size, buf)) {
     return -1;
   }
-  while (m > 0) {
-    a = HexToValue(*(in++));
-    b = HexToValue(*(in++));
-    *(out++) = (a << 4) | b;
-    m -= 2;
-  }
-  return n;
+  int ret;
+  while ((ret = writer->Write(ssl)) == SSL_MESSAGE_WANT_READ ||
+         ret == SSL_MESSAGE_WANT_WRITE)
+    ;
+  return ret == SSL_MESSAGE_DONE ? size : -1;
 }
 
-string* ByteToHexRightToLeft(int size, byte* in) {
-  if (in == nullptr)
+bool SslMessageRead(SSL* ssl, string* message) {
+  SslMessageReader reader;
+  int ret;
+  while ((ret = reader.Read(ssl, message)) == SSL_MESSAGE_WANT_READ ||
+         ret == SSL_MESSAGE_WANT_WRITE)
+    ;
+  return ret == SSL_MESSAGE_DONE;
+}
+
+bool SslMessageWrite(SSL* ssl, string& message) {
+  return SslMessageWrite(ssl, (int)message.size(), (byte*)message.data()) >= 0;
+}
+
+int SslRead(SSL* ssl, int size, byte* buf) {
+  return SSL_read(ssl, buf, size);
+}
+
+int SslWrite(SSL* ssl, int size, byte* buf) {
+  return SSL_write(ssl, buf, size);
+}
+
+// Hex conversions use the shared table-driven codec in tao/codec.h.
+string* ByteToHexLeftToRight(int size, byte* in) {
+  if (in == nullptr || size < 0)
     return nullptr;
-  int n = NumHexInBytes(size, in);
-  string* out = new string(n, 0);
-  char* str = (char*)out->c_str();
-  byte a, b;
-
-  in += size - 1;
-  while (size > 0) {
-    a = (*in) >> 4;
-    b = (*in) & 0xf;
-    in--;
-    *(str++) = ValueToHex(a);
-    *(str++) = ValueToHex(b);
-    size--;
-  }
+  string* out = new string(tao::HexEncodedSize(size), 0);
+  tao::HexEncode(in, size, (char*)out->data());
   return out;
 }
 
+string* ByteToHexRightToLeft(int size, byte* in) {
+  if (in == nullptr || size < 0)
+    return nullptr;
+  string reversed((const char*)in, size);
+  std::reverse(reversed.begin(), reversed.end());
+  return new string(tao::HexEncode(reversed));
+}
 
-int HexToByteRightToLeft(char* in, int size, byte* out) {
-  if (in == nullptr) {
+// Returns the number of bytes, or -1 if in is not hex or out is too small.
+int HexToByteLeftToRight(char* in, int size, byte* out) {
+  if (in == nullptr)
     return -1;
-  }
-  int n = NumBytesInHex(in);
-  int m = strlen(in);
-  byte a, b;
-
-  out += n - 1;
-  if (m < 0) {
+  size_t len = strlen(in);
+  int n = len / 2;
+  if ((len % 2) != 0 || n > size || !tao::HexDecode(in, len, out))
     return -1;
-  }
-  while (m > 0) {
-    a = HexToValue(*(in++));
-    b = HexToValue(*(in++));
-    *(out--) = (a << 4) | b;
-    m -= 2;
-  }
+  return n;
+}
+
+int HexToByteRightToLeft(char* in, int size, byte* out) {
+  int n = HexToByteLeftToRight(in, size, out);
+  if (n > 0)
+    std::reverse(out, out + n);
   return n;
 }
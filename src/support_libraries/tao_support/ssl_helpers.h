@@ -37,8 +37,13 @@
 
 #include "messages.pb.h"
 
+#include <atomic>
 #include <string>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 
 using std::string;
 
@@ -58,11 +63,94 @@ bool SignX509Certificate(EVP_PKEY* signingKey, bool f_isCa, bool f_canSign,
                          X509_REQ* req, bool verify_req_sig, X509* cert);
 bool VerifyX509CertificateChain(X509* cacert, X509* cert);
 
+// Default number of verified chains an X509VerifyContext remembers.
+#define X509_VERIFY_CACHE_SIZE 1024
+
+// A long-lived trust store seeded with the policy cert, and an LRU of the
+// chains it has already verified.  A chain is keyed by the SHA-256 of its
+// certificates' DER and by the verify purpose, trust, depth and flags, and
+// is remembered only until its earliest notAfter.
+// Safe to share between threads.
+class X509VerifyContext {
+private:
+  struct CachedChain {
+    string key_;
+    time_t not_after_;
+  };
+
+  std::mutex mu_;
+  X509_STORE* store_;
+  int max_entries_;
+  std::list<CachedChain> lru_;    // Most recently used first.
+  std::unordered_map<string, std::list<CachedChain>::iterator> index_;
+  int hits_;
+  int misses_;
+
+  bool CacheLookup(const string& key);
+  void CacheInsert(const string& key, time_t not_after);
+  static int SslVerifyCallback(X509_STORE_CTX* store_ctx, void* arg);
+public:
+  X509VerifyContext(int max_entries = X509_VERIFY_CACHE_SIZE);
+  ~X509VerifyContext();
+  X509VerifyContext(const X509VerifyContext&) = delete;
+  X509VerifyContext& operator=(const X509VerifyContext&) = delete;
+
+  bool Init(X509* policy_cert);
+  // Verifies cert, with the untrusted intermediate certs in chain (which
+  // may be null), against the policy cert.
+  bool Verify(X509* cert, STACK_OF(X509)* chain);
+  bool Verify(string& der_cert, std::list<string>* der_chain);
+  void ClearCache();
+  void GetCacheStats(int* hits, int* misses);
+
+  // Makes ssl_ctx skip chains in the cache.  Other chains are verified
+  // by ssl_ctx's own store, as usual, and cached if they pass.  Cached
+  // chains are keyed on the certs the verifying store trusts, so one
+  // X509VerifyContext may serve SSL_CTXs with different policy certs.
+  void AttachToSslCtx(SSL_CTX* ssl_ctx);
+};
+
 BIGNUM* bin_to_BN(int len, byte* buf);
 string* BN_to_bin(BIGNUM& n);
 bool BN_to_string(BIGNUM& n, string* out);
 
 void XorBlocks(int size, byte* in1, byte* in2, byte* out);
+
+// Number of counter blocks encrypted per pass of AesCtr.
+#define AESCTR_BATCH_BLOCKS 8
+
+// Streaming AES-CTR.  Keystream is produced AESCTR_BATCH_BLOCKS blocks
+// at a time by one EVP (AES-NI when available) ECB call and applied
+// 64 bits at a time.  Successive Crypt calls continue the keystream, so
+// a message may be processed in pieces of any size, and in may equal out.
+// Counter blocks are laid out as in the original AesCtrCrypt: the iv is
+// a big-endian 128-bit counter, and each block encrypted is that counter
+// with its bytes reversed.
+class AesCtr {
+private:
+  EVP_CIPHER_CTX* ctx_;
+  uint64_t ctr_[2];      // ctr_[0] is the low half.
+  byte keystream_[AESCTR_BATCH_BLOCKS * AESBLKSIZE];
+  int keystream_size_;
+  int keystream_used_;
+
+  bool SetIv(int iv_size, byte* iv);
+  void MakeCounterBlocks(int num_blocks, byte* out);
+  bool NextKeystream(int num_blocks);
+public:
+  AesCtr();
+  ~AesCtr();
+  AesCtr(const AesCtr&) = delete;
+  AesCtr& operator=(const AesCtr&) = delete;
+
+  bool Init(int key_size_bits, byte* key, int iv_size, byte* iv);
+  // Start from an AES-ECB context that is already keyed, with padding
+  // disabled.  The key schedule is copied; keyed_ecb is not modified.
+  bool Init(const EVP_CIPHER_CTX* keyed_ecb, int iv_size, byte* iv);
+  bool Crypt(int size, byte* in, byte* out);
+};
+
+// One-shot AesCtr.  Exactly size bytes of out are written.
 bool AesCtrCrypt(string& iv, int key_size_bits, byte* key, int size,
                     byte* in, byte* out);
 #define SSL_NO_SERVER_VERIFY_NO_CLIENT_AUTH 0
@@ -70,11 +158,119 @@ bool AesCtrCrypt(string& iv, int key_size_bits, byte* key, int size,
 #define SSL_SERVER_VERIFY_NO_CLIENT_VERIFY 2
 #define SSL_SERVER_VERIFY_CLIENT_VERIFY 3
 
+// ConcurrentServerLoop defaults.
+#define SSL_SERVER_WORKERS 16
+#define SSL_SERVER_MAX_PENDING 64
+#define SSL_HANDSHAKE_TIMEOUT_SECONDS 10
+
+// Server session cache.
+#define SSL_SESSION_TIMEOUT_SECONDS 600
+#define SSL_SESSION_CACHE_SIZE 4096
+
+// Installs OpenSSL 1.0.x locking callbacks, unless the application
+// already has, so that SSL objects may be used on several threads.  A
+// forked child gets fresh locks.
+void InitOpenSslThreading();
+
+// Framed messages are a 32-bit big-endian body size, then the body.
+#define SSL_MESSAGE_HEADER_SIZE 4
+#define SSL_MESSAGE_MAX_SIZE (256 * 1024 * 1024)
+// Largest TLS record payload.  The header and the start of the body go
+// out together in one record; the rest is written from the caller's
+// buffer.
+#define SSL_MESSAGE_FIRST_RECORD 16384
+// The size in the header comes from the peer, so a string is grown by at
+// most this much at a time, as the body arrives, rather than to the whole
+// size at once.
+#define SSL_MESSAGE_READ_CHUNK (64 * 1024)
+
+// Results of SslMessageReader::Read and SslMessageWriter::Write.
+#define SSL_MESSAGE_ERROR -1
+#define SSL_MESSAGE_DONE 0
+#define SSL_MESSAGE_WANT_READ 1
+#define SSL_MESSAGE_WANT_WRITE 2
+#define SSL_MESSAGE_TOO_LARGE 3
+
+// Reads framed messages of any size up to SSL_MESSAGE_MAX_SIZE, from a
+// blocking or non-blocking SSL.  Read returns SSL_MESSAGE_WANT_READ or
+// SSL_MESSAGE_WANT_WRITE when the SSL would block; call it again, with
+// the same destination, once the fd is ready.
+class SslMessageReader {
+private:
+  byte header_[SSL_MESSAGE_HEADER_SIZE];
+  int header_got_;
+  int body_size_;
+  int body_got_;
+  bool discard_;
+
+  int ReadHeader(SSL* ssl);
+  int ReadBody(SSL* ssl, byte* body);
+  int DiscardBody(SSL* ssl);
+public:
+  SslMessageReader();
+  void Reset();
+  int Read(SSL* ssl, string* message);
+  // A message larger than size is read and thrown away, so that the next
+  // one can still be read, and SSL_MESSAGE_TOO_LARGE returned with its
+  // size in *message_size.
+  int Read(SSL* ssl, int size, byte* buf, int* message_size);
+};
+
+// Writes one framed message to a blocking or non-blocking SSL.  The
+// message is not copied, beyond what shares the first record with the
+// header, and must stay unchanged until Write returns SSL_MESSAGE_DONE or
+// SSL_MESSAGE_ERROR.  On SSL_MESSAGE_WANT_* call Write again once the fd
+// is ready.
+class SslMessageWriter {
+private:
+  byte first_[SSL_MESSAGE_FIRST_RECORD];
+  int first_size_;
+  const byte* rest_;
+  int rest_size_;
+  bool first_sent_;
+public:
+  SslMessageWriter();
+  bool Start(int size, const byte* message);
+  int Write(SSL* ssl);
+};
+
+// Blocking forms.  The buffer forms return the message size, or -1.  A
+// message too large for the buffer is discarded and gives -1.
 int SslMessageRead(SSL* ssl, int size, byte* buf);
 int SslMessageWrite(SSL* ssl, int size, byte* buf);
+bool SslMessageRead(SSL* ssl, string* message);
+bool SslMessageWrite(SSL* ssl, string& message);
 int SslRead(SSL* ssl, int size, byte* buf);
 int SslWrite(SSL* ssl, int size, byte* buf);
 
+// A client SSL_CTX that many SslChannels may share, configured as
+// InitClientSslChannel configures its own.  It keeps the last session
+// with each server so that later connections can resume it, by session
+// id or ticket, instead of doing a full handshake.  Safe to share
+// between threads.
+class SslClientContext {
+private:
+  std::mutex mu_;
+  SSL_CTX* ssl_ctx_;
+  EVP_PKEY* private_key_;
+  std::map<string, SSL_SESSION*> sessions_;   // By "address:port".
+public:
+  SslClientContext();
+  ~SslClientContext();
+  SslClientContext(const SslClientContext&) = delete;
+  SslClientContext& operator=(const SslClientContext&) = delete;
+
+  bool Init(X509* caCert, X509* programCert, EVP_PKEY* key,
+            int verify = SSL_SERVER_VERIFY_CLIENT_VERIFY,
+            X509VerifyContext* verifier = nullptr);
+  SSL_CTX* GetSslCtx();
+  EVP_PKEY* GetPrivateKey();
+  // The caller must SSL_SESSION_free a non-null result.
+  SSL_SESSION* GetSession(const string& server);
+  void SaveSession(const string& server, SSL* ssl);
+  void ForgetSession(const string& server);
+};
+
 class SslChannel {
 private:
   bool server_role_;
@@ -84,6 +280,12 @@ private:
   X509* peer_cert_;
   X509_STORE *store_;
   EVP_PKEY* private_key_;
+  X509VerifyContext* cert_verifier_;
+  std::atomic<int> wake_fd_;
+  std::atomic<bool> stop_;
+
+  bool ConnectSsl(SSL_CTX* ssl_ctx, SslClientContext* context,
+                  const string& server);
 public:
   SslChannel();
   ~SslChannel();
@@ -94,15 +296,44 @@ public:
                                 X509* caCert, X509* programCert,
                                 string& keyType, EVP_PKEY* key,
                                 int verify = SSL_SERVER_VERIFY_CLIENT_VERIFY);
+  // Connects using a shared context, resuming its session with this
+  // server when it has one.  context must outlive the channel.
+  bool InitClientSslChannel(SslClientContext* context, string& address,
+                            string& port);
   bool InitServerSslChannel(string& network, string& address, string& port,
                                 X509* caCert, X509* programCert,
                                 string& keyType, EVP_PKEY* key,
                                 int verify = SSL_SERVER_VERIFY_CLIENT_VERIFY);
+  // Peer chains are checked with, and cached in, verifier instead of a
+  // private store.  Call before Init*SslChannel; verifier must outlive
+  // the channel.
+  void SetCertVerifier(X509VerifyContext* verifier);
   bool ServerLoop(void(*Handle)(SslChannel*,  SSL*, int));
+  // Serves many clients at once.  Connections are accepted and their
+  // handshakes driven without blocking, from epoll readiness events;
+  // each established connection is then passed, in blocking mode, to
+  // Handle on one of num_workers threads.  Handle owns the SSL and fd,
+  // as in ServerLoop.  At most num_workers + max_pending connections are
+  // in progress at once; beyond that new ones wait in the listen queue.
+  // Returns when StopServerLoop is called.
+  bool ConcurrentServerLoop(void(*Handle)(SslChannel*,  SSL*, int),
+                            int num_workers = SSL_SERVER_WORKERS,
+                            int max_pending = SSL_SERVER_MAX_PENDING);
+  // Makes ConcurrentServerLoop return once running handlers finish.  May
+  // be called from any thread, including a handler.
+  void StopServerLoop();
   void Close();
   SSL* GetSslChannel() {return ssl_;};
+  // The local port of the socket, e.g. the one a server bound to port "0"
+  // was given, or -1.
+  int GetPort();
 
   X509* GetPeerCert();
+  // Whether the handshake resumed an earlier session.
+  bool SessionReused();
+  // Whether an idle connection can still be used: nothing is unread and
+  // the peer has neither closed it nor sent anything.  Does not block.
+  bool IsAlive();
 };
 
 bool EC_SIG_serialize(ECDSA_SIG* sig, string* out);
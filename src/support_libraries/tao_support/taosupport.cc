@@ -81,6 +81,7 @@ void SerializeTermToString(tao::Term* term, string* name) {
 }
 
 TaoChannel::~TaoChannel() {
+  CloseTaoChannel();
 }
 
 void TaoProgramData::ClearProgramData() {
@@ -100,6 +101,17 @@ void TaoProgramData::ClearProgramData() {
     X509_free(policy_certificate_);
   }
   policy_certificate_ = nullptr;
+  {
+    std::lock_guard<std::mutex> l(ssl_client_context_mu_);
+    if (ssl_client_context_ != nullptr) {
+      delete ssl_client_context_;
+    }
+    ssl_client_context_ = nullptr;
+  }
+  if (cert_verifier_ != nullptr) {
+    delete cert_verifier_;
+  }
+  cert_verifier_ = nullptr;
 }
 
 TaoProgramData::TaoProgramData() {
@@ -109,6 +121,8 @@ TaoProgramData::TaoProgramData() {
   tao_name_.clear();
   policy_cert_.clear();
   policy_certificate_ = nullptr;
+  cert_verifier_ = nullptr;
+  ssl_client_context_ = nullptr;
   program_signing_key_ = nullptr;
   verifying_key_ = nullptr;
   crypting_key_ = nullptr;
@@ -171,6 +185,29 @@ bool TaoProgramData::GetProgramCert(string* cert) {
   return true;
 }
 
+X509VerifyContext* TaoProgramData::GetCertVerifier() {
+  return cert_verifier_;
+}
+
+SslClientContext* TaoProgramData::GetSslClientContext() {
+  std::lock_guard<std::mutex> l(ssl_client_context_mu_);
+  if (ssl_client_context_ != nullptr) {
+    return ssl_client_context_;
+  }
+  if (policy_certificate_ == nullptr || program_certificate_ == nullptr) {
+    return nullptr;
+  }
+  SslClientContext* context = new SslClientContext();
+  if (!context->Init(policy_certificate_, program_certificate_,
+                     GetProgramKey(), SSL_SERVER_VERIFY_CLIENT_VERIFY,
+                     cert_verifier_)) {
+    delete context;
+    return nullptr;
+  }
+  ssl_client_context_ = context;
+  return ssl_client_context_;
+}
+
 X509* TaoProgramData::GetProgramCertificate() {
   return program_certificate_;
 }
@@ -260,6 +297,11 @@ bool TaoProgramData::InitTao(string& cipher_suite, FDMessageChannel* msg, Tao* t
     printf("Can't DER parse policy cert.\n");
     return false;
   }
+  cert_verifier_ = new X509VerifyContext();
+  if (!cert_verifier_->Init(policy_certificate_)) {
+    printf("Can't make policy cert trust store.\n");
+    return false;
+  }
 
   // Read host cert
   if (!ReadFile(host_cert_file_name_, &host_cert_)) {
@@ -379,18 +421,13 @@ bool TaoProgramData::RequestDomainServiceCert(string& request_string) {
     printf("RequestDomainServiceCert: Domain channel write failure.\n");
     return false;
   }
-  byte read_buf[BUFSIZE];
   string response_buf;
-  int bytes_read = 0;
-  while ((bytes_read = SslMessageRead(domainChannel.GetSslChannel(), BUFSIZE, read_buf))
-           == 0);
-  if (bytes_read <= 0) {
-    printf("RequestDomainServiceCert: Domain channel read failure (%d).\n", bytes_read);
+  if (!SslMessageRead(domainChannel.GetSslChannel(), &response_buf)) {
+    printf("RequestDomainServiceCert: Domain channel read failure.\n");
     return false;
   }
 
   // Get response and populate this with cert and cert chain.
-  response_buf.assign((const char*)read_buf, bytes_read);
   domain_policy::DomainCertResponse response;
   if (!response.ParseFromString(response_buf)) {
     printf("Domain channel parse failure.\n");
@@ -540,6 +577,10 @@ bool TaoProgramData::InitProgramKeys(tao_support::SavedProgramData* pd) {
     printf("Can't DER parse program cert.\n");
     return false;
   }
+  if (!cert_verifier_->Verify(program_cert_, &program_cert_chain_)) {
+    printf("Program cert doesn't verify against policy cert.\n");
+    return false;
+  }
 
   pd->set_crypto_suite(cipher_suite_);
   pd->set_file_path(program_path_);
@@ -658,8 +699,9 @@ bool TaoProgramData::GetProgramData() {
       printf("GetProgramData: no delegation\n");
   }
 
-  byte* pc = (byte*)program_data.program_cert().data();
-  program_certificate_ = d2i_X509(nullptr, (const byte**)&pc, program_data.program_cert().size());
+  program_cert_ = program_data.program_cert();
+  byte* pc = (byte*)program_cert_.data();
+  program_certificate_ = d2i_X509(nullptr, (const byte**)&pc, program_cert_.size());
   if (program_certificate_ == nullptr) {
     printf("Can't DER parse program cert.\n");
     return false;
@@ -669,6 +711,10 @@ bool TaoProgramData::GetProgramData() {
     string der_cert = program_data.signer_cert_chain(i);
     program_cert_chain_.push_back(der_cert);
   }
+  if (!cert_verifier_->Verify(program_cert_, &program_cert_chain_)) {
+    printf("GetProgramData: program cert doesn't verify against policy cert\n");
+    return false;
+  }
 
   return true;
 }
@@ -686,14 +732,14 @@ bool TaoChannel::OpenTaoChannel(TaoProgramData& client_program_data,
       return false;
   }
 
-  // Open TLS channel with Program cert.
-  string network("tcp");
-  if (!peer_channel_.InitClientSslChannel(network, serverAddress, port,
-                    client_program_data.GetPolicyCertificate(),
-                    client_program_data.GetProgramCertificate(),
-                    key_type,
-                    client_program_data.GetProgramKey(),
-                    SSL_SERVER_VERIFY_CLIENT_VERIFY)) {
+  // Open TLS channel with Program cert, resuming an earlier session
+  // with this server if there is one.
+  SslClientContext* context = client_program_data.GetSslClientContext();
+  if (context == nullptr) {
+    printf("OpenTaoChannel: Can't make Ssl client context.\n");
+    return false;
+  }
+  if (!peer_channel_.InitClientSslChannel(context, serverAddress, port)) {
     printf("OpenTaoChannel: Can't Init Ssl channel.\n");
     return false;
   }
@@ -714,6 +760,11 @@ bool TaoChannel::OpenTaoChannel(TaoProgramData& client_program_data,
 
 void TaoChannel::CloseTaoChannel() {
   peer_channel_.Close();
+  peerCertificate_ = nullptr;
+}
+
+bool TaoChannel::IsAlive() {
+  return peer_channel_.IsAlive();
 }
 
 bool TaoChannel::SendRequest(int size, byte* out) {
@@ -730,3 +781,54 @@ bool TaoChannel::GetRequest(int* size, byte* in) {
   *size = k;
   return true;
 }
+
+bool TaoChannel::SendRequest(string& out) {
+  return SslMessageWrite(peer_channel_.GetSslChannel(), out);
+}
+
+bool TaoChannel::GetRequest(string* in) {
+  if (!SslMessageRead(peer_channel_.GetSslChannel(), in)) {
+    printf("Can't read request channel.\n");
+    return false;
+  }
+  return true;
+}
+
+TaoChannelPool::TaoChannelPool(int max_per_peer, int idle_seconds)
+    : pool_(max_per_peer, idle_seconds) {
+}
+
+TaoChannel* TaoChannelPool::Acquire(TaoProgramData& client_program_data,
+                                    string& address, string& port) {
+  string policy_cert;
+  if (!client_program_data.GetPolicyCert(&policy_cert)) {
+    printf("TaoChannelPool::Acquire: No policy cert.\n");
+    return nullptr;
+  }
+  // A channel is authenticated as the program that opened it, so it may
+  // only be reused by the same program.
+  string program_cert;
+  client_program_data.GetProgramCert(&program_cert);
+  string key = address + ":" + port + ":" + policy_cert + ":" + program_cert;
+
+  return pool_.Acquire(key, [&]() {
+    TaoChannel* channel = new TaoChannel();
+    if (!channel->OpenTaoChannel(client_program_data, address, port)) {
+      delete channel;
+      return (TaoChannel*)nullptr;
+    }
+    return channel;
+  });
+}
+
+void TaoChannelPool::Release(TaoChannel* channel, bool reusable) {
+  pool_.Release(channel, reusable);
+}
+
+void TaoChannelPool::CloseIdle() {
+  pool_.CloseIdle();
+}
+
+void TaoChannelPool::GetStats(int* opened, int* reused) {
+  pool_.GetStats(opened, reused);
+}
@@ -21,6 +21,7 @@
 #include "tao/util.h"
 
 #include "agile_crypto_support.h"
+#include "channel_pool.h"
 
 #include "attestation.pb.h"
 
@@ -30,6 +31,7 @@
 
 #include <string>
 #include <list>
+#include <mutex>
 
 #ifndef byte
 typedef unsigned char byte;
@@ -74,6 +76,15 @@ private:
   X509* policy_certificate_;
   Verifier* policy_verifying_key_;
 
+  // Trust store holding the policy cert, and the chains it has verified.
+  X509VerifyContext* cert_verifier_;
+
+  // Client TLS context shared by this program's TaoChannels, made on first
+  // use.  TaoChannelPool opens channels from several threads at once, so it
+  // is made under ssl_client_context_mu_.
+  std::mutex ssl_client_context_mu_;
+  SslClientContext* ssl_client_context_;
+
   // host certificate.
   string host_cert_file_name_;
   string host_cert_;
@@ -126,6 +137,8 @@ public:
   void SetProgramCertificate(X509* c);
   X509* GetProgramCertificate();
   std::list<string>* GetProgramCertChain();
+  X509VerifyContext* GetCertVerifier();
+  SslClientContext* GetSslClientContext();
 
   bool InitCounter(string& label, int64_t& c);
   bool GetCounter(string& label, int64_t* c);
@@ -148,8 +161,41 @@ public:
   bool OpenTaoChannel(TaoProgramData& client_program_data,
                       string& serverAddress, string& port);
   void CloseTaoChannel();
+  bool IsAlive();
   bool SendRequest(int size, byte* out);
   bool GetRequest(int* size, byte* in);
+  // Messages of any size up to SSL_MESSAGE_MAX_SIZE.
+  bool SendRequest(string& out);
+  bool GetRequest(string* in);
   void Print();
 };
+
+#define TAO_CHANNEL_POOL_MAX_PER_PEER 8
+#define TAO_CHANNEL_POOL_IDLE_SECONDS 60
+
+// Keeps TaoChannels open for reuse; see ChannelPool.  Channels are kept
+// by server address and port and by the policy and program certs of the
+// program data that opened them.  The TaoProgramData passed to Acquire
+// must outlive the pool, and every channel must be released before the
+// pool is destroyed.
+class TaoChannelPool {
+private:
+  ChannelPool<TaoChannel> pool_;
+
+public:
+  TaoChannelPool(int max_per_peer = TAO_CHANNEL_POOL_MAX_PER_PEER,
+                 int idle_seconds = TAO_CHANNEL_POOL_IDLE_SECONDS);
+  TaoChannelPool(const TaoChannelPool&) = delete;
+  TaoChannelPool& operator=(const TaoChannelPool&) = delete;
+
+  // Returns an open channel to address:port, or nullptr if one can't be
+  // opened.
+  TaoChannel* Acquire(TaoProgramData& client_program_data, string& address,
+                      string& port);
+  // Returns channel to the pool.  Pass reusable = false if an exchange on
+  // it failed or was left unfinished; it is then closed.
+  void Release(TaoChannel* channel, bool reusable = true);
+  void CloseIdle();
+  void GetStats(int* opened, int* reused);
+};
 #endif
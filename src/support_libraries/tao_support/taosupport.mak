@@ -57,23 +57,65 @@ endif
 
 O= $(OBJ_DIR)
 dobj=	$(O)/taosupport_test.o $(O)/agile_crypto_support.o $(O)/keys.pb.o $(O)/attestation.pb.o \
-        $(O)/ssl_helpers.o  #$(O)/taosupport.o
+        $(O)/ssl_helpers.o $(O)/codec.o  #$(O)/taosupport.o
+bobj=	$(O)/aes_ctr_benchmark.o $(O)/ssl_helpers.o $(O)/codec.o $(O)/keys.pb.o $(O)/attestation.pb.o
+vobj=	$(O)/verify_batch_benchmark.o $(O)/agile_crypto_support.o $(O)/ssl_helpers.o $(O)/codec.o \
+        $(O)/keys.pb.o $(O)/attestation.pb.o
+pobj=	$(O)/parallel_protect_benchmark.o $(O)/agile_crypto_support.o $(O)/ssl_helpers.o $(O)/codec.o \
+        $(O)/keys.pb.o $(O)/attestation.pb.o
+kobj=	$(O)/derive_benchmark.o $(O)/agile_crypto_support.o $(O)/ssl_helpers.o $(O)/codec.o \
+        $(O)/keys.pb.o $(O)/attestation.pb.o
 
-all:	taosupport_test.exe
+all:	taosupport_test.exe aes_ctr_benchmark.exe verify_batch_benchmark.exe \
+	parallel_protect_benchmark.exe derive_benchmark.exe
 clean:
 	@echo "removing object files"
 	rm $(O)/*.o
 	@echo "removing executable file"
-	rm $(EXE_DIR)/taosupport_test.exe
+	rm $(EXE_DIR)/taosupport_test.exe $(EXE_DIR)/aes_ctr_benchmark.exe \
+	    $(EXE_DIR)/verify_batch_benchmark.exe $(EXE_DIR)/parallel_protect_benchmark.exe \
+	    $(EXE_DIR)/derive_benchmark.exe
 
 taosupport_test.exe: $(dobj) 
 	@echo "linking executable files"
 	$(LINK) -o $(EXE_DIR)/taosupport_test.exe $(dobj) $(LDFLAGS)
 
+aes_ctr_benchmark.exe: $(bobj) 
+	@echo "linking executable files"
+	$(LINK) -o $(EXE_DIR)/aes_ctr_benchmark.exe $(bobj) $(LDFLAGS)
+
+verify_batch_benchmark.exe: $(vobj) 
+	@echo "linking executable files"
+	$(LINK) -o $(EXE_DIR)/verify_batch_benchmark.exe $(vobj) $(LDFLAGS)
+
+parallel_protect_benchmark.exe: $(pobj) 
+	@echo "linking executable files"
+	$(LINK) -o $(EXE_DIR)/parallel_protect_benchmark.exe $(pobj) $(LDFLAGS)
+
+derive_benchmark.exe: $(kobj) 
+	@echo "linking executable files"
+	$(LINK) -o $(EXE_DIR)/derive_benchmark.exe $(kobj) $(LDFLAGS)
+
 $(O)/taosupport_test.o: $(ST)/taosupport_test.cc
 	@echo "compiling taosupport_test.cc"
 	$(CC) $(CFLAGS) -c -o $(O)/taosupport_test.o $(ST)/taosupport_test.cc
 
+$(O)/aes_ctr_benchmark.o: $(ST)/aes_ctr_benchmark.cc
+	@echo "compiling aes_ctr_benchmark.cc"
+	$(CC) $(CFLAGS) -c -o $(O)/aes_ctr_benchmark.o $(ST)/aes_ctr_benchmark.cc
+
+$(O)/verify_batch_benchmark.o: $(ST)/verify_batch_benchmark.cc
+	@echo "compiling verify_batch_benchmark.cc"
+	$(CC) $(CFLAGS) -c -o $(O)/verify_batch_benchmark.o $(ST)/verify_batch_benchmark.cc
+
+$(O)/parallel_protect_benchmark.o: $(ST)/parallel_protect_benchmark.cc
+	@echo "compiling parallel_protect_benchmark.cc"
+	$(CC) $(CFLAGS) -c -o $(O)/parallel_protect_benchmark.o $(ST)/parallel_protect_benchmark.cc
+
+$(O)/derive_benchmark.o: $(ST)/derive_benchmark.cc
+	@echo "compiling derive_benchmark.cc"
+	$(CC) $(CFLAGS) -c -o $(O)/derive_benchmark.o $(ST)/derive_benchmark.cc
+
 $(O)/agile_crypto_support.o: $(ST)/agile_crypto_support.cc
 	@echo "compiling agile_crypto_support.cc"
 	$(CC) $(CFLAGS) -c -o $(O)/agile_crypto_support.o $(ST)/agile_crypto_support.cc
@@ -82,6 +124,10 @@ $(O)/ssl_helpers.o: $(ST)/ssl_helpers.cc
 	@echo "compiling ssl_helpers.cc"
 	$(CC) $(CFLAGS) -c -o $(O)/ssl_helpers.o $(ST)/ssl_helpers.cc
 
+$(O)/codec.o: $(SRC_DIR)/tao/codec.cc
+	@echo "compiling codec.cc"
+	$(CC) $(CFLAGS) -c -o $(O)/codec.o $(SRC_DIR)/tao/codec.cc
+
 $(O)/keys.pb.o: $(SP)/keys.pb.cc
 	@echo "compiling keys.pb.cc"
 	$(CC) $(CFLAGS) -c -o $(O)/keys.pb.o $(SP)/keys.pb.cc
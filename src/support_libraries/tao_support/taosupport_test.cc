@@ -14,20 +14,30 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
 
 #include <string>
 
 #include <gtest/gtest.h>
 #include <gflags/gflags.h>
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <cmath>
+#include <thread>
+#include <vector>
 
 #include <ssl_helpers.h>
+#include <channel_pool.h>
 #include <agile_crypto_support.h>
+#include <openssl/aes.h>
 #include <openssl/rand.h> 
 
 using std::string;
+using std::thread;
 
 
 DEFINE_bool(printall, false, "printall flag");
@@ -89,6 +99,25 @@ TEST(SigningCryptingVerifying, all) {
     Verifier* v = VerifierFromSigner(s);
     EXPECT_TRUE(v != nullptr);
     EXPECT_TRUE(v->Verify(msg, sig));
+    if (i > 0) {
+      // Earlier builds signed p384 with SHA-512 and p521 with SHA-384.
+      byte digest[64];
+      int dig_len;
+      if (i == 1) {
+        SHA512((byte*)msg.data(), msg.size(), digest);
+        dig_len = 64;
+      } else {
+        SHA384((byte*)msg.data(), msg.size(), digest);
+        dig_len = 48;
+      }
+      ECDSA_SIG* legacy = ECDSA_do_sign(digest, dig_len, s->ec_key_);
+      string legacy_sig;
+      EXPECT_TRUE(legacy != nullptr && EC_SIG_serialize(legacy, &legacy_sig));
+      ECDSA_SIG_free(legacy);
+      EXPECT_TRUE(v->Verify(msg, legacy_sig));
+      string other("a different message");
+      EXPECT_FALSE(v->Verify(other, legacy_sig));
+    }
     tao::CryptoKey* ckS = SignerToCryptoKey(s);
     EXPECT_TRUE(ckS != nullptr);
     tao::CryptoKey* ckV = VerifierToCryptoKey(v);
@@ -155,6 +184,475 @@ TEST(Protect_Unprotect, all) {
   printf("\n");
 }
 
+TEST(CompactProtect, all) {
+  string types[2] = {"aes256-ctr-hmacsha384", "aes128-gcm"};
+
+  for (int i = 0; i < 2; i++) {
+    tao::CryptoKey ckCrypter;
+    EXPECT_TRUE(GenerateCryptoKey(types[i], &ckCrypter));
+    Crypter* c = CryptoKeyToCrypter(ckCrypter);
+    EXPECT_TRUE(c != nullptr);
+
+    string msg("compact record payload");
+    string encrypted;
+    string decrypted;
+    EXPECT_TRUE(ProtectCompact(*c, msg, &encrypted));
+    EXPECT_EQ(msg.size() + CompactProtectOverhead(*c), encrypted.size());
+    EXPECT_TRUE(UnprotectCompact(*c, encrypted, &decrypted));
+    EXPECT_TRUE(msg == decrypted);
+
+    // In place, in both directions.
+    int offset = CompactProtectOffset(*c);
+    byte buf[256];
+    int used = 0;
+    memcpy(buf + offset, msg.data(), msg.size());
+    EXPECT_TRUE(ProtectCompact(*c, msg.size(), buf + offset, sizeof(buf), buf,
+                               &used));
+    EXPECT_EQ((int)encrypted.size(), used);
+    byte* plain = nullptr;
+    int plain_size = 0;
+    EXPECT_TRUE(UnprotectCompactInPlace(*c, used, buf, &plain, &plain_size));
+    EXPECT_EQ(buf + offset, plain);
+    EXPECT_TRUE(msg == string((const char*)plain, plain_size));
+
+    // Tampering and a too-small buffer are caught.
+    encrypted[offset] ^= 1;
+    EXPECT_FALSE(UnprotectCompact(*c, encrypted, &decrypted));
+    byte small[4];
+    EXPECT_FALSE(ProtectCompact(*c, msg.size(), (byte*)msg.data(),
+                                sizeof(small), small, &used));
+
+    // The protobuf format can also be decrypted into a buffer.
+    EXPECT_TRUE(Protect(*c, msg, &encrypted));
+    EXPECT_TRUE(Unprotect(*c, encrypted, sizeof(buf), buf, &plain_size));
+    EXPECT_TRUE(msg == string((const char*)buf, plain_size));
+    delete c;
+  }
+}
+
+TEST(ChunkedProtect, all) {
+  string types[2] = {"aes128-ctr-hmacsha256", "aes256-gcm"};
+  int chunk = 1000;
+
+  for (int i = 0; i < 2; i++) {
+    tao::CryptoKey ckCrypter;
+    EXPECT_TRUE(GenerateCryptoKey(types[i], &ckCrypter));
+    Crypter* c = CryptoKeyToCrypter(ckCrypter);
+    EXPECT_TRUE(c != nullptr);
+    int overhead = c->IvSize() + c->MacSize();
+
+    int sizes[] = {0, 1, chunk, chunk + 1, 10 * chunk + 5};
+    for (int size : sizes) {
+      string msg(size, 0);
+      RAND_bytes((byte*)&msg[0], size);
+      string encrypted;
+      EXPECT_TRUE(ProtectChunked(*c, chunk, msg, &encrypted));
+      EXPECT_EQ(ChunkedProtectSize(*c, chunk, size), (int64_t)encrypted.size());
+      ChunkedUnprotector chunks;
+      EXPECT_TRUE(chunks.Init(c, encrypted.size(),
+                              (const byte*)encrypted.data()));
+      EXPECT_EQ(size, chunks.PlaintextSize());
+      string decrypted;
+      string piece;
+      for (int64_t j = 0; j < chunks.NumChunks(); j++) {
+        EXPECT_TRUE(chunks.DecryptChunk(j, &piece));
+        decrypted += piece;
+      }
+      EXPECT_TRUE(msg == decrypted);
+    }
+
+    // Random access, and tampering, reordering and truncation are caught.
+    string msg(10 * chunk + 5, 'c');
+    string encrypted;
+    EXPECT_TRUE(ProtectChunked(*c, chunk, msg, &encrypted));
+    ChunkedUnprotector chunks;
+    EXPECT_TRUE(chunks.Init(c, encrypted.size(), (const byte*)encrypted.data()));
+    string piece;
+    EXPECT_TRUE(chunks.DecryptChunk(7, &piece));
+    EXPECT_TRUE(msg.substr(7 * chunk, chunk) == piece);
+    EXPECT_TRUE(chunks.DecryptChunk(10, &piece));
+    EXPECT_EQ(5, (int)piece.size());
+    EXPECT_FALSE(chunks.DecryptChunk(11, &piece));
+
+    string swapped(encrypted);
+    int stride = chunk + overhead;
+    swapped.replace(CHUNKED_PROTECT_HEADER_SIZE, stride,
+                    encrypted, CHUNKED_PROTECT_HEADER_SIZE + stride, stride);
+    EXPECT_TRUE(chunks.Init(c, swapped.size(), (const byte*)swapped.data()));
+    EXPECT_FALSE(chunks.DecryptChunk(0, &piece));
+    EXPECT_TRUE(chunks.DecryptChunk(2, &piece));
+
+    string moved(encrypted);
+    string other;
+    EXPECT_TRUE(ProtectChunked(*c, chunk, msg, &other));
+    moved.replace(0, CHUNKED_PROTECT_HEADER_SIZE, other, 0,
+                  CHUNKED_PROTECT_HEADER_SIZE);
+    EXPECT_TRUE(chunks.Init(c, moved.size(), (const byte*)moved.data()));
+    EXPECT_FALSE(chunks.DecryptChunk(3, &piece));
+
+    EXPECT_FALSE(chunks.Init(c, encrypted.size() - stride,
+                             (const byte*)encrypted.data()));
+
+    // Files, read through a mapping.
+    string plain_file("chunked_plain");
+    string protected_file("chunked_protected");
+    string out_file("chunked_out");
+    EXPECT_TRUE(WriteFile(plain_file, msg));
+    EXPECT_TRUE(ProtectChunkedFile(*c, chunk, plain_file, protected_file));
+    EXPECT_TRUE(UnprotectChunkedFile(*c, protected_file, out_file));
+    string out;
+    EXPECT_TRUE(ReadFile(out_file, &out));
+    EXPECT_TRUE(msg == out);
+    EXPECT_TRUE(chunks.OpenFile(c, protected_file));
+    EXPECT_TRUE(chunks.DecryptChunk(4, &piece));
+    EXPECT_TRUE(msg.substr(4 * chunk, chunk) == piece);
+    chunks.Close();
+
+    // In place, and a failed unprotect leaves nothing behind.
+    EXPECT_TRUE(ProtectChunkedFile(*c, chunk, plain_file, plain_file));
+    EXPECT_TRUE(ReadFile(plain_file, &out));
+    out[CHUNKED_PROTECT_HEADER_SIZE + 1] ^= 1;
+    EXPECT_TRUE(WriteFile(plain_file, out));
+    unlink(out_file.c_str());
+    EXPECT_FALSE(UnprotectChunkedFile(*c, plain_file, out_file));
+    EXPECT_NE(0, access(out_file.c_str(), F_OK));
+    unlink(plain_file.c_str());
+    unlink(protected_file.c_str());
+    unlink(out_file.c_str());
+    delete c;
+  }
+}
+
+TEST(ParallelProtect, all) {
+  string types[2] = {"aes256-ctr-hmacsha384", "aes128-gcm"};
+
+  for (int i = 0; i < 2; i++) {
+    tao::CryptoKey ckCrypter;
+    EXPECT_TRUE(GenerateCryptoKey(types[i], &ckCrypter));
+    Crypter* c = CryptoKeyToCrypter(ckCrypter);
+    EXPECT_TRUE(c != nullptr);
+
+    string msg(3 * PARALLEL_PROTECT_SEGMENT + 17, 0);
+    RAND_bytes((byte*)&msg[0], msg.size());
+    string encrypted;
+    string decrypted;
+    EXPECT_TRUE(ParallelProtect(*c, msg, &encrypted, 4));
+    EXPECT_TRUE(ParallelUnprotect(*c, encrypted, &decrypted, 4));
+    EXPECT_TRUE(msg == decrypted);
+
+    // Small segments, and the serial and parallel forms interoperate.
+    int segment = 4096;
+    std::vector<byte> out(ChunkedProtectSize(*c, segment, msg.size()));
+    EXPECT_TRUE(ParallelProtect(*c, msg.size(), (const byte*)msg.data(),
+                                out.size(), out.data(), 3, segment));
+    ChunkedUnprotector chunks;
+    EXPECT_TRUE(chunks.Init(c, out.size(), out.data()));
+    string piece;
+    EXPECT_TRUE(chunks.DecryptChunk(chunks.NumChunks() - 1, &piece));
+    EXPECT_TRUE(msg.substr(msg.size() - piece.size()) == piece);
+    EXPECT_TRUE(ProtectChunked(*c, segment, msg, &encrypted));
+    EXPECT_TRUE(ParallelUnprotect(*c, encrypted, &decrypted, 0));
+    EXPECT_TRUE(msg == decrypted);
+
+    // One bad segment fails the whole payload and leaves no plaintext.
+    std::vector<byte> plain(msg.size());
+    int64_t plain_size = 0;
+    out[out.size() / 2] ^= 1;
+    EXPECT_FALSE(ParallelUnprotect(*c, out.size(), out.data(), plain.size(),
+                                   plain.data(), &plain_size, 3));
+    EXPECT_TRUE(std::all_of(plain.begin(), plain.end(),
+                            [](byte b) { return b == 0; }));
+    delete c;
+  }
+}
+
+TEST(AeadProtect_Unprotect, all) {
+  extern string Basic128BitAeadCipherSuite;
+  extern string Basic256BitAeadCipherSuite;
+  string suites[2] = {Basic128BitAeadCipherSuite, Basic256BitAeadCipherSuite};
+
+  for (int i = 0; i < 2; i++) {
+    string type;
+    EXPECT_TRUE(CrypterAlgorithmNameFromCipherSuite(suites[i], &type));
+    tao::CryptoKey ckCrypter;
+    EXPECT_TRUE(GenerateCryptoKey(type, &ckCrypter));
+    EXPECT_EQ(1, ckCrypter.key_components_size());
+
+    Crypter* c = CryptoKeyToCrypter(ckCrypter);
+    EXPECT_TRUE(c != nullptr);
+    string msg(100000, 'm');
+    string encrypted;
+    string decrypted;
+    EXPECT_TRUE(Protect(*c, msg, &encrypted));
+    EXPECT_TRUE(Unprotect(*c, encrypted, &decrypted));
+    EXPECT_TRUE(msg == decrypted);
+
+    // The key survives a round trip through CryptoKey.
+    tao::CryptoKey* ck = CrypterToCryptoKey(c);
+    EXPECT_TRUE(ck != nullptr);
+    Crypter* c2 = CryptoKeyToCrypter(*ck);
+    EXPECT_TRUE(c2 != nullptr);
+    EXPECT_TRUE(Unprotect(*c2, encrypted, &decrypted));
+    EXPECT_TRUE(msg == decrypted);
+
+    string iv, mac, ciphertext;
+    EXPECT_TRUE(c->Encrypt(msg, &iv, &mac, &ciphertext));
+    ciphertext[msg.size() / 2] ^= 1;
+    EXPECT_FALSE(c->Decrypt(ciphertext, iv, mac, &decrypted));
+    delete ck;
+    delete c2;
+    delete c;
+  }
+}
+
+static string Hex(const string& in) {
+  string* h = ByteToHexLeftToRight(in.size(), (byte*)in.data());
+  string out(*h);
+  delete h;
+  return out;
+}
+
+TEST(Deriver, all) {
+  // RFC 5869, test cases 1 and 3.
+  tao::CryptoHeader ch;
+  ch.set_key_type("hdkf-sha256");
+  string secret(22, 0x0b);
+  Deriver d;
+  d.ch_ = &ch;
+  d.secret_bytes_ = &secret;
+
+  string salt;
+  string context;
+  for (int i = 0; i <= 0x0c; i++)
+    salt.push_back((char)i);
+  for (int i = 0xf0; i <= 0xf9; i++)
+    context.push_back((char)i);
+  string material(42, 0);
+  string out;
+  EXPECT_TRUE(d.Derive(salt, context, material, &out));
+  EXPECT_EQ(string("3cb25f25faacd57a90434f64d0362f2a2d2d0a90cf1a5a4c5db02d56"
+                   "ecc4c5bf34007208d5b887185865"), Hex(out));
+  string empty;
+  EXPECT_TRUE(d.Derive(empty, empty, material, &out));
+  EXPECT_EQ(string("8da4e775a563c18f715f802a063c5a31b8a11f5c5ee1879ec3454e5f"
+                   "3c738d2d9d201395faa4b61a96c8"), Hex(out));
+
+  // DeriveMany matches Derive, after switching back to the first salt.
+  std::vector<string> contexts;
+  for (int i = 0; i < 5; i++)
+    contexts.push_back("tenant " + std::to_string(i));
+  std::vector<string> keys;
+  EXPECT_TRUE(d.DeriveMany(salt, contexts, 32, &keys));
+  EXPECT_EQ(5, (int)keys.size());
+  string key_size(32, 0);
+  for (int i = 0; i < 5; i++) {
+    EXPECT_TRUE(d.Derive(salt, contexts[i], key_size, &out));
+    EXPECT_TRUE(out == keys[i]);
+  }
+  EXPECT_TRUE(keys[0] != keys[1]);
+
+  // A new secret takes effect after InitKeyState.
+  string other_secret(22, 0x0c);
+  d.secret_bytes_ = &other_secret;
+  EXPECT_TRUE(d.InitKeyState());
+  EXPECT_TRUE(d.Derive(salt, contexts[0], key_size, &out));
+  EXPECT_TRUE(out != keys[0]);
+
+  string too_long(255 * 32 + 1, 0);
+  EXPECT_FALSE(d.Derive(salt, context, too_long, &out));
+  ch.set_key_type("hdkf-md5");
+  EXPECT_FALSE(d.InitKeyState());
+}
+
+TEST(CrypterThreads, all) {
+  string type("aes256-ctr-hmacsha384");
+  tao::CryptoKey ckCrypter;
+
+  EXPECT_TRUE(GenerateCryptoKey(type, &ckCrypter));
+  Crypter* c = CryptoKeyToCrypter(ckCrypter);
+  EXPECT_TRUE(c != nullptr);
+
+  // One Crypter, used from several threads at once.
+  InitOpenSslThreading();
+  bool ok[4];
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([c, t, &ok]() {
+      ok[t] = true;
+      for (int i = 0; i < 200; i++) {
+        string msg(i * 7 + t, (char)('a' + t));
+        string iv, mac, encrypted, decrypted;
+        ok[t] = ok[t] && c->Encrypt(msg, &iv, &mac, &encrypted) &&
+                c->Decrypt(encrypted, iv, mac, &decrypted) && msg == decrypted;
+      }
+    });
+  }
+  for (std::thread& t : threads)
+    t.join();
+  for (int t = 0; t < 4; t++)
+    EXPECT_TRUE(ok[t]);
+
+  // A modified ciphertext is rejected.
+  string msg("0123456789abcdef0123");
+  string iv, mac, encrypted, decrypted;
+  EXPECT_TRUE(c->Encrypt(msg, &iv, &mac, &encrypted));
+  encrypted[3] ^= 1;
+  EXPECT_FALSE(c->Decrypt(encrypted, iv, mac, &decrypted));
+  delete c;
+}
+
+TEST(SignerNoncePool, all) {
+  string s_types[3] = {
+    "ecdsap256",
+    "ecdsap384",
+    "ecdsap521",
+  };
+
+  for (int i = 0; i < 3; i++) {
+    tao::CryptoKey ckSigner;
+    EXPECT_TRUE(GenerateCryptoKey(s_types[i], &ckSigner));
+    Signer* s = CryptoKeyToSigner(ckSigner);
+    EXPECT_TRUE(s != nullptr);
+    Verifier* v = VerifierFromSigner(s);
+    EXPECT_TRUE(v != nullptr);
+    EXPECT_TRUE(s->EnableNoncePool(8));
+
+    // More signatures than pooled nonces, so some come from refills and
+    // some from the fallback.
+    bool ok[4];
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([s, v, t, &ok]() {
+        ok[t] = true;
+        for (int j = 0; j < 50; j++) {
+          string msg(j + 1, (char)('a' + t));
+          string sig;
+          ok[t] = ok[t] && s->Sign(msg, &sig) && v->Verify(msg, sig);
+          msg[0] ^= 1;
+          ok[t] = ok[t] && !v->Verify(msg, sig);
+        }
+      });
+    }
+    for (std::thread& t : threads)
+      t.join();
+    for (int t = 0; t < 4; t++)
+      EXPECT_TRUE(ok[t]);
+
+    // A forked child signs without the parent's nonces, and can drop the
+    // pool even though it has no refiller.
+    pid_t pid = fork();
+    if (pid == 0) {
+      string msg("child");
+      string sig;
+      bool child_ok = s->Sign(msg, &sig) && v->Verify(msg, sig);
+      delete s;
+      _exit(child_ok ? 0 : 1);
+    }
+    int status = -1;
+    EXPECT_EQ(pid, waitpid(pid, &status, 0));
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    delete v;
+    delete s;
+  }
+}
+
+TEST(VerifyBatch, all) {
+  string type("ecdsap256");
+  tao::CryptoKey ckSigner;
+  EXPECT_TRUE(GenerateCryptoKey(type, &ckSigner));
+  Signer* s = CryptoKeyToSigner(ckSigner);
+  EXPECT_TRUE(s != nullptr);
+  Verifier* v = VerifierFromSigner(s);
+  EXPECT_TRUE(v != nullptr);
+
+  int n = 100;
+  std::vector<string> msgs(n);
+  std::vector<string> sigs(n);
+  std::vector<VerifyBatchItem> items(n);
+  for (int i = 0; i < n; i++) {
+    msgs[i] = string(i + 1, 'm');
+    EXPECT_TRUE(s->Sign(msgs[i], &sigs[i]));
+    items[i].verifier_ = v;
+    items[i].msg_ = &msgs[i];
+    items[i].sig_ = &sigs[i];
+  }
+  std::vector<bool> results;
+  EXPECT_TRUE(VerifyBatch(items, &results, 4));
+  EXPECT_EQ(n, (int)results.size());
+
+  // Only the altered items fail.
+  msgs[17][0] ^= 1;
+  items[42].verifier_ = nullptr;
+  EXPECT_FALSE(VerifyBatch(items, &results, 0));
+  for (int i = 0; i < n; i++)
+    EXPECT_EQ(i != 17 && i != 42, (bool)results[i]);
+  delete v;
+  delete s;
+}
+
+// Keystream as computed by the original AesCtrCrypt: one AES_encrypt of
+// the byte-reversed 128-bit counter per block.
+static void ReferenceAesCtr(byte* iv, int key_size_bits, byte* key, int size,
+                            byte* in, byte* out) {
+  AES_KEY ectx;
+  byte ctr[16];
+  byte block[16];
+
+  AES_set_encrypt_key(key, key_size_bits, &ectx);
+  memcpy(ctr, iv, 16);
+  for (int i = 0; i < size; i += 16) {
+    byte reversed[16];
+    for (int j = 0; j < 16; j++)
+      reversed[j] = ctr[15 - j];
+    AES_encrypt(reversed, block, &ectx);
+    for (int j = 0; j < 16 && i + j < size; j++)
+      out[i + j] = in[i + j] ^ block[j];
+    for (int j = 15; j >= 0 && ++ctr[j] == 0; j--)
+      ;
+  }
+}
+
+TEST(AesCtr, all) {
+  byte key[32];
+  byte iv_bytes[16];
+  byte in[1000];
+  byte expected[1000];
+  byte out[1001];
+
+  RAND_bytes(key, sizeof(key));
+  RAND_bytes(in, sizeof(in));
+  // Make the low half of the counter wrap within the message.
+  memset(iv_bytes, 0xff, sizeof(iv_bytes));
+  iv_bytes[0] = 0x12;
+  iv_bytes[15] = 0xfd;
+  string iv((const char*)iv_bytes, sizeof(iv_bytes));
+
+  int sizes[] = {0, 1, 15, 16, 17, 127, 128, 129, 255, 1000};
+  for (int key_size_bits : {128, 256}) {
+    for (int size : sizes) {
+      ReferenceAesCtr(iv_bytes, key_size_bits, key, size, in, expected);
+      out[size] = 0xa5;
+      EXPECT_TRUE(AesCtrCrypt(iv, key_size_bits, key, size, in, out));
+      EXPECT_EQ(0, memcmp(expected, out, size));
+      // Nothing past the end is written.
+      EXPECT_EQ(0xa5, out[size]);
+    }
+
+    // Pieces of odd sizes, in place, give the same result.
+    ReferenceAesCtr(iv_bytes, key_size_bits, key, sizeof(in), in, expected);
+    memcpy(out, in, sizeof(in));
+    AesCtr ctr;
+    EXPECT_TRUE(ctr.Init(key_size_bits, key, sizeof(iv_bytes), iv_bytes));
+    int done = 0;
+    for (int piece = 1; done < (int)sizeof(in); piece += 37) {
+      int n = std::min(piece, (int)sizeof(in) - done);
+      EXPECT_TRUE(ctr.Crypt(n, out + done, out + done));
+      done += n;
+    }
+    EXPECT_EQ(0, memcmp(expected, out, sizeof(in)));
+  }
+}
+
 TEST(Certs, all) {
   tao::CryptoKey ckSigner;
   string type("ecdsap256");
@@ -207,6 +705,449 @@ TEST(Certs, all) {
   printf("\n");
 }
 
+// A cert for subject_key, signed by signing_key as issuer.
+static X509* MakeTestCert(Signer* signing_key, string& issuer,
+                          Signer* subject_key, string& subject, bool is_ca) {
+  X509_REQ* req = X509_REQ_new();
+  string keyUsage("");
+  string extendedKeyUsage("");
+  X509* cert = X509_new();
+  if (!GenerateX509CertificateRequest(subject_key->sk_, subject, false, req) ||
+      !SignX509Certificate(signing_key->sk_, is_ca, is_ca, issuer, keyUsage,
+                           extendedKeyUsage, int64_t(365 * 86400),
+                           subject_key->sk_, req, false, cert)) {
+    X509_free(cert);
+    cert = nullptr;
+  }
+  X509_REQ_free(req);
+  return cert;
+}
+
+TEST(X509VerifyContext, all) {
+  string type("ecdsap256");
+  tao::CryptoKey ckPolicy;
+  tao::CryptoKey ckProgram;
+  EXPECT_TRUE(GenerateCryptoKey(type, &ckPolicy));
+  EXPECT_TRUE(GenerateCryptoKey(type, &ckProgram));
+  Signer* policy_key = CryptoKeyToSigner(ckPolicy);
+  Signer* program_key = CryptoKeyToSigner(ckProgram);
+  EXPECT_TRUE(policy_key != nullptr && program_key != nullptr);
+
+  string policy_name("policy");
+  string program_name("program");
+  X509* policy_cert = MakeTestCert(policy_key, policy_name, policy_key,
+                                   policy_name, true);
+  X509* program_cert = MakeTestCert(policy_key, policy_name, program_key,
+                                    program_name, false);
+  X509* self_signed = MakeTestCert(program_key, program_name, program_key,
+                                   program_name, true);
+  EXPECT_TRUE(policy_cert != nullptr && program_cert != nullptr &&
+              self_signed != nullptr);
+
+  X509VerifyContext verifier(2);
+  EXPECT_TRUE(verifier.Init(policy_cert));
+  EXPECT_TRUE(verifier.Verify(program_cert, nullptr));
+  EXPECT_TRUE(verifier.Verify(program_cert, nullptr));
+  EXPECT_FALSE(verifier.Verify(self_signed, nullptr));
+  EXPECT_FALSE(verifier.Verify(self_signed, nullptr));
+  int hits, misses;
+  verifier.GetCacheStats(&hits, &misses);
+  EXPECT_EQ(1, hits);
+  EXPECT_EQ(3, misses);
+
+  // The DER form shares the cache.
+  int len = i2d_X509(program_cert, nullptr);
+  string der(len, 0);
+  byte* p = (byte*)der.data();
+  i2d_X509(program_cert, &p);
+  EXPECT_TRUE(verifier.Verify(der, nullptr));
+  verifier.GetCacheStats(&hits, &misses);
+  EXPECT_EQ(2, hits);
+
+  verifier.ClearCache();
+  EXPECT_TRUE(verifier.Verify(program_cert, nullptr));
+  verifier.GetCacheStats(&hits, &misses);
+  EXPECT_EQ(4, misses);
+
+  // An SSL_CTX whose store trusts another cert must not be handed a chain
+  // cached by the policy cert's store.
+  SSL_library_init();
+  SSL_CTX* other_ctx = SSL_CTX_new(TLSv1_2_client_method());
+  EXPECT_TRUE(other_ctx != nullptr);
+  EXPECT_EQ(1, X509_STORE_add_cert(SSL_CTX_get_cert_store(other_ctx),
+                                   self_signed));
+  verifier.AttachToSslCtx(other_ctx);
+  X509_STORE_CTX* store_ctx = X509_STORE_CTX_new();
+  EXPECT_EQ(1, X509_STORE_CTX_init(store_ctx, SSL_CTX_get_cert_store(other_ctx),
+                                   program_cert, nullptr));
+  EXPECT_NE(1, other_ctx->app_verify_callback(store_ctx,
+                                              other_ctx->app_verify_arg));
+  X509_STORE_CTX_free(store_ctx);
+  SSL_CTX_free(other_ctx);
+
+  EXPECT_TRUE(VerifyX509CertificateChain(policy_cert, program_cert));
+  EXPECT_FALSE(VerifyX509CertificateChain(policy_cert, self_signed));
+
+  X509_free(policy_cert);
+  X509_free(program_cert);
+  X509_free(self_signed);
+  delete policy_key;
+  delete program_key;
+}
+
+static void EchoHandler(SslChannel* channel, SSL* ssl, int fd) {
+  byte buf[1024];
+  int n = SslMessageRead(ssl, sizeof(buf), buf);
+  if (n > 0)
+    SslMessageWrite(ssl, n, buf);
+  SSL_free(ssl);
+  close(fd);
+}
+
+TEST(ConcurrentServerLoop, all) {
+  string type("ecdsap256");
+  tao::CryptoKey ckPolicy;
+  tao::CryptoKey ckProgram;
+  EXPECT_TRUE(GenerateCryptoKey(type, &ckPolicy));
+  EXPECT_TRUE(GenerateCryptoKey(type, &ckProgram));
+  Signer* policy_key = CryptoKeyToSigner(ckPolicy);
+  Signer* program_key = CryptoKeyToSigner(ckProgram);
+  string policy_name("policy");
+  string program_name("program");
+  X509* policy_cert = MakeTestCert(policy_key, policy_name, policy_key,
+                                   policy_name, true);
+  X509* program_cert = MakeTestCert(policy_key, policy_name, program_key,
+                                    program_name, false);
+  X509VerifyContext verifier;
+  EXPECT_TRUE(verifier.Init(policy_cert));
+
+  string network("tcp");
+  string address("127.0.0.1");
+  string port("0");
+  SslChannel server;
+  server.SetCertVerifier(&verifier);
+  EXPECT_TRUE(server.InitServerSslChannel(network, address, port, policy_cert,
+                                          program_cert, type,
+                                          program_key->sk_));
+  // Bound to any free port; clients connect to the one it got.
+  port = std::to_string(server.GetPort());
+  thread loop([&server]() { server.ConcurrentServerLoop(EchoHandler, 2, 2); });
+
+  // More clients than workers, all at once.
+  bool ok[8];
+  std::vector<thread> clients;
+  for (int c = 0; c < 8; c++) {
+    clients.emplace_back([&, c]() {
+      SslChannel client;
+      client.SetCertVerifier(&verifier);
+      string msg(c + 10, (char)('a' + c));
+      byte buf[1024];
+      ok[c] = client.InitClientSslChannel(network, address, port, policy_cert,
+                                          program_cert, type,
+                                          program_key->sk_) &&
+              SslMessageWrite(client.GetSslChannel(), msg.size(),
+                              (byte*)msg.data()) > 0 &&
+              SslMessageRead(client.GetSslChannel(), sizeof(buf), buf) ==
+                  (int)msg.size() &&
+              memcmp(buf, msg.data(), msg.size()) == 0;
+    });
+  }
+  for (thread& t : clients)
+    t.join();
+  for (int c = 0; c < 8; c++)
+    EXPECT_TRUE(ok[c]);
+  int hits, misses;
+  verifier.GetCacheStats(&hits, &misses);
+  EXPECT_GT(hits, 0);
+  // The TLS checks had an SSL purpose and depth, so a plain Verify of the
+  // same chain is not found in the cache.
+  int tls_misses = misses;
+  EXPECT_TRUE(verifier.Verify(program_cert, nullptr));
+  verifier.GetCacheStats(&hits, &misses);
+  EXPECT_EQ(tls_misses + 1, misses);
+
+  server.StopServerLoop();
+  loop.join();
+  X509_free(policy_cert);
+  X509_free(program_cert);
+}
+
+TEST(SslSessionResumption, all) {
+  string type("ecdsap256");
+  tao::CryptoKey ckPolicy;
+  tao::CryptoKey ckProgram;
+  EXPECT_TRUE(GenerateCryptoKey(type, &ckPolicy));
+  EXPECT_TRUE(GenerateCryptoKey(type, &ckProgram));
+  Signer* policy_key = CryptoKeyToSigner(ckPolicy);
+  Signer* program_key = CryptoKeyToSigner(ckProgram);
+  string policy_name("policy");
+  string program_name("program");
+  X509* policy_cert = MakeTestCert(policy_key, policy_name, policy_key,
+                                   policy_name, true);
+  X509* program_cert = MakeTestCert(policy_key, policy_name, program_key,
+                                    program_name, false);
+
+  string network("tcp");
+  string address("127.0.0.1");
+  string port("0");
+  SslChannel server;
+  EXPECT_TRUE(server.InitServerSslChannel(network, address, port, policy_cert,
+                                          program_cert, type,
+                                          program_key->sk_));
+  port = std::to_string(server.GetPort());
+  thread loop([&server]() { server.ConcurrentServerLoop(EchoHandler, 2, 2); });
+
+  SslClientContext context;
+  EXPECT_TRUE(context.Init(policy_cert, program_cert, program_key->sk_));
+  for (int i = 0; i < 3; i++) {
+    SslChannel client;
+    EXPECT_TRUE(client.InitClientSslChannel(&context, address, port));
+    // Only the first connection does a full handshake.
+    EXPECT_EQ(i > 0, client.SessionReused());
+    EXPECT_TRUE(client.GetPeerCert() != nullptr);
+    string msg("resumed");
+    byte buf[64];
+    EXPECT_TRUE(SslMessageWrite(client.GetSslChannel(), msg.size(),
+                                (byte*)msg.data()) > 0);
+    EXPECT_EQ((int)msg.size(),
+              SslMessageRead(client.GetSslChannel(), sizeof(buf), buf));
+    // EchoHandler closes the connection after one message.
+    for (int w = 0; w < 200 && client.IsAlive(); w++)
+      usleep(10000);
+    EXPECT_FALSE(client.IsAlive());
+    client.Close();
+  }
+
+  server.StopServerLoop();
+  loop.join();
+  X509_free(policy_cert);
+  X509_free(program_cert);
+}
+
+// Echoes messages until the client closes.
+static void StringEchoHandler(SslChannel* channel, SSL* ssl, int fd) {
+  string msg;
+  while (SslMessageRead(ssl, &msg) && SslMessageWrite(ssl, msg))
+    ;
+  SSL_free(ssl);
+  close(fd);
+}
+
+// Drives a non-blocking SslMessageWriter and SslMessageReader together, as
+// an event loop would, so that neither side fills its socket buffer.
+static bool NonBlockingEcho(SSL* ssl, string& msg, string* reply) {
+  int fd = SSL_get_fd(ssl);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  SslMessageWriter writer;
+  SslMessageReader reader;
+  if (!writer.Start(msg.size(), (const byte*)msg.data()))
+    return false;
+  int w = SSL_MESSAGE_WANT_WRITE;
+  int r = SSL_MESSAGE_WANT_READ;
+  while (r != SSL_MESSAGE_DONE) {
+    if (w != SSL_MESSAGE_DONE)
+      w = writer.Write(ssl);
+    r = reader.Read(ssl, reply);
+    if (w == SSL_MESSAGE_ERROR || r == SSL_MESSAGE_ERROR)
+      return false;
+    if (r != SSL_MESSAGE_DONE) {
+      struct pollfd p;
+      p.fd = fd;
+      p.events = POLLIN;
+      if (w == SSL_MESSAGE_WANT_WRITE || r == SSL_MESSAGE_WANT_WRITE)
+        p.events |= POLLOUT;
+      if (poll(&p, 1, 10000) <= 0)
+        return false;
+    }
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  return w == SSL_MESSAGE_DONE;
+}
+
+TEST(LargeMessages, all) {
+  string type("ecdsap256");
+  tao::CryptoKey ckPolicy;
+  tao::CryptoKey ckProgram;
+  EXPECT_TRUE(GenerateCryptoKey(type, &ckPolicy));
+  EXPECT_TRUE(GenerateCryptoKey(type, &ckProgram));
+  Signer* policy_key = CryptoKeyToSigner(ckPolicy);
+  Signer* program_key = CryptoKeyToSigner(ckProgram);
+  string policy_name("policy");
+  string program_name("program");
+  X509* policy_cert = MakeTestCert(policy_key, policy_name, policy_key,
+                                   policy_name, true);
+  X509* program_cert = MakeTestCert(policy_key, policy_name, program_key,
+                                    program_name, false);
+
+  string network("tcp");
+  string address("127.0.0.1");
+  string port("0");
+  SslChannel server;
+  EXPECT_TRUE(server.InitServerSslChannel(network, address, port, policy_cert,
+                                          program_cert, type,
+                                          program_key->sk_));
+  port = std::to_string(server.GetPort());
+  thread loop([&server]() {
+    server.ConcurrentServerLoop(StringEchoHandler, 2, 2);
+  });
+
+  SslClientContext context;
+  EXPECT_TRUE(context.Init(policy_cert, program_cert, program_key->sk_));
+  SslChannel client;
+  EXPECT_TRUE(client.InitClientSslChannel(&context, address, port));
+  SSL* ssl = client.GetSslChannel();
+  EXPECT_TRUE(client.IsAlive());
+
+  // Empty, smaller than one record, just over one record, and several MB.
+  int sizes[] = {0, 100, SSL_MESSAGE_FIRST_RECORD - SSL_MESSAGE_HEADER_SIZE + 1,
+                 3 * 1024 * 1024 + 7};
+  for (int size : sizes) {
+    string msg(size, 0);
+    RAND_bytes((byte*)&msg[0], size);
+    string reply;
+    EXPECT_TRUE(SslMessageWrite(ssl, msg));
+    EXPECT_TRUE(SslMessageRead(ssl, &reply));
+    EXPECT_TRUE(reply == msg);
+  }
+
+  // The buffer forms reject a message that does not fit, but skip it, so
+  // the next one is read.
+  string big(8192, 'x');
+  string after("after");
+  byte small[1024];
+  EXPECT_EQ((int)big.size(), SslMessageWrite(ssl, big.size(), (byte*)big.data()));
+  EXPECT_EQ(-1, SslMessageRead(ssl, sizeof(small), small));
+  EXPECT_TRUE(SslMessageWrite(ssl, after));
+  EXPECT_EQ((int)after.size(), SslMessageRead(ssl, sizeof(small), small));
+  EXPECT_EQ(0, memcmp(small, after.data(), after.size()));
+  client.Close();
+
+  SslChannel nb_client;
+  EXPECT_TRUE(nb_client.InitClientSslChannel(&context, address, port));
+  string msg(8 * 1024 * 1024, 0);
+  RAND_bytes((byte*)&msg[0], msg.size());
+  string reply;
+  EXPECT_TRUE(NonBlockingEcho(nb_client.GetSslChannel(), msg, &reply));
+  EXPECT_TRUE(reply == msg);
+  nb_client.Close();
+
+  server.StopServerLoop();
+  loop.join();
+  X509_free(policy_cert);
+  X509_free(program_cert);
+}
+
+static bool PoolEcho(SslChannel* channel, const char* text) {
+  string msg(text);
+  string reply;
+  return SslMessageWrite(channel->GetSslChannel(), msg) &&
+         SslMessageRead(channel->GetSslChannel(), &reply) && reply == msg;
+}
+
+TEST(ChannelPool, all) {
+  string type("ecdsap256");
+  tao::CryptoKey ckPolicy;
+  tao::CryptoKey ckProgram;
+  EXPECT_TRUE(GenerateCryptoKey(type, &ckPolicy));
+  EXPECT_TRUE(GenerateCryptoKey(type, &ckProgram));
+  Signer* policy_key = CryptoKeyToSigner(ckPolicy);
+  Signer* program_key = CryptoKeyToSigner(ckProgram);
+  string policy_name("policy");
+  string program_name("program");
+  X509* policy_cert = MakeTestCert(policy_key, policy_name, policy_key,
+                                   policy_name, true);
+  X509* program_cert = MakeTestCert(policy_key, policy_name, program_key,
+                                    program_name, false);
+
+  string network("tcp");
+  string address("127.0.0.1");
+  string port("0");
+  SslChannel server;
+  EXPECT_TRUE(server.InitServerSslChannel(network, address, port, policy_cert,
+                                          program_cert, type,
+                                          program_key->sk_));
+  port = std::to_string(server.GetPort());
+  thread loop([&server]() {
+    server.ConcurrentServerLoop(StringEchoHandler, 4, 4);
+  });
+
+  SslClientContext context;
+  EXPECT_TRUE(context.Init(policy_cert, program_cert, program_key->sk_));
+  auto open = [&]() {
+    SslChannel* channel = new SslChannel();
+    if (!channel->InitClientSslChannel(&context, address, port)) {
+      delete channel;
+      return (SslChannel*)nullptr;
+    }
+    return channel;
+  };
+  string key("server");
+  string other_key("other client");
+  int opened, reused;
+
+  // One channel per key, closed after a second idle.
+  ChannelPool<SslChannel> pool(1, 1);
+  SslChannel* first = pool.Acquire(key, open);
+  ASSERT_TRUE(first != nullptr);
+  EXPECT_TRUE(PoolEcho(first, "first"));
+  pool.Release(first);
+
+  // A released channel is reused.
+  SslChannel* second = pool.Acquire(key, open);
+  EXPECT_TRUE(second == first);
+  EXPECT_TRUE(PoolEcho(second, "second"));
+  pool.GetStats(&opened, &reused);
+  EXPECT_EQ(1, opened);
+  EXPECT_EQ(1, reused);
+
+  // Another key gets its own channel without waiting.
+  SslChannel* other = pool.Acquire(other_key, open);
+  ASSERT_TRUE(other != nullptr);
+  EXPECT_TRUE(other != second);
+  EXPECT_TRUE(PoolEcho(other, "other"));
+  pool.Release(other);
+
+  // At the limit, Acquire waits for a Release.
+  std::atomic<bool> acquired(false);
+  SslChannel* third = nullptr;
+  thread waiter([&]() {
+    third = pool.Acquire(key, open);
+    acquired = true;
+  });
+  usleep(200000);
+  EXPECT_FALSE(acquired);
+  pool.Release(second);
+  waiter.join();
+  EXPECT_TRUE(third == first);
+  EXPECT_TRUE(PoolEcho(third, "third"));
+
+  // A channel released as unusable is closed, not reused.
+  pool.Release(third, false);
+  SslChannel* fourth = pool.Acquire(key, open);
+  ASSERT_TRUE(fourth != nullptr);
+  EXPECT_TRUE(PoolEcho(fourth, "fourth"));
+  pool.GetStats(&opened, &reused);
+  EXPECT_EQ(3, opened);
+  EXPECT_EQ(2, reused);
+
+  // An expired idle channel is closed, and a new one opened.
+  pool.Release(fourth);
+  usleep(1500000);
+  SslChannel* fifth = pool.Acquire(key, open);
+  ASSERT_TRUE(fifth != nullptr);
+  EXPECT_TRUE(PoolEcho(fifth, "fifth"));
+  pool.Release(fifth);
+  pool.GetStats(&opened, &reused);
+  EXPECT_EQ(4, opened);
+  EXPECT_EQ(2, reused);
+
+  pool.CloseIdle();
+  server.StopServerLoop();
+  loop.join();
+  X509_free(policy_cert);
+  X509_free(program_cert);
+}
+
 TEST(KeyBytes, all) {
   tao::CryptoKey ckSigner;
   string type("ecdsap256");
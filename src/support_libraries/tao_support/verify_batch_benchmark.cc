@@ -0,0 +1,102 @@
+//
+// Copyright 2015 Google Corporation, All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//     http://www.apache.org/licenses/LICENSE-2.0
+// or in the the file LICENSE-2.0.txt in the top level sourcedirectory
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License
+//
+// File: verify_batch_benchmark.cc
+// Measures VerifyBatch throughput as the number of threads grows.
+
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include <agile_crypto_support.h>
+
+using std::string;
+using std::vector;
+
+DEFINE_string(key_type, "ecdsap256", "signing key type");
+DEFINE_int32(batch_size, 4096, "signatures per batch");
+DEFINE_int32(batches, 4, "batches to verify for each thread count");
+DEFINE_int32(max_threads, 0, "largest thread count, 0 for one per core");
+DEFINE_int32(message_size, 256, "bytes per signed message");
+
+int main(int an, char** av) {
+#ifdef __linux__
+  gflags::ParseCommandLineFlags(&an, &av, true);
+#else
+  google::ParseCommandLineFlags(&an, &av, true);
+#endif
+  tao::CryptoKey ck;
+  if (!GenerateCryptoKey(FLAGS_key_type, &ck)) {
+    printf("Can't generate a %s key\n", FLAGS_key_type.c_str());
+    return 1;
+  }
+  Signer* s = CryptoKeyToSigner(ck);
+  Verifier* v = s == nullptr ? nullptr : VerifierFromSigner(s);
+  if (v == nullptr) {
+    printf("Can't make a signer and verifier\n");
+    return 1;
+  }
+
+  int n = FLAGS_batch_size;
+  vector<string> msgs(n);
+  vector<string> sigs(n);
+  vector<VerifyBatchItem> items(n);
+  for (int i = 0; i < n; i++) {
+    msgs[i].assign(FLAGS_message_size, (char)i);
+    msgs[i].append((const char*)&i, sizeof(i));
+    if (!s->Sign(msgs[i], &sigs[i])) {
+      printf("Sign failed\n");
+      return 1;
+    }
+    items[i].verifier_ = v;
+    items[i].msg_ = &msgs[i];
+    items[i].sig_ = &sigs[i];
+  }
+
+  int max_threads = FLAGS_max_threads;
+  if (max_threads <= 0)
+    max_threads = std::thread::hardware_concurrency();
+  // 1, 2, 4, ... and max_threads itself.
+  vector<int> thread_counts;
+  for (int t = 1; t < max_threads; t *= 2)
+    thread_counts.push_back(t);
+  thread_counts.push_back(max_threads);
+
+  printf("%8s %16s %8s\n", "threads", "verifies/sec", "speedup");
+  double one_thread = 0.0;
+  vector<bool> results;
+  for (int threads : thread_counts) {
+    auto start = std::chrono::steady_clock::now();
+    for (int b = 0; b < FLAGS_batches; b++) {
+      if (!VerifyBatch(items, &results, threads)) {
+        printf("VerifyBatch failed\n");
+        return 1;
+      }
+    }
+    double secs = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    double rate = (double)n * FLAGS_batches / secs;
+    if (threads == 1)
+      one_thread = rate;
+    printf("%8d %16.0f %7.2fx\n", threads, rate, rate / one_thread);
+  }
+  delete v;
+  delete s;
+  return 0;
+}
@@ -0,0 +1,192 @@
+//  File: codec.cc
+//
+//  Description: Table-driven hex and web-safe base64 encoding and decoding.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "tao/codec.h"
+
+#include <string.h>
+
+using std::string;
+
+namespace tao {
+// The two hex digits of each byte value, so that encoding is one 2-byte copy
+// per byte.
+static const char HexPairs[] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+// The value of each hex digit, or 0xff. Decoding ORs the values together and
+// checks the high bits once at the end, instead of branching per character.
+static const uint8_t HexValues[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+static const char Base64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// The value of each web-safe base64 character, or 0xff.
+static const uint8_t Base64Values[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0x3f,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+void HexEncode(const uint8_t *in, size_t size, char *out) {
+  for (size_t i = 0; i < size; i++) {
+    memcpy(out + 2 * i, HexPairs + 2 * in[i], 2);
+  }
+}
+
+bool HexDecode(const char *in, size_t len, uint8_t *out) {
+  if (len % 2) return false;
+  const uint8_t *digits = reinterpret_cast<const uint8_t *>(in);
+  uint8_t bad = 0;
+  for (size_t i = 0; i < len / 2; i++) {
+    uint8_t high = HexValues[digits[2 * i]];
+    uint8_t low = HexValues[digits[2 * i + 1]];
+    bad |= high | low;
+    out[i] = static_cast<uint8_t>((high << 4) | (low & 0xf));
+  }
+  return (bad & 0xf0) == 0;
+}
+
+string HexEncode(const string &in) {
+  string out(HexEncodedSize(in.size()), 0);
+  HexEncode(reinterpret_cast<const uint8_t *>(in.data()), in.size(), &out[0]);
+  return out;
+}
+
+bool HexDecode(const string &in, string *out) {
+  if (in.size() % 2) return false;
+  string bytes(in.size() / 2, 0);
+  if (!HexDecode(in.data(), in.size(), reinterpret_cast<uint8_t *>(&bytes[0])))
+    return false;
+  out->swap(bytes);
+  return true;
+}
+
+int64_t Base64DecodedSize(const char *in, size_t len) {
+  if (len % 4) return -1;
+  int64_t size = len / 4 * 3;
+  if (len > 0 && in[len - 1] == '=') size--;
+  if (len > 0 && in[len - 2] == '=') size--;
+  return size;
+}
+
+void Base64Encode(const uint8_t *in, size_t size, char *out) {
+  size_t i = 0;
+  for (; i + 3 <= size; i += 3, out += 4) {
+    uint32_t v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+    out[0] = Base64Chars[v >> 18];
+    out[1] = Base64Chars[(v >> 12) & 0x3f];
+    out[2] = Base64Chars[(v >> 6) & 0x3f];
+    out[3] = Base64Chars[v & 0x3f];
+  }
+  size_t rest = size - i;
+  if (rest == 0) return;
+  uint32_t v = (in[i] << 16) | (rest == 2 ? in[i + 1] << 8 : 0);
+  out[0] = Base64Chars[v >> 18];
+  out[1] = Base64Chars[(v >> 12) & 0x3f];
+  out[2] = rest == 2 ? Base64Chars[(v >> 6) & 0x3f] : '=';
+  out[3] = '=';
+}
+
+bool Base64Decode(const char *in, size_t len, uint8_t *out) {
+  if (len % 4) return false;
+  if (len == 0) return true;
+  const uint8_t *chars = reinterpret_cast<const uint8_t *>(in);
+  uint8_t bad = 0;
+  // Every group but the last has no padding.
+  size_t groups = len / 4 - 1;
+  for (size_t g = 0; g < groups; g++, chars += 4, out += 3) {
+    uint8_t a = Base64Values[chars[0]];
+    uint8_t b = Base64Values[chars[1]];
+    uint8_t c = Base64Values[chars[2]];
+    uint8_t d = Base64Values[chars[3]];
+    bad |= a | b | c | d;
+    uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+    out[0] = static_cast<uint8_t>(v >> 16);
+    out[1] = static_cast<uint8_t>(v >> 8);
+    out[2] = static_cast<uint8_t>(v);
+  }
+
+  // "xx==", "xxx=" or "xxxx".
+  int pad = (chars[3] == '=') + (chars[2] == '=');
+  if (chars[2] == '=' && chars[3] != '=') return false;
+  uint8_t a = Base64Values[chars[0]];
+  uint8_t b = Base64Values[chars[1]];
+  uint8_t c = pad == 2 ? 0 : Base64Values[chars[2]];
+  uint8_t d = pad >= 1 ? 0 : Base64Values[chars[3]];
+  bad |= a | b | c | d;
+  uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+  out[0] = static_cast<uint8_t>(v >> 16);
+  if (pad < 2) out[1] = static_cast<uint8_t>(v >> 8);
+  if (pad < 1) out[2] = static_cast<uint8_t>(v);
+  return (bad & 0xc0) == 0;
+}
+
+string Base64Encode(const string &in) {
+  string out(Base64EncodedSize(in.size()), 0);
+  Base64Encode(reinterpret_cast<const uint8_t *>(in.data()), in.size(),
+               &out[0]);
+  return out;
+}
+
+bool Base64Decode(const string &in, string *out) {
+  int64_t size = Base64DecodedSize(in.data(), in.size());
+  if (size < 0) return false;
+  string bytes(size, 0);
+  if (!Base64Decode(in.data(), in.size(),
+                    reinterpret_cast<uint8_t *>(&bytes[0])))
+    return false;
+  out->swap(bytes);
+  return true;
+}
+}  // namespace tao
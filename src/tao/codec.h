@@ -0,0 +1,91 @@
+//  File: codec.h
+//
+//  Description: Table-driven hex and web-safe base64 encoding and decoding.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TAO_CODEC_H_
+#define TAO_CODEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+/// This file depends only on the standard library, so that the tpm2 and
+/// tao_support code can build it without the rest of the tao library.
+namespace tao {
+/// Get the number of characters in the hex encoding of size bytes.
+inline size_t HexEncodedSize(size_t size) { return 2 * size; }
+
+/// Encode bytes as lowercase hex, high nibble first.
+/// @param in The bytes to encode.
+/// @param size The number of bytes.
+/// @param[out] out A buffer for exactly HexEncodedSize(size) characters. No
+/// terminating NUL is written.
+void HexEncode(const uint8_t *in, size_t size, char *out);
+
+/// Decode hex, in either case.
+/// @param in The hex characters.
+/// @param len The number of characters, which must be even.
+/// @param[out] out A buffer for exactly len / 2 bytes. Its contents are
+/// undefined if decoding fails.
+/// @return false if len is odd or any character is not a hex digit.
+bool HexDecode(const char *in, size_t len, uint8_t *out);
+
+/// Encode a string of bytes as lowercase hex.
+/// @param in The bytes to encode.
+std::string HexEncode(const std::string &in);
+
+/// Decode hex into a string of bytes.
+/// @param in The hex characters.
+/// @param[out] out The decoded bytes.
+bool HexDecode(const std::string &in, std::string *out);
+
+/// Get the number of characters in the padded base64 encoding of size bytes.
+inline size_t Base64EncodedSize(size_t size) { return (size + 2) / 3 * 4; }
+
+/// Get the number of bytes a padded base64 encoding decodes to.
+/// @param in The base64 characters. Only the trailing padding is examined.
+/// @param len The number of characters.
+/// @return The decoded size, or -1 if len is not a multiple of 4.
+int64_t Base64DecodedSize(const char *in, size_t len);
+
+/// Encode bytes as web-safe base64 (RFC 4648 section 5, with '-' and '_'),
+/// padded with '=' to a multiple of 4 characters.
+/// @param in The bytes to encode.
+/// @param size The number of bytes.
+/// @param[out] out A buffer for exactly Base64EncodedSize(size) characters.
+/// No terminating NUL is written.
+void Base64Encode(const uint8_t *in, size_t size, char *out);
+
+/// Decode padded web-safe base64.
+/// @param in The base64 characters.
+/// @param len The number of characters, a multiple of 4.
+/// @param[out] out A buffer for exactly Base64DecodedSize(in, len) bytes. Its
+/// contents are undefined if decoding fails.
+/// @return false if the length, a character or the padding is invalid.
+bool Base64Decode(const char *in, size_t len, uint8_t *out);
+
+/// Encode a string of bytes as padded web-safe base64.
+/// @param in The bytes to encode.
+std::string Base64Encode(const std::string &in);
+
+/// Decode padded web-safe base64 into a string of bytes.
+/// @param in The base64 characters.
+/// @param[out] out The decoded bytes.
+bool Base64Decode(const std::string &in, std::string *out);
+}  // namespace tao
+
+#endif  // TAO_CODEC_H_
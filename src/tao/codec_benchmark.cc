@@ -0,0 +1,244 @@
+//  File: codec_benchmark.cc
+//
+//  Description: Checks the table-driven hex and base64 codec against known
+//  answers and compares its speed with the byte-at-a-time routines it
+//  replaced.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <string>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "tao/codec.h"
+#include "tao/util.h"
+
+DEFINE_int32(bytes_per_size, 64 * 1024 * 1024,
+             "Approximate number of bytes to encode for each input size");
+
+using std::string;
+using std::stringstream;
+
+using tao::Base64Decode;
+using tao::Base64Encode;
+using tao::HexDecode;
+using tao::HexEncode;
+using tao::InitializeApp;
+
+// The original bytesToHex from util.cc.
+static string LegacyBytesToHex(const string &s) {
+  stringstream out;
+  string hex = "0123456789abcdef";
+  for (auto &c : s) out << hex[(c >> 4) & 0xf] << hex[(c >> 0) & 0xf];
+  return out.str();
+}
+
+// The original ValueToHex/HexToValue loops from conversions.cc and
+// ssl_helpers.cc.
+static char LegacyValueToHex(uint8_t x) {
+  if (x <= 9) {
+    return x + '0';
+  } else if (x >= 10 && x <= 15) {
+    return x - 10 + 'a';
+  } else {
+    return ' ';
+  }
+}
+
+static uint8_t LegacyHexToValue(char x) {
+  if (x >= '0' && x <= '9') {
+    return x - '0';
+  } else if (x >= 'a' && x <= 'f') {
+    return x + 10 - 'a';
+  } else {
+    return 0;
+  }
+}
+
+static string LegacyHexEncode(const string &in) {
+  string out(2 * in.size(), 0);
+  for (size_t i = 0; i < in.size(); i++) {
+    out[2 * i] = LegacyValueToHex(static_cast<uint8_t>(in[i]) >> 4);
+    out[2 * i + 1] = LegacyValueToHex(static_cast<uint8_t>(in[i]) & 0xf);
+  }
+  return out;
+}
+
+static string LegacyHexDecode(const string &in) {
+  string out(in.size() / 2, 0);
+  for (size_t i = 0; i < out.size(); i++)
+    out[i] = (LegacyHexToValue(in[2 * i]) << 4) | LegacyHexToValue(in[2 * i + 1]);
+  return out;
+}
+
+// The original ThreeBytesToBase64 encoding from conversions.cc, with the
+// output sized exactly so that it can be compared.
+static const char LegacyBase64Order[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static void LegacyThreeBytesToBase64(uint8_t a, uint8_t b, uint8_t c,
+                                     char *out) {
+  out[0] = LegacyBase64Order[(a >> 2) & 0x3f];
+  out[1] = LegacyBase64Order[((a << 4) & 0x3f) | (b >> 4)];
+  out[2] = LegacyBase64Order[((b << 2) & 0x3f) | (c >> 6)];
+  out[3] = LegacyBase64Order[c & 0x3f];
+}
+
+static string LegacyBase64Encode(const string &s) {
+  string out(tao::Base64EncodedSize(s.size()), 0);
+  const uint8_t *in = reinterpret_cast<const uint8_t *>(s.data());
+  size_t size = s.size();
+  char *str = &out[0];
+  for (; size >= 3; in += 3, str += 4, size -= 3)
+    LegacyThreeBytesToBase64(in[0], in[1], in[2], str);
+  if (size == 2) {
+    str[0] = LegacyBase64Order[in[0] >> 2];
+    str[1] = LegacyBase64Order[((in[0] << 4) & 0x3f) | (in[1] >> 4)];
+    str[2] = LegacyBase64Order[(in[1] << 2) & 0x3f];
+    str[3] = '=';
+  } else if (size == 1) {
+    str[0] = LegacyBase64Order[in[0] >> 2];
+    str[1] = LegacyBase64Order[(in[0] & 0x3) << 4];
+    str[2] = '=';
+    str[3] = '=';
+  }
+  return out;
+}
+
+// The original Base64CharValue decoding from conversions.cc.
+static uint8_t LegacyBase64CharValue(char a) {
+  if (a >= 'A' && a <= 'Z') {
+    return a - 'A';
+  } else if (a >= 'a' && a <= 'z') {
+    return a - 'a' + 26;
+  } else if (a >= '0' && a <= '9') {
+    return a - '0' + 52;
+  } else if (a == '-') {
+    return 62;
+  } else if (a == '_') {
+    return 63;
+  } else {
+    return 0xff;
+  }
+}
+
+static string LegacyBase64Decode(const string &in) {
+  string out;
+  for (size_t i = 0; i + 4 <= in.size(); i += 4) {
+    uint8_t x = LegacyBase64CharValue(in[i]);
+    uint8_t y = LegacyBase64CharValue(in[i + 1]);
+    out.push_back((x << 2) | (y >> 4));
+    if (in[i + 2] == '=') break;
+    x = LegacyBase64CharValue(in[i + 2]);
+    out.push_back((y << 4) | (x >> 2));
+    if (in[i + 3] == '=') break;
+    y = LegacyBase64CharValue(in[i + 3]);
+    out.push_back((x << 6) | y);
+  }
+  return out;
+}
+
+// Runs f over size-byte inputs and returns MB of input per second.
+static double Measure(size_t size, const std::function<void()> &f) {
+  int iterations = FLAGS_bytes_per_size / size;
+  if (iterations < 4) iterations = 4;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) f();
+  double secs = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+  return static_cast<double>(size) * iterations / secs / 1e6;
+}
+
+static void Report(const char *label, size_t size, double legacy,
+                   double current) {
+  printf("%-16s %8zu %12.1f %12.1f %7.1fx\n", label, size, legacy, current,
+         current / legacy);
+}
+
+// Checks both codecs against RFC 4648 section 10, plus bytes that use the
+// web-safe characters.
+static void CheckKnownAnswers() {
+  const char *vectors[][2] = {
+      {"", ""},
+      {"f", "Zg=="},
+      {"fo", "Zm8="},
+      {"foo", "Zm9v"},
+      {"foob", "Zm9vYg=="},
+      {"fooba", "Zm9vYmE="},
+      {"foobar", "Zm9vYmFy"},
+      {"\xfb\xff", "-_8="},
+      {"\xfb\xef\xbe", "----"},
+      {"\xff\xff\xff", "____"},
+  };
+  for (auto &v : vectors) {
+    string bytes = v[0], b64 = v[1], out;
+    CHECK_EQ(b64, Base64Encode(bytes));
+    CHECK_EQ(b64, LegacyBase64Encode(bytes));
+    CHECK_EQ(b64, LegacyBase64Encode(bytes));
+    CHECK(Base64Decode(b64, &out) && out == bytes);
+    CHECK_EQ(bytes, LegacyBase64Decode(b64));
+  }
+}
+
+int main(int argc, char **argv) {
+  InitializeApp(&argc, &argv, true);
+  CheckKnownAnswers();
+
+  printf("%-16s %8s %12s %12s %8s\n", "operation", "size", "legacy MB/s",
+         "codec MB/s", "speedup");
+  // Principal names and keys, quotes, and bulk data.
+  for (size_t size : {32, 256, 4096, 1024 * 1024}) {
+    string bytes(size, 0);
+    for (size_t i = 0; i < size; i++) bytes[i] = static_cast<char>(i * 131 + 7);
+    string hex = HexEncode(bytes);
+    string b64 = Base64Encode(bytes);
+    string out;
+    CHECK_EQ(hex, LegacyBytesToHex(bytes));
+    CHECK_EQ(hex, LegacyHexEncode(bytes));
+    CHECK(HexDecode(hex, &out) && out == bytes);
+    CHECK_EQ(b64, LegacyBase64Encode(bytes));
+    CHECK(Base64Decode(b64, &out) && out == bytes);
+    CHECK_EQ(bytes, LegacyBase64Decode(b64));
+
+    volatile size_t sink = 0;
+    Report("bytesToHex", size,
+           Measure(size, [&]() { sink += LegacyBytesToHex(bytes).size(); }),
+           Measure(size, [&]() { sink += HexEncode(bytes).size(); }));
+    Report("hex encode", size,
+           Measure(size, [&]() { sink += LegacyHexEncode(bytes).size(); }),
+           Measure(size, [&]() { sink += HexEncode(bytes).size(); }));
+    Report("hex decode", size,
+           Measure(size, [&]() { sink += LegacyHexDecode(hex).size(); }),
+           Measure(size, [&]() {
+             HexDecode(hex, &out);
+             sink += out.size();
+           }));
+    Report("base64 encode", size,
+           Measure(size, [&]() { sink += LegacyBase64Encode(bytes).size(); }),
+           Measure(size, [&]() { sink += Base64Encode(bytes).size(); }));
+    Report("base64 decode", size,
+           Measure(size, [&]() { sink += LegacyBase64Decode(b64).size(); }),
+           Measure(size, [&]() {
+             Base64Decode(b64, &out);
+             sink += out.size();
+           }));
+  }
+  return 0;
+}
@@ -19,16 +19,23 @@
 #include "tao/fd_message_channel.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <list>
 #include <string>
+#include <vector>
 
 #include <glog/logging.h>
 
 #include "tao/util.h"
 
 namespace tao {
+constexpr size_t FDMessageChannel::DefaultReadAheadSize;
 
 void FDMessageChannel::FDClose() {
   if (readfd_ != -1) {
@@ -38,6 +45,7 @@ void FDMessageChannel::FDClose() {
     close(writefd_);
   }
   readfd_ = writefd_ = -1;
+  read_pos_ = read_end_ = 0;
 }
 
 bool FDMessageChannel::SendData(const void *buffer, size_t buffer_len) {
@@ -59,6 +67,63 @@ bool FDMessageChannel::SendData(const void *buffer, size_t buffer_len) {
   return true;
 }
 
+bool FDMessageChannel::SendString(const string &s) {
+  return SendStrings(std::vector<const string *>(1, &s));
+}
+
+bool FDMessageChannel::SendStrings(const std::vector<const string *> &strs) {
+  if (IsClosed()) {
+    LOG(ERROR) << "Could not send data, channel already closed";
+    return false;
+  }
+  // Each string is framed by its length, so it takes two iovecs.
+  std::vector<uint32_t> net_lens(strs.size());
+  std::vector<struct iovec> iov(2 * strs.size());
+  for (size_t i = 0; i < strs.size(); i++) {
+    net_lens[i] = htonl(strs[i]->size());
+    iov[2 * i].iov_base = &net_lens[i];
+    iov[2 * i].iov_len = sizeof(net_lens[i]);
+    iov[2 * i + 1].iov_base = const_cast<char *>(strs[i]->data());
+    iov[2 * i + 1].iov_len = strs[i]->size();
+  }
+  struct iovec *next = iov.data();
+  size_t remaining = iov.size();
+  while (remaining > 0) {
+    int count = static_cast<int>(std::min<size_t>(remaining, IOV_MAX));
+    ssize_t bytes_written = writev(writefd_, next, count);
+    if (bytes_written < 0 && errno == EINTR) {
+      continue;
+    } else if (bytes_written <= 0) {
+      PLOG(ERROR) << "Could not send data";
+      Close();
+      return false;
+    }
+    // Skip past whatever was written, which may end mid-iovec.
+    size_t written = static_cast<size_t>(bytes_written);
+    while (remaining > 0 && written >= next->iov_len) {
+      written -= next->iov_len;
+      next++;
+      remaining--;
+    }
+    if (written > 0) {
+      next->iov_base = reinterpret_cast<char *>(next->iov_base) + written;
+      next->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+bool FDMessageChannel::EnableReadAhead(size_t size) {
+  if (HasBufferedData()) {
+    LOG(ERROR) << "Can't resize the read-ahead buffer while it holds data";
+    return false;
+  }
+  read_ahead_size_ = size;
+  read_buf_.reset(size > 0 ? new char[size] : nullptr);
+  read_pos_ = read_end_ = 0;
+  return true;
+}
+
 bool FDMessageChannel::ReceivePartialData(void *buffer, size_t max_recv_len,
                                           size_t *recv_len, bool *eof) {
   if (IsClosed()) {
@@ -68,6 +133,28 @@ bool FDMessageChannel::ReceivePartialData(void *buffer, size_t max_recv_len,
   } else {
     *eof = false;
   }
+  if (!HasBufferedData() && read_ahead_size_ > max_recv_len) {
+    // Refill the read-ahead buffer. Larger reads bypass it to avoid a copy.
+    int in_len = read(readfd_, read_buf_.get(), read_ahead_size_);
+    if (in_len == 0) {
+      *eof = true;
+      Close();
+      return true;
+    } else if (in_len < 0) {
+      PLOG(ERROR) << "Failed to read data from file descriptor";
+      Close();
+      return false;
+    }
+    read_pos_ = 0;
+    read_end_ = in_len;
+  }
+  if (HasBufferedData()) {
+    size_t len = std::min(max_recv_len, read_end_ - read_pos_);
+    memcpy(buffer, read_buf_.get() + read_pos_, len);
+    read_pos_ += len;
+    *recv_len = len;
+    return true;
+  }
   int in_len =
       read(readfd_, reinterpret_cast<unsigned char *>(buffer), max_recv_len);
   if (in_len == 0) {
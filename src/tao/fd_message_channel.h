@@ -21,6 +21,7 @@
 
 #include <list>
 #include <string>
+#include <vector>
 
 #include "tao/message_channel.h"
 
@@ -31,13 +32,22 @@ namespace tao {
 /// file descriptors. One file descriptor is used for sending messages, the
 /// other for receiving messages. The descriptors can be the same. On Close() or
 /// object destruction the file descriptors will be closed.
+///
+/// Each outgoing string, or group of strings sent with SendStrings() or
+/// SendMessages(), is written with a single writev() call. Incoming data can
+/// optionally be read ahead into a buffer, so that several small frames are
+/// parsed from each read() call. See EnableReadAhead().
 class FDMessageChannel : public MessageChannel {
  public:
   /// Construct FDMessageChannel.
   /// @param readfd The file descriptor to use for receiving messages.
   /// @param writefd The file descriptor to use for sending messages.
   FDMessageChannel(int readfd, int writefd)
-      : readfd_(readfd), writefd_(writefd) {}
+      : readfd_(readfd),
+        writefd_(writefd),
+        read_ahead_size_(0),
+        read_pos_(0),
+        read_end_(0) {}
 
   virtual ~FDMessageChannel() { FDClose(); }
 
@@ -46,9 +56,25 @@ class FDMessageChannel : public MessageChannel {
   virtual void Close() { FDClose(); }
   virtual bool IsClosed() const { return (readfd_ < 0 || writefd_ < 0); }
   virtual bool SendData(const void *buffer, size_t buffer_len);
+  virtual bool SendString(const string &s);
+  virtual bool SendStrings(const std::vector<const string *> &strs);
   virtual bool SerializeToString(string *params) const;
   /// @}
 
+  /// Read incoming data ahead into a buffer. Reads shorter than the buffer are
+  /// then served from it, and a single read() can pick up several frames.
+  /// Because buffered data is invisible to select() on the read descriptor and
+  /// is not carried across SerializeToString(), read-ahead is off by default.
+  /// @param size The size of the read-ahead buffer, or 0 to disable read-ahead.
+  /// Read-ahead can only be disabled once the buffer has been drained.
+  bool EnableReadAhead(size_t size = DefaultReadAheadSize);
+
+  /// Check whether received data is waiting in the read-ahead buffer.
+  bool HasBufferedData() const { return read_pos_ < read_end_; }
+
+  /// The default size of the read-ahead buffer.
+  static constexpr size_t DefaultReadAheadSize = 64 * 1024;
+
   /// Attempt to deserialize a channel.
   /// @param params Channel parameters from SerializeToString().
   static FDMessageChannel *DeserializeFromString(const string &params);
@@ -70,6 +96,15 @@ class FDMessageChannel : public MessageChannel {
   /// File descriptor for reading from host Tao.
   int writefd_;
 
+  /// The size of the read-ahead buffer, or 0 if read-ahead is disabled.
+  size_t read_ahead_size_;
+
+  /// The read-ahead buffer.
+  unique_ptr<char[]> read_buf_;
+
+  /// The start and end of unconsumed data in read_buf_.
+  size_t read_pos_, read_end_;
+
   /// These methods have the same semantics as MessageChannel.
   /// @{
   virtual bool ReceivePartialData(void *buffer, size_t max_recv_len,
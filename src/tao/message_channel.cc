@@ -23,28 +23,68 @@
 
 #include <list>
 #include <string>
+#include <vector>
+
+#include <algorithm>
 
 #include <glog/logging.h>
+#include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/message.h>
 
 #include "tao/util.h"
 
+using google::protobuf::io::CodedOutputStream;
+
 namespace tao {
 constexpr size_t MessageChannel::DefaultMaxMessageSize;
+constexpr size_t MessageChannelInputStream::DefaultBufferSize;
+constexpr size_t MessageChannelOutputStream::DefaultBufferSize;
 
 bool MessageChannel::SendString(const string &s) {
   uint32_t net_len = htonl(s.size());
   return SendData(&net_len, sizeof(net_len)) && SendData(s.c_str(), s.size());
 }
 
+bool MessageChannel::SendStrings(const std::vector<const string *> &strs) {
+  for (const string *s : strs) {
+    if (!SendString(*s)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 bool MessageChannel::SendMessage(const google::protobuf::Message &m) {
-  string serialized;
-  if (!m.SerializeToString(&serialized)) {
-    LOG(ERROR) << "Could not serialize the Message to a string";
-    Close();  // Not really necessary, but simplifies semantics.
+  return SendMessages(std::vector<const google::protobuf::Message *>(1, &m));
+}
+
+bool MessageChannel::SendMessages(
+    const std::vector<const google::protobuf::Message *> &msgs) {
+  if (IsClosed()) {
+    LOG(ERROR) << "Could not send data, channel already closed";
+    return false;
+  }
+  // Serialize each Message, framed by its length, straight into the stream.
+  MessageChannelOutputStream out(this);
+  {
+    CodedOutputStream coded(&out);
+    for (const google::protobuf::Message *m : msgs) {
+      size_t len = m->ByteSizeLong();
+      if (!m->IsInitialized() || len > UINT32_MAX) {
+        LOG(ERROR) << "Could not serialize the Message";
+        Close();  // Not really necessary, but simplifies semantics.
+        return false;
+      }
+      uint32_t net_len = htonl(static_cast<uint32_t>(len));
+      coded.WriteRaw(&net_len, sizeof(net_len));
+      m->SerializeWithCachedSizes(&coded);
+    }
+  }
+  if (!out.Flush()) {
+    LOG(ERROR) << "Could not send the Message";
     return false;
   }
-  return SendString(serialized);
+  return true;
 }
 
 bool MessageChannel::ReceiveData(void *buffer, size_t buffer_len, bool *eof) {
@@ -88,24 +128,37 @@ bool MessageChannel::ReceiveString(string *s, bool *eof) {
     Close();
     return false;
   }
-  unique_ptr<char[]> temp_data(new char[len]);
-  if (!ReceiveData(temp_data.get(), static_cast<size_t>(len), eof) || *eof) {
+  s->resize(len);
+  if (!ReceiveData(str2char(s), static_cast<size_t>(len), eof) || *eof) {
     LOG(ERROR) << "Could not get the data";
+    s->clear();
     return false;
   }
-  s->assign(temp_data.get(), len);
   return true;
 }
 
 bool MessageChannel::ReceiveMessage(google::protobuf::Message *m, bool *eof) {
-  string s;
-  if (!ReceiveString(&s, eof)) {
-    LOG(ERROR) << "Could not receive message";
+  uint32_t net_len;
+  if (!ReceiveData(&net_len, sizeof(net_len), eof)) {
+    LOG(ERROR) << "Could not get the length of the data";
     return false;
   } else if (*eof) {
     return true;
   }
-  if (!m->ParseFromString(s)) {
+  uint32_t len = ntohl(net_len);
+  if (len > MaxMessageSize()) {
+    LOG(ERROR) << "Message exceeded maximum allowable size";
+    Close();
+    return false;
+  }
+  // Parse the Message as it arrives, rather than receiving it into a string.
+  MessageChannelInputStream in(this, len);
+  bool parsed = m->ParseFromZeroCopyStream(&in);
+  if (in.Failed()) {
+    LOG(ERROR) << "Could not get the data";
+    Close();
+    return false;
+  } else if (!parsed || !in.AtLimit()) {
     LOG(ERROR) << "Could not parse message";
     Close();
     return false;
@@ -113,4 +166,110 @@ bool MessageChannel::ReceiveMessage(google::protobuf::Message *m, bool *eof) {
   return true;
 }
 
+MessageChannelInputStream::MessageChannelInputStream(MessageChannel *channel,
+                                                     size_t limit,
+                                                     size_t buffer_size)
+    : channel_(channel),
+      remaining_(limit),
+      byte_count_(0),
+      buffer_size_(std::min(limit, buffer_size)),
+      pos_(0),
+      end_(0),
+      failed_(false) {}
+
+bool MessageChannelInputStream::Next(const void **data, int *size) {
+  if (pos_ == end_) {
+    if (remaining_ == 0 || failed_) {
+      return false;
+    }
+    if (buffer_.get() == nullptr) {
+      buffer_.reset(new char[buffer_size_]);
+    }
+    size_t recv_len;
+    bool eof;
+    if (!channel_->ReceivePartialData(buffer_.get(),
+                                      std::min(remaining_, buffer_size_),
+                                      &recv_len, &eof) ||
+        eof) {
+      LOG(ERROR) << "Failed to read complete data";
+      failed_ = true;
+      return false;
+    }
+    remaining_ -= recv_len;
+    pos_ = 0;
+    end_ = recv_len;
+  }
+  *data = buffer_.get() + pos_;
+  *size = static_cast<int>(end_ - pos_);
+  byte_count_ += end_ - pos_;
+  pos_ = end_;
+  return true;
+}
+
+void MessageChannelInputStream::BackUp(int count) {
+  pos_ -= count;
+  byte_count_ -= count;
+}
+
+bool MessageChannelInputStream::Skip(int count) {
+  const void *data;
+  int size;
+  while (count > 0) {
+    if (!Next(&data, &size)) {
+      return false;
+    }
+    if (size > count) {
+      BackUp(size - count);
+      size = count;
+    }
+    count -= size;
+  }
+  return true;
+}
+
+google::protobuf::int64 MessageChannelInputStream::ByteCount() const {
+  return byte_count_;
+}
+
+MessageChannelOutputStream::MessageChannelOutputStream(MessageChannel *channel,
+                                                       size_t buffer_size)
+    : channel_(channel),
+      byte_count_(0),
+      buffer_size_(buffer_size),
+      buffer_(new char[buffer_size]),
+      used_(0),
+      failed_(false) {}
+
+bool MessageChannelOutputStream::Next(void **data, int *size) {
+  if (used_ == buffer_size_ && !Flush()) {
+    return false;
+  }
+  *data = buffer_.get() + used_;
+  *size = static_cast<int>(buffer_size_ - used_);
+  byte_count_ += buffer_size_ - used_;
+  used_ = buffer_size_;
+  return true;
+}
+
+void MessageChannelOutputStream::BackUp(int count) {
+  used_ -= count;
+  byte_count_ -= count;
+}
+
+google::protobuf::int64 MessageChannelOutputStream::ByteCount() const {
+  return byte_count_;
+}
+
+bool MessageChannelOutputStream::Flush() {
+  if (failed_) {
+    return false;
+  }
+  if (used_ > 0 && !channel_->SendData(buffer_.get(), used_)) {
+    failed_ = true;
+    return false;
+  }
+  used_ = 0;
+  return true;
+}
+
 }  // namespace tao
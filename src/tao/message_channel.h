@@ -21,6 +21,9 @@
 
 #include <list>
 #include <string>
+#include <vector>
+
+#include <google/protobuf/io/zero_copy_stream.h>
 
 #include "tao/util.h"
 
@@ -73,6 +76,13 @@ class MessageChannel {
   /// @param s The string to send.
   virtual bool SendString(const string &s);
 
+  /// Send several raw strings to the channel, in order, with the same effect
+  /// as calling SendString() on each. Channels may coalesce them into fewer
+  /// writes.
+  /// Failure will close the channel.
+  /// @param strs The strings to send.
+  virtual bool SendStrings(const std::vector<const string *> &strs);
+
   /// Receive a string over the channel.
   /// Failure or eof will close the channel.
   /// @param[out] s The string to receive the data.
@@ -89,6 +99,14 @@ class MessageChannel {
   /// @param m The Message to send.
   virtual bool SendMessage(const google::protobuf::Message &m);
 
+  /// Send several Messages to the channel, in order, with the same effect as
+  /// calling SendMessage() on each. Channels may coalesce them into fewer
+  /// writes.
+  /// Failure will close the channel.
+  /// @param msgs The Messages to send.
+  virtual bool SendMessages(
+      const std::vector<const google::protobuf::Message *> &msgs);
+
   /// Receive a Message over the channel.
   /// Failure or eof will close the channel.
   /// @param[out] m The received Message.
@@ -119,6 +137,109 @@ class MessageChannel {
   /// @param[out] eof Will be set to true iff end of stream reached.
   virtual bool ReceivePartialData(void *buffer, size_t max_recv_len,
                                   size_t *recv_len, bool *eof) = 0;
+
+  friend class MessageChannelInputStream;
+};
+
+/// A ZeroCopyInputStream that reads a fixed number of bytes from a channel, so
+/// that a Message can be parsed as its frame arrives, with bounded buffering,
+/// instead of first being received into a string.
+class MessageChannelInputStream
+    : public google::protobuf::io::ZeroCopyInputStream {
+ public:
+  /// Construct a MessageChannelInputStream.
+  /// @param channel The channel to read from. Ownership is not taken.
+  /// @param limit The number of bytes to read before reporting end of stream.
+  /// @param buffer_size The maximum number of bytes to buffer at once.
+  MessageChannelInputStream(MessageChannel *channel, size_t limit,
+                            size_t buffer_size = DefaultBufferSize);
+
+  /// These methods have the same semantics as ZeroCopyInputStream.
+  /// @{
+  virtual bool Next(const void **data, int *size);
+  virtual void BackUp(int count);
+  virtual bool Skip(int count);
+  virtual google::protobuf::int64 ByteCount() const;
+  /// @}
+
+  /// Check whether every byte up to the limit has been consumed.
+  bool AtLimit() const { return remaining_ == 0 && pos_ == end_; }
+
+  /// Check whether the channel failed or reached end of stream before the
+  /// limit.
+  bool Failed() const { return failed_; }
+
+  /// The default maximum number of bytes to buffer at once.
+  static constexpr size_t DefaultBufferSize = 64 * 1024;
+
+ private:
+  /// The channel to read from.
+  MessageChannel *channel_;
+
+  /// The number of bytes not yet read from the channel.
+  size_t remaining_;
+
+  /// The number of bytes handed out by Next(), less any backed up.
+  size_t byte_count_;
+
+  /// The buffer, and the positions of unconsumed data within it.
+  size_t buffer_size_;
+  unique_ptr<char[]> buffer_;
+  size_t pos_, end_;
+
+  /// Whether reading from the channel failed.
+  bool failed_;
+
+  DISALLOW_COPY_AND_ASSIGN(MessageChannelInputStream);
+};
+
+/// A ZeroCopyOutputStream that writes to a channel through a bounded buffer,
+/// so that a Message can be serialized without first being copied into a
+/// string.
+class MessageChannelOutputStream
+    : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  /// Construct a MessageChannelOutputStream.
+  /// @param channel The channel to write to. Ownership is not taken.
+  /// @param buffer_size The number of bytes to buffer before each write.
+  explicit MessageChannelOutputStream(MessageChannel *channel,
+                                      size_t buffer_size = DefaultBufferSize);
+
+  /// Flushes any buffered data, ignoring failure. Call Flush() to check it.
+  virtual ~MessageChannelOutputStream() { Flush(); }
+
+  /// These methods have the same semantics as ZeroCopyOutputStream.
+  /// @{
+  virtual bool Next(void **data, int *size);
+  virtual void BackUp(int count);
+  virtual google::protobuf::int64 ByteCount() const;
+  /// @}
+
+  /// Send any buffered data to the channel.
+  bool Flush();
+
+  /// Check whether sending to the channel failed.
+  bool Failed() const { return failed_; }
+
+  /// The default number of bytes to buffer before each write.
+  static constexpr size_t DefaultBufferSize = 64 * 1024;
+
+ private:
+  /// The channel to write to.
+  MessageChannel *channel_;
+
+  /// The number of bytes sent or buffered.
+  size_t byte_count_;
+
+  /// The buffer, and the number of bytes in use.
+  size_t buffer_size_;
+  unique_ptr<char[]> buffer_;
+  size_t used_;
+
+  /// Whether sending to the channel failed.
+  bool failed_;
+
+  DISALLOW_COPY_AND_ASSIGN(MessageChannelOutputStream);
 };
 }  // namespace tao
 
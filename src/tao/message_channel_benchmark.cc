@@ -0,0 +1,167 @@
+//  File: message_channel_benchmark.cc
+//
+//  Description: Counts the system calls made by FDMessageChannel for an
+//  RPC-shaped exchange, with and without coalesced writes and read-ahead.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "tao/fd_message_channel.h"
+#include "tao/tao_rpc.pb.h"
+#include "tao/util.h"
+
+DEFINE_int32(iterations, 100000, "Number of request/response exchanges");
+DEFINE_int32(payload_size, 64, "Size of each request and response payload");
+
+using std::string;
+using std::vector;
+
+using tao::FDMessageChannel;
+using tao::InitializeApp;
+using tao::ProtoRPCRequestHeader;
+using tao::ProtoRPCResponseHeader;
+using tao::TaoRPCRequest;
+using tao::TaoRPCResponse;
+
+// Counters for the system calls of interest. The wrappers below take
+// precedence over the libc versions for everything linked into this program,
+// including the tao library.
+static std::atomic<uint64_t> read_calls(0);
+static std::atomic<uint64_t> write_calls(0);
+
+extern "C" ssize_t read(int fd, void *buf, size_t count) {
+  read_calls++;
+  return syscall(SYS_read, fd, buf, count);
+}
+
+extern "C" ssize_t write(int fd, const void *buf, size_t count) {
+  write_calls++;
+  return syscall(SYS_write, fd, buf, count);
+}
+
+extern "C" ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+  write_calls++;
+  return syscall(SYS_writev, fd, iov, iovcnt);
+}
+
+/// An FDMessageChannel that sends and receives the way FDMessageChannel did
+/// originally: each Message is serialized into a string, and its length and
+/// payload are written separately, then received into a string and parsed.
+class LegacyFDMessageChannel : public FDMessageChannel {
+ public:
+  LegacyFDMessageChannel(int readfd, int writefd)
+      : FDMessageChannel(readfd, writefd) {}
+  virtual bool SendString(const string &s) {
+    return tao::MessageChannel::SendString(s);
+  }
+  virtual bool SendStrings(const vector<const string *> &strs) {
+    return tao::MessageChannel::SendStrings(strs);
+  }
+  virtual bool SendMessages(
+      const vector<const google::protobuf::Message *> &msgs) {
+    for (const google::protobuf::Message *m : msgs) {
+      string serialized;
+      if (!m->SerializeToString(&serialized) || !SendString(serialized)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  virtual bool ReceiveMessage(google::protobuf::Message *m, bool *eof) {
+    string s;
+    return ReceiveString(&s, eof) && (*eof || m->ParseFromString(s));
+  }
+};
+
+/// Run request/response exchanges shaped like TaoRPC calls: a header and body
+/// in each direction.
+/// @param client The channel for the requester.
+/// @param server The channel for the responder.
+static void RunExchanges(FDMessageChannel *client, FDMessageChannel *server,
+                         const string &label) {
+  string payload(FLAGS_payload_size, 'x');
+  std::thread responder([server, &payload]() {
+    ProtoRPCRequestHeader reqHdr;
+    TaoRPCRequest req;
+    ProtoRPCResponseHeader respHdr;
+    TaoRPCResponse resp;
+    resp.set_data(payload);
+    bool eof;
+    for (int i = 0; i < FLAGS_iterations; i++) {
+      CHECK(server->ReceiveMessage(&reqHdr, &eof) && !eof);
+      CHECK(server->ReceiveMessage(&req, &eof) && !eof);
+      respHdr.set_op(reqHdr.op());
+      respHdr.set_seq(reqHdr.seq());
+      CHECK(server->SendMessages({&respHdr, &resp}));
+    }
+  });
+
+  ProtoRPCRequestHeader reqHdr;
+  TaoRPCRequest req;
+  ProtoRPCResponseHeader respHdr;
+  TaoRPCResponse resp;
+  reqHdr.set_op("Tao.Seal");
+  req.set_data(payload);
+  bool eof;
+  read_calls = write_calls = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < FLAGS_iterations; i++) {
+    reqHdr.set_seq(i);
+    CHECK(client->SendMessages({&reqHdr, &req}));
+    CHECK(client->ReceiveMessage(&respHdr, &eof) && !eof);
+    CHECK(client->ReceiveMessage(&resp, &eof) && !eof);
+  }
+  auto end = std::chrono::steady_clock::now();
+  responder.join();
+
+  double secs = std::chrono::duration<double>(end - start).count();
+  double n = FLAGS_iterations;
+  printf("%-28s %8.2f reads/rpc %8.2f writes/rpc %10.0f rpc/s\n",
+         label.c_str(), read_calls / n, write_calls / n, n / secs);
+}
+
+int main(int argc, char **argv) {
+  InitializeApp(&argc, &argv, true);
+
+  int before[2], after[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, before) == 0);
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, after) == 0);
+
+  // Before: separate writes for each length and payload, exact-size reads.
+  LegacyFDMessageChannel before_client(before[0], before[0]);
+  LegacyFDMessageChannel before_server(before[1], before[1]);
+  RunExchanges(&before_client, &before_server, "unbuffered");
+
+  // After: one write per RPC direction, and read-ahead on both ends.
+  FDMessageChannel after_client(after[0], after[0]);
+  FDMessageChannel after_server(after[1], after[1]);
+  after_client.EnableReadAhead();
+  after_server.EnableReadAhead();
+  RunExchanges(&after_client, &after_server, "buffered, read-ahead");
+  return 0;
+}
@@ -0,0 +1,237 @@
+//  File: random_pool_tao.cc
+//
+//  Description: A Tao wrapper that serves small random requests from a pool.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "tao/random_pool_tao.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include <glog/logging.h>
+#include <openssl/crypto.h>
+
+using std::lock_guard;
+using std::mutex;
+using std::unique_lock;
+
+namespace tao {
+constexpr size_t RandomPoolTao::DefaultBlockSize;
+constexpr size_t RandomPoolTao::DefaultLowWater;
+constexpr size_t RandomPoolTao::MinBlockSize;
+
+/// Incremented in every forked child.
+static std::atomic<unsigned> fork_generation(0);
+
+static void CountFork() { fork_generation++; }
+
+RandomPoolTao::RandomPoolTao(Tao *host, size_t block_size, size_t low_water)
+    : host_(host),
+      block_size_(std::max(block_size, MinBlockSize)),
+      low_water_(low_water),
+      pool_changed_(new std::condition_variable),
+      pool_offset_(0),
+      pool_size_(0),
+      refilling_(true),  // Start with a full pool.
+      refill_failed_(false),
+      stopping_(false) {
+  static std::once_flag once;
+  std::call_once(once, []() { pthread_atfork(nullptr, nullptr, CountFork); });
+  generation_ = fork_generation;
+  refill_thread_.reset(new std::thread(&RandomPoolTao::RefillLoop, this));
+}
+
+RandomPoolTao::~RandomPoolTao() {
+  if (Forked()) {
+    // Neither can be destroyed in the child, nor the pool lock taken.
+    pool_changed_.release();
+    refill_thread_.release();
+  } else {
+    {
+      lock_guard<mutex> lock(pool_mutex_);
+      stopping_ = true;
+    }
+    pool_changed_->notify_all();
+    refill_thread_->join();
+  }
+  for (string &block : pool_) {
+    SecureStringErase(&block);
+  }
+}
+
+void RandomPoolTao::RefillLoop() {
+  unique_lock<mutex> lock(pool_mutex_);
+  for (;;) {
+    pool_changed_->wait(lock, [this]() { return stopping_ || refilling_; });
+    if (stopping_) {
+      return;
+    }
+    lock.unlock();
+    string block;
+    bool ok;
+    {
+      lock_guard<mutex> host_lock(host_mutex_);
+      ok = host_->GetRandomBytes(block_size_, &block);
+    }
+    lock.lock();
+    if (ok && block.size() == block_size_) {
+      pool_.push_back(std::move(block));
+      pool_size_ += block_size_;
+      refill_failed_ = false;
+      // Keep going if one block wasn't enough to reach the low-water mark.
+      refilling_ = (pool_size_ < low_water_);
+    } else {
+      LOG(ERROR) << "Could not refill the random pool from the host Tao";
+      SecureStringErase(&block);
+      refill_failed_ = true;
+      refilling_ = false;
+    }
+    pool_changed_->notify_all();
+  }
+}
+
+bool RandomPoolTao::Forked() const {
+  return generation_ != fork_generation;
+}
+
+bool RandomPoolTao::GetRandomBytes(size_t size, string *bytes) {
+  if (Forked()) {
+    LOG(ERROR) << "RandomPoolTao can't be used in a forked child";
+    return false;
+  }
+  if (size > block_size_ / 2) {
+    lock_guard<mutex> host_lock(host_mutex_);
+    return host_->GetRandomBytes(size, bytes);
+  }
+  unique_lock<mutex> lock(pool_mutex_);
+  while (pool_size_ < size) {
+    if (refill_failed_ && !refilling_) {
+      // Try the pool again later, but don't make this caller wait for it.
+      refilling_ = true;
+      pool_changed_->notify_all();
+      lock.unlock();
+      lock_guard<mutex> host_lock(host_mutex_);
+      return host_->GetRandomBytes(size, bytes);
+    }
+    if (!refilling_) {
+      refilling_ = true;
+      pool_changed_->notify_all();
+    }
+    pool_changed_->wait(lock, [this]() { return !refilling_; });
+  }
+  bytes->resize(size);
+  size_t filled = 0;
+  while (filled < size) {
+    string &block = pool_.front();
+    size_t len = std::min(size - filled, block.size() - pool_offset_);
+    char *src = &block[pool_offset_];
+    memcpy(&(*bytes)[filled], src, len);
+    OPENSSL_cleanse(src, len);
+    filled += len;
+    pool_offset_ += len;
+    if (pool_offset_ == block.size()) {
+      SecureStringErase(&block);
+      pool_.pop_front();
+      pool_offset_ = 0;
+    }
+  }
+  pool_size_ -= size;
+  if (pool_size_ < low_water_ && !refilling_) {
+    refilling_ = true;
+    pool_changed_->notify_all();
+  }
+  return true;
+}
+
+size_t RandomPoolTao::PoolSize() {
+  lock_guard<mutex> lock(pool_mutex_);
+  return pool_size_;
+}
+
+bool RandomPoolTao::SerializeToString(string *params) const {
+  lock_guard<mutex> host_lock(host_mutex_);
+  return host_->SerializeToString(params);
+}
+
+bool RandomPoolTao::GetTaoName(string *name) {
+  lock_guard<mutex> host_lock(host_mutex_);
+  return host_->GetTaoName(name);
+}
+
+bool RandomPoolTao::ExtendTaoName(const string &subprin) {
+  lock_guard<mutex> host_lock(host_mutex_);
+  return host_->ExtendTaoName(subprin);
+}
+
+bool RandomPoolTao::GetSharedSecret(size_t size, const string &policy,
+                                    string *bytes) {
+  lock_guard<mutex> host_lock(host_mutex_);
+  return host_->GetSharedSecret(size, policy, bytes);
+}
+
+bool RandomPoolTao::Attest(const string &message, string *attestation) {
+  lock_guard<mutex> host_lock(host_mutex_);
+  return host_->Attest(message, attestation);
+}
+
+bool RandomPoolTao::Seal(const string &data, const string &policy,
+                         string *sealed) {
+  lock_guard<mutex> host_lock(host_mutex_);
+  return host_->Seal(data, policy, sealed);
+}
+
+bool RandomPoolTao::Unseal(const string &sealed, string *data,
+                           string *policy) {
+  lock_guard<mutex> host_lock(host_mutex_);
+  return host_->Unseal(sealed, data, policy);
+}
+
+bool RandomPoolTao::InitCounter(const string &label, int64_t &c) {
+  lock_guard<mutex> host_lock(host_mutex_);
+  return host_->InitCounter(label, c);
+}
+
+bool RandomPoolTao::GetCounter(const string &label, int64_t *c) {
+  lock_guard<mutex> host_lock(host_mutex_);
+  return host_->GetCounter(label, c);
+}
+
+bool RandomPoolTao::RollbackProtectedSeal(const string &label,
+                                          const string &data,
+                                          const string &policy,
+                                          string *sealed) {
+  lock_guard<mutex> host_lock(host_mutex_);
+  return host_->RollbackProtectedSeal(label, data, policy, sealed);
+}
+
+bool RandomPoolTao::RollbackProtectedUnseal(const string &sealed,
+                                            string *data, string *policy) {
+  lock_guard<mutex> host_lock(host_mutex_);
+  return host_->RollbackProtectedUnseal(sealed, data, policy);
+}
+
+string RandomPoolTao::GetRecentErrorMessage() const {
+  lock_guard<mutex> host_lock(host_mutex_);
+  return host_->GetRecentErrorMessage();
+}
+
+string RandomPoolTao::ResetRecentErrorMessage() {
+  lock_guard<mutex> host_lock(host_mutex_);
+  return host_->ResetRecentErrorMessage();
+}
+}  // namespace tao
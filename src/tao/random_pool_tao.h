@@ -0,0 +1,150 @@
+//  File: random_pool_tao.h
+//
+//  Description: A Tao wrapper that serves small random requests from a pool.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TAO_RANDOM_POOL_TAO_H_
+#define TAO_RANDOM_POOL_TAO_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "tao/tao.h"
+#include "tao/util.h"
+
+namespace tao {
+/// A Tao that forwards every call to a host Tao, except that small
+/// GetRandomBytes() requests are served from a pool of bytes that the host
+/// supplied earlier. The pool is refilled in large blocks by a background
+/// thread whenever it falls below a low-water mark, so a typical request costs
+/// a memcpy rather than an RPC. Bytes are erased from the pool as they are
+/// handed out, and every byte is handed out at most once.
+///
+/// Calls to the host Tao, from the caller or the refill thread, are serialized,
+/// so a host Tao that is not thread-safe, like TaoRPC, can be wrapped.
+///
+/// A RandomPoolTao is not fork-safe. In a child forked from the process that
+/// made it, GetRandomBytes() fails rather than hand out bytes that the parent
+/// may also hand out, and the other methods must not be called, since the
+/// child has no refill thread and another thread may have held a lock at the
+/// fork. The child may destroy it, which erases the pool.
+class RandomPoolTao : public Tao {
+ public:
+  /// Construct a RandomPoolTao and start its refill thread.
+  /// @param host The host Tao. Ownership is taken.
+  /// @param block_size The number of bytes to fetch from the host at a time,
+  /// at least MinBlockSize. Requests larger than half a block go straight to
+  /// the host.
+  /// @param low_water The pool size below which a refill starts.
+  explicit RandomPoolTao(Tao *host, size_t block_size = DefaultBlockSize,
+                         size_t low_water = DefaultLowWater);
+
+  /// Stop the refill thread and erase the pool.
+  virtual ~RandomPoolTao();
+
+  /// Tao implementation. Everything but GetRandomBytes() is forwarded to the
+  /// host Tao.
+  /// @{
+  virtual bool SerializeToString(string *params) const;
+  virtual bool GetTaoName(string *name);
+  virtual bool ExtendTaoName(const string &subprin);
+  virtual bool GetRandomBytes(size_t size, string *bytes);
+  virtual bool GetSharedSecret(size_t size, const string &policy,
+                               string *bytes);
+  virtual bool Attest(const string &message, string *attestation);
+  virtual bool Seal(const string &data, const string &policy, string *sealed);
+  virtual bool Unseal(const string &sealed, string *data, string *policy);
+  virtual bool InitCounter(const string &label, int64_t &c);
+  virtual bool GetCounter(const string &label, int64_t *c);
+  virtual bool RollbackProtectedSeal(const string &label, const string &data,
+                                     const string &policy, string *sealed);
+  virtual bool RollbackProtectedUnseal(const string &sealed, string *data,
+                                       string *policy);
+  virtual string GetRecentErrorMessage() const;
+  virtual string ResetRecentErrorMessage();
+  /// @}
+
+  /// Get the number of random bytes currently in the pool.
+  size_t PoolSize();
+
+  /// The default number of bytes to fetch from the host at a time.
+  static constexpr size_t DefaultBlockSize = 4096;
+
+  /// The default pool size below which a refill starts.
+  static constexpr size_t DefaultLowWater = 1024;
+
+  /// Smaller block sizes are raised to this, since a refill of empty blocks
+  /// would never reach the low-water mark.
+  static constexpr size_t MinBlockSize = 64;
+
+ private:
+  /// The host Tao.
+  unique_ptr<Tao> host_;
+
+  /// Serializes calls to host_.
+  mutable std::mutex host_mutex_;
+
+  /// The number of bytes to fetch from the host at a time.
+  size_t block_size_;
+
+  /// The pool size below which a refill starts.
+  size_t low_water_;
+
+  /// Protects the pool and the refill state.
+  std::mutex pool_mutex_;
+
+  /// Signals the refill thread, and callers waiting for a refill. A forked
+  /// child abandons it, since it still counts the parent's waiters.
+  unique_ptr<std::condition_variable> pool_changed_;
+
+  /// Blocks of random bytes from the host. Bytes before pool_offset_ in the
+  /// first block have already been handed out and erased.
+  std::deque<string> pool_;
+
+  /// The number of bytes already used from the first block.
+  size_t pool_offset_;
+
+  /// The number of unused bytes in the pool.
+  size_t pool_size_;
+
+  /// Whether a refill has been requested or is in progress.
+  bool refilling_;
+
+  /// Whether the last refill failed. Callers then go straight to the host.
+  bool refill_failed_;
+
+  /// Whether the refill thread should exit.
+  bool stopping_;
+
+  /// The refill thread. A forked child abandons it.
+  unique_ptr<std::thread> refill_thread_;
+
+  /// The fork generation this object was made in.
+  unsigned generation_;
+
+  /// The body of the refill thread.
+  void RefillLoop();
+
+  /// Whether this is a forked child of the process that made this object.
+  bool Forked() const;
+
+  DISALLOW_COPY_AND_ASSIGN(RandomPoolTao);
+};
+}  // namespace tao
+
+#endif  // TAO_RANDOM_POOL_TAO_H_
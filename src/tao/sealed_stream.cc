@@ -0,0 +1,537 @@
+//  File: sealed_stream.cc
+//
+//  Description: Sealing and unsealing of large streams in fixed-size chunks.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "tao/sealed_stream.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include <glog/logging.h>
+#include <openssl/err.h>
+
+#include "tao/sealed_stream.pb.h"
+
+using std::condition_variable;
+using std::deque;
+using std::function;
+using std::lock_guard;
+using std::mutex;
+using std::unique_lock;
+
+namespace tao {
+constexpr size_t SealedStreamWriter::DefaultChunkSize;
+constexpr size_t SealedStreamWriter::MaxChunkSize;
+
+/// The size of the data-encryption key, for AES-256.
+static constexpr int SealedStreamKeySize = 32;
+
+/// The size of the GCM nonce. The key is fresh for each stream, so the nonce
+/// only needs to be unique within it, and the chunk index is used.
+static constexpr int SealedStreamNonceSize = 12;
+
+/// The size of the GCM authentication tag on each chunk.
+static constexpr int SealedStreamTagSize = 16;
+
+/// The number of chunks that may be read ahead of the chunk being processed.
+static constexpr size_t SealedStreamPipelineDepth = 4;
+
+/// Each chunk frame is a flag byte, the ciphertext, and the tag.
+static constexpr uint8_t SealedStreamFinalFlag = 1;
+
+/// Read until a buffer is full or the input ends.
+/// @param fd The file descriptor to read from.
+/// @param buffer The buffer to fill.
+/// @param len The length of buffer.
+/// @param[out] filled The number of bytes read.
+static bool ReadFully(int fd, void *buffer, size_t len, size_t *filled) {
+  char *p = reinterpret_cast<char *>(buffer);
+  *filled = 0;
+  while (*filled < len) {
+    ssize_t n = read(fd, p + *filled, len - *filled);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      PLOG(ERROR) << "Could not read sealed stream data";
+      return false;
+    } else if (n == 0) {
+      break;
+    }
+    *filled += n;
+  }
+  return true;
+}
+
+/// Write an entire buffer.
+/// @param fd The file descriptor to write to.
+/// @param buffer The data to write.
+/// @param len The length of buffer.
+static bool WriteFully(int fd, const void *buffer, size_t len) {
+  const char *p = reinterpret_cast<const char *>(buffer);
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      PLOG(ERROR) << "Could not write sealed stream data";
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+/// Read one length-prefixed frame.
+/// @param fd The file descriptor to read from.
+/// @param max_len The largest frame to accept.
+/// @param[out] frame The frame.
+/// @param[out] eof Will be set to true iff the input ended before the frame.
+static bool ReadFrameFromFd(int fd, size_t max_len, string *frame, bool *eof) {
+  uint32_t net_len;
+  size_t filled;
+  if (!ReadFully(fd, &net_len, sizeof(net_len), &filled)) {
+    return false;
+  }
+  *eof = (filled == 0);
+  if (*eof) {
+    return true;
+  } else if (filled != sizeof(net_len)) {
+    LOG(ERROR) << "Sealed stream is truncated";
+    return false;
+  }
+  size_t len = ntohl(net_len);
+  if (len > max_len) {
+    LOG(ERROR) << "Sealed stream frame exceeded maximum allowable size";
+    return false;
+  }
+  frame->resize(len);
+  if (!ReadFully(fd, str2char(frame), len, &filled)) {
+    return false;
+  } else if (filled != len) {
+    LOG(ERROR) << "Sealed stream is truncated";
+    return false;
+  }
+  return true;
+}
+
+/// Compute the nonce and additional data that bind a chunk to its position.
+/// @param index The index of the chunk.
+/// @param flags The flag byte of the chunk.
+/// @param[out] nonce The nonce, of SealedStreamNonceSize bytes.
+/// @param[out] aad The additional data, of 9 bytes.
+static void ChunkBinding(uint64_t index, uint8_t flags, unsigned char *nonce,
+                         unsigned char *aad) {
+  memset(nonce, 0, SealedStreamNonceSize);
+  for (int i = 0; i < 8; i++) {
+    nonce[SealedStreamNonceSize - 1 - i] = (index >> (8 * i)) & 0xff;
+  }
+  memcpy(aad, nonce + SealedStreamNonceSize - 8, 8);
+  aad[8] = flags;
+}
+
+/// Set up a cipher context for AES-256-GCM with a given key.
+/// @param key The data-encryption key.
+/// @param encrypt Whether to encrypt rather than decrypt.
+/// @param[out] ctx The new context.
+static bool InitCipher(const string &key, bool encrypt, ScopedCipherCtx *ctx) {
+  ctx->reset(EVP_CIPHER_CTX_new());
+  if (ctx->get() == nullptr ||
+      !EVP_CipherInit_ex(ctx->get(), EVP_aes_256_gcm(), nullptr, nullptr,
+                         nullptr, encrypt ? 1 : 0) ||
+      !EVP_CIPHER_CTX_ctrl(ctx->get(), EVP_CTRL_GCM_SET_IVLEN,
+                           SealedStreamNonceSize, nullptr) ||
+      !EVP_CipherInit_ex(ctx->get(), nullptr, nullptr, str2uchar(key), nullptr,
+                         encrypt ? 1 : 0)) {
+    LOG(ERROR) << "Could not initialize the sealed stream cipher";
+    OpenSSLSuccess();
+    return false;
+  }
+  return true;
+}
+
+bool SealedStreamWriter::Init(Tao *tao, const string &policy, int fd,
+                              size_t chunk_size) {
+  if (chunk_size == 0 || chunk_size > MaxChunkSize) {
+    LOG(ERROR) << "Invalid sealed stream chunk size " << chunk_size;
+    return false;
+  }
+  ScopedSafeString key(new string());
+  if (!tao->GetRandomBytes(SealedStreamKeySize, key.get())) {
+    LOG(ERROR) << "Could not generate a key for the sealed stream";
+    return false;
+  }
+  SealedStreamHeader header;
+  if (!tao->Seal(*key, policy, header.mutable_sealed_key())) {
+    LOG(ERROR) << "Can't seal the key for the sealed stream";
+    return false;
+  }
+  header.set_chunk_size(chunk_size);
+  if (!InitCipher(*key, true /* encrypt */, &ctx_)) {
+    return false;
+  }
+  string serialized;
+  header.SerializeToString(&serialized);
+  uint32_t net_len = htonl(serialized.size());
+  if (!WriteFully(fd, &net_len, sizeof(net_len)) ||
+      !WriteFully(fd, serialized.data(), serialized.size())) {
+    LOG(ERROR) << "Could not write the sealed stream header";
+    ctx_.reset();
+    return false;
+  }
+  fd_ = fd;
+  chunk_size_ = chunk_size;
+  index_ = 0;
+  buffer_.resize(chunk_size);
+  buffered_ = 0;
+  return true;
+}
+
+bool SealedStreamWriter::Write(const void *data, size_t len) {
+  if (ctx_.get() == nullptr) {
+    LOG(ERROR) << "Sealed stream is not open for writing";
+    return false;
+  }
+  const char *p = reinterpret_cast<const char *>(data);
+  while (len > 0) {
+    // A full chunk is only written once more data arrives, since until then
+    // it might be the final chunk.
+    if (buffered_ == chunk_size_ && !WriteChunk(false /* not final */)) {
+      return false;
+    }
+    size_t n = std::min(len, chunk_size_ - buffered_);
+    memcpy(&buffer_[buffered_], p, n);
+    buffered_ += n;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool SealedStreamWriter::Finish() {
+  if (ctx_.get() == nullptr) {
+    LOG(ERROR) << "Sealed stream is not open for writing";
+    return false;
+  }
+  bool ok = WriteChunk(true /* final */);
+  ctx_.reset();
+  return ok;
+}
+
+bool SealedStreamWriter::WriteChunk(bool final) {
+  uint8_t flags = final ? SealedStreamFinalFlag : 0;
+  unsigned char nonce[SealedStreamNonceSize];
+  unsigned char aad[9];
+  ChunkBinding(index_, flags, nonce, aad);
+  size_t frame_len = 1 + buffered_ + SealedStreamTagSize;
+  frame_.resize(4 + frame_len);
+  unsigned char *out = str2uchar(&frame_);
+  uint32_t net_len = htonl(frame_len);
+  memcpy(out, &net_len, sizeof(net_len));
+  out[4] = flags;
+  int len, final_len;
+  if (!EVP_EncryptInit_ex(ctx_.get(), nullptr, nullptr, nullptr, nonce) ||
+      !EVP_EncryptUpdate(ctx_.get(), nullptr, &len, aad, sizeof(aad)) ||
+      !EVP_EncryptUpdate(ctx_.get(), out + 5,
+                         &len, reinterpret_cast<unsigned char *>(&buffer_[0]),
+                         static_cast<int>(buffered_)) ||
+      !EVP_EncryptFinal_ex(ctx_.get(), out + 5 + len, &final_len) ||
+      !EVP_CIPHER_CTX_ctrl(ctx_.get(), EVP_CTRL_GCM_GET_TAG,
+                           SealedStreamTagSize, out + 5 + buffered_)) {
+    LOG(ERROR) << "Could not encrypt a sealed stream chunk";
+    OpenSSLSuccess();
+    ctx_.reset();
+    return false;
+  }
+  if (!WriteFully(fd_, frame_.data(), frame_.size())) {
+    LOG(ERROR) << "Could not write a sealed stream chunk";
+    ctx_.reset();
+    return false;
+  }
+  index_++;
+  buffered_ = 0;
+  return true;
+}
+
+bool SealedStreamReader::Init(Tao *tao, const string &policy, int fd) {
+  string serialized;
+  bool eof;
+  // The header holds little more than a sealed key.
+  if (!ReadFrameFromFd(fd, 64 * 1024, &serialized, &eof) || eof) {
+    LOG(ERROR) << "Could not read the sealed stream header";
+    return false;
+  }
+  SealedStreamHeader header;
+  if (!header.ParseFromString(serialized)) {
+    LOG(ERROR) << "Could not parse the sealed stream header";
+    return false;
+  }
+  if (header.chunk_size() == 0 ||
+      header.chunk_size() > SealedStreamWriter::MaxChunkSize) {
+    LOG(ERROR) << "Invalid sealed stream chunk size " << header.chunk_size();
+    return false;
+  }
+  ScopedSafeString key(new string());
+  string unseal_policy;
+  if (!tao->Unseal(header.sealed_key(), key.get(), &unseal_policy)) {
+    LOG(ERROR) << "Can't unseal the key for the sealed stream";
+    return false;
+  }
+  if (unseal_policy != policy) {
+    LOG(ERROR) << "Unsealed the stream key, but provenance is uncertain";
+    return false;
+  }
+  if (key->size() != SealedStreamKeySize) {
+    LOG(ERROR) << "The sealed stream key has the wrong size";
+    return false;
+  }
+  if (!InitCipher(*key, false /* decrypt */, &ctx_)) {
+    return false;
+  }
+  fd_ = fd;
+  chunk_size_ = header.chunk_size();
+  index_ = 0;
+  done_ = false;
+  return true;
+}
+
+bool SealedStreamReader::Next(string *chunk, bool *eof) {
+  if (!ReadFrame(&frame_, eof)) {
+    return false;
+  } else if (*eof) {
+    return true;
+  }
+  return OpenFrame(frame_, chunk);
+}
+
+bool SealedStreamReader::ReadFrame(string *frame, bool *eof) {
+  if (ctx_.get() == nullptr) {
+    LOG(ERROR) << "Sealed stream is not open for reading";
+    return false;
+  }
+  return ReadFrameFromFd(fd_, 1 + chunk_size_ + SealedStreamTagSize, frame,
+                         eof);
+}
+
+bool SealedStreamReader::OpenFrame(const string &frame, string *chunk) {
+  if (done_) {
+    LOG(ERROR) << "Sealed stream has data after the final chunk";
+    return false;
+  }
+  if (frame.size() < 1 + SealedStreamTagSize) {
+    LOG(ERROR) << "Sealed stream chunk is too short";
+    return false;
+  }
+  uint8_t flags = frame[0];
+  if ((flags & ~SealedStreamFinalFlag) != 0) {
+    LOG(ERROR) << "Sealed stream chunk has unknown flags";
+    return false;
+  }
+  unsigned char nonce[SealedStreamNonceSize];
+  unsigned char aad[9];
+  ChunkBinding(index_, flags, nonce, aad);
+  size_t len = frame.size() - 1 - SealedStreamTagSize;
+  const unsigned char *in = reinterpret_cast<const unsigned char *>(&frame[1]);
+  // GCM decryption never produces more output than input.
+  chunk->resize(len);
+  unsigned char *out = str2uchar(chunk);
+  int out_len, final_len;
+  if (!EVP_DecryptInit_ex(ctx_.get(), nullptr, nullptr, nullptr, nonce) ||
+      !EVP_DecryptUpdate(ctx_.get(), nullptr, &out_len, aad, sizeof(aad)) ||
+      !EVP_DecryptUpdate(ctx_.get(), out, &out_len, in,
+                         static_cast<int>(len)) ||
+      !EVP_CIPHER_CTX_ctrl(ctx_.get(), EVP_CTRL_GCM_SET_TAG,
+                           SealedStreamTagSize,
+                           const_cast<unsigned char *>(in + len)) ||
+      !EVP_DecryptFinal_ex(ctx_.get(), out + out_len, &final_len)) {
+    LOG(ERROR) << "Sealed stream chunk " << index_
+               << " failed authentication";
+    ERR_clear_error();
+    SecureStringErase(chunk);
+    chunk->clear();
+    return false;
+  }
+  index_++;
+  done_ = (flags & SealedStreamFinalFlag) != 0;
+  return true;
+}
+
+/// Run a producer and a consumer concurrently, with a bounded queue of items
+/// between them. The producer runs on a new thread.
+/// @param produce Fill the next item, or set eof when there are no more.
+/// @param consume Process an item.
+/// @param erase Whether items hold secrets that must be erased after use.
+static bool RunPipeline(function<bool(string *, bool *)> produce,
+                        function<bool(string *)> consume, bool erase) {
+  mutex m;
+  condition_variable changed;
+  deque<string> queue;
+  bool producer_done = false, producer_ok = true, stop = false;
+
+  std::thread producer([&]() {
+    for (;;) {
+      {
+        unique_lock<mutex> lock(m);
+        changed.wait(lock, [&]() {
+          return stop || queue.size() < SealedStreamPipelineDepth;
+        });
+        if (stop) break;
+      }
+      string item;
+      bool eof = false;
+      bool ok = produce(&item, &eof);
+      lock_guard<mutex> lock(m);
+      if (!ok || eof) {
+        producer_ok = ok;
+        producer_done = true;
+        changed.notify_all();
+        break;
+      }
+      queue.push_back(std::move(item));
+      changed.notify_all();
+    }
+  });
+
+  bool ok = true;
+  for (;;) {
+    string item;
+    {
+      unique_lock<mutex> lock(m);
+      changed.wait(lock, [&]() { return !queue.empty() || producer_done; });
+      if (queue.empty()) break;
+      item = std::move(queue.front());
+      queue.pop_front();
+      changed.notify_all();
+    }
+    ok = consume(&item);
+    if (erase) SecureStringErase(&item);
+    if (!ok) break;
+  }
+  {
+    lock_guard<mutex> lock(m);
+    stop = true;
+    changed.notify_all();
+  }
+  producer.join();
+  if (erase) {
+    for (string &item : queue) SecureStringErase(&item);
+  }
+  return ok && producer_ok;
+}
+
+bool SealStream(Tao *tao, const string &policy, int in_fd, int out_fd,
+                size_t chunk_size) {
+  SealedStreamWriter writer;
+  if (!writer.Init(tao, policy, out_fd, chunk_size)) {
+    return false;
+  }
+  auto produce = [in_fd, chunk_size](string *item, bool *eof) {
+    item->resize(chunk_size);
+    size_t filled;
+    if (!ReadFully(in_fd, str2char(item), chunk_size, &filled)) {
+      return false;
+    }
+    item->resize(filled);
+    *eof = (filled == 0);
+    return true;
+  };
+  auto consume = [&writer](string *item) {
+    return writer.Write(item->data(), item->size());
+  };
+  if (!RunPipeline(produce, consume, true /* erase */)) {
+    LOG(ERROR) << "Could not seal the stream";
+    return false;
+  }
+  return writer.Finish();
+}
+
+bool UnsealStream(Tao *tao, const string &policy, int in_fd, int out_fd) {
+  SealedStreamReader reader;
+  if (!reader.Init(tao, policy, in_fd)) {
+    return false;
+  }
+  string chunk;
+  auto produce = [&reader](string *item, bool *eof) {
+    return reader.ReadFrame(item, eof);
+  };
+  auto consume = [&reader, &chunk, out_fd](string *item) {
+    return reader.OpenFrame(*item, &chunk) &&
+           WriteFully(out_fd, chunk.data(), chunk.size());
+  };
+  bool ok = RunPipeline(produce, consume, false /* erase */);
+  SecureStringErase(&chunk);
+  if (!ok) {
+    LOG(ERROR) << "Could not unseal the stream";
+    return false;
+  } else if (!reader.Done()) {
+    LOG(ERROR) << "Sealed stream is truncated";
+    return false;
+  }
+  return true;
+}
+
+bool SealFile(Tao *tao, const string &policy, const string &in_path,
+              const string &out_path) {
+  ScopedFd in_fd(new int(open(in_path.c_str(), O_RDONLY)));
+  if (*in_fd < 0) {
+    PLOG(ERROR) << "Could not open " << in_path;
+    return false;
+  }
+  ScopedFd out_fd(new int(
+      open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600)));
+  if (*out_fd < 0) {
+    PLOG(ERROR) << "Could not create " << out_path;
+    return false;
+  }
+  if (!SealStream(tao, policy, *in_fd, *out_fd)) {
+    LOG(ERROR) << "Could not seal " << in_path << " to " << out_path;
+    unlink(out_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool UnsealFile(Tao *tao, const string &policy, const string &in_path,
+                const string &out_path) {
+  ScopedFd in_fd(new int(open(in_path.c_str(), O_RDONLY)));
+  if (*in_fd < 0) {
+    PLOG(ERROR) << "Could not open " << in_path;
+    return false;
+  }
+  ScopedFd out_fd(new int(
+      open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600)));
+  if (*out_fd < 0) {
+    PLOG(ERROR) << "Could not create " << out_path;
+    return false;
+  }
+  if (!UnsealStream(tao, policy, *in_fd, *out_fd)) {
+    LOG(ERROR) << "Could not unseal " << in_path << " to " << out_path;
+    unlink(out_path.c_str());
+    return false;
+  }
+  return true;
+}
+}  // namespace tao
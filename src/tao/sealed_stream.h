@@ -0,0 +1,193 @@
+//  File: sealed_stream.h
+//
+//  Description: Sealing and unsealing of large streams in fixed-size chunks.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TAO_SEALED_STREAM_H_
+#define TAO_SEALED_STREAM_H_
+
+#include <string>
+
+#include "tao/tao.h"
+#include "tao/util.h"
+
+namespace tao {
+/// Writes a stream sealed against the host Tao, using memory proportional to
+/// the chunk size rather than to the stream. Only a fresh data-encryption key
+/// is sealed by the Tao. The data is split into chunks that are each encrypted
+/// and authenticated with AES-256-GCM under that key. Each chunk is bound to
+/// its position, and the last chunk is marked, so that chunks can't be
+/// reordered, dropped, or truncated without detection.
+///
+/// The stream starts with a SealedStreamHeader, and each chunk follows as a
+/// frame, all framed by a 4-byte length in network byte order just as
+/// MessageChannel frames strings.
+class SealedStreamWriter {
+ public:
+  SealedStreamWriter() : fd_(-1), chunk_size_(0), index_(0), buffered_(0) {}
+  virtual ~SealedStreamWriter() { SecureStringErase(&buffer_); }
+
+  /// Seal a new data-encryption key and write the stream header.
+  /// @param tao The interface to access the host Tao.
+  /// @param policy A sealing policy under which to seal the key.
+  /// @param fd The file descriptor to write to. Ownership is not taken.
+  /// @param chunk_size The maximum number of plaintext bytes in each chunk.
+  bool Init(Tao *tao, const string &policy, int fd,
+            size_t chunk_size = DefaultChunkSize);
+
+  /// Encrypt and write data. Data is buffered until a whole chunk is ready.
+  /// @param data The data to write.
+  /// @param len The length of data.
+  bool Write(const void *data, size_t len);
+
+  /// Write any buffered data as the final chunk. This must be called once all
+  /// data has been written, or the stream will be rejected as truncated.
+  bool Finish();
+
+  /// The default maximum number of plaintext bytes in each chunk.
+  static constexpr size_t DefaultChunkSize = 1024 * 1024;
+
+  /// The largest chunk size that a stream may use.
+  static constexpr size_t MaxChunkSize = 16 * 1024 * 1024;
+
+ private:
+  /// The file descriptor to write to.
+  int fd_;
+
+  /// The maximum number of plaintext bytes in each chunk.
+  size_t chunk_size_;
+
+  /// The index of the next chunk.
+  uint64_t index_;
+
+  /// The cipher context, keyed with the data-encryption key.
+  ScopedCipherCtx ctx_;
+
+  /// Plaintext waiting to be written, in a buffer of chunk_size_ bytes that is
+  /// reused for each chunk and erased on destruction.
+  string buffer_;
+
+  /// The number of bytes of plaintext in buffer_.
+  size_t buffered_;
+
+  /// The frame being written, reused for each chunk.
+  string frame_;
+
+  /// Encrypt and write buffer_ as the next chunk.
+  /// @param final Whether this is the last chunk of the stream.
+  bool WriteChunk(bool final);
+
+  DISALLOW_COPY_AND_ASSIGN(SealedStreamWriter);
+};
+
+/// Reads a stream written by SealedStreamWriter, one chunk at a time.
+class SealedStreamReader {
+ public:
+  SealedStreamReader() : fd_(-1), chunk_size_(0), index_(0), done_(false) {}
+  virtual ~SealedStreamReader() {}
+
+  /// Read the stream header and unseal the data-encryption key.
+  /// @param tao The interface to access the host Tao.
+  /// @param policy The policy under which the stream is expected to have been
+  /// sealed. The call will fail if this does not match the actual policy.
+  /// @param fd The file descriptor to read from. Ownership is not taken.
+  bool Init(Tao *tao, const string &policy, int fd);
+
+  /// Read, decrypt, and authenticate the next chunk.
+  /// @param[out] chunk The plaintext of the chunk.
+  /// @param[out] eof Will be set to true iff the final chunk was already read.
+  bool Next(string *chunk, bool *eof);
+
+  /// Low-level functions, which let reading and decryption be done
+  /// concurrently. Next() is equivalent to ReadFrame() then OpenFrame().
+  /// @{
+
+  /// Read the next encrypted chunk without decrypting it.
+  /// @param[out] frame The encrypted chunk.
+  /// @param[out] eof Will be set to true iff the input ended cleanly.
+  bool ReadFrame(string *frame, bool *eof);
+
+  /// Decrypt and authenticate a chunk. Chunks must be opened in order.
+  /// @param frame An encrypted chunk from ReadFrame().
+  /// @param[out] chunk The plaintext of the chunk.
+  bool OpenFrame(const string &frame, string *chunk);
+
+  /// Check whether the final chunk has been opened.
+  bool Done() const { return done_; }
+
+  /// @}
+
+ private:
+  /// The file descriptor to read from.
+  int fd_;
+
+  /// The maximum number of plaintext bytes in each chunk.
+  size_t chunk_size_;
+
+  /// The index of the next chunk to open.
+  uint64_t index_;
+
+  /// Whether the final chunk has been opened.
+  bool done_;
+
+  /// The cipher context, keyed with the data-encryption key.
+  ScopedCipherCtx ctx_;
+
+  /// The frame being read by Next(), reused for each chunk.
+  string frame_;
+
+  DISALLOW_COPY_AND_ASSIGN(SealedStreamReader);
+};
+
+/// Seal everything from one file descriptor to another. Reading the input is
+/// overlapped with encrypting and writing the output.
+/// @param tao The interface to access the host Tao.
+/// @param policy A sealing policy under which to seal the stream.
+/// @param in_fd The file descriptor to read plaintext from.
+/// @param out_fd The file descriptor to write the sealed stream to.
+/// @param chunk_size The maximum number of plaintext bytes in each chunk.
+bool SealStream(Tao *tao, const string &policy, int in_fd, int out_fd,
+                size_t chunk_size = SealedStreamWriter::DefaultChunkSize);
+
+/// Unseal a stream from one file descriptor to another. Reading the input is
+/// overlapped with decrypting and writing the output. Data is written as each
+/// chunk is authenticated, so on failure the output holds a prefix of the
+/// plaintext and must be discarded.
+/// @param tao The interface to access the host Tao.
+/// @param policy The policy under which the stream is expected to have been
+/// sealed.
+/// @param in_fd The file descriptor to read the sealed stream from.
+/// @param out_fd The file descriptor to write plaintext to.
+bool UnsealStream(Tao *tao, const string &policy, int in_fd, int out_fd);
+
+/// Seal a file. See SealStream().
+/// @param tao The interface to access the host Tao.
+/// @param policy A sealing policy under which to seal the file.
+/// @param in_path The file to seal.
+/// @param out_path The location to store the sealed file.
+bool SealFile(Tao *tao, const string &policy, const string &in_path,
+              const string &out_path);
+
+/// Unseal a file. See UnsealStream(). On failure, out_path is removed.
+/// @param tao The interface to access the host Tao.
+/// @param policy The policy under which the file is expected to have been
+/// sealed.
+/// @param in_path The sealed file.
+/// @param out_path The location to store the unsealed file.
+bool UnsealFile(Tao *tao, const string &policy, const string &in_path,
+                const string &out_path);
+}  // namespace tao
+
+#endif  // TAO_SEALED_STREAM_H_
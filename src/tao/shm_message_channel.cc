@@ -0,0 +1,408 @@
+//  File: shm_message_channel.cc
+//
+//  Description: A MessageChannel that communicates over a pair of ring buffers
+//  in shared memory.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "tao/shm_message_channel.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "tao/util.h"
+
+namespace tao {
+
+/// One direction of a ShmMessageChannel. The positions count bytes since the
+/// channel was created, so the ring is empty when they are equal and full when
+/// they differ by the ring size. Each is written by only one endpoint, and
+/// they are kept on separate cache lines.
+struct ShmRing {
+  /// Total bytes written, advanced only by the writer.
+  alignas(64) std::atomic<uint64_t> head;
+
+  /// Total bytes read, advanced only by the reader.
+  alignas(64) std::atomic<uint64_t> tail;
+
+  /// Set by the reader while it waits for data.
+  alignas(64) std::atomic<uint32_t> reader_waiting;
+
+  /// Set by the writer while it waits for space.
+  std::atomic<uint32_t> writer_waiting;
+};
+
+/// The start of the shared memory. The ring data areas follow it.
+struct ShmChannelHeader {
+  /// Identifies the memory as a channel, and the layout version.
+  uint32_t magic;
+
+  /// The capacity of each ring, a power of two.
+  uint64_t ring_size;
+
+  /// The rings. Ring s is written by side s.
+  ShmRing rings[2];
+};
+
+/// The magic value for ShmChannelHeader, which includes a layout version.
+static constexpr uint32_t ShmChannelMagic = 0x54414f01;
+
+/// The size of the header, padded so that ring data starts on a page.
+static size_t ShmHeaderSize() {
+  size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  return (sizeof(ShmChannelHeader) + page - 1) / page * page;
+}
+
+constexpr size_t ShmMessageChannel::DefaultRingSize;
+
+ShmMessageChannel::ShmMessageChannel(int memfd, int doorbell, int side,
+                                     ShmChannelHeader *header, size_t map_len,
+                                     uint64_t ring_size)
+    : memfd_(memfd),
+      doorbell_(doorbell),
+      side_(side),
+      header_(header),
+      map_len_(map_len),
+      size_(ring_size),
+      peer_gone_(false) {}
+
+bool ShmMessageChannel::CreatePair(size_t ring_size,
+                                   unique_ptr<ShmMessageChannel> *first,
+                                   unique_ptr<ShmMessageChannel> *second) {
+  size_t size = 1;
+  while (size < ring_size) {
+    size <<= 1;
+  }
+  size_t map_len = ShmHeaderSize() + 2 * size;
+  int memfd = memfd_create("tao_shm_channel", 0);
+  if (memfd < 0) {
+    PLOG(ERROR) << "Could not create shared memory for channel";
+    return false;
+  }
+  if (ftruncate(memfd, map_len) < 0) {
+    PLOG(ERROR) << "Could not size shared memory for channel";
+    close(memfd);
+    return false;
+  }
+  int doorbells[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, doorbells) < 0) {
+    PLOG(ERROR) << "Could not create doorbell for channel";
+    close(memfd);
+    return false;
+  }
+  void *mem[2];
+  for (int i = 0; i < 2; i++) {
+    mem[i] =
+        mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (mem[i] == MAP_FAILED) {
+      PLOG(ERROR) << "Could not map shared memory for channel";
+      if (i == 1) munmap(mem[0], map_len);
+      close(memfd);
+      close(doorbells[0]);
+      close(doorbells[1]);
+      return false;
+    }
+  }
+  // The new file is zero-filled, which is the initial state of every field.
+  ShmChannelHeader *header = new (mem[0]) ShmChannelHeader();
+  header->magic = ShmChannelMagic;
+  header->ring_size = size;
+  // Each endpoint owns its own descriptor for the memory.
+  int memfd2 = dup(memfd);
+  if (memfd2 < 0) {
+    PLOG(ERROR) << "Could not duplicate shared memory descriptor";
+    munmap(mem[0], map_len);
+    munmap(mem[1], map_len);
+    close(memfd);
+    close(doorbells[0]);
+    close(doorbells[1]);
+    return false;
+  }
+  first->reset(new ShmMessageChannel(
+      memfd, doorbells[0], 0, static_cast<ShmChannelHeader *>(mem[0]),
+      map_len, size));
+  second->reset(new ShmMessageChannel(
+      memfd2, doorbells[1], 1, static_cast<ShmChannelHeader *>(mem[1]),
+      map_len, size));
+  return true;
+}
+
+void ShmMessageChannel::ShmClose() {
+  // Closing the doorbell is what tells the peer, once every copy of this
+  // endpoint's descriptors is closed, just as with a pipe.
+  if (header_ != nullptr) {
+    munmap(header_, map_len_);
+    header_ = nullptr;
+  }
+  if (memfd_ != -1) {
+    close(memfd_);
+  }
+  if (doorbell_ != -1) {
+    close(doorbell_);
+  }
+  memfd_ = doorbell_ = -1;
+}
+
+char *ShmMessageChannel::RingData(int ring) const {
+  return reinterpret_cast<char *>(header_) + ShmHeaderSize() +
+         ring * size_;
+}
+
+bool ShmMessageChannel::CheckRing(uint64_t head, uint64_t tail) {
+  if (head - tail > size_) {
+    LOG(ERROR) << "ShmMessageChannel ring is corrupt";
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void ShmMessageChannel::Notify(ShmRing *ring, bool reader) {
+  // Pairs with the fence in the waiting endpoint: either it sees our update
+  // to the ring, or we see its flag.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  std::atomic<uint32_t> &waiting =
+      reader ? ring->reader_waiting : ring->writer_waiting;
+  if (waiting.load(std::memory_order_relaxed) == 0) {
+    return;
+  }
+  // A full doorbell already has a wakeup pending, so EAGAIN is harmless.
+  char c = 0;
+  ssize_t n;
+  do {
+    n = send(doorbell_, &c, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    peer_gone_ = true;
+  }
+}
+
+bool ShmMessageChannel::WaitForDoorbell() {
+  // Drain any rings that have accumulated, so the next wait blocks.
+  char buf[64];
+  ssize_t n;
+  do {
+    n = recv(doorbell_, buf, sizeof(buf), 0);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    PLOG(ERROR) << "Could not wait for channel doorbell";
+    return false;
+  } else if (n == 0) {
+    peer_gone_ = true;
+  }
+  return true;
+}
+
+bool ShmMessageChannel::Put(const void *buffer, size_t buffer_len) {
+  ShmRing *ring = &header_->rings[side_];
+  uint64_t size = size_;
+  char *data = RingData(side_);
+  const char *src = reinterpret_cast<const char *>(buffer);
+  while (buffer_len > 0) {
+    if (peer_gone_) {
+      LOG(ERROR) << "Could not send data, peer closed the channel";
+      Close();
+      return false;
+    }
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    if (!CheckRing(head, tail)) {
+      return false;
+    }
+    uint64_t space = size - (head - tail);
+    if (space == 0) {
+      // The reader must be told about what is already in the ring, or it
+      // might never make room for the rest.
+      Notify(ring, true);
+      ring->writer_waiting.store(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (ring->tail.load(std::memory_order_relaxed) == tail &&
+          !WaitForDoorbell()) {
+        ring->writer_waiting.store(0, std::memory_order_relaxed);
+        Close();
+        return false;
+      }
+      ring->writer_waiting.store(0, std::memory_order_relaxed);
+      continue;
+    }
+    size_t len = static_cast<size_t>(std::min<uint64_t>(space, buffer_len));
+    size_t offset = static_cast<size_t>(head & (size - 1));
+    size_t first = std::min<size_t>(len, size - offset);
+    memcpy(data + offset, src, first);
+    memcpy(data, src + first, len - first);
+    ring->head.store(head + len, std::memory_order_release);
+    src += len;
+    buffer_len -= len;
+  }
+  return true;
+}
+
+bool ShmMessageChannel::SendData(const void *buffer, size_t buffer_len) {
+  if (IsClosed()) {
+    LOG(ERROR) << "Could not send data, channel already closed";
+    return false;
+  }
+  if (!Put(buffer, buffer_len)) {
+    return false;
+  }
+  Notify(&header_->rings[side_], true);
+  return true;
+}
+
+bool ShmMessageChannel::SendString(const string &s) {
+  return SendStrings(std::vector<const string *>(1, &s));
+}
+
+bool ShmMessageChannel::SendStrings(const std::vector<const string *> &strs) {
+  if (IsClosed()) {
+    LOG(ERROR) << "Could not send data, channel already closed";
+    return false;
+  }
+  for (const string *s : strs) {
+    uint32_t net_len = htonl(s->size());
+    if (!Put(&net_len, sizeof(net_len)) || !Put(s->data(), s->size())) {
+      return false;
+    }
+  }
+  // One wakeup, if any, covers all of the frames.
+  Notify(&header_->rings[side_], true);
+  return true;
+}
+
+bool ShmMessageChannel::ReceivePartialData(void *buffer, size_t max_recv_len,
+                                           size_t *recv_len, bool *eof) {
+  if (IsClosed()) {
+    LOG(ERROR) << "Can't receive data, channel is already closed";
+    *eof = true;
+    return true;
+  } else {
+    *eof = false;
+  }
+  int peer = 1 - side_;
+  ShmRing *ring = &header_->rings[peer];
+  uint64_t size = size_;
+  uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+  uint64_t head = ring->head.load(std::memory_order_acquire);
+  while (head == tail) {
+    if (peer_gone_) {
+      // The peer published its data before going away, so check once more.
+      head = ring->head.load(std::memory_order_acquire);
+      if (head != tail) break;
+      *eof = true;
+      Close();
+      return true;
+    }
+    ring->reader_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    head = ring->head.load(std::memory_order_acquire);
+    if (head == tail && !WaitForDoorbell()) {
+      ring->reader_waiting.store(0, std::memory_order_relaxed);
+      Close();
+      return false;
+    }
+    ring->reader_waiting.store(0, std::memory_order_relaxed);
+    head = ring->head.load(std::memory_order_acquire);
+  }
+  if (!CheckRing(head, tail)) {
+    return false;
+  }
+  size_t len = static_cast<size_t>(std::min<uint64_t>(head - tail, max_recv_len));
+  size_t offset = static_cast<size_t>(tail & (size - 1));
+  size_t first = std::min<size_t>(len, size - offset);
+  const char *data = RingData(peer);
+  char *dst = reinterpret_cast<char *>(buffer);
+  memcpy(dst, data + offset, first);
+  memcpy(dst + first, data, len - first);
+  ring->tail.store(tail + len, std::memory_order_release);
+  Notify(ring, false);
+  *recv_len = len;
+  return true;
+}
+
+bool ShmMessageChannel::GetFileDescriptors(list<int> *keep_open) const {
+  if (memfd_ != -1) {
+    keep_open->push_back(memfd_);
+  }
+  if (doorbell_ != -1) {
+    keep_open->push_back(doorbell_);
+  }
+  return true;
+}
+
+bool ShmMessageChannel::SerializeToString(string *params) const {
+  stringstream out;
+  out << "tao::ShmMessageChannel(" << memfd_ << ", " << doorbell_ << ", "
+      << side_ << ")";
+  params->assign(out.str());
+  return true;
+}
+
+ShmMessageChannel *ShmMessageChannel::DeserializeFromString(
+    const string &params) {
+  stringstream in(params);
+  skip(in, "tao::ShmMessageChannel(");
+  if (!in) return nullptr;  // not for us
+  int memfd, doorbell, side;
+  in >> memfd;
+  skip(in, ", ");
+  in >> doorbell;
+  skip(in, ", ");
+  in >> side;
+  skip(in, ")");
+  if (!in || (in.get() && !in.eof()) || (side != 0 && side != 1)) {
+    LOG(ERROR) << "Could not deserialize ShmMessageChannel";
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(memfd, &st) < 0) {
+    PLOG(ERROR) << "Could not get size of ShmMessageChannel memory";
+    return nullptr;
+  }
+  size_t map_len = static_cast<size_t>(st.st_size);
+  if (map_len < ShmHeaderSize()) {
+    LOG(ERROR) << "ShmMessageChannel memory is too small";
+    return nullptr;
+  }
+  void *mem =
+      mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (mem == MAP_FAILED) {
+    PLOG(ERROR) << "Could not map ShmMessageChannel memory";
+    return nullptr;
+  }
+  ShmChannelHeader *header = static_cast<ShmChannelHeader *>(mem);
+  uint64_t size = header->ring_size;
+  if (header->magic != ShmChannelMagic || size == 0 ||
+      (size & (size - 1)) != 0 || ShmHeaderSize() + 2 * size != map_len) {
+    LOG(ERROR) << "Invalid ShmMessageChannel memory";
+    munmap(mem, map_len);
+    return nullptr;
+  }
+  return new ShmMessageChannel(memfd, doorbell, side, header, map_len, size);
+}
+
+}  // namespace tao
@@ -0,0 +1,154 @@
+//  File: shm_message_channel.h
+//
+//  Description: A MessageChannel that communicates over a pair of ring buffers
+//  in shared memory.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TAO_SHM_MESSAGE_CHANNEL_H_
+#define TAO_SHM_MESSAGE_CHANNEL_H_
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include "tao/message_channel.h"
+
+#include "tao/util.h"
+
+namespace tao {
+struct ShmChannelHeader;
+struct ShmRing;
+
+/// A MessageChannel between two co-located processes that exchanges data
+/// through shared memory rather than through the kernel. A memfd holds two
+/// single-producer, single-consumer ring buffers, one for each direction, and
+/// both endpoints map it. Data is copied straight into the peer's ring, so a
+/// large Seal or Unseal payload is not copied in and out of a pipe buffer.
+///
+/// An endpoint only asks to be woken when it finds its ring empty (or, when
+/// sending, full), and the peer only rings the doorbell when asked, so a
+/// steady stream of messages needs few wakeups. The doorbell is a Unix socket
+/// pair rather than an eventfd, so that closing an endpoint, or exiting, is
+/// seen by the peer as end of stream, just as with a pipe.
+///
+/// As with FDMessageChannel, each endpoint must be used by one thread at a
+/// time. On Close() or object destruction the descriptors will be closed.
+class ShmMessageChannel : public MessageChannel {
+ public:
+  virtual ~ShmMessageChannel() { ShmClose(); }
+
+  /// Create both endpoints of a new channel. Typically one endpoint is kept
+  /// and the other is serialized and passed to a hosted program.
+  /// @param ring_size The capacity of each ring in bytes. This is rounded up to
+  /// a power of two.
+  /// @param[out] first The first endpoint.
+  /// @param[out] second The second endpoint.
+  static bool CreatePair(size_t ring_size,
+                         unique_ptr<ShmMessageChannel> *first,
+                         unique_ptr<ShmMessageChannel> *second);
+
+  /// These methods have the same semantics as MessageChannel.
+  /// @{
+  virtual void Close() { ShmClose(); }
+  virtual bool IsClosed() const { return header_ == nullptr; }
+  virtual bool SendData(const void *buffer, size_t buffer_len);
+  virtual bool SendString(const string &s);
+  virtual bool SendStrings(const std::vector<const string *> &strs);
+  virtual bool SerializeToString(string *params) const;
+  /// @}
+
+  /// The default capacity of each ring.
+  static constexpr size_t DefaultRingSize = 1024 * 1024;
+
+  /// Attempt to deserialize a channel.
+  /// @param params Channel parameters from SerializeToString().
+  static ShmMessageChannel *DeserializeFromString(const string &params);
+
+  /// Get a list of file descriptors that should be kept open across fork/exec.
+  /// @param[out] keep_open The list of file descriptors to preserve.
+  virtual bool GetFileDescriptors(list<int> *keep_open) const;
+
+ protected:
+  /// Construct an endpoint over an already-mapped region.
+  /// @param memfd The file descriptor of the shared memory.
+  /// @param doorbell This endpoint's half of the doorbell socket pair.
+  /// @param side Which endpoint this is, 0 or 1.
+  /// @param header The mapped shared memory. Ownership is taken.
+  /// @param map_len The length of the mapping.
+  /// @param ring_size The validated capacity of each ring.
+  ShmMessageChannel(int memfd, int doorbell, int side,
+                    ShmChannelHeader *header, size_t map_len,
+                    uint64_t ring_size);
+
+  /// These methods have the same semantics as MessageChannel.
+  /// @{
+  virtual bool ReceivePartialData(void *buffer, size_t max_recv_len,
+                                  size_t *recv_len, bool *eof);
+  /// @}
+
+  /// A non-virtual version of Close for use in destructor.
+  void ShmClose();
+
+ private:
+  /// File descriptor of the shared memory.
+  int memfd_;
+
+  /// This endpoint's half of the doorbell socket pair.
+  int doorbell_;
+
+  /// Which endpoint this is. Side s writes ring s and reads ring 1 - s.
+  int side_;
+
+  /// The shared memory, or nullptr once closed.
+  ShmChannelHeader *header_;
+
+  /// The length of the mapping.
+  size_t map_len_;
+
+  /// The capacity of each ring. This is checked against the mapping once and
+  /// kept here, since the copy in shared memory can be changed by the peer.
+  uint64_t size_;
+
+  /// Whether the peer has closed the channel or exited, as seen by end of
+  /// stream or an error on the doorbell.
+  bool peer_gone_;
+
+  /// Copy data into the outgoing ring, waiting for space as needed. The peer
+  /// is woken only if it has to be for progress to be made.
+  bool Put(const void *buffer, size_t buffer_len);
+
+  /// Wake the peer if it is waiting on the given ring.
+  /// @param ring The ring that has changed.
+  /// @param reader Whether the peer would be waiting as the ring's reader
+  /// (for data) rather than its writer (for space).
+  void Notify(ShmRing *ring, bool reader);
+
+  /// Block until the doorbell rings or the peer goes away.
+  bool WaitForDoorbell();
+
+  /// Check that a ring's positions are consistent. The peer can write any
+  /// value into shared memory, so a ring holding more than size_ bytes is
+  /// treated as corruption and the channel is closed.
+  bool CheckRing(uint64_t head, uint64_t tail);
+
+  /// Get the base of a ring's data area.
+  char *RingData(int ring) const;
+
+  DISALLOW_COPY_AND_ASSIGN(ShmMessageChannel);
+};
+
+}  // namespace tao
+
+#endif  // TAO_SHM_MESSAGE_CHANNEL_H_
@@ -0,0 +1,330 @@
+//  File: soft_tao.cc
+//
+//  Description: A Tao implemented in software, with keys held in memory.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "tao/soft_tao.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+using std::lock_guard;
+using std::mutex;
+
+namespace tao {
+
+/// The size of each SoftTao key.
+static constexpr size_t SoftTaoKeySize = 32;
+
+/// The version byte that starts each sealed blob.
+static constexpr char SoftTaoSealVersion = 1;
+
+/// The sizes of the GCM nonce and tag in a sealed blob.
+static constexpr size_t SoftTaoNonceSize = 12;
+static constexpr size_t SoftTaoTagSize = 16;
+
+/// Append a big-endian integer to a string.
+/// @param value The integer.
+/// @param bytes The number of low-order bytes of value to append.
+/// @param[out] out The string to append to.
+static void AppendBigEndian(uint64_t value, int bytes, string *out) {
+  for (int i = bytes - 1; i >= 0; i--) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+/// Read a big-endian integer from a string.
+/// @param in The string.
+/// @param pos The offset of the integer, which is advanced past it.
+/// @param bytes The size of the integer.
+/// @param[out] value The integer.
+static bool ReadBigEndian(const string &in, size_t *pos, int bytes,
+                          uint64_t *value) {
+  if (in.size() < *pos || in.size() - *pos < static_cast<size_t>(bytes)) {
+    return false;
+  }
+  *value = 0;
+  for (int i = 0; i < bytes; i++) {
+    *value = (*value << 8) | static_cast<unsigned char>(in[(*pos)++]);
+  }
+  return true;
+}
+
+bool SoftTao::Init(const string &name) {
+  state_.reset(new SharedState());
+  state_->seal_key.resize(SoftTaoKeySize);
+  state_->secret_key.resize(SoftTaoKeySize);
+  if (!RAND_bytes(str2uchar(&state_->seal_key), SoftTaoKeySize) ||
+      !RAND_bytes(str2uchar(&state_->secret_key), SoftTaoKeySize)) {
+    LOG(ERROR) << "Could not generate keys for SoftTao";
+    state_.reset();
+    return false;
+  }
+  name_ = name;
+  return true;
+}
+
+SoftTao *SoftTao::NewChild(const string &subprin) const {
+  SoftTao *child = new SoftTao();
+  child->state_ = state_;
+  child->name_ = name_ + "::" + subprin;
+  return child;
+}
+
+bool SoftTao::Fail(const string &msg) {
+  failure_msg_ = msg;
+  LOG(ERROR) << "SoftTao: " << msg;
+  return false;
+}
+
+bool SoftTao::PolicyBinding(const string &policy, string *binding) {
+  if (policy == Tao::SealPolicyDefault ||
+      policy == Tao::SealPolicyConservative) {
+    *binding = name_;
+  } else if (policy == Tao::SealPolicyLiberal) {
+    binding->clear();
+  } else {
+    return Fail("Unsupported policy " + policy);
+  }
+  return true;
+}
+
+bool SoftTao::GetTaoName(string *name) {
+  if (state_.get() == nullptr) return Fail("Not initialized");
+  name->assign(name_);
+  return true;
+}
+
+bool SoftTao::ExtendTaoName(const string &subprin) {
+  if (state_.get() == nullptr) return Fail("Not initialized");
+  if (subprin.empty()) return Fail("Invalid subprincipal");
+  name_ += "::" + subprin;
+  return true;
+}
+
+bool SoftTao::GetRandomBytes(size_t size, string *bytes) {
+  if (size == 0) return Fail("Invalid size");
+  bytes->resize(size);
+  if (!RAND_bytes(str2uchar(bytes), size)) {
+    return Fail("Could not generate random bytes");
+  }
+  return true;
+}
+
+bool SoftTao::GetSharedSecret(size_t size, const string &policy,
+                              string *bytes) {
+  if (state_.get() == nullptr) return Fail("Not initialized");
+  if (size == 0) return Fail("Invalid size");
+  string binding;
+  if (!PolicyBinding(policy, &binding)) {
+    return false;
+  }
+  // Expand HMAC-SHA256(secret_key, counter || policy || binding) in counter
+  // mode to the requested size.
+  string info;
+  AppendBigEndian(policy.size(), 4, &info);
+  info += policy;
+  info += binding;
+  bytes->clear();
+  unsigned char block[EVP_MAX_MD_SIZE];
+  for (uint32_t counter = 1; bytes->size() < size; counter++) {
+    string input;
+    AppendBigEndian(counter, 4, &input);
+    input += info;
+    unsigned int len;
+    if (HMAC(EVP_sha256(), state_->secret_key.data(),
+             state_->secret_key.size(),
+             reinterpret_cast<const unsigned char *>(input.data()),
+             input.size(), block, &len) == nullptr) {
+      return Fail("Could not derive a shared secret");
+    }
+    bytes->append(reinterpret_cast<char *>(block),
+                  std::min<size_t>(len, size - bytes->size()));
+  }
+  OPENSSL_cleanse(block, sizeof(block));
+  return true;
+}
+
+bool SoftTao::Attest(const string &message, string *attestation) {
+  return Fail("Attest is not supported");
+}
+
+bool SoftTao::Seal(const string &data, const string &policy, string *sealed) {
+  if (state_.get() == nullptr) return Fail("Not initialized");
+  string binding;
+  if (!PolicyBinding(policy, &binding)) {
+    return false;
+  }
+  if (policy.size() > 0xffff) return Fail("Policy is too long");
+  string header(1, SoftTaoSealVersion);
+  AppendBigEndian(policy.size(), 2, &header);
+  header += policy;
+  string aad = header + binding;
+  string nonce(SoftTaoNonceSize, 0);
+  if (!RAND_bytes(str2uchar(&nonce), nonce.size())) {
+    return Fail("Could not generate a nonce");
+  }
+  size_t prefix = header.size() + nonce.size();
+  sealed->assign(header);
+  sealed->append(nonce);
+  sealed->resize(prefix + data.size() + SoftTaoTagSize);
+  unsigned char *out = str2uchar(sealed) + prefix;
+  ScopedCipherCtx ctx(EVP_CIPHER_CTX_new());
+  int len, final_len;
+  if (ctx.get() == nullptr ||
+      !EVP_EncryptInit_ex(ctx.get(), EVP_aes_256_gcm(), nullptr, nullptr,
+                          nullptr) ||
+      !EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_IVLEN, nonce.size(),
+                           nullptr) ||
+      !EVP_EncryptInit_ex(ctx.get(), nullptr, nullptr,
+                          str2uchar(&state_->seal_key), str2uchar(&nonce)) ||
+      !EVP_EncryptUpdate(ctx.get(), nullptr, &len, str2uchar(&aad),
+                         aad.size()) ||
+      !EVP_EncryptUpdate(ctx.get(), out, &len,
+                         reinterpret_cast<const unsigned char *>(data.data()),
+                         data.size()) ||
+      !EVP_EncryptFinal_ex(ctx.get(), out + len, &final_len) ||
+      !EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, SoftTaoTagSize,
+                           out + data.size())) {
+    OpenSSLSuccess();
+    return Fail("Could not seal data");
+  }
+  return true;
+}
+
+bool SoftTao::Unseal(const string &sealed, string *data, string *policy) {
+  if (state_.get() == nullptr) return Fail("Not initialized");
+  size_t pos = 1;
+  uint64_t policy_len;
+  if (sealed.empty() || sealed[0] != SoftTaoSealVersion ||
+      !ReadBigEndian(sealed, &pos, 2, &policy_len) ||
+      sealed.size() - pos < policy_len + SoftTaoNonceSize + SoftTaoTagSize) {
+    return Fail("Invalid sealed data");
+  }
+  string sealed_policy = sealed.substr(pos, policy_len);
+  pos += policy_len;
+  string binding;
+  if (!PolicyBinding(sealed_policy, &binding)) {
+    return false;
+  }
+  string aad = sealed.substr(0, pos) + binding;
+  const unsigned char *nonce =
+      reinterpret_cast<const unsigned char *>(sealed.data()) + pos;
+  const unsigned char *in = nonce + SoftTaoNonceSize;
+  size_t in_len = sealed.size() - pos - SoftTaoNonceSize - SoftTaoTagSize;
+  data->resize(in_len);
+  unsigned char *out = str2uchar(data);
+  ScopedCipherCtx ctx(EVP_CIPHER_CTX_new());
+  int len, final_len;
+  if (ctx.get() == nullptr ||
+      !EVP_DecryptInit_ex(ctx.get(), EVP_aes_256_gcm(), nullptr, nullptr,
+                          nullptr) ||
+      !EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_IVLEN, SoftTaoNonceSize,
+                           nullptr) ||
+      !EVP_DecryptInit_ex(ctx.get(), nullptr, nullptr,
+                          str2uchar(&state_->seal_key), nonce) ||
+      !EVP_DecryptUpdate(ctx.get(), nullptr, &len, str2uchar(&aad),
+                         aad.size()) ||
+      !EVP_DecryptUpdate(ctx.get(), out, &len, in, in_len) ||
+      !EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG, SoftTaoTagSize,
+                           const_cast<unsigned char *>(in + in_len)) ||
+      !EVP_DecryptFinal_ex(ctx.get(), out + len, &final_len)) {
+    ERR_clear_error();
+    SecureStringErase(data);
+    data->clear();
+    return Fail("Could not unseal data");
+  }
+  policy->assign(sealed_policy);
+  return true;
+}
+
+bool SoftTao::InitCounter(const string &label, int64_t &c) {
+  if (state_.get() == nullptr) return Fail("Not initialized");
+  if (label.empty()) return Fail("Label unspecified");
+  lock_guard<mutex> lock(state_->counter_mutex);
+  auto it = state_->counters.find(CounterKey(label));
+  if (it == state_->counters.end() || it->second <= c) {
+    state_->counters[CounterKey(label)] = c;
+  }
+  return true;
+}
+
+bool SoftTao::GetCounter(const string &label, int64_t *c) {
+  if (state_.get() == nullptr) return Fail("Not initialized");
+  lock_guard<mutex> lock(state_->counter_mutex);
+  auto it = state_->counters.find(CounterKey(label));
+  if (it == state_->counters.end()) {
+    return Fail("No such counter");
+  }
+  *c = it->second;
+  return true;
+}
+
+bool SoftTao::RollbackProtectedSeal(const string &label, const string &data,
+                                    const string &policy, string *sealed) {
+  if (state_.get() == nullptr) return Fail("Not initialized");
+  int64_t c;
+  {
+    lock_guard<mutex> lock(state_->counter_mutex);
+    auto it = state_->counters.find(CounterKey(label));
+    if (it == state_->counters.end()) {
+      return Fail("Can't get current counter");
+    }
+    c = ++it->second;
+  }
+  // The label and new counter value are sealed along with the data.
+  ScopedSafeString payload(new string());
+  AppendBigEndian(label.size(), 4, payload.get());
+  payload->append(label);
+  AppendBigEndian(static_cast<uint64_t>(c), 8, payload.get());
+  payload->append(data);
+  return Seal(*payload, policy, sealed);
+}
+
+bool SoftTao::RollbackProtectedUnseal(const string &sealed, string *data,
+                                      string *policy) {
+  ScopedSafeString payload(new string());
+  if (!Unseal(sealed, payload.get(), policy)) {
+    return false;
+  }
+  size_t pos = 0;
+  uint64_t label_len, sealed_counter;
+  if (!ReadBigEndian(*payload, &pos, 4, &label_len) ||
+      payload->size() - pos < label_len) {
+    return Fail("Invalid rollback-protected data");
+  }
+  string label = payload->substr(pos, label_len);
+  pos += label_len;
+  if (!ReadBigEndian(*payload, &pos, 8, &sealed_counter)) {
+    return Fail("Invalid rollback-protected data");
+  }
+  int64_t c;
+  if (!GetCounter(label, &c)) {
+    return false;
+  }
+  if (static_cast<int64_t>(sealed_counter) != c) {
+    return Fail("Rollback-protected data has a stale counter");
+  }
+  data->assign(*payload, pos, string::npos);
+  return true;
+}
+}  // namespace tao
@@ -0,0 +1,126 @@
+//  File: soft_tao.h
+//
+//  Description: A Tao implemented in software, with keys held in memory.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TAO_SOFT_TAO_H_
+#define TAO_SOFT_TAO_H_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "tao/tao.h"
+#include "tao/util.h"
+
+namespace tao {
+/// A Tao whose keys are generated and held in memory, for use as a stand-in
+/// host when testing or benchmarking hosted programs and host-side code. A
+/// SoftTao offers no protection beyond that of its own process, and its keys
+/// do not survive it, so data sealed by one instance can only be unsealed by
+/// the same instance or its children.
+///
+/// Sealing uses AES-256-GCM. Data sealed under the "self" and "few" policies
+/// is bound to the Tao name of the sealer, while the "any" policy binds only
+/// to the keys. Attestation is not supported.
+///
+/// Each SoftTao should be used by one thread at a time. A parent and its
+/// children may be used concurrently.
+class SoftTao : public Tao {
+ public:
+  SoftTao() {}
+  virtual ~SoftTao() {}
+
+  /// Generate fresh keys.
+  /// @param name The Tao name of this instance.
+  bool Init(const string &name);
+
+  /// Create a SoftTao for a hosted program, which shares keys and counters
+  /// with this one and whose name extends this one's.
+  /// @param subprin The extension to the name.
+  SoftTao *NewChild(const string &subprin) const;
+
+  /// Tao implementation.
+  /// @{
+  virtual bool GetTaoName(string *name);
+  virtual bool ExtendTaoName(const string &subprin);
+  virtual bool GetRandomBytes(size_t size, string *bytes);
+  virtual bool GetSharedSecret(size_t size, const string &policy,
+                               string *bytes);
+  virtual bool Attest(const string &message, string *attestation);
+  virtual bool Seal(const string &data, const string &policy, string *sealed);
+  virtual bool Unseal(const string &sealed, string *data, string *policy);
+  virtual bool InitCounter(const string &label, int64_t &c);
+  virtual bool GetCounter(const string &label, int64_t *c);
+  virtual bool RollbackProtectedSeal(const string &label, const string &data,
+                                     const string &policy, string *sealed);
+  virtual bool RollbackProtectedUnseal(const string &sealed, string *data,
+                                       string *policy);
+  virtual string GetRecentErrorMessage() const { return failure_msg_; }
+  virtual string ResetRecentErrorMessage() {
+    string msg = failure_msg_;
+    failure_msg_.clear();
+    return msg;
+  }
+  /// @}
+
+ private:
+  /// State shared by a SoftTao and its children.
+  struct SharedState {
+    /// The key for sealing.
+    string seal_key;
+
+    /// The key for deriving shared secrets.
+    string secret_key;
+
+    /// Protects counters.
+    std::mutex counter_mutex;
+
+    /// Rollback counters, keyed by Tao name and label.
+    std::map<string, int64_t> counters;
+
+    ~SharedState() {
+      SecureStringErase(&seal_key);
+      SecureStringErase(&secret_key);
+    }
+  };
+
+  /// The keys and counters.
+  std::shared_ptr<SharedState> state_;
+
+  /// The Tao name of this instance.
+  string name_;
+
+  /// The most recent error message.
+  string failure_msg_;
+
+  /// Record an error for GetRecentErrorMessage().
+  /// @param msg The error message.
+  bool Fail(const string &msg);
+
+  /// Get the name that data sealed under a policy is bound to.
+  /// @param policy The sealing policy.
+  /// @param[out] binding The name, or the empty string.
+  bool PolicyBinding(const string &policy, string *binding);
+
+  /// Get the key under which counters for a label are stored.
+  string CounterKey(const string &label) const { return name_ + '\0' + label; }
+
+  DISALLOW_COPY_AND_ASSIGN(SoftTao);
+};
+}  // namespace tao
+
+#endif  // TAO_SOFT_TAO_H_
@@ -21,12 +21,25 @@
 #include <glog/logging.h>
 
 #include "tao/fd_message_channel.h"
+#include "tao/shm_message_channel.h"
 
 namespace tao {
+constexpr size_t TaoRPC::DefaultMaxOutstanding;
+const char TaoRPC::BatchUnsupportedError[] =
+    "rpc: can't find method Tao.Batch";
 
 bool TaoRPC::GetTaoName(string *name) {
+  if (tao_name_known_) {
+    name->assign(tao_name_);
+    return true;
+  }
   TaoRPCRequest rpc;
-  return Request("Tao.GetTaoName", rpc, name, nullptr /* policy */, nullptr);
+  if (!Request("Tao.GetTaoName", rpc, name, nullptr /* policy */, nullptr)) {
+    return false;
+  }
+  tao_name_ = *name;
+  tao_name_known_ = true;
+  return true;
 }
 
 bool TaoRPC::ExtendTaoName(const string &subprin) {
@@ -97,59 +110,125 @@ bool TaoRPC::RollbackProtectedUnseal(const string &sealed, string *data, string
 
 bool TaoRPC::Request(const string &op, const TaoRPCRequest &req, string *data,
                      string *policy, int64_t* counter) {
+  bool ok = false;
+  uint64_t seq;
+  auto done = [&](bool success, const TaoRPCResponse &resp) {
+    ok = success && UnpackResponse(resp, data, policy, counter);
+  };
+  if (!SendAsync(op, req, done, &seq) || !Wait(seq)) {
+    return false;
+  }
+  return ok;
+}
+
+bool TaoRPC::SendAsync(const string &op, const TaoRPCRequest &req,
+                       ResponseCallback callback, uint64_t *seq) {
+  // Bound the pipeline depth so neither side can fill the channel in both
+  // directions at once.
+  while (pending_.size() >= max_outstanding_) {
+    if (!ReceiveResponse()) {
+      return false;
+    }
+  }
+  // Forget the name once it may change, whether or not the change succeeds.
+  if (op == "Tao.ExtendTaoName") {
+    tao_name_known_ = false;
+  }
+  for (const TaoRPCBatchOp &batch_op : req.batch()) {
+    if (batch_op.op() == "Tao.ExtendTaoName") {
+      tao_name_known_ = false;
+    }
+  }
   ProtoRPCRequestHeader reqHdr;
-  ProtoRPCResponseHeader respHdr;
   reqHdr.set_op(op);
   reqHdr.set_seq(++last_seq_);
-  TaoRPCResponse resp;
-  bool eof;
-  if (!channel_->SendMessage(reqHdr)) {
-    failure_msg_ = "Channel send header failed";
-    LOG(ERROR) << "RPC to Tao host failed: " << failure_msg_;
+  // The header and request go out together, in a single write if the channel
+  // supports it.
+  if (!channel_->SendMessages({&reqHdr, &req})) {
+    FailOutstanding("Channel send failed");
     return false;
   }
-  if (!channel_->SendMessage(req)) {
-    failure_msg_ = "Channel send failed";
-    LOG(ERROR) << "RPC to Tao host failed: " << failure_msg_;
-    return false;
+  PendingRequest &pending = pending_[reqHdr.seq()];
+  pending.op = op;
+  pending.callback = callback;
+  if (seq != nullptr) {
+    *seq = reqHdr.seq();
   }
+  return true;
+}
+
+bool TaoRPC::Wait(uint64_t seq) {
+  while (pending_.count(seq) != 0) {
+    if (!ReceiveResponse()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TaoRPC::WaitAll() {
+  while (!pending_.empty()) {
+    if (!ReceiveResponse()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TaoRPC::ReceiveResponse() {
+  ProtoRPCResponseHeader respHdr;
+  TaoRPCResponse resp;
+  bool eof;
   if (!channel_->ReceiveMessage(&respHdr, &eof)) {
-    failure_msg_ = "Channel receive header failed";
-    LOG(ERROR) << "RPC to Tao host failed: " << failure_msg_;
-    return false;
+    return FailOutstanding("Channel receive header failed");
   }
   if (eof) {
-    failure_msg_ = "Channel is closed";
-    LOG(ERROR) << "RPC to Tao host failed: " << failure_msg_;
-    return false;
+    return FailOutstanding("Channel is closed");
   }
+  auto it = pending_.find(respHdr.seq());
+  if (it == pending_.end()) {
+    return FailOutstanding("Unexpected sequence number in response");
+  }
+  PendingRequest pending = std::move(it->second);
+  pending_.erase(it);
   if (respHdr.has_error()) {
     failure_msg_ = respHdr.error();
     LOG(ERROR) << "RPC to Tao host failed: " << failure_msg_;
     string discard;
     channel_->ReceiveString(&discard, &eof);
-    return false;
+    pending.callback(false, resp);
+    return true;
   }
-  if (!channel_->ReceiveMessage(&resp, &eof)) {
-    failure_msg_ = "Channel receive failed";
-    LOG(ERROR) << "RPC to Tao host failed: " << failure_msg_;
+  if (!channel_->ReceiveMessage(&resp, &eof) || eof) {
+    FailOutstanding(eof ? "Channel is closed" : "Channel receive failed");
+    pending.callback(false, resp);
     return false;
   }
-  if (eof) {
-    failure_msg_ = "Channel is closed";
-    LOG(ERROR) << "RPC to Tao host failed: " << failure_msg_;
-    return false;
-  }
-  if (respHdr.op() != op) {
+  if (respHdr.op() != pending.op) {
     failure_msg_ = "Unexpected operation in response";
     LOG(ERROR) << "RPC to Tao host failed: " << failure_msg_;
-    return false;
+    pending.callback(false, resp);
+    return true;
   }
-  if (respHdr.seq() != reqHdr.seq()) {
-    failure_msg_ = "Unexpected sequence number in response";
-    LOG(ERROR) << "RPC to Tao host failed: " << failure_msg_;
-    return false;
+  pending.callback(true, resp);
+  return true;
+}
+
+bool TaoRPC::FailOutstanding(const string &msg) {
+  failure_msg_ = msg;
+  LOG(ERROR) << "RPC to Tao host failed: " << failure_msg_;
+  channel_->Close();
+  std::map<uint64_t, PendingRequest> failed;
+  failed.swap(pending_);
+  TaoRPCResponse empty;
+  for (auto &entry : failed) {
+    entry.second.callback(false, empty);
   }
+  return false;
+}
+
+bool TaoRPC::UnpackResponse(const TaoRPCResponse &resp, string *data,
+                            string *policy, int64_t *counter) {
   if (data != nullptr) {
     if (!resp.has_data()) {
       failure_msg_ = "Malformed response (missing data)";
@@ -189,11 +268,206 @@ TaoRPC *TaoRPC::DeserializeFromString(const string &params) {
   string channel_params;
   getline(in, channel_params, '\0');
   // Try each known channel type.
+  FDMessageChannel *fd_channel;
+  fd_channel = FDMessageChannel::DeserializeFromString(channel_params);
+  if (fd_channel != nullptr) {
+    // The host channel belongs to this TaoRPC alone, so reads can safely run
+    // ahead of the message currently being parsed.
+    fd_channel->EnableReadAhead();
+    return new TaoRPC(fd_channel);
+  }
   MessageChannel *channel;
-  channel = FDMessageChannel::DeserializeFromString(channel_params);
+  channel = ShmMessageChannel::DeserializeFromString(channel_params);
   if (channel != nullptr) return new TaoRPC(channel);
   LOG(ERROR) << "Unknown channel serialized for TaoRPC";
   return nullptr;
 }
 
+TaoRPCRequest *TaoRPCBatch::Add(const string &op, string *data, string *policy,
+                                int64_t *counter) {
+  Op result;
+  result.data = data;
+  result.policy = policy;
+  result.counter = counter;
+  result.succeeded = false;
+  ops_.push_back(result);
+  TaoRPCBatchOp *entry = batch_.add_batch();
+  entry->set_op(op);
+  return entry->mutable_request();
+}
+
+size_t TaoRPCBatch::GetTaoName(string *name) {
+  Add("Tao.GetTaoName", name, nullptr /* policy */, nullptr);
+  return ops_.size() - 1;
+}
+
+size_t TaoRPCBatch::ExtendTaoName(const string &subprin) {
+  Add("Tao.ExtendTaoName", nullptr /* data */, nullptr /* policy */, nullptr)
+      ->set_data(subprin);
+  return ops_.size() - 1;
+}
+
+size_t TaoRPCBatch::GetRandomBytes(size_t size, string *bytes) {
+  Add("Tao.GetRandomBytes", bytes, nullptr /* policy */, nullptr)
+      ->set_size(size);
+  return ops_.size() - 1;
+}
+
+size_t TaoRPCBatch::GetSharedSecret(size_t size, const string &policy,
+                                    string *bytes) {
+  TaoRPCRequest *rpc =
+      Add("Tao.GetSharedSecret", bytes, nullptr /* policy */, nullptr);
+  rpc->set_size(size);
+  rpc->set_policy(policy);
+  return ops_.size() - 1;
+}
+
+size_t TaoRPCBatch::Attest(const string &message, string *attestation) {
+  Add("Tao.Attest", attestation, nullptr /* policy */, nullptr)
+      ->set_data(message);
+  return ops_.size() - 1;
+}
+
+size_t TaoRPCBatch::Seal(const string &data, const string &policy,
+                         string *sealed) {
+  TaoRPCRequest *rpc = Add("Tao.Seal", sealed, nullptr /* policy */, nullptr);
+  rpc->set_data(data);
+  rpc->set_policy(policy);
+  return ops_.size() - 1;
+}
+
+size_t TaoRPCBatch::Unseal(const string &sealed, string *data,
+                           string *policy) {
+  Add("Tao.Unseal", data, policy, nullptr)->set_data(sealed);
+  return ops_.size() - 1;
+}
+
+size_t TaoRPCBatch::InitCounter(const string &label, int64_t c) {
+  TaoRPCRequest *rpc = Add("Tao.InitCounter", nullptr, nullptr, nullptr);
+  rpc->set_label(label);
+  rpc->set_counter(c);
+  return ops_.size() - 1;
+}
+
+size_t TaoRPCBatch::GetCounter(const string &label, int64_t *c) {
+  Add("Tao.GetCounter", nullptr, nullptr, c)->set_label(label);
+  return ops_.size() - 1;
+}
+
+size_t TaoRPCBatch::RollbackProtectedSeal(const string &label,
+                                          const string &data,
+                                          const string &policy,
+                                          string *sealed) {
+  TaoRPCRequest *rpc =
+      Add("Tao.RollbackProtectedSeal", sealed, nullptr, nullptr);
+  rpc->set_label(label);
+  rpc->set_policy(policy);
+  rpc->set_data(data);
+  return ops_.size() - 1;
+}
+
+size_t TaoRPCBatch::RollbackProtectedUnseal(const string &sealed,
+                                            string *data, string *policy) {
+  Add("Tao.RollbackProtectedUnseal", data, policy, nullptr)->set_data(sealed);
+  return ops_.size() - 1;
+}
+
+void TaoRPCBatch::Finish(Op *op, bool success, const TaoRPCResponse &resp) {
+  op->succeeded = success && tao_->UnpackResponse(resp, op->data, op->policy,
+                                                  op->counter);
+  op->error = op->succeeded ? "" : tao_->failure_msg_;
+}
+
+bool TaoRPCBatch::Run() {
+  for (auto &op : ops_) {
+    op.succeeded = false;
+    op.error = "Not sent";
+  }
+  if (ops_.empty()) {
+    return true;
+  }
+  if (!tao_->batch_unsupported_) {
+    bool supported;
+    bool ok = RunBatch(&supported);
+    if (supported) {
+      return ok;
+    }
+    VLOG(1) << "Host does not support Tao.Batch, pipelining instead";
+    tao_->batch_unsupported_ = true;
+  }
+  return RunPipelined();
+}
+
+bool TaoRPCBatch::RunBatch(bool *supported) {
+  bool accepted = false;
+  bool all_ok = true;
+  auto done = [&](bool success, const TaoRPCResponse &resp) {
+    accepted = success;
+    if (!success) {
+      return;
+    }
+    if (static_cast<size_t>(resp.batch_size()) != ops_.size()) {
+      tao_->failure_msg_ = "Malformed response (wrong batch size)";
+      LOG(ERROR) << "RPC to Tao host failed: " << tao_->failure_msg_;
+      all_ok = false;
+      for (auto &op : ops_) {
+        op.error = tao_->failure_msg_;
+      }
+      return;
+    }
+    for (size_t i = 0; i < ops_.size(); i++) {
+      const TaoRPCBatchResult &result = resp.batch(i);
+      if (result.has_error()) {
+        tao_->failure_msg_ = result.error();
+        Finish(&ops_[i], false, result.response());
+      } else {
+        Finish(&ops_[i], true, result.response());
+      }
+      all_ok = all_ok && ops_[i].succeeded;
+    }
+  };
+  *supported = true;
+  uint64_t seq;
+  if (!tao_->SendAsync("Tao.Batch", batch_, done, &seq) || !tao_->Wait(seq)) {
+    for (auto &op : ops_) {
+      op.error = tao_->failure_msg_;
+    }
+    return false;
+  }
+  if (!accepted) {
+    // Only a host that does not know the method has certainly not run any of
+    // the operations. After any other error some may have run, and resending
+    // them could repeat an operation that is not idempotent.
+    if (tao_->failure_msg_ == TaoRPC::BatchUnsupportedError) {
+      *supported = false;
+    } else {
+      for (auto &op : ops_) {
+        op.error = tao_->failure_msg_;
+      }
+    }
+    return false;
+  }
+  return all_ok;
+}
+
+bool TaoRPCBatch::RunPipelined() {
+  for (size_t i = 0; i < ops_.size(); i++) {
+    Op *op = &ops_[i];
+    auto done = [this, op](bool success, const TaoRPCResponse &resp) {
+      Finish(op, success, resp);
+    };
+    const TaoRPCBatchOp &entry = batch_.batch(i);
+    if (!tao_->SendAsync(entry.op(), entry.request(), done, nullptr)) {
+      op->error = tao_->failure_msg_;
+      break;
+    }
+  }
+  tao_->WaitAll();
+  bool all_ok = true;
+  for (auto &op : ops_) {
+    all_ok = all_ok && op.succeeded;
+  }
+  return all_ok;
+}
+
 }  // namespace tao
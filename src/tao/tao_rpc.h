@@ -19,7 +19,10 @@
 #ifndef TAO_TAO_RPC_H_
 #define TAO_TAO_RPC_H_
 
+#include <functional>
+#include <map>
 #include <string>
+#include <vector>
 
 #include "tao/message_channel.h"
 #include "tao/tao.h"
@@ -35,7 +38,12 @@ class TaoRPC : public Tao {
   /// Construct a TaoRPC.
   /// @param channel The channel over which to send and receive messages.
   /// Ownership is taken.
-  explicit TaoRPC(MessageChannel *channel) : channel_(channel) {}
+  explicit TaoRPC(MessageChannel *channel)
+      : channel_(channel),
+        last_seq_(0),
+        max_outstanding_(DefaultMaxOutstanding),
+        batch_unsupported_(false),
+        tao_name_known_(false) {}
 
   void Close() { channel_->Close(); }
 
@@ -43,7 +51,9 @@ class TaoRPC : public Tao {
 
   static TaoRPC *DeserializeFromString(const string &params);
 
-  /// Tao implementation.
+  /// Tao implementation. GetTaoName() asks the host only the first time, and
+  /// again after this TaoRPC sends Tao.ExtendTaoName. A name extended through
+  /// another channel or TaoRPC is not noticed.
   /// @{
   bool GetTaoName(string *name);
   bool ExtendTaoName(const string &subprin);
@@ -67,6 +77,54 @@ class TaoRPC : public Tao {
   }
   /// @}
 
+  /// Pipelined RPC interface. Several requests can be in flight on the channel
+  /// at once, and responses are matched to requests by sequence number, so the
+  /// host may answer them in any order. Like the rest of TaoRPC, these methods
+  /// are not thread-safe.
+  /// @{
+
+  /// A callback invoked when the response to a pipelined request arrives.
+  /// @param success Whether the host completed the request. If false,
+  /// GetRecentErrorMessage() describes the failure.
+  /// @param resp The response from the host. Only meaningful on success.
+  typedef std::function<void(bool success, const TaoRPCResponse &resp)>
+      ResponseCallback;
+
+  /// Send a request without waiting for the response. If too many requests
+  /// are already outstanding, this first collects responses until there is
+  /// room in the pipeline.
+  /// @param op The operation, e.g. "Tao.Seal".
+  /// @param req The request to send.
+  /// @param callback A callback to be invoked exactly once, from within a
+  /// later call to SendAsync(), Wait(), WaitAll(), or any synchronous Tao
+  /// method. It is not invoked if SendAsync() itself fails.
+  /// @param[out] seq The sequence number of the request, if not nullptr.
+  bool SendAsync(const string &op, const TaoRPCRequest &req,
+                 ResponseCallback callback, uint64_t *seq);
+
+  /// Collect responses until the one for a given request has arrived.
+  /// @param seq The sequence number returned by SendAsync().
+  bool Wait(uint64_t seq);
+
+  /// Collect responses until no requests are outstanding.
+  bool WaitAll();
+
+  /// Get the number of requests that have been sent but not yet answered.
+  size_t NumOutstanding() const { return pending_.size(); }
+
+  /// Set the maximum number of requests that may be in flight at once.
+  /// @param n The new limit. Values less than 1 are treated as 1.
+  void SetMaxOutstanding(size_t n) { max_outstanding_ = (n < 1 ? 1 : n); }
+
+  /// By default, at most this many requests are in flight at once.
+  static constexpr size_t DefaultMaxOutstanding = 64;
+
+  /// The error a host that does not implement Tao.Batch returns for it. This
+  /// must match batchUnsupportedError in go/tao/linux_host_tao_rpc.go.
+  static const char BatchUnsupportedError[];
+
+  /// @}
+
  protected:
   /// The channel over which to send and receive messages.
   unique_ptr<MessageChannel> channel_;
@@ -75,9 +133,51 @@ class TaoRPC : public Tao {
   string failure_msg_;
 
   /// Most recent RPC sequence number.
-  unsigned int last_seq_;
+  uint64_t last_seq_;
+
+  /// A request that has been sent but not yet answered.
+  struct PendingRequest {
+    string op;
+    ResponseCallback callback;
+  };
+
+  /// Outstanding requests, indexed by sequence number.
+  std::map<uint64_t, PendingRequest> pending_;
+
+  /// The maximum number of outstanding requests.
+  size_t max_outstanding_;
+
+  /// Whether the host has rejected a Tao.Batch request.
+  bool batch_unsupported_;
+
+  /// The name the host last returned from Tao.GetTaoName, if
+  /// tao_name_known_.
+  string tao_name_;
+
+  /// Whether tao_name_ is still the name of this hosted program.
+  bool tao_name_known_;
 
  private:
+  friend class TaoRPCBatch;
+
+  /// Receive one response from the host Tao and invoke its callback. On
+  /// channel or protocol failure, the channel is closed and every outstanding
+  /// request fails.
+  bool ReceiveResponse();
+
+  /// Close the channel and invoke the callbacks of all outstanding requests
+  /// with a failure.
+  /// @param msg The failure message.
+  bool FailOutstanding(const string &msg);
+
+  /// Copy the fields of a response into output parameters.
+  /// @param resp The response.
+  /// @param[out] data The returned data, if not nullptr.
+  /// @param[out] policy The returned policy, if not nullptr.
+  /// @param[out] counter The returned counter, if not nullptr.
+  bool UnpackResponse(const TaoRPCResponse &resp, string *data, string *policy,
+                      int64_t *counter);
+
   /// Do an RPC request/response interaction with the host Tao.
   /// @param op The operation.
   /// @param req The request to send.
@@ -88,6 +188,108 @@ class TaoRPC : public Tao {
 
   DISALLOW_COPY_AND_ASSIGN(TaoRPC);
 };
+
+/// A builder for a Tao.Batch request, which carries many Tao operations to the
+/// host in a single round trip. Each method below queues one operation and
+/// returns its index within the batch. Output parameters are filled in by
+/// Run(), and must remain valid until then. For example:
+///
+///    TaoRPCBatch batch(tao);
+///    for (size_t i = 0; i < records.size(); i++)
+///      batch.Seal(records[i], Tao::SealPolicyDefault, &sealed[i]);
+///    batch.GetRandomBytes(32, &nonce);
+///    if (!batch.Run()) { ... check batch.Succeeded(i) ... }
+///
+/// If the host does not support Tao.Batch, Run() falls back to pipelining the
+/// individual operations over the channel.
+class TaoRPCBatch {
+ public:
+  /// Construct a TaoRPCBatch.
+  /// @param tao The TaoRPC over which to send the batch. Ownership is not
+  /// taken.
+  explicit TaoRPCBatch(TaoRPC *tao) : tao_(tao) {}
+
+  /// Operations to be batched. These have the same semantics as the Tao
+  /// methods of the same names.
+  /// @{
+  size_t GetTaoName(string *name);
+  size_t ExtendTaoName(const string &subprin);
+  size_t GetRandomBytes(size_t size, string *bytes);
+  size_t GetSharedSecret(size_t size, const string &policy, string *bytes);
+  size_t Attest(const string &message, string *attestation);
+  size_t Seal(const string &data, const string &policy, string *sealed);
+  size_t Unseal(const string &sealed, string *data, string *policy);
+  size_t InitCounter(const string &label, int64_t c);
+  size_t GetCounter(const string &label, int64_t *c);
+  size_t RollbackProtectedSeal(const string &label, const string &data,
+                               const string &policy, string *sealed);
+  size_t RollbackProtectedUnseal(const string &sealed, string *data,
+                                 string *policy);
+  /// @}
+
+  /// Send all queued operations to the host and fill in their outputs. The
+  /// batch is left intact, so per-operation status can be inspected.
+  /// @return true iff every operation succeeded.
+  bool Run();
+
+  /// Get the number of queued operations.
+  size_t Size() const { return ops_.size(); }
+
+  /// Check whether an operation succeeded. Only meaningful after Run().
+  /// @param i The index of the operation.
+  bool Succeeded(size_t i) const { return ops_[i].succeeded; }
+
+  /// Get the error message for an operation that failed.
+  /// @param i The index of the operation.
+  string Error(size_t i) const { return ops_[i].error; }
+
+  /// Discard all queued operations and their results.
+  void Clear() {
+    ops_.clear();
+    batch_.Clear();
+  }
+
+ private:
+  /// The destinations for the results of a queued operation.
+  struct Op {
+    string *data;
+    string *policy;
+    int64_t *counter;
+    bool succeeded;
+    string error;
+  };
+
+  /// Queue an operation.
+  /// @param op The operation.
+  /// @param[out] data The returned data, if not nullptr.
+  /// @param[out] policy The returned policy, if not nullptr.
+  /// @param[out] counter The returned counter, if not nullptr.
+  /// @return The request to be filled in for the new operation.
+  TaoRPCRequest *Add(const string &op, string *data, string *policy,
+                     int64_t *counter);
+
+  /// Fill in the results of an operation from a response.
+  void Finish(Op *op, bool success, const TaoRPCResponse &resp);
+
+  /// Send the queued operations as a single Tao.Batch request.
+  /// @param[out] supported Set to false if the host does not know Tao.Batch,
+  /// in which case none of the operations has run.
+  bool RunBatch(bool *supported);
+
+  /// Send the queued operations as individual pipelined requests.
+  bool RunPipelined();
+
+  /// The TaoRPC over which to send the batch.
+  TaoRPC *tao_;
+
+  /// The queued operations, as a Tao.Batch request.
+  TaoRPCRequest batch_;
+
+  /// The result destinations of the queued operations.
+  std::vector<Op> ops_;
+
+  DISALLOW_COPY_AND_ASSIGN(TaoRPCBatch);
+};
 }  // namespace tao
 
 #endif  // TAO_TAO_RPC_H_
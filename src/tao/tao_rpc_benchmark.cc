@@ -0,0 +1,247 @@
+//  File: tao_rpc_benchmark.cc
+//
+//  Description: Measures the throughput and latency of TaoRPC operations
+//  against an in-process host over each kind of channel, and prints the
+//  results as JSON.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "tao/fd_message_channel.h"
+#include "tao/shm_message_channel.h"
+#include "tao/soft_tao.h"
+#include "tao/tao_rpc.h"
+#include "tao/tao_rpc_server.h"
+#include "tao/util.h"
+
+DEFINE_string(channels, "socketpair,pipe,shm",
+              "Comma-separated list of channel types to measure");
+DEFINE_int32(iterations, 10000,
+             "Number of calls per operation, for small payloads");
+DEFINE_int64(bytes_per_case, 256 * 1024 * 1024,
+             "Payload bytes per Seal/Unseal case; fewer calls are made for "
+             "large payloads so that each case moves about this much data");
+DEFINE_int64(max_seal_size, 16 * 1024 * 1024,
+             "Largest Seal/Unseal payload to measure");
+
+using std::string;
+using std::vector;
+
+using tao::FDMessageChannel;
+using tao::InitializeApp;
+using tao::MessageChannel;
+using tao::ProtoRPCRequestHeader;
+using tao::ProtoRPCResponseHeader;
+using tao::ShmMessageChannel;
+using tao::SoftTao;
+using tao::Tao;
+using tao::TaoRPC;
+using tao::TaoRPCRequest;
+using tao::TaoRPCResponse;
+using tao::TaoRPCServer;
+
+/// A SoftTao that also attests, with an HMAC standing in for the signature,
+/// so that Attest can be measured end to end.
+class BenchmarkTao : public SoftTao {
+ public:
+  virtual bool Attest(const string &message, string *attestation) {
+    string name;
+    if (!GetTaoName(&name)) return false;
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int mac_len;
+    string statement = name + message;
+    HMAC(EVP_sha256(), name.data(), name.size(),
+         reinterpret_cast<const unsigned char *>(statement.data()),
+         statement.size(), mac, &mac_len);
+    attestation->assign(statement);
+    attestation->append(reinterpret_cast<char *>(mac), mac_len);
+    return true;
+  }
+};
+
+/// Answer TaoRPC requests on a channel until it closes, the way a host does.
+/// @param channel The host end of the channel.
+/// @param tao The Tao to answer with.
+static void ServeChannel(MessageChannel *channel, Tao *tao) {
+  ProtoRPCRequestHeader reqHdr;
+  TaoRPCRequest req;
+  ProtoRPCResponseHeader respHdr;
+  TaoRPCResponse resp;
+  bool eof;
+  while (channel->ReceiveMessage(&reqHdr, &eof) && !eof &&
+         channel->ReceiveMessage(&req, &eof) && !eof) {
+    respHdr.Clear();
+    respHdr.set_op(reqHdr.op());
+    respHdr.set_seq(reqHdr.seq());
+    resp.Clear();
+    string error;
+    if (!TaoRPCServer::HandleRequest(tao, reqHdr.op(), req, &resp, &error)) {
+      respHdr.set_error(error);
+      resp.Clear();
+    }
+    if (!channel->SendMessages({&respHdr, &resp})) break;
+  }
+}
+
+/// Create a connected pair of channels of a given type.
+/// @param type "socketpair", "pipe", or "shm".
+/// @param[out] client The hosted program's end.
+/// @param[out] host The host's end.
+static bool CreateChannels(const string &type,
+                           std::unique_ptr<MessageChannel> *client,
+                           std::unique_ptr<MessageChannel> *host) {
+  if (type == "socketpair") {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return false;
+    client->reset(new FDMessageChannel(fds[0], fds[0]));
+    host->reset(new FDMessageChannel(fds[1], fds[1]));
+  } else if (type == "pipe") {
+    int down[2], up[2];
+    if (pipe(down) != 0 || pipe(up) != 0) return false;
+    client->reset(new FDMessageChannel(up[0], down[1]));
+    host->reset(new FDMessageChannel(down[0], up[1]));
+  } else if (type == "shm") {
+    std::unique_ptr<ShmMessageChannel> a, b;
+    if (!ShmMessageChannel::CreatePair(ShmMessageChannel::DefaultRingSize, &a,
+                                       &b)) {
+      return false;
+    }
+    client->reset(a.release());
+    host->reset(b.release());
+  } else {
+    LOG(ERROR) << "Unknown channel type " << type;
+    return false;
+  }
+  for (MessageChannel *channel : {client->get(), host->get()}) {
+    FDMessageChannel *fd_channel = dynamic_cast<FDMessageChannel *>(channel);
+    if (fd_channel != nullptr) fd_channel->EnableReadAhead();
+  }
+  return true;
+}
+
+/// Time repeated calls of one operation and print a JSON result object.
+/// @param channel The channel type, for the report.
+/// @param op The operation name, for the report.
+/// @param size The payload size, for the report.
+/// @param iterations The number of calls.
+/// @param call Makes one call and returns its success.
+/// @param[in,out] first Whether this is the first result to be printed.
+static void Measure(const string &channel, const string &op, size_t size,
+                    int iterations, const std::function<bool()> &call,
+                    bool *first) {
+  typedef std::chrono::steady_clock Clock;
+  vector<double> latencies;
+  latencies.reserve(iterations);
+  // Warm up buffers and caches before timing.
+  CHECK(call()) << op << " failed";
+  auto start = Clock::now();
+  for (int i = 0; i < iterations; i++) {
+    auto t0 = Clock::now();
+    CHECK(call()) << op << " failed";
+    latencies.push_back(
+        std::chrono::duration<double, std::micro>(Clock::now() - t0).count());
+  }
+  double secs = std::chrono::duration<double>(Clock::now() - start).count();
+  std::sort(latencies.begin(), latencies.end());
+  double p50 = latencies[latencies.size() / 2];
+  double p99 = latencies[std::min(latencies.size() - 1,
+                                  latencies.size() * 99 / 100)];
+  printf(
+      "%s\n    {\"channel\": \"%s\", \"op\": \"%s\", \"size\": %zu, "
+      "\"iterations\": %d, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.1f, "
+      "\"p50_us\": %.1f, \"p99_us\": %.1f}",
+      *first ? "" : ",", channel.c_str(), op.c_str(), size, iterations,
+      iterations / secs, iterations * static_cast<double>(size) / secs / 1e6,
+      p50, p99);
+  fflush(stdout);
+  *first = false;
+}
+
+/// Measure every operation over one type of channel.
+/// @param type The channel type.
+/// @param host The Tao for the host end.
+/// @param[in,out] first Whether no result has been printed yet.
+static void RunChannel(const string &type, Tao *host, bool *first) {
+  std::unique_ptr<MessageChannel> client_channel, host_channel;
+  CHECK(CreateChannels(type, &client_channel, &host_channel))
+      << "Could not create " << type << " channels";
+  MessageChannel *host_end = host_channel.get();
+  std::thread server([host_end, host]() { ServeChannel(host_end, host); });
+  {
+    TaoRPC rpc(client_channel.release());
+    int n = FLAGS_iterations;
+    string out, data, policy;
+
+    Measure(type, "GetRandomBytes", 32, n,
+            [&]() { return rpc.GetRandomBytes(32, &out); }, first);
+    Measure(type, "Attest", 64, n,
+            [&]() { return rpc.Attest(string(64, 'a'), &out); }, first);
+    int64_t counter = 0;
+    Measure(type, "InitCounter", 0, n,
+            [&]() { return rpc.InitCounter("bench", ++counter); }, first);
+    Measure(type, "GetCounter", 0, n,
+            [&]() { return rpc.GetCounter("bench", &counter); }, first);
+
+    for (size_t size = 64; size <= static_cast<size_t>(FLAGS_max_seal_size);
+         size *= 4) {
+      int iterations = static_cast<int>(
+          std::max<int64_t>(10, std::min<int64_t>(n, FLAGS_bytes_per_case /
+                                                         size)));
+      string payload(size, 'p');
+      string sealed;
+      Measure(type, "Seal", size, iterations,
+              [&]() {
+                return rpc.Seal(payload, Tao::SealPolicyDefault, &sealed);
+              },
+              first);
+      Measure(type, "Unseal", size, iterations,
+              [&]() { return rpc.Unseal(sealed, &data, &policy); }, first);
+    }
+    rpc.Close();
+  }
+  server.join();
+}
+
+int main(int argc, char **argv) {
+  InitializeApp(&argc, &argv, true);
+
+  BenchmarkTao host;
+  CHECK(host.Init("BenchmarkHost")) << "Could not initialize the host";
+
+  bool first = true;
+  printf("{\n  \"results\": [");
+  std::stringstream types(FLAGS_channels);
+  string type;
+  while (std::getline(types, type, ',')) {
+    if (!type.empty()) RunChannel(type, &host, &first);
+  }
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -0,0 +1,547 @@
+//  File: tao_rpc_server.cc
+//
+//  Description: A server that provides the Tao interface to hosted programs
+//  over channels, the counterpart of TaoRPC.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "tao/tao_rpc_server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <glog/logging.h>
+
+using std::lock_guard;
+using std::mutex;
+
+namespace tao {
+constexpr size_t TaoRPCServer::ReadSize;
+constexpr size_t TaoRPCServer::MaxQueuedOutput;
+
+TaoRPCServer::TaoRPCServer(size_t num_workers)
+    : epoll_fd_(-1),
+      wake_fd_(-1),
+      listen_fd_(-1),
+      stopping_(false),
+      pool_(num_workers) {}
+
+TaoRPCServer::~TaoRPCServer() {
+  // Let in-progress requests finish before the descriptors they use go away.
+  pool_.Wait();
+  if (listen_fd_ != -1) {
+    close(listen_fd_);
+    unlink(listen_path_.c_str());
+  }
+  if (wake_fd_ != -1) {
+    close(wake_fd_);
+  }
+  if (epoll_fd_ != -1) {
+    close(epoll_fd_);
+  }
+}
+
+bool TaoRPCServer::Init() {
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0) {
+    PLOG(ERROR) << "Could not create epoll instance";
+    return false;
+  }
+  wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wake_fd_ < 0) {
+    PLOG(ERROR) << "Could not create eventfd";
+    return false;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = &wake_fd_;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev) < 0) {
+    PLOG(ERROR) << "Could not watch eventfd";
+    return false;
+  }
+  return true;
+}
+
+bool TaoRPCServer::AddChannel(FDMessageChannel *channel, Tao *tao) {
+  unique_ptr<Connection> conn(new Connection());
+  conn->channel.reset(channel);
+  conn->tao.reset(tao);
+  conn->write_watched = false;
+  // Workers must never block on a hosted program that stalls.
+  int rfd = channel->GetReadFileDescriptor();
+  int wfd = channel->GetWriteFileDescriptor();
+  if (fcntl(rfd, F_SETFL, fcntl(rfd, F_GETFL) | O_NONBLOCK) < 0 ||
+      fcntl(wfd, F_SETFL, fcntl(wfd, F_GETFL) | O_NONBLOCK) < 0) {
+    PLOG(ERROR) << "Could not make channel non-blocking";
+    return false;
+  }
+  Connection *c = conn.get();
+  {
+    lock_guard<mutex> lock(mutex_);
+    connections_[c] = std::move(conn);
+  }
+  if (!Arm(c, EPOLL_CTL_ADD)) {
+    lock_guard<mutex> lock(mutex_);
+    connections_.erase(c);
+    return false;
+  }
+  return true;
+}
+
+bool TaoRPCServer::Listen(const string &path, const TaoFactory &factory) {
+  struct sockaddr_un addr;
+  if (path.size() + 1 > sizeof(addr.sun_path)) {
+    LOG(ERROR) << "Socket path is too long: " << path;
+    return false;
+  }
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (listen_fd_ < 0) {
+    PLOG(ERROR) << "Could not create socket";
+    return false;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  if (bind(listen_fd_, reinterpret_cast<struct sockaddr *>(&addr),
+           sizeof(addr)) < 0) {
+    PLOG(ERROR) << "Could not bind socket to " << path;
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  listen_path_ = path;
+  if (listen(listen_fd_, SOMAXCONN) < 0) {
+    PLOG(ERROR) << "Could not listen on " << path;
+    return false;
+  }
+  factory_ = factory;
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = &listen_fd_;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev) < 0) {
+    PLOG(ERROR) << "Could not watch socket";
+    return false;
+  }
+  return true;
+}
+
+bool TaoRPCServer::Run() {
+  std::vector<struct epoll_event> events(64);
+  while (!stopping_) {
+    int n = epoll_wait(epoll_fd_, events.data(), events.size(), -1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      PLOG(ERROR) << "Could not wait for requests";
+      pool_.Wait();
+      return false;
+    }
+    for (int i = 0; i < n; i++) {
+      void *ptr = events[i].data.ptr;
+      if (ptr == &wake_fd_) {
+        uint64_t count;
+        if (read(wake_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+          PLOG(ERROR) << "Could not read eventfd";
+        }
+      } else if (ptr == &listen_fd_) {
+        AcceptConnections();
+      } else {
+        Connection *conn = reinterpret_cast<Connection *>(ptr);
+        // This blocks once enough channels are waiting for a worker.
+        if (!pool_.Submit([this, conn]() { ServeConnection(conn); })) {
+          CloseConnection(conn);
+        }
+      }
+    }
+  }
+  pool_.Wait();
+  return true;
+}
+
+void TaoRPCServer::Stop() {
+  stopping_ = true;
+  uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) < 0) {
+    PLOG(ERROR) << "Could not wake the server";
+  }
+}
+
+size_t TaoRPCServer::NumChannels() {
+  lock_guard<mutex> lock(mutex_);
+  return connections_.size();
+}
+
+void TaoRPCServer::AcceptConnections() {
+  for (;;) {
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        PLOG(ERROR) << "Could not accept a connection";
+      }
+      return;
+    }
+    Tao *tao = factory_(fd);
+    if (tao == nullptr) {
+      LOG(ERROR) << "Rejected a connection";
+      close(fd);
+      continue;
+    }
+    AddChannel(new FDMessageChannel(fd, fd), tao);
+  }
+}
+
+bool TaoRPCServer::Arm(Connection *conn, int op) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.ptr = conn;
+  if (epoll_ctl(epoll_fd_, op, conn->channel->GetReadFileDescriptor(), &ev) <
+      0) {
+    PLOG(ERROR) << "Could not watch channel";
+    return false;
+  }
+  return true;
+}
+
+bool TaoRPCServer::ArmOutput(Connection *conn) {
+  int rfd = conn->channel->GetReadFileDescriptor();
+  int wfd = conn->channel->GetWriteFileDescriptor();
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLOUT | EPOLLONESHOT;
+  ev.data.ptr = conn;
+  // A separate write descriptor is added to epoll the first time it is
+  // needed. The read descriptor stays disarmed until Arm() is called.
+  int op = EPOLL_CTL_MOD;
+  if (wfd != rfd && !conn->write_watched) {
+    op = EPOLL_CTL_ADD;
+  }
+  if (epoll_ctl(epoll_fd_, op, wfd, &ev) < 0) {
+    PLOG(ERROR) << "Could not watch channel";
+    return false;
+  }
+  if (wfd != rfd) {
+    conn->write_watched = true;
+  }
+  return true;
+}
+
+void TaoRPCServer::CloseConnection(Connection *conn) {
+  int fd = conn->channel->GetReadFileDescriptor();
+  if (fd >= 0) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  }
+  if (conn->write_watched) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, conn->channel->GetWriteFileDescriptor(),
+              nullptr);
+  }
+  lock_guard<mutex> lock(mutex_);
+  connections_.erase(conn);
+}
+
+bool TaoRPCServer::ReadAvailable(Connection *conn, bool *eof) {
+  int fd = conn->channel->GetReadFileDescriptor();
+  size_t start = conn->pending.size();
+  conn->pending.resize(start + ReadSize);
+  ssize_t n;
+  do {
+    n = read(fd, &conn->pending[start], ReadSize);
+  } while (n < 0 && errno == EINTR);
+  conn->pending.resize(start + (n > 0 ? n : 0));
+  *eof = (n == 0);
+  if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    PLOG(ERROR) << "Could not read request";
+    return false;
+  }
+  return true;
+}
+
+bool TaoRPCServer::Flush(Connection *conn) {
+  int fd = conn->channel->GetWriteFileDescriptor();
+  size_t written = 0;
+  while (written < conn->outgoing.size()) {
+    ssize_t n = write(fd, conn->outgoing.data() + written,
+                      conn->outgoing.size() - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else if (n <= 0) {
+      PLOG(ERROR) << "Could not send response";
+      return false;
+    }
+    written += n;
+  }
+  conn->outgoing.erase(0, written);
+  return true;
+}
+
+/// Append a Message to data to be sent, framed as MessageChannel frames it.
+/// @param m The Message.
+/// @param[in,out] out The data to be sent.
+static void AppendFrame(const google::protobuf::Message &m, string *out) {
+  uint32_t net_len = htonl(m.ByteSize());
+  out->append(reinterpret_cast<char *>(&net_len), sizeof(net_len));
+  m.AppendToString(out);
+}
+
+/// Find the next length-prefixed frame in received data.
+/// @param buf The received data.
+/// @param[in,out] pos The offset of the frame, advanced past it if it is
+/// complete.
+/// @param max_size The largest frame to accept.
+/// @param[out] data The start of the frame contents.
+/// @param[out] size The size of the frame contents.
+/// @param[out] complete Whether the whole frame has been received.
+/// @return false if the frame is too large.
+static bool NextFrame(const string &buf, size_t *pos, size_t max_size,
+                      const char **data, size_t *size, bool *complete) {
+  uint32_t net_len;
+  *complete = false;
+  if (buf.size() - *pos < sizeof(net_len)) {
+    return true;
+  }
+  memcpy(&net_len, buf.data() + *pos, sizeof(net_len));
+  *size = ntohl(net_len);
+  if (*size > max_size) {
+    LOG(ERROR) << "Message exceeded maximum allowable size";
+    return false;
+  }
+  if (buf.size() - *pos - sizeof(net_len) < *size) {
+    return true;
+  }
+  *data = buf.data() + *pos + sizeof(net_len);
+  *pos += sizeof(net_len) + *size;
+  *complete = true;
+  return true;
+}
+
+void TaoRPCServer::ServeConnection(Connection *conn) {
+  // Send what earlier requests left queued before reading any more, so a
+  // hosted program that does not read its responses stops being served
+  // rather than making the queue grow.
+  if (!Flush(conn)) {
+    CloseConnection(conn);
+    return;
+  } else if (!conn->outgoing.empty()) {
+    if (!ArmOutput(conn)) {
+      CloseConnection(conn);
+    }
+    return;
+  }
+  bool eof;
+  if (!ReadAvailable(conn, &eof)) {
+    CloseConnection(conn);
+    return;
+  }
+  ProtoRPCRequestHeader reqHdr;
+  TaoRPCRequest req;
+  ProtoRPCResponseHeader respHdr;
+  TaoRPCResponse resp;
+  size_t max_size = conn->channel->MaxMessageSize();
+  // Handle the whole requests received, including pipelined ones, until
+  // enough responses are queued. Any partial request stays pending until
+  // epoll reports more of it.
+  size_t pos = 0;
+  while (conn->outgoing.size() < MaxQueuedOutput) {
+    size_t next = pos;
+    const char *hdr_data, *req_data;
+    size_t hdr_size, req_size;
+    bool complete;
+    if (!NextFrame(conn->pending, &next, max_size, &hdr_data, &hdr_size,
+                   &complete)) {
+      CloseConnection(conn);
+      return;
+    } else if (!complete) {
+      break;
+    }
+    if (!NextFrame(conn->pending, &next, max_size, &req_data, &req_size,
+                   &complete)) {
+      CloseConnection(conn);
+      return;
+    } else if (!complete) {
+      break;
+    }
+    if (!reqHdr.ParseFromArray(hdr_data, hdr_size) ||
+        !req.ParseFromArray(req_data, req_size)) {
+      LOG(ERROR) << "Could not parse request";
+      CloseConnection(conn);
+      return;
+    }
+    pos = next;
+    respHdr.Clear();
+    respHdr.set_op(reqHdr.op());
+    respHdr.set_seq(reqHdr.seq());
+    resp.Clear();
+    string error;
+    if (!HandleRequest(conn->tao.get(), reqHdr.op(), req, &resp, &error)) {
+      respHdr.set_error(error);
+      resp.Clear();
+    }
+    AppendFrame(respHdr, &conn->outgoing);
+    AppendFrame(resp, &conn->outgoing);
+  }
+  conn->pending.erase(0, pos);
+  // Requests left pending by a full queue are handled once it is sent.
+  bool full = conn->outgoing.size() >= MaxQueuedOutput;
+  if (!Flush(conn) || eof) {
+    CloseConnection(conn);
+    return;
+  }
+  bool ok;
+  if (full || !conn->outgoing.empty()) {
+    ok = ArmOutput(conn);
+  } else {
+    ok = Arm(conn, EPOLL_CTL_MOD);
+  }
+  if (!ok) {
+    CloseConnection(conn);
+  }
+}
+
+/// Record the reason a Tao operation failed.
+/// @param tao The Tao that failed.
+/// @param op The operation.
+/// @param[out] error The error message.
+static bool TaoFailed(Tao *tao, const string &op, string *error) {
+  *error = tao->ResetRecentErrorMessage();
+  if (error->empty()) {
+    *error = op + " failed";
+  }
+  return false;
+}
+
+bool TaoRPCServer::HandleRequest(Tao *tao, const string &op,
+                                 const TaoRPCRequest &req,
+                                 TaoRPCResponse *resp, string *error) {
+  if (op == "Tao.GetTaoName") {
+    if (!tao->GetTaoName(resp->mutable_data())) {
+      return TaoFailed(tao, op, error);
+    }
+  } else if (op == "Tao.ExtendTaoName") {
+    if (!req.has_data()) {
+      *error = "missing subprincipal";
+      return false;
+    }
+    if (!tao->ExtendTaoName(req.data())) {
+      return TaoFailed(tao, op, error);
+    }
+  } else if (op == "Tao.GetRandomBytes") {
+    if (!req.has_size() || req.size() <= 0) {
+      *error = "invalid size";
+      return false;
+    }
+    if (!tao->GetRandomBytes(req.size(), resp->mutable_data())) {
+      return TaoFailed(tao, op, error);
+    }
+  } else if (op == "Tao.GetSharedSecret") {
+    if (!req.has_size() || req.size() <= 0) {
+      *error = "invalid size";
+      return false;
+    } else if (!req.has_policy()) {
+      *error = "missing policy";
+      return false;
+    }
+    if (!tao->GetSharedSecret(req.size(), req.policy(),
+                              resp->mutable_data())) {
+      return TaoFailed(tao, op, error);
+    }
+  } else if (op == "Tao.Attest") {
+    if (!tao->Attest(req.data(), resp->mutable_data())) {
+      return TaoFailed(tao, op, error);
+    }
+  } else if (op == "Tao.Seal") {
+    if (!req.has_policy()) {
+      *error = "missing policy";
+      return false;
+    }
+    if (!tao->Seal(req.data(), req.policy(), resp->mutable_data())) {
+      return TaoFailed(tao, op, error);
+    }
+  } else if (op == "Tao.Unseal") {
+    if (!tao->Unseal(req.data(), resp->mutable_data(),
+                     resp->mutable_policy())) {
+      return TaoFailed(tao, op, error);
+    }
+  } else if (op == "Tao.InitCounter") {
+    if (!req.has_label() || !req.has_counter()) {
+      *error = "Label or counter unspecified";
+      return false;
+    }
+    int64_t c = req.counter();
+    if (!tao->InitCounter(req.label(), c)) {
+      return TaoFailed(tao, op, error);
+    }
+  } else if (op == "Tao.GetCounter") {
+    if (!req.has_label()) {
+      *error = "Label unspecified";
+      return false;
+    }
+    int64_t c;
+    if (!tao->GetCounter(req.label(), &c)) {
+      return TaoFailed(tao, op, error);
+    }
+    resp->set_counter(c);
+  } else if (op == "Tao.RollbackProtectedSeal") {
+    if (!req.has_label()) {
+      *error = "Label unspecified";
+      return false;
+    } else if (!req.has_policy()) {
+      *error = "Policy unspecified";
+      return false;
+    }
+    if (!tao->RollbackProtectedSeal(req.label(), req.data(), req.policy(),
+                                    resp->mutable_data())) {
+      return TaoFailed(tao, op, error);
+    }
+  } else if (op == "Tao.RollbackProtectedUnseal") {
+    if (!req.has_data()) {
+      *error = "Data unspecified";
+      return false;
+    }
+    if (!tao->RollbackProtectedUnseal(req.data(), resp->mutable_data(),
+                                      resp->mutable_policy())) {
+      return TaoFailed(tao, op, error);
+    }
+  } else if (op == "Tao.Batch") {
+    for (const TaoRPCBatchOp &batch_op : req.batch()) {
+      TaoRPCBatchResult *result = resp->add_batch();
+      string op_error;
+      if (batch_op.op() == "Tao.Batch") {
+        result->set_error("nested Tao.Batch");
+      } else if (!HandleRequest(tao, batch_op.op(), batch_op.request(),
+                                result->mutable_response(), &op_error)) {
+        result->clear_response();
+        result->set_error(op_error);
+      }
+    }
+  } else {
+    *error = "rpc: can't find method " + op;
+    return false;
+  }
+  return true;
+}
+}  // namespace tao
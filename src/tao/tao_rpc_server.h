@@ -0,0 +1,186 @@
+//  File: tao_rpc_server.h
+//
+//  Description: A server that provides the Tao interface to hosted programs
+//  over channels, the counterpart of TaoRPC.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TAO_TAO_RPC_SERVER_H_
+#define TAO_TAO_RPC_SERVER_H_
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "tao/fd_message_channel.h"
+#include "tao/tao.h"
+#include "tao/tao_rpc.pb.h"
+#include "tao/thread_pool.h"
+#include "tao/util.h"
+
+namespace tao {
+/// A server for the requests that TaoRPC sends, which lets one process host
+/// many hosted programs. Each channel is served by its own Tao, typically one
+/// that acts on behalf of the hosted program at the other end, e.g. a child
+/// from SoftTao::NewChild().
+///
+/// A single thread waits on every channel with epoll. When a request arrives,
+/// the channel is handed to a worker pool, which handles that request and any
+/// others already received on the channel, then hands the channel back.
+/// Requests on one channel are handled one at a time and answered in order,
+/// while different channels are served in parallel. Each channel's Tao is only
+/// used by one worker at a time. Tao.Batch requests are supported.
+///
+/// Workers never block on a channel. A worker reads only the bytes already
+/// available and keeps any partial request with the channel until epoll
+/// reports the rest. Responses are queued and written as the channel accepts
+/// them. Once MaxQueuedOutput bytes of responses are waiting, no more requests
+/// are handled on that channel until they are sent. So a hosted program that
+/// stalls partway through a request, or does not read its responses, holds up
+/// neither a worker nor the other channels.
+class TaoRPCServer {
+ public:
+  /// Creates the Tao that will serve a connection accepted by Listen().
+  /// The argument is the connected socket, e.g. for SO_PEERCRED. The Tao is
+  /// owned by the server. Return nullptr to reject the connection.
+  typedef std::function<Tao *(int fd)> TaoFactory;
+
+  /// Construct a TaoRPCServer.
+  /// @param num_workers The number of worker threads, or 0 for one per CPU.
+  explicit TaoRPCServer(size_t num_workers = 0);
+
+  virtual ~TaoRPCServer();
+
+  /// Prepare to serve. This must be called before any other method.
+  bool Init();
+
+  /// Serve requests that arrive on a channel. This may be called before or
+  /// while Run() is in progress.
+  /// @param channel The channel. Ownership is taken. The server makes its
+  /// descriptors non-blocking and uses them directly, so no received data may
+  /// be buffered in it.
+  /// @param tao The Tao to serve the channel with. Ownership is taken.
+  bool AddChannel(FDMessageChannel *channel, Tao *tao);
+
+  /// Accept connections on a Unix domain socket and serve each one.
+  /// @param path The path of the socket, which must not exist.
+  /// @param factory Creates the Tao for each connection.
+  bool Listen(const string &path, const TaoFactory &factory);
+
+  /// Serve requests until Stop() is called, then wait for requests in
+  /// progress to finish.
+  bool Run();
+
+  /// Make Run() return. This may be called from any thread.
+  void Stop();
+
+  /// Get the number of open channels.
+  size_t NumChannels();
+
+  /// Handle a single request, as a worker does. Tao.Batch is handled by
+  /// handling each operation in turn.
+  /// @param tao The Tao to handle the request with.
+  /// @param op The operation, e.g. "Tao.Seal".
+  /// @param req The request.
+  /// @param[out] resp The response.
+  /// @param[out] error The error message if the request failed.
+  static bool HandleRequest(Tao *tao, const string &op,
+                            const TaoRPCRequest &req, TaoRPCResponse *resp,
+                            string *error);
+
+ private:
+  /// A channel and the Tao that serves it.
+  struct Connection {
+    unique_ptr<FDMessageChannel> channel;
+    unique_ptr<Tao> tao;
+    /// Received bytes that do not yet make up a whole request.
+    string pending;
+    /// Responses not yet sent.
+    string outgoing;
+    /// Whether a write descriptor separate from the read descriptor has been
+    /// added to epoll.
+    bool write_watched;
+  };
+
+  /// The most bytes read from a channel at a time.
+  static constexpr size_t ReadSize = 64 * 1024;
+
+  /// The number of bytes of queued responses at which a channel stops having
+  /// its requests handled.
+  static constexpr size_t MaxQueuedOutput = 1024 * 1024;
+
+  /// The epoll instance, or -1 before Init().
+  int epoll_fd_;
+
+  /// An eventfd that wakes Run() for Stop().
+  int wake_fd_;
+
+  /// The listening socket, or -1.
+  int listen_fd_;
+
+  /// The path of the listening socket, removed on destruction.
+  string listen_path_;
+
+  /// Creates the Tao for each accepted connection.
+  TaoFactory factory_;
+
+  /// Whether Stop() has been called.
+  std::atomic<bool> stopping_;
+
+  /// Protects connections_.
+  std::mutex mutex_;
+
+  /// The open channels.
+  std::map<Connection *, unique_ptr<Connection>> connections_;
+
+  /// The workers. This is declared last so that it is destroyed first, while
+  /// the connections its tasks use still exist.
+  ThreadPool pool_;
+
+  /// Accept pending connections on the listening socket.
+  void AcceptConnections();
+
+  /// Handle the requests waiting on a connection, on a worker thread.
+  /// @param conn The connection.
+  void ServeConnection(Connection *conn);
+
+  /// Read the bytes available on a connection without blocking.
+  /// @param conn The connection. The bytes are appended to conn->pending.
+  /// @param[out] eof Whether the connection reached end of stream.
+  bool ReadAvailable(Connection *conn, bool *eof);
+
+  /// Send as many queued responses as a connection accepts without blocking.
+  /// @param conn The connection. Sent bytes are removed from conn->outgoing.
+  bool Flush(Connection *conn);
+
+  /// Ask epoll to report when a connection can accept more responses.
+  /// @param conn The connection.
+  bool ArmOutput(Connection *conn);
+
+  /// Ask epoll to report the next request on a connection.
+  /// @param conn The connection.
+  /// @param op EPOLL_CTL_ADD or EPOLL_CTL_MOD.
+  bool Arm(Connection *conn, int op);
+
+  /// Stop watching a connection and free it.
+  /// @param conn The connection.
+  void CloseConnection(Connection *conn);
+
+  DISALLOW_COPY_AND_ASSIGN(TaoRPCServer);
+};
+}  // namespace tao
+
+#endif  // TAO_TAO_RPC_SERVER_H_
@@ -0,0 +1,99 @@
+//  File: thread_pool.cc
+//
+//  Description: A fixed-size pool of worker threads with a bounded queue.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "tao/thread_pool.h"
+
+#include <glog/logging.h>
+
+using std::lock_guard;
+using std::mutex;
+using std::unique_lock;
+
+namespace tao {
+constexpr size_t ThreadPool::DefaultMaxQueued;
+
+ThreadPool::ThreadPool(size_t num_threads, size_t max_queued)
+    : max_queued_(max_queued), running_(0), stopping_(false) {
+  if (num_threads == 0) {
+    num_threads = std::thread::hardware_concurrency();
+    if (num_threads == 0) num_threads = 1;
+  }
+  for (size_t i = 0; i < num_threads; i++) {
+    workers_.emplace_back(&ThreadPool::WorkerLoop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  task_ready_.notify_all();
+  for (std::thread &worker : workers_) {
+    worker.join();
+  }
+}
+
+bool ThreadPool::Submit(Task task) {
+  unique_lock<mutex> lock(mutex_);
+  task_done_.wait(lock, [this]() {
+    return stopping_ || max_queued_ == 0 || queue_.size() < max_queued_;
+  });
+  if (stopping_) {
+    LOG(ERROR) << "Can't submit a task, the thread pool is stopping";
+    return false;
+  }
+  queue_.push_back(std::move(task));
+  task_ready_.notify_one();
+  return true;
+}
+
+bool ThreadPool::TrySubmit(Task task) {
+  lock_guard<mutex> lock(mutex_);
+  if (stopping_ || (max_queued_ != 0 && queue_.size() >= max_queued_)) {
+    return false;
+  }
+  queue_.push_back(std::move(task));
+  task_ready_.notify_one();
+  return true;
+}
+
+void ThreadPool::Wait() {
+  unique_lock<mutex> lock(mutex_);
+  task_done_.wait(lock, [this]() { return queue_.empty() && running_ == 0; });
+}
+
+void ThreadPool::WorkerLoop() {
+  unique_lock<mutex> lock(mutex_);
+  for (;;) {
+    task_ready_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return;  // Stopping, and every task has been run.
+    }
+    Task task = std::move(queue_.front());
+    queue_.pop_front();
+    running_++;
+    // A producer may be waiting for room.
+    task_done_.notify_all();
+    lock.unlock();
+    task();
+    lock.lock();
+    running_--;
+    task_done_.notify_all();
+  }
+}
+}  // namespace tao
@@ -0,0 +1,99 @@
+//  File: thread_pool.h
+//
+//  Description: A fixed-size pool of worker threads with a bounded queue.
+//
+//  Copyright (c) 2013, Google Inc.  All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef TAO_THREAD_POOL_H_
+#define TAO_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "tao/util.h"
+
+namespace tao {
+/// A fixed number of worker threads that run tasks in the order they are
+/// submitted. The queue of waiting tasks is bounded, so a producer that gets
+/// ahead of the workers is made to wait rather than using unbounded memory.
+class ThreadPool {
+ public:
+  /// A unit of work.
+  typedef std::function<void()> Task;
+
+  /// Construct a ThreadPool and start its workers.
+  /// @param num_threads The number of worker threads, or 0 for one per CPU.
+  /// @param max_queued The maximum number of tasks waiting for a worker, or 0
+  /// for no limit.
+  explicit ThreadPool(size_t num_threads = 0,
+                      size_t max_queued = DefaultMaxQueued);
+
+  /// Finish all submitted tasks, then stop the workers.
+  virtual ~ThreadPool();
+
+  /// Queue a task, waiting for room in the queue if necessary.
+  /// @param task The task to run.
+  bool Submit(Task task);
+
+  /// Queue a task only if there is room in the queue right now.
+  /// @param task The task to run.
+  bool TrySubmit(Task task);
+
+  /// Wait until every submitted task has finished.
+  void Wait();
+
+  /// Get the number of worker threads.
+  size_t NumThreads() const { return workers_.size(); }
+
+  /// The default maximum number of tasks waiting for a worker.
+  static constexpr size_t DefaultMaxQueued = 1024;
+
+ private:
+  /// The maximum number of tasks waiting for a worker, or 0 for no limit.
+  size_t max_queued_;
+
+  /// Protects the fields below.
+  std::mutex mutex_;
+
+  /// Signals workers that a task is ready or that the pool is stopping.
+  std::condition_variable task_ready_;
+
+  /// Signals producers that the queue has room, and waiters that the pool is
+  /// idle.
+  std::condition_variable task_done_;
+
+  /// Tasks waiting for a worker.
+  std::deque<Task> queue_;
+
+  /// The number of tasks being run.
+  size_t running_;
+
+  /// Whether the workers should exit once the queue is empty.
+  bool stopping_;
+
+  /// The worker threads.
+  std::vector<std::thread> workers_;
+
+  /// The body of each worker thread.
+  void WorkerLoop();
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+};
+}  // namespace tao
+
+#endif  // TAO_THREAD_POOL_H_
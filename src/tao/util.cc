@@ -25,12 +25,14 @@
 #include <netinet/in.h>
 #include <signal.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/unistd.h>
 
+#include <map>
 #include <memory>
 #include <mutex>
 #include <sstream>
@@ -47,6 +49,7 @@
 #include <openssl/rand.h>
 #include <openssl/ssl.h>
 
+#include "tao/codec.h"
 #include "tao/tao.h"
 
 using std::lock_guard;
@@ -152,8 +155,165 @@ bool InitializeApp(int *argc, char ***argv, bool remove_args) {
   return InitializeOpenSSL();
 }
 
-bool MakeSealedSecret(Tao *tao, const string &path, const string &policy,
-                      int secret_size, string *secret) {
+/// The identity of the contents of a sealed-secret file, as far as stat()
+/// can tell. Rewriting or replacing the file changes at least one field.
+struct SealedFileVersion {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  struct timespec ctime;
+};
+
+static bool StatSealedFile(const string &path, SealedFileVersion *version) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return false;
+  }
+  version->dev = st.st_dev;
+  version->ino = st.st_ino;
+  version->size = st.st_size;
+  version->mtime = st.st_mtim;
+  version->ctime = st.st_ctim;
+  return true;
+}
+
+static bool SameVersion(const SealedFileVersion &a,
+                        const SealedFileVersion &b) {
+  return a.dev == b.dev && a.ino == b.ino && a.size == b.size &&
+         a.mtime.tv_sec == b.mtime.tv_sec &&
+         a.mtime.tv_nsec == b.mtime.tv_nsec &&
+         a.ctime.tv_sec == b.ctime.tv_sec && a.ctime.tv_nsec == b.ctime.tv_nsec;
+}
+
+/// A copy of an unsealed secret in memory that is locked against swapping and
+/// excluded from core dumps, and is wiped when freed.
+class LockedSecret {
+ public:
+  LockedSecret() : data_(nullptr), size_(0), mapped_(0) {}
+  ~LockedSecret() { Free(); }
+
+  /// Copy a secret into locked memory.
+  /// @param secret The secret.
+  bool Assign(const string &secret) {
+    Free();
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t mapped = (secret.size() + page) / page * page;
+    void *p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      PLOG(ERROR) << "Could not allocate memory for a cached secret";
+      return false;
+    }
+    if (mlock(p, mapped) != 0) {
+      PLOG(WARNING) << "Could not lock memory for a cached secret";
+      munmap(p, mapped);
+      return false;
+    }
+    madvise(p, mapped, MADV_DONTDUMP);
+    memcpy(p, secret.data(), secret.size());
+    data_ = reinterpret_cast<char *>(p);
+    size_ = secret.size();
+    mapped_ = mapped;
+    return true;
+  }
+
+  /// Copy the secret out.
+  /// @param[out] secret The secret.
+  void Get(string *secret) const { secret->assign(data_, size_); }
+
+ private:
+  void Free() {
+    if (data_ != nullptr) {
+      OPENSSL_cleanse(data_, mapped_);
+      munlock(data_, mapped_);
+      munmap(data_, mapped_);
+      data_ = nullptr;
+    }
+  }
+
+  char *data_;
+  size_t size_;
+  size_t mapped_;
+
+  DISALLOW_COPY_AND_ASSIGN(LockedSecret);
+};
+
+/// A secret unsealed from a file, and what it was unsealed with.
+struct CachedSealedSecret {
+  /// The name of the Tao, rather than its address, which a later Tao could
+  /// reuse. A Tao whose name was extended gets a different name, as it would
+  /// from Unseal().
+  string tao_name;
+  string policy;
+  bool rollback_protected;
+  SealedFileVersion version;
+  LockedSecret secret;
+};
+
+/// Protects SealedSecretCache().
+static mutex sealed_secret_cache_mutex;
+
+/// Unsealed secrets, keyed by path.
+static std::map<string, unique_ptr<CachedSealedSecret>> &SealedSecretCache() {
+  static auto *cache = new std::map<string, unique_ptr<CachedSealedSecret>>();
+  return *cache;
+}
+
+/// Look up a cached secret that was unsealed from the same version of a file,
+/// by a Tao with the same name and with the same policy.
+static bool LookupSealedSecret(const string &tao_name, const string &path,
+                               const string &policy, bool rollback_protected,
+                               const SealedFileVersion &version,
+                               string *secret) {
+  lock_guard<mutex> l(sealed_secret_cache_mutex);
+  auto it = SealedSecretCache().find(path);
+  if (it == SealedSecretCache().end()) {
+    return false;
+  }
+  const CachedSealedSecret &entry = *it->second;
+  if (entry.tao_name != tao_name || entry.policy != policy ||
+      entry.rollback_protected != rollback_protected ||
+      !SameVersion(entry.version, version)) {
+    return false;
+  }
+  entry.secret.Get(secret);
+  return true;
+}
+
+/// Remember a secret along with the version of the file it came from. Nothing
+/// is cached if the secret can't be held in locked memory.
+static void CacheSealedSecret(const string &tao_name, const string &path,
+                              const string &policy, bool rollback_protected,
+                              const SealedFileVersion &version,
+                              const string &secret) {
+  unique_ptr<CachedSealedSecret> entry(new CachedSealedSecret);
+  entry->tao_name = tao_name;
+  entry->policy = policy;
+  entry->rollback_protected = rollback_protected;
+  entry->version = version;
+  if (!entry->secret.Assign(secret)) {
+    InvalidateSealedSecret(path);
+    return;
+  }
+  lock_guard<mutex> l(sealed_secret_cache_mutex);
+  SealedSecretCache()[path] = std::move(entry);
+}
+
+void InvalidateSealedSecret(const string &path) {
+  lock_guard<mutex> l(sealed_secret_cache_mutex);
+  SealedSecretCache().erase(path);
+}
+
+void InvalidateAllSealedSecrets() {
+  lock_guard<mutex> l(sealed_secret_cache_mutex);
+  SealedSecretCache().clear();
+}
+
+/// Generate, seal, and save a secret, with or without rollback protection.
+static bool MakeSecret(Tao *tao, const string &path, const string &policy,
+                       int secret_size, bool rollback_protected,
+                       string *secret) {
   if (secret == nullptr) {
     LOG(ERROR) << "Could not seal null secret";
     return false;
@@ -163,7 +323,18 @@ bool MakeSealedSecret(Tao *tao, const string &path, const string &policy,
     return false;
   }
   string sealed_secret;
-  if (!tao->Seal(*secret, policy, &sealed_secret)) {
+  bool sealed;
+  if (rollback_protected) {
+    int64_t counter = 0;
+    if (!tao->GetCounter(path, &counter) && !tao->InitCounter(path, counter)) {
+      LOG(ERROR) << "Can't create a rollback counter for " << path;
+      return false;
+    }
+    sealed = tao->RollbackProtectedSeal(path, *secret, policy, &sealed_secret);
+  } else {
+    sealed = tao->Seal(*secret, policy, &sealed_secret);
+  }
+  if (!sealed) {
     LOG(ERROR) << "Can't seal the secret";
     return false;
   }
@@ -171,27 +342,57 @@ bool MakeSealedSecret(Tao *tao, const string &path, const string &policy,
     LOG(ERROR) << "Can't create directory for " << path;
     return false;
   }
+  InvalidateSealedSecret(path);
   if (!WriteStringToFile(path, sealed_secret)) {
     LOG(ERROR) << "Can't write the sealed secret to " << path;
     return false;
   }
+  string tao_name;
+  SealedFileVersion version;
+  if (tao->GetTaoName(&tao_name) && StatSealedFile(path, &version)) {
+    CacheSealedSecret(tao_name, path, policy, rollback_protected, version,
+                      *secret);
+  }
   VLOG(2) << "Sealed a secret of size " << secret_size;
   return true;
 }
 
-bool GetSealedSecret(Tao *tao, const string &path, const string &policy,
-                     string *secret) {
+/// Read and unseal a secret, with or without rollback protection, or return
+/// the cached copy if the file has not changed since it was last unsealed.
+static bool GetSecret(Tao *tao, const string &path, const string &policy,
+                      bool rollback_protected, string *secret) {
   if (secret == nullptr) {
     LOG(ERROR) << "Could not unseal null secret";
     return false;
   }
+  SealedFileVersion before;
+  if (!StatSealedFile(path, &before)) {
+    LOG(ERROR) << "Can't read the sealed secret from " << path;
+    return false;
+  }
+  // The cache is used only if the Tao can name itself. TaoRPC remembers its
+  // name, so this does not cost a request to the host each time.
+  string tao_name;
+  bool named = tao->GetTaoName(&tao_name);
+  if (named && LookupSealedSecret(tao_name, path, policy, rollback_protected,
+                                  before, secret)) {
+    VLOG(2) << "Found a cached secret of size " << secret->size();
+    return true;
+  }
   string sealed_secret;
   if (!ReadFileToString(path, &sealed_secret)) {
     LOG(ERROR) << "Can't read the sealed secret from " << path;
     return false;
   }
   string unseal_policy;
-  if (!tao->Unseal(sealed_secret, secret, &unseal_policy)) {
+  bool unsealed;
+  if (rollback_protected) {
+    unsealed = tao->RollbackProtectedUnseal(sealed_secret, secret,
+                                            &unseal_policy);
+  } else {
+    unsealed = tao->Unseal(sealed_secret, secret, &unseal_policy);
+  }
+  if (!unsealed) {
     LOG(ERROR) << "Can't unseal the secret";
     return false;
   }
@@ -199,10 +400,26 @@ bool GetSealedSecret(Tao *tao, const string &path, const string &policy,
     LOG(ERROR) << "Unsealed secret, but provenance is uncertain";
     return false;
   }
+  // Only cache the secret if the file didn't change while it was being read.
+  SealedFileVersion after;
+  if (named && StatSealedFile(path, &after) && SameVersion(before, after)) {
+    CacheSealedSecret(tao_name, path, policy, rollback_protected, after,
+                      *secret);
+  }
   VLOG(2) << "Unsealed a secret of size " << secret->size();
   return true;
 }
 
+bool MakeSealedSecret(Tao *tao, const string &path, const string &policy,
+                      int secret_size, string *secret) {
+  return MakeSecret(tao, path, policy, secret_size, false, secret);
+}
+
+bool GetSealedSecret(Tao *tao, const string &path, const string &policy,
+                     string *secret) {
+  return GetSecret(tao, path, policy, false, secret);
+}
+
 bool CreateTempDir(const string &prefix, ScopedTempDir *dir) {
   // Get a temporary directory to use for the files.
   string dir_template = string("/tmp/temp_") + prefix + string("_XXXXXX");
@@ -386,36 +603,9 @@ string elideBytes(const string &s) {
            bytesToHex(s.substr(s.size() - 5));
 }
 
-string bytesToHex(const string &s) {
-  stringstream out;
-  string hex = "0123456789abcdef";
-  for (auto &c : s) out << hex[(c >> 4) & 0xf] << hex[(c >> 0) & 0xf];
-  return out.str();
-}
+string bytesToHex(const string &s) { return HexEncode(s); }
 
-static int hexToInt(char c, int *i) {
-  if ('0' <= c && c <= '9')
-    *i = (c - '0');
-  else if ('a' <= c && c <= 'f')
-    *i = 10 + (c - 'a');
-  else if ('A' <= c && c <= 'F')
-    *i = 10 + (c - 'A');
-  else
-    return false;
-  return true;
-}
-
-bool bytesFromHex(const string &hex, string *s) {
-  stringstream out;
-  if (hex.size() % 2) return false;
-  for (unsigned int i = 0; i < hex.size(); i += 2) {
-    int x, y;
-    if (!hexToInt(hex[i], &x) || !hexToInt(hex[i + 1], &y)) return false;
-    out.put((x << 4) | y);
-  }
-  s->assign(out.str());
-  return true;
-}
+bool bytesFromHex(const string &hex, string *s) { return HexDecode(hex, s); }
 
 bool split(const string &s, const string &delim, list<string> *values) {
   values->clear();
@@ -576,12 +766,12 @@ bool GetACounter(Tao *tao, const string &label, const int64_t* c) {
 
 bool MakeRollbackProtectedSealedSecret(Tao *tao, const string &path,
       const string &policy, int secret_size, string *secret) {
-  return false;
+  return MakeSecret(tao, path, policy, secret_size, true, secret);
 }
 
 bool GetRollbackProtectedSealedSecret(Tao *tao, const string &path,
       const string &policy, string *secret) {
-  return false;
+  return GetSecret(tao, path, policy, true, secret);
 }
 
 }  // namespace tao
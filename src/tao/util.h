@@ -33,6 +33,7 @@
 /// implementation, so we include them here.
 #include <chromium/base/file_path.h>
 #include <chromium/base/file_util.h>
+#include <openssl/evp.h>
 
 #include "tao/tao.h"
 
@@ -136,6 +137,9 @@ typedef unique_free_ptr<FILE, file_close> ScopedFile;
 /// A smart pointer to a temporary directory to be cleaned upon destruction.
 typedef unique_free_ptr<string, temp_file_cleaner> ScopedTempDir;
 
+/// A smart pointer to an OpenSSL EVP_CIPHER_CTX.
+typedef unique_free_ptr<EVP_CIPHER_CTX, EVP_CIPHER_CTX_free> ScopedCipherCtx;
+
 /// Extract pointer to string data. These can be used for library functions
 /// that require raw pointers instead of C++ strings. Returned const pointers
 /// should not be written to. Returned non-const pointers can be written. Any
@@ -210,9 +214,23 @@ bool MakeSealedSecret(Tao *tao, const string &path, const string &policy,
 /// sealed. The call will fail if this does not match the actual policy under
 /// which the secret was sealed.
 /// @param secret[out] The unsealed secret.
+///
+/// The unsealed secret is cached in locked memory for the rest of the process,
+/// so later calls with a Tao of the same name, and the same path and policy,
+/// return it without unsealing again, until the file is modified or replaced.
 bool GetSealedSecret(Tao *tao, const string &path, const string &policy,
                      string *secret);
 
+/// Discard the cached copy of a secret read by GetSealedSecret() or
+/// GetRollbackProtectedSealedSecret(), so the next call unseals it again.
+/// This is only needed when the sealed secret changes in a way that stat()
+/// can't see, since the cache already checks the file on every call.
+/// @param path The location of the sealed secret.
+void InvalidateSealedSecret(const string &path);
+
+/// Discard every cached secret, e.g. when reloading configuration.
+void InvalidateAllSealedSecrets();
+
 /// Create a temporary directory.
 /// @param prefix The partial path of the directory to create.
 /// @param[out] dir A pointer to an object that will take ownership of the
@@ -347,8 +365,15 @@ bool MarshalKeyPrin(const string &key, string *out);
 
 bool InitNewCounter(Tao *tao, const string &label, const int64_t& c);
 bool GetACounter(Tao *tao, const string &label, const int64_t* c);
+
+/// Like MakeSealedSecret(), but sealed with RollbackProtectedSeal() under a
+/// counter labeled with the path.
 bool MakeRollbackProtectedSealedSecret(Tao *tao, const string &path,
       const string &policy, int secret_size, string *secret);
+
+/// Like GetSealedSecret(), but for a secret made by
+/// MakeRollbackProtectedSealedSecret(). Unsealing fails if the file is older
+/// than the most recent secret sealed under its counter.
 bool GetRollbackProtectedSealedSecret(Tao *tao, const string &path,
       const string &policy, string *secret);
 
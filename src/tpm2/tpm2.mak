@@ -34,7 +34,7 @@ TARGET_MACHINE_TYPE= x64
 
 S= $(SRC_DIR)/src/github.com/jlmucb/cloudproxy/src/tpm2
 O= $(OBJ_DIR)/tpm20
-INCLUDE= -I$(S) -I$(SRC_DIR)/keys -I/usr/local/include -I$(GOOGLE_INCLUDE)
+INCLUDE= -I$(S) -I$(S)/.. -I$(SRC_DIR)/keys -I/usr/local/include -I$(GOOGLE_INCLUDE)
 
 CFLAGS=$(INCLUDE) -O3 -g -Wall -std=c++11 -Wno-strict-aliasing -Wno-deprecated # -DGFLAGS_NS=google
 CFLAGS1=$(INCLUDE) -O1 -g -Wall -std=c++11
@@ -51,62 +51,74 @@ dobj_tpm2_util=					$(O)/tpm2_lib.o \
   $(O)/tpm2.pb.o \
   $(O)/openssl_helpers.o \
   $(O)/conversions.o \
+  $(O)/codec.o \
   $(O)/tpm2_util.o
 dobj_GeneratePolicyKey=				$(O)/tpm2_lib.o \
   $(O)/tpm2.pb.o \
   $(O)/openssl_helpers.o \
   $(O)/conversions.o \
+  $(O)/codec.o \
   $(O)/GeneratePolicyKey.o
 dobj_CloudProxySignEndorsementKey=		$(O)/tpm2_lib.o \
   $(O)/tpm2.pb.o \
   $(O)/conversions.o \
+  $(O)/codec.o \
   $(O)/openssl_helpers.o \
   $(O)/CloudProxySignEndorsementKey.o 
 dobj_GetEndorsementKey=				$(O)/tpm2_lib.o \
   $(O)/tpm2.pb.o \
   $(O)/conversions.o \
+  $(O)/codec.o \
   $(O)/openssl_helpers.o \
   $(O)/GetEndorsementKey.o
 dobj_SelfSignPolicyCert=			$(O)/tpm2_lib.o \
   $(O)/openssl_helpers.o \
   $(O)/conversions.o \
+  $(O)/codec.o \
   $(O)/tpm2.pb.o \
   $(O)/SelfSignPolicyCert.o
 dobj_CreateAndSaveCloudProxyKeyHierarchy=	$(O)/tpm2_lib.o \
   $(O)/tpm2.pb.o \
   $(O)/openssl_helpers.o \
   $(O)/conversions.o \
+  $(O)/codec.o \
   $(O)/CreateAndSaveCloudProxyKeyHierarchy.o
 dobj_RestoreCloudProxyKeyHierarchy=		$(O)/tpm2_lib.o \
   $(O)/tpm2.pb.o \
   $(O)/openssl_helpers.o \
   $(O)/conversions.o \
+  $(O)/codec.o \
   $(O)/RestoreCloudProxyKeyHierarchy.o
 dobj_ClientGenerateProgramKeyRequest=		$(O)/tpm2_lib.o \
   $(O)/tpm2.pb.o \
   $(O)/quote_protocol.o \
   $(O)/conversions.o \
+  $(O)/codec.o \
   $(O)/openssl_helpers.o \
   $(O)/ClientGenerateProgramKeyRequest.o
 dobj_ServerSignProgramKeyRequest=		$(O)/tpm2_lib.o \
   $(O)/tpm2.pb.o \
   $(O)/quote_protocol.o \
   $(O)/conversions.o \
+  $(O)/codec.o \
   $(O)/openssl_helpers.o \
   $(O)/ServerSignProgramKeyRequest.o
 dobj_ClientGetProgramKeyCert=			$(O)/tpm2_lib.o \
   $(O)/tpm2.pb.o \
   $(O)/conversions.o \
+  $(O)/codec.o \
   $(O)/openssl_helpers.o \
   $(O)/ClientGetProgramKeyCert.o
 dobj_SigningInstructions=			$(O)/tpm2_lib.o \
   $(O)/tpm2.pb.o \
   $(O)/conversions.o \
+  $(O)/codec.o \
   $(O)/openssl_helpers.o \
   $(O)/SigningInstructions.o
 dobj_PadTest =	$(O)/tpm2_lib.o \
   $(O)/tpm2.pb.o \
   $(O)/conversions.o \
+  $(O)/codec.o \
   $(O)/quote_protocol.o \
   $(O)/openssl_helpers.o \
   $(O)/padtest.o
@@ -202,6 +214,10 @@ $(O)/conversions.o: $(S)/conversions.cc
 	@echo "compiling conversions.cc"
 	$(CC) $(CFLAGS) -c -o $(O)/conversions.o $(S)/conversions.cc
 
+$(O)/codec.o: $(S)/../tao/codec.cc
+	@echo "compiling codec.cc"
+	$(CC) $(CFLAGS) -c -o $(O)/codec.o $(S)/../tao/codec.cc
+
 $(O)/openssl_helpers.o: $(S)/openssl_helpers.cc
 	@echo "compiling openssl_helpers.cc"
 	$(CC) $(CFLAGS) -c -o $(O)/openssl_helpers.o $(S)/openssl_helpers.cc